@@ -0,0 +1,52 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Header file for what the benches share
+// The clock is the monotonic one of the metrics, getMetricsTime, see metrics.h
+// A case is a function that runs what it measures a number of times: it's warmed up,
+// then timed over several rounds, the median round is the result and the fastest one shows the noise
+
+#include "../src/metrics.h"
+
+#define BENCH_MAX_ROUNDS 32
+
+typedef struct BENCH_TIMING {
+    // Both in ns per iteration
+    double median;
+    double fastest;
+} BenchTiming;
+
+// Keeps the compiler from dropping the measured calls, the cases store their results on it
+volatile long sink;
+
+// Prints the error of the last call and exits
+void fail(const char* message);
+
+// Runs the case warmup times, then rounds rounds of iterations
+// rounds is at most BENCH_MAX_ROUNDS
+BenchTiming timeRounds(void (*run)(int iterations), int warmup, int iterations, int rounds);
+
+void fail(const char* message) {
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+int compareDouble(const void* a, const void* b) {
+    double first = *(const double*)a, second = *(const double*)b;
+    return (first > second) - (first < second);
+}
+
+BenchTiming timeRounds(void (*run)(int iterations), int warmup, int iterations, int rounds) {
+    run(warmup);
+    double times[BENCH_MAX_ROUNDS];
+    for (int round = 0; round < rounds; round++) {
+        long long start = getMetricsTime();
+        run(iterations);
+        times[round] = (double)(getMetricsTime() - start) / iterations;
+    }
+    qsort(times, rounds, sizeof(double), compareDouble);
+    BenchTiming timing = {.median = times[rounds / 2], .fastest = times[0]};
+    return timing;
+}
+
+#endif
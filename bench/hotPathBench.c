@@ -0,0 +1,353 @@
+// Measures each function on the path of a request on its own, to judge parser and serializer changes on numbers
+// Each case is warmed up, then run for several rounds, and reported with the median and the fastest round in ns/op
+// --perf adds the cycles, instructions, branch misses and cache misses per op, when the kernel lets perf in
+// --save-baseline writes the medians to a file, --baseline compares with one,
+// and fails if a case got slower than the threshold, 10% unless --threshold says otherwise
+// The baseline is only meaningful on the machine it was saved on
+// Build and run with `make run`, compare with the stored baseline with `make hot-path`
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "../src/httpHandler.h"
+#include "bench.h"
+
+#define WARMUP_ITERATIONS 100000
+#define ITERATIONS 1000000
+#define ROUNDS 7
+#define PERF_COUNTERS 4
+#define MAX_BASELINE_CASES 64
+
+#define PERF_FLAG "--perf"
+#define BASELINE_FLAG "--baseline"
+#define SAVE_BASELINE_FLAG "--save-baseline"
+#define THRESHOLD_FLAG "--threshold"
+#define FILTER_FLAG "--filter"
+
+typedef struct BENCH_CASE {
+    const char* name;
+    void (*run)(int iterations);
+} BenchCase;
+
+typedef struct BASELINE_ENTRY {
+    char name[64];
+    double nsPerOp;
+} BaselineEntry;
+
+const char getRequest[] =
+    "GET /clientes/1/extrato HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "User-Agent: Gatling/3.10.3\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+const char postRequest[] =
+    "POST /clientes/1/transacoes HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "User-Agent: Gatling/3.10.3\r\n"
+    "Accept: */*\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 49\r\n"
+    "\r\n"
+    "{\"valor\": 1000, \"tipo\": \"c\", \"descricao\": \"abc\"}";
+
+const char transactionBody[] = "{\"valor\": 1000, \"tipo\": \"c\", \"descricao\": \"abc\"}";
+
+const char* perfCounterNames[PERF_COUNTERS] = {"cycles", "instructions", "branch-misses", "cache-misses"};
+const unsigned long long perfCounterConfigs[PERF_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                              PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+
+User user;
+Transaction transactions[2];
+char serializedUser[USER_SERIALIZED_MAX_SIZE];
+int serializedUserSize;
+
+BaselineEntry baseline[MAX_BASELINE_CASES];
+int baselineSize = 0;
+
+// A user with every transaction, like the accounts under load
+void fillUser() {
+    memset(&user, 0, sizeof(User));
+    user.id = 1;
+    user.limit = 100000;
+    user.total = -12345;
+    for (int i = 0; i < MAX_TRANSACTIONS; i++) {
+        Transaction* transaction = &user.transactions[i];
+        transaction->valor = 1000 + i * 37;
+        transaction->tipo = i % 2 == 0 ? 'c' : 'd';
+        char descricao[16];
+        transaction->descricaoLength = (unsigned char)sprintf(descricao, "desc%d", i);
+        memcpy(transaction->descricao, descricao, transaction->descricaoLength);
+        transaction->realizadaEm = getEpochTimeUs();
+    }
+    user.nTransactions = MAX_TRANSACTIONS;
+    user.oldestTransaction = 0;
+    // A credit and a debit of the same valor, so the balance goes back and forth
+    parseTransaction(transactionBody, sizeof(transactionBody) - 1, &transactions[0]);
+    transactions[1] = transactions[0];
+    transactions[1].tipo = 'd';
+    serializedUserSize = serializeUser(&user, serializedUser);
+}
+
+// The cases
+
+void benchParseGet(int iterations) {
+    HttpRequest request;
+    for (int i = 0; i < iterations; i++) {
+        sink = parseHttpRequest(getRequest, sizeof(getRequest) - 1, CONNECTION_READ_SIZE, &request);
+    }
+}
+
+// Also finds the id of the POST, which getIdFromPOSTRequest used to do
+void benchParsePost(int iterations) {
+    HttpRequest request;
+    for (int i = 0; i < iterations; i++) {
+        sink = parseHttpRequest(postRequest, sizeof(postRequest) - 1, CONNECTION_READ_SIZE, &request);
+    }
+}
+
+// Was getTransactionFromBody
+void benchParseTransaction(int iterations) {
+    Transaction transaction;
+    for (int i = 0; i < iterations; i++) {
+        sink = parseTransaction(transactionBody, sizeof(transactionBody) - 1, &transaction);
+    }
+}
+
+void benchSerializeGet(int iterations) {
+    char buffer[RESPONSE_SIZE];
+    for (int i = 0; i < iterations; i++) {
+        int responseSize = 0, timestampOffset;
+        serializeGetResponse(&user, buffer, sizeof(buffer), &responseSize, &timestampOffset);
+        sink = responseSize;
+    }
+}
+
+void benchSerializePost(int iterations) {
+    char buffer[POST_RESPONSE_SIZE];
+    for (int i = 0; i < iterations; i++) {
+        int responseSize = 0;
+        serializePostResponse(&user, buffer, sizeof(buffer), &responseSize);
+        sink = responseSize;
+    }
+}
+
+void benchAddTransaction(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        sink = addTransaction(&user, &transactions[i & 1]);
+    }
+}
+
+void benchAddSaldo(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        sink = addSaldo(&user, &transactions[i & 1]);
+    }
+}
+
+void benchBin(int iterations) {
+    char bin[4];
+    for (int i = 0; i < iterations; i++) {
+        toBin(i, bin);
+        sink = fromBin(bin);
+    }
+}
+
+void benchSerializeUser(int iterations) {
+    char buffer[USER_SERIALIZED_MAX_SIZE];
+    for (int i = 0; i < iterations; i++) {
+        sink = serializeUser(&user, buffer);
+    }
+}
+
+void benchDeserializeUser(int iterations) {
+    User deserialized;
+    for (int i = 0; i < iterations; i++) {
+        sink = deserializeUser(serializedUser, serializedUserSize, &deserialized);
+    }
+}
+
+const BenchCase benchCases[] = {
+    {"parseHttpRequest GET", benchParseGet},
+    {"parseHttpRequest POST", benchParsePost},
+    {"parseTransaction", benchParseTransaction},
+    {"serializeGetResponse", benchSerializeGet},
+    {"serializePostResponse", benchSerializePost},
+    {"addTransaction", benchAddTransaction},
+    {"addSaldo", benchAddSaldo},
+    {"toBin + fromBin", benchBin},
+    {"serializeUser", benchSerializeUser},
+    {"deserializeUser", benchDeserializeUser},
+};
+
+// Perf counters
+
+int perfEventOpen(struct perf_event_attr* attributes, int groupFd) {
+    return (int)syscall(__NR_perf_event_open, attributes, 0, -1, groupFd, 0);
+}
+
+// Opens the counters as a group, led by the first one, counting this thread in user space
+// Returns the fd of the leader, or ERROR if perf isn't available
+int openPerfCounters() {
+    int fds[PERF_COUNTERS];
+    int leader = ERROR;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = perfCounterConfigs[i];
+        attributes.disabled = leader == ERROR;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_GROUP;
+        fds[i] = perfEventOpen(&attributes, leader);
+        if (fds[i] == ERROR) {
+            int error = errno;
+            for (int j = 0; j < i; j++) {
+                close(fds[j]);
+            }
+            errno = error;
+            return ERROR;
+        }
+        if (leader == ERROR) {
+            leader = fds[i];
+        }
+    }
+    return leader;
+}
+
+// Reads the counters of the group into values
+// Returns ERROR if they can't be read
+int readPerfCounters(int leader, unsigned long long* values) {
+    unsigned long long group[1 + PERF_COUNTERS];
+    if (read(leader, group, sizeof(group)) != (ssize_t)sizeof(group)) {
+        return ERROR;
+    }
+    memcpy(values, &group[1], PERF_COUNTERS * sizeof(unsigned long long));
+    return SUCCESS;
+}
+
+// Baseline
+
+// Returns the median of the case on the baseline, or 0 if it's not there
+double getBaseline(const char* name) {
+    for (int i = 0; i < baselineSize; i++) {
+        if (strcmp(baseline[i].name, name) == 0) {
+            return baseline[i].nsPerOp;
+        }
+    }
+    return 0;
+}
+
+// Each line is the median ns/op, then the name of the case
+int loadBaseline(const char* path) {
+    FILE* file = fopen(path, "r");
+    errIfNull(file);
+    char line[128];
+    while (baselineSize < MAX_BASELINE_CASES && fgets(line, sizeof(line), file) != NULL) {
+        BaselineEntry* entry = &baseline[baselineSize];
+        int nameStart;
+        if (sscanf(line, "%lf %n", &entry->nsPerOp, &nameStart) != 1) {
+            continue;
+        }
+        snprintf(entry->name, sizeof(entry->name), "%s", &line[nameStart]);
+        entry->name[strcspn(entry->name, "\r\n")] = '\0';
+        baselineSize++;
+    }
+    fclose(file);
+    return SUCCESS;
+}
+
+// Runs the case and prints its line
+// Returns its median ns/op
+double runCase(const BenchCase* benchCase, int perfLeader, bool compare, double threshold, bool* regressed) {
+    fillUser();
+    // The counters also see the warmup, its iterations count on the per op values
+    if (perfLeader != ERROR) {
+        ioctl(perfLeader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perfLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    BenchTiming timing = timeRounds(benchCase->run, WARMUP_ITERATIONS, ITERATIONS, ROUNDS);
+    unsigned long long counters[PERF_COUNTERS];
+    bool counted = false;
+    if (perfLeader != ERROR) {
+        ioctl(perfLeader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        counted = readPerfCounters(perfLeader, counters) == SUCCESS;
+    }
+    double median = timing.median;
+
+    printf("%-24s %9.1f ns/op  (min %9.1f)", benchCase->name, median, timing.fastest);
+    for (int i = 0; counted && i < PERF_COUNTERS; i++) {
+        printf("  %s %.1f", perfCounterNames[i], (double)counters[i] / ((double)ITERATIONS * ROUNDS + WARMUP_ITERATIONS));
+    }
+    double baselineNs = compare ? getBaseline(benchCase->name) : 0;
+    if (baselineNs > 0) {
+        double change = (median - baselineNs) / baselineNs * 100;
+        bool slower = change > threshold;
+        *regressed = *regressed || slower;
+        printf("  baseline %9.1f  %+6.1f%%%s", baselineNs, change, slower ? "  REGRESSION" : "");
+    } else if (compare) {
+        printf("  no baseline");
+    }
+    printf("\n");
+    return median;
+}
+
+int main(int argc, char* argv[]) {
+    bool perf = false;
+    const char* baselinePath = NULL;
+    const char* savePath = NULL;
+    const char* filter = NULL;
+    double threshold = 10;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], PERF_FLAG) == 0) {
+            perf = true;
+            continue;
+        }
+        // The other flags take a value
+        if (i + 1 == argc) {
+            break;
+        }
+        if (strcmp(argv[i], BASELINE_FLAG) == 0) {
+            baselinePath = argv[i + 1];
+        } else if (strcmp(argv[i], SAVE_BASELINE_FLAG) == 0) {
+            savePath = argv[i + 1];
+        } else if (strcmp(argv[i], THRESHOLD_FLAG) == 0) {
+            threshold = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], FILTER_FLAG) == 0) {
+            filter = argv[i + 1];
+        }
+        i++;
+    }
+    if (baselinePath != NULL && loadBaseline(baselinePath) == ERROR) {
+        perror("Failed to read the baseline");
+        return EXIT_FAILURE;
+    }
+    FILE* saveFile = NULL;
+    if (savePath != NULL && (saveFile = fopen(savePath, "w")) == NULL) {
+        perror("Failed to write the baseline");
+        return EXIT_FAILURE;
+    }
+    int perfLeader = perf ? openPerfCounters() : ERROR;
+    if (perf && perfLeader == ERROR) {
+        printf("{ Perf counters unavailable: %s }\n", strerror(errno));
+    }
+
+    bool regressed = false;
+    for (size_t i = 0; i < sizeof(benchCases) / sizeof(BenchCase); i++) {
+        if (filter != NULL && strstr(benchCases[i].name, filter) == NULL) {
+            continue;
+        }
+        double median = runCase(&benchCases[i], perfLeader, baselinePath != NULL, threshold, &regressed);
+        if (saveFile != NULL) {
+            fprintf(saveFile, "%.1f %s\n", median, benchCases[i].name);
+        }
+    }
+    if (saveFile != NULL) {
+        fclose(saveFile);
+    }
+    if (perfLeader != ERROR) {
+        close(perfLeader);
+    }
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
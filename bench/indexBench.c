@@ -0,0 +1,109 @@
+// Measures the user index lookup cost from 10 to 10 million users
+// Dense ids are 1..n, like the accounts created in order, strided ids are multiples of 64,
+// all with the same low bits, and sparse ids are random 31 bit ids
+// The lookups go to random users, so the bigger tables also pay for the cache misses
+// Build and run with `make run`
+
+#include "../src/userIndex.h"
+#include "bench.h"
+
+#define WARMUP_LOOKUPS 1000000
+#define LOOKUPS 1000000
+#define ROUNDS 5
+// Ids looked up, picked before the timing so picking them isn't measured
+#define QUERY_IDS 1024 * 1024
+// Small enough that 2 * 10 million strided ids fit in an int
+#define ID_STRIDE 64
+
+#define IDS_DENSE 0
+#define IDS_STRIDED 1
+#define IDS_SPARSE 2
+
+const char* idsNames[] = {"dense", "strided", "sparse"};
+
+const int sizes[] = {10, 1000, 100000, 1000000, 10000000};
+const int nSizes = sizeof(sizes) / sizeof(int);
+
+// xorshift, the same sequence on every run
+uint32_t randomState = 2463534242u;
+uint32_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// The index the lookups go to, and the ids they look up
+UserIndex* lookupIndex;
+const int* lookupIds;
+
+void runLookups(int iterations) {
+    long slots = 0;
+    for (int i = 0; i < iterations; i++) {
+        slots += findUserSlot(lookupIndex, lookupIds[i & (QUERY_IDS - 1)]);
+    }
+    sink = slots;
+}
+
+// Returns the ns per lookup
+double timeLookups(UserIndex* index, const int* queryIds) {
+    lookupIndex = index;
+    lookupIds = queryIds;
+    return timeRounds(runLookups, WARMUP_LOOKUPS, LOOKUPS, ROUNDS).median;
+}
+
+// The i-th id of the kind, dense and strided ids past the size are missing from the index
+int makeId(int kind, int i) {
+    if (kind == IDS_SPARSE) {
+        return (int)(nextRandom() & INT32_MAX);
+    }
+    return kind == IDS_STRIDED ? (i + 1) * ID_STRIDE : i + 1;
+}
+
+void benchSize(int size, int kind, int* ids, int* queryIds) {
+    UserIndex index;
+    if (initUserIndex(&index) == ERROR) {
+        perror("Failed to create the index");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < size; i++) {
+        ids[i] = makeId(kind, i);
+        if (addUserSlot(&index, ids[i], i) == ERROR) {
+            perror("Failed to grow the index");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < QUERY_IDS; i++) {
+        queryIds[i] = ids[nextRandom() % size];
+    }
+    double hit = timeLookups(&index, queryIds);
+
+    // Ids above every dense and strided id, sparse ones may rarely hit, it doesn't change the cost
+    for (int i = 0; i < QUERY_IDS; i++) {
+        queryIds[i] = makeId(kind, size + (int)(nextRandom() % size));
+    }
+    double miss = timeLookups(&index, queryIds);
+
+    printf("%-7s %9d users: found %5.1f ns/lookup, missing %5.1f ns/lookup, table %6.1f MB\n",
+           idsNames[kind], size, hit, miss,
+           (double)index.capacity * sizeof(UserIndexEntry) / (1024 * 1024));
+    freeUserIndex(&index);
+}
+
+int main() {
+    int* ids = malloc((size_t)sizes[nSizes - 1] * sizeof(int));
+    int* queryIds = malloc(QUERY_IDS * sizeof(int));
+    if (ids == NULL || queryIds == NULL) {
+        perror("Failed to allocate the ids");
+        return EXIT_FAILURE;
+    }
+    for (int kind = IDS_DENSE; kind <= IDS_SPARSE; kind++) {
+        for (int i = 0; i < nSizes; i++) {
+            benchSize(sizes[i], kind, ids, queryIds);
+        }
+    }
+    free(ids);
+    free(queryIds);
+    return EXIT_SUCCESS;
+}
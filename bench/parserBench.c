@@ -0,0 +1,209 @@
+// Measures the parse cost of each request, comparing the single pass parser with the old
+// getRequestLength + fixed offsets + strstr path
+// Build and run with `make run`, add simd=-mavx2 to scan with AVX2 instead of SSE2
+
+#include "../src/httpHandler.h"
+#include "bench.h"
+
+#define WARMUP_ITERATIONS 100000
+#define ITERATIONS 1000000
+#define ROUNDS 5
+
+const char getRequest[] =
+    "GET /clientes/1/extrato HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "User-Agent: Gatling/3.10.3\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+const char postRequest[] =
+    "POST /clientes/1/transacoes HTTP/1.1\r\n"
+    "Host: localhost:9999\r\n"
+    "User-Agent: Gatling/3.10.3\r\n"
+    "Accept: */*\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 49\r\n"
+    "\r\n"
+    "{\"valor\": 1000, \"tipo\": \"c\", \"descricao\": \"abc\"}";
+
+// The parsing used before the single pass parser, kept here as the baseline
+
+int legacyGetLineLength(const char* line, const char* end) {
+    for (const char* current = line; current < end; current++) {
+        if (*current == '\n') {
+            return current - line + 1;
+        }
+    }
+    return 0;
+}
+
+bool legacyIsHeader(const char* line, int lineLength, const char* name, int nameLength) {
+    return lineLength > nameLength && strncasecmp(line, name, nameLength) == 0;
+}
+
+const char* legacyGetHeaderValue(const char* line, int nameLength) {
+    const char* value = &line[nameLength];
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    return value;
+}
+
+int legacyGetRequestLength(const char* buffer, int length, bool* keepAlive) {
+    const char* end = &buffer[length];
+    int lineLength = legacyGetLineLength(buffer, end);
+    if (lineLength == 0) {
+        return 0;
+    }
+    int versionStart = lineLength - 8 - 2;
+    if (versionStart > 0 && partialEqual(&buffer[versionStart], "HTTP/1.0", 8)) {
+        *keepAlive = false;
+    }
+
+    long contentLength = 0;
+    const char* line = &buffer[lineLength];
+    while (true) {
+        lineLength = legacyGetLineLength(line, end);
+        if (lineLength == 0) {
+            return 0;
+        }
+        if (line[0] == '\n' || (line[0] == '\r' && line[1] == '\n')) {
+            line += lineLength;
+            break;
+        }
+        if (legacyIsHeader(line, lineLength, "Content-Length:", 15)) {
+            const char* value = legacyGetHeaderValue(line, 15);
+            contentLength = 0;
+            while (*value >= '0' && *value <= '9') {
+                contentLength = contentLength * 10 + (*value - '0');
+                value++;
+            }
+        } else if (legacyIsHeader(line, lineLength, "Connection:", 11)) {
+            const char* value = legacyGetHeaderValue(line, 11);
+            if (strncasecmp(value, "close", 5) == 0) {
+                *keepAlive = false;
+            } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+                *keepAlive = true;
+            }
+        }
+        line += lineLength;
+    }
+    long requestLength = (line - buffer) + contentLength;
+    return requestLength > length ? 0 : (int)requestLength;
+}
+
+int legacyGetIdFromRequest(const char* request, int offset) {
+    if (request[offset - 1] != '/' || request[offset + 1] != '/') {
+        return ERROR;
+    }
+    if (request[offset] < '0' || request[offset] > '9') {
+        return ERROR;
+    }
+    return request[offset] - '0';
+}
+
+int legacyGetTransactionFromBody(char* request, Transaction* transaction) {
+    char* body = strstr(request, "{");
+    errIfNull(body);
+
+    char* valor = strstr(body, "valor");
+    errIfNull(valor);
+    valor = strstr(valor, ":");
+    errIfNull(valor);
+    transaction->valor = atoi(&valor[1]);
+
+    char* tipo = strstr(body, "tipo");
+    errIfNull(tipo);
+    tipo = strstr(tipo, ":");
+    errIfNull(tipo);
+    tipo = strstr(tipo, "\"");
+    errIfNull(tipo);
+    transaction->tipo = tipo[1];
+
+    char* descricaoStart = strstr(body, "descricao");
+    errIfNull(descricaoStart);
+    descricaoStart = strstr(descricaoStart, ":");
+    errIfNull(descricaoStart);
+    descricaoStart = strstr(descricaoStart, "\"");
+    errIfNull(descricaoStart);
+    descricaoStart++;
+    char* descricaoEnd = strstr(descricaoStart, "\"");
+    errIfNull(descricaoEnd);
+    int length = descricaoEnd - descricaoStart;
+    if (length > 10 || length < 1) {
+        return ERROR;
+    }
+    memcpy(transaction->descricao, descricaoStart, length);
+    transaction->descricaoLength = (unsigned char)length;
+
+    // The old parser stamped the transaction on the api
+    transaction->realizadaEm = getEpochTimeUs();
+    return SUCCESS;
+}
+
+// Parses a request the old way, the request is '\0' terminated like handleConnectionRequests did
+int legacyParse(char* request, int length, Transaction* transaction) {
+    bool keepAlive = true;
+    int requestLength = legacyGetRequestLength(request, length, &keepAlive);
+    char saved = request[requestLength];
+    request[requestLength] = '\0';
+    int result;
+    if (partialEqual(request, GET_METHOD, GET_METHOD_LENGTH)) {
+        result = legacyGetIdFromRequest(request, 14);
+    } else {
+        result = legacyGetIdFromRequest(request, 15);
+        if (result != ERROR) {
+            result = legacyGetTransactionFromBody(request, transaction);
+        }
+    }
+    request[requestLength] = saved;
+    return result;
+}
+
+int parse(char* request, int length, Transaction* transaction) {
+    HttpRequest parsed;
+    int result = parseHttpRequest(request, length, CONNECTION_READ_SIZE, &parsed);
+    if (result > 0 && parsed.method == HTTP_METHOD_POST) {
+        result = parseTransaction(parsed.body, parsed.bodyLength, transaction);
+    }
+    return result + parsed.id;
+}
+
+// The request the cases parse
+char buffer[CONNECTION_READ_SIZE + 1];
+int bufferLength;
+Transaction transaction;
+
+void runLegacy(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        sink = legacyParse(buffer, bufferLength, &transaction);
+    }
+}
+
+void runSinglePass(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        sink = parse(buffer, bufferLength, &transaction);
+    }
+}
+
+void benchRequest(const char* name, const char* request, int length) {
+    memcpy(buffer, request, length);
+    bufferLength = length;
+    double legacy = timeRounds(runLegacy, WARMUP_ITERATIONS, ITERATIONS, ROUNDS).median;
+    double singlePass = timeRounds(runSinglePass, WARMUP_ITERATIONS, ITERATIONS, ROUNDS).median;
+    printf("%-5s %3d bytes: legacy %6.1f ns/request, single pass %6.1f ns/request, %.2fx\n",
+           name, length, legacy, singlePass, legacy / singlePass);
+}
+
+int main() {
+#if defined(__AVX2__)
+    printf("Scanning with AVX2\n");
+#elif defined(__SSE2__)
+    printf("Scanning with SSE2\n");
+#else
+    printf("Scanning without SIMD\n");
+#endif
+    benchRequest("GET", getRequest, sizeof(getRequest) - 1);
+    benchRequest("POST", postRequest, sizeof(postRequest) - 1);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+// Measures the cold start of the in-memory database with a million accounts
+// Compares rebuilding the users from the whole log with loading a checkpoint and replaying the log written after it
+// Runs on a temporary directory, the data directory of the db isn't touched
+// Build and run with `make run`
+
+#include <sys/stat.h>
+
+#include "../src/dbMemory.h"
+#include "bench.h"
+
+#define USERS 1000000
+// Updates spread over the users, before and after the checkpoint
+#define UPDATES 1000000
+#define TAIL_UPDATES 100000
+// Changes between commits, so the log buffer stays small
+#define COMMIT_EVERY 4096
+
+void commitEvery(int change) {
+    if (change % COMMIT_EVERY == COMMIT_EVERY - 1) {
+        commitChanges();
+    }
+}
+
+void updateUsers(int nUpdates) {
+    Transaction transaction = {.valor = 1, .tipo = 'c', .descricao = "bench", .descricaoLength = 5};
+    transaction.realizadaEm = getEpochTimeUs();
+    User user;
+    for (int i = 0; i < nUpdates; i++) {
+        if (updateUserMemory(1 + (int)((long long)i * 7919 % USERS), &transaction, &user) != SUCCESS) {
+            fail("Failed to update a user");
+        }
+        commitEvery(i);
+    }
+    commitChanges();
+}
+
+// Returns the ms to open the database
+long long timeRecovery() {
+    long long start = getCurrentTimeMs();
+    if (openMemoryDb(false) == ERROR) {
+        fail("Failed to recover");
+    }
+    long long elapsed = getCurrentTimeMs() - start;
+    if (memoryUsersCount != USERS) {
+        fprintf(stderr, "Recovered %d users instead of %d\n", memoryUsersCount, USERS);
+        exit(EXIT_FAILURE);
+    }
+    return elapsed;
+}
+
+void printRecovery(const char* name, long long ms) {
+    printf("%-21s %6lld ms: %7d checkpoint users in %5lld ms, %8lld log records in %5lld ms\n",
+           name, ms, memoryRecovery.checkpointUsers, memoryRecovery.checkpointMs,
+           memoryRecovery.logRecords, memoryRecovery.logMs);
+}
+
+int main() {
+    char directory[] = "/tmp/recovery-bench-XXXXXX";
+    if (mkdtemp(directory) == NULL || chdir(directory) == -1 || mkdir("data", 0755) == -1) {
+        fail("Failed to create the data directory");
+    }
+
+    if (openMemoryDb(true) == ERROR) {
+        fail("Failed to create the database");
+    }
+    for (int i = 0; i < USERS; i++) {
+        User user = {.id = i + 1, .limit = 100000};
+        if (writeUserMemory(&user) == ERROR) {
+            fail("Failed to create a user");
+        }
+        commitEvery(i);
+    }
+    updateUsers(UPDATES);
+    printf("%d users, %d updates, log %.1f MB\n", USERS, UPDATES, (double)getLogEnd() / (1024 * 1024));
+    closeMemoryDb();
+
+    printRecovery("whole log", timeRecovery());
+
+    long long start = getCurrentTimeMs();
+    if (checkpointMemoryDb() == ERROR) {
+        fail("Failed to write the checkpoint");
+    }
+    printf("%-21s %6lld ms\n", "checkpoint", getCurrentTimeMs() - start);
+    updateUsers(TAIL_UPDATES);
+    closeMemoryDb();
+
+    printRecovery("checkpoint and tail", timeRecovery());
+    closeMemoryDb();
+
+    unlink(LOG_FILE_NAME);
+    removeCheckpoint();
+    rmdir("data");
+    if (chdir("/") == -1 || rmdir(directory) == -1) {
+        fail("Failed to remove the data directory");
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+// Compares the sizes of the db replies over a loopback tcp connection, the way the db answers the api
+// Every reply goes on its own send, like the db answers every request, and the reader counts its recv calls
+// The whole user was the reply to every read and update, the balance is the update reply now,
+// and the header only read is the projection with no transactions
+// Build and run with `make run`
+
+#include <netinet/tcp.h>
+#include <pthread.h>
+
+#include "../src/account.h"
+#include "../src/dbProtocol.h"
+#include "bench.h"
+
+#define REPLIES 1000000
+#define READ_BUFFER_SIZE 64 * 1024
+
+typedef struct REPLY_SHAPE {
+    const char* name;
+    char frame[DB_FRAME_HEADER_SIZE + 1024];
+    int frameLength;
+} ReplyShape;
+
+typedef struct SENDER {
+    int socket;
+    ReplyShape* shape;
+} Sender;
+
+void* sendReplies(void* argument) {
+    Sender* sender = argument;
+    for (int i = 0; i < REPLIES; i++) {
+        int sent = 0;
+        while (sent < sender->shape->frameLength) {
+            ssize_t result = send(sender->socket, &sender->shape->frame[sent], sender->shape->frameLength - sent, 0);
+            if (result < 1) {
+                fail("Failed to send a reply");
+            }
+            sent += result;
+        }
+    }
+    return NULL;
+}
+
+// Returns a connected pair of loopback tcp sockets
+void connectPair(int* sending, int* receiving) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = 0, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addressLength = sizeof(address);
+    if (listener == ERROR || bind(listener, (SA*)&address, sizeof(address)) == ERROR ||
+        listen(listener, 1) == ERROR || getsockname(listener, (SA*)&address, &addressLength) == ERROR) {
+        fail("Failed to listen");
+    }
+    *sending = socket(AF_INET, SOCK_STREAM, 0);
+    if (*sending == ERROR || connect(*sending, (SA*)&address, sizeof(address)) == ERROR) {
+        fail("Failed to connect");
+    }
+    *receiving = accept(listener, NULL, NULL);
+    if (*receiving == ERROR) {
+        fail("Failed to accept");
+    }
+    // Like the db, every reply leaves right away
+    int noDelay = 1;
+    setsockopt(*sending, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    close(listener);
+}
+
+void benchShape(ReplyShape* shape) {
+    int sending, receiving;
+    connectPair(&sending, &receiving);
+    Sender sender = {sending, shape};
+    pthread_t thread;
+
+    static char buffer[READ_BUFFER_SIZE];
+    long long expected = (long long)REPLIES * shape->frameLength, received = 0;
+    long recvCalls = 0;
+    long long start = getMetricsTime();
+    if (pthread_create(&thread, NULL, sendReplies, &sender) != 0) {
+        fail("Failed to start the sender");
+    }
+    while (received < expected) {
+        ssize_t result = recv(receiving, buffer, sizeof(buffer), 0);
+        if (result < 1) {
+            fail("Failed to receive the replies");
+        }
+        received += result;
+        recvCalls++;
+    }
+    long long elapsed = getMetricsTime() - start;
+    pthread_join(thread, NULL);
+    close(sending);
+    close(receiving);
+
+    printf("%-16s %4d bytes/reply: %6.1f ns/reply, %6.1f MB, %5.1f replies/recv\n",
+           shape->name, shape->frameLength, (double)elapsed / REPLIES,
+           (double)expected / (1024 * 1024), (double)REPLIES / recvCalls);
+}
+
+int main() {
+    // A busy account, the 10 transactions with the longest descricao
+    User user = {.id = 1, .limit = 100000, .total = -12345};
+    for (int i = 0; i < MAX_TRANSACTIONS; i++) {
+        Transaction transaction = {.valor = 1000 + i, .tipo = 'd', .descricaoLength = DESCRIPTION_SIZE};
+        memcpy(transaction.descricao, "descricao0", DESCRIPTION_SIZE);
+        transaction.realizadaEm = getEpochTimeUs();
+        addTransaction(&user, &transaction);
+    }
+
+    ReplyShape shapes[4] = {{.name = "whole user v1"}, {.name = "whole user"}, {.name = "header only"}, {.name = "balance"}};
+    // The struct copy the db sent before the compact layout, 740 bytes
+    int legacyUserSize = 5 * 4 + MAX_TRANSACTIONS * 72;
+    memset(&shapes[0].frame[DB_FRAME_HEADER_SIZE], 0, legacyUserSize);
+    shapes[0].frameLength = writeFrameHeader(shapes[0].frame, DB_METHOD_READ, SUCCESS, 0, legacyUserSize);
+    int payloadSize = serializeUser(&user, &shapes[1].frame[DB_FRAME_HEADER_SIZE]);
+    shapes[1].frameLength = writeFrameHeader(shapes[1].frame, DB_METHOD_READ, SUCCESS, 0, payloadSize);
+    payloadSize = serializeUserProjection(&user, 0, &shapes[2].frame[DB_FRAME_HEADER_SIZE]);
+    shapes[2].frameLength = writeFrameHeader(shapes[2].frame, DB_METHOD_READ, SUCCESS, 0, payloadSize);
+    payloadSize = serializeBalance(&user, &shapes[3].frame[DB_FRAME_HEADER_SIZE]);
+    shapes[3].frameLength = writeFrameHeader(shapes[3].frame, DB_METHOD_UPDATE, SUCCESS, 0, payloadSize);
+
+    for (int i = 0; i < 4; i++) {
+        benchShape(&shapes[i]);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+// Compares the response writer with the old sprintf + strcat serialization,
+// and with the statements sent again from the statement cache, see extratoCache.h
+// Build and run with `make run`
+
+#include "../src/httpHandler.h"
+#include "bench.h"
+
+#define WARMUP_ITERATIONS 100000
+#define ITERATIONS 1000000
+#define ROUNDS 5
+
+// The serialization used before the response writer, kept here as the baseline
+const char* legacyTemplate = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n%s";
+
+void legacySerializeOrderedTransactions(User* user, char* body) {
+    if (user->nTransactions == 0) {
+        return;
+    }
+    char transactionData[256];
+
+    int i = user->oldestTransaction;
+    i = (i - 1 + user->nTransactions) % user->nTransactions;
+    for (int j = 0; j < user->nTransactions; j++) {
+        Transaction transaction = user->transactions[i];
+        // The timestamps used to be stored formatted, now they're formatted here too
+        char realizadaEm[DATE_SIZE];
+        formatTimestamp(transaction.realizadaEm, realizadaEm);
+        const char* transactionTemplate = "{\"valor\":%d,\"tipo\":\"%c\",\"descricao\":\"%.*s\",\"realizada_em\":\"%s\"},";
+        sprintf(transactionData,
+                transactionTemplate,
+                transaction.valor, transaction.tipo, transaction.descricaoLength, transaction.descricao, realizadaEm);
+
+        strcat(body, transactionData);
+        i = (i - 1 + user->nTransactions) % user->nTransactions;
+    }
+    int length = strlen(body);
+    body[length - 1] = '\0';
+}
+
+int legacySerializeGetResponse(User* user, char* response) {
+    char body[8 * 1024] = "";
+    char dateTime[DATE_SIZE];
+
+    getCurrentTimeStr(dateTime);
+    const char* userDataTemplate = "{\"saldo\":{\"total\":%d,\"data_extrato\":\"%s\",\"limite\":%d},\"ultimas_transacoes\":[";
+    sprintf(body, userDataTemplate, user->total, dateTime, user->limit);
+
+    legacySerializeOrderedTransactions(user, body);
+    strcat(body, "]}");
+
+    sprintf(response, legacyTemplate, (int)strlen(body), body);
+    // RESPOND used strlen to find the size
+    return strlen(response);
+}
+
+int legacySerializePostResponse(User* user, char* response) {
+    char body[256];
+    sprintf(body, "{\"limite\":%d, \"saldo\":%d}", user->limit, user->total);
+    sprintf(response, legacyTemplate, (int)strlen(body), body);
+    return strlen(response);
+}
+
+void fillUser(User* user, int nTransactions) {
+    memset(user, 0, sizeof(User));
+    user->id = 1;
+    user->limit = 100000;
+    user->total = -12345;
+    for (int i = 0; i < nTransactions; i++) {
+        Transaction transaction;
+        transaction.valor = 1000 + i * 37;
+        transaction.tipo = i % 2 == 0 ? 'c' : 'd';
+        char descricao[16];
+        transaction.descricaoLength = (unsigned char)sprintf(descricao, "desc%d", i);
+        memcpy(transaction.descricao, descricao, transaction.descricaoLength);
+        transaction.realizadaEm = getEpochTimeUs();
+        user->transactions[i] = transaction;
+    }
+    user->nTransactions = nTransactions;
+    user->oldestTransaction = 0;
+}
+
+// The user the cases serialize, and the buffer they write to
+User user;
+char buffer[RESPONSE_SIZE];
+
+void runLegacyGet(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        sink = legacySerializeGetResponse(&user, buffer);
+    }
+}
+
+void runWriterGet(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        int responseSize = 0, timestampOffset;
+        serializeGetResponse(&user, buffer, sizeof(buffer), &responseSize, &timestampOffset);
+        sink = responseSize;
+    }
+}
+
+void runCachedGet(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        int responseSize = 0;
+        getCachedExtrato(user.id, user.nTransactions, &responseSize);
+        sink = responseSize;
+    }
+}
+
+void runLegacyPost(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        sink = legacySerializePostResponse(&user, buffer);
+    }
+}
+
+void runWriterPost(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        int responseSize = 0;
+        serializePostResponse(&user, buffer, sizeof(buffer), &responseSize);
+        sink = responseSize;
+    }
+}
+
+double timeCase(void (*run)(int iterations)) {
+    return timeRounds(run, WARMUP_ITERATIONS, ITERATIONS, ROUNDS).median;
+}
+
+void benchGet() {
+    double legacy = timeCase(runLegacyGet);
+    double writer = timeCase(runWriterGet);
+
+    int responseSize, timestampOffset;
+    char* response = serializeGetResponse(&user, buffer, sizeof(buffer), &responseSize, &timestampOffset);
+    cacheExtrato(user.id, user.nTransactions, response, responseSize, timestampOffset);
+    double cached = timeCase(runCachedGet);
+
+    printf("GET  %2d transactions: sprintf %7.1f ns/op, writer %7.1f ns/op, %.2fx, cached %7.1f ns/op\n",
+           user.nTransactions, legacy, writer, legacy / writer, cached);
+}
+
+void benchPost() {
+    double legacy = timeCase(runLegacyPost);
+    double writer = timeCase(runWriterPost);
+    printf("POST              : sprintf %7.1f ns/op, writer %7.1f ns/op, %.2fx\n", legacy, writer, legacy / writer);
+}
+
+int main() {
+    fillUser(&user, 0);
+    benchGet();
+    fillUser(&user, 5);
+    benchGet();
+    fillUser(&user, MAX_TRANSACTIONS);
+    benchGet();
+    benchPost();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+// Compares the round trip latency of the api <-> db transports, see dbTransport.h
+// A child process answers each request frame with a reply frame, through the same connection code the servers use,
+// and the parent sends one request at a time and waits for its reply, like a lone client would
+// Build and run with `make run`
+
+#include <sys/wait.h>
+
+#include "../src/dbProtocol.h"
+#include "../src/dbTransport.h"
+#include "bench.h"
+
+#define ROUND_TRIPS 100000
+#define WARMUP_ROUND_TRIPS 1000
+// A read request, and the reply to a read with the 10 transactions
+#define REQUEST_PAYLOAD_SIZE 5
+#define REPLY_PAYLOAD_SIZE 254
+
+int compareLongLong(const void* a, const void* b) {
+    long long first = *(const long long*)a, second = *(const long long*)b;
+    return (first > second) - (first < second);
+}
+
+// Waits until a whole frame is on the connection, and consumes it
+void receiveFrame(EventLoop* loop, Connection* connection) {
+    while (true) {
+        int bytesRead = receiveIntoConnection(connection);
+        if (bytesRead == 0 || (bytesRead == ERROR && errno != EAGAIN)) {
+            fail("Failed to receive a frame");
+        }
+        DbFrameHeader header;
+        int frameLength = readFrameHeader(connection->readBuffer, connection->readLength, &header);
+        if (frameLength == ERROR) {
+            fprintf(stderr, "Invalid frame\n");
+            exit(EXIT_FAILURE);
+        }
+        if (frameLength > 0) {
+            consumeConnectionInput(connection, frameLength);
+            return;
+        }
+        if (bytesRead == ERROR && waitEvents(loop, WAIT_FOREVER) == ERROR) {
+            fail("Failed to wait");
+        }
+    }
+}
+
+// Answers every request of the run
+void serveReplies(int socket) {
+    EventLoop loop;
+    setupEventLoop(&loop);
+    if (watchDbConnection(&loop, socket) == ERROR) {
+        fail("Failed to watch the connection");
+    }
+    Connection* connection = getConnection(socket);
+    char reply[DB_FRAME_HEADER_SIZE + REPLY_PAYLOAD_SIZE] = {0};
+    int replyLength = writeFrameHeader(reply, DB_METHOD_READ, SUCCESS, 0, REPLY_PAYLOAD_SIZE);
+    for (int i = 0; i < WARMUP_ROUND_TRIPS + ROUND_TRIPS; i++) {
+        receiveFrame(&loop, connection);
+        if (sendToClient(socket, reply, replyLength) == ERROR || flushConnection(connection) == ERROR) {
+            fail("Failed to send a reply");
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+// Returns the connected loopback tcp socket of the parent, and the child gets the other one
+int connectTcp() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = 0, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addressLength = sizeof(address);
+    if (listener == ERROR || bind(listener, (SA*)&address, sizeof(address)) == ERROR ||
+        listen(listener, 1) == ERROR || getsockname(listener, (SA*)&address, &addressLength) == ERROR) {
+        fail("Failed to listen");
+    }
+    if (fork() == 0) {
+        int accepted = accept(listener, NULL, NULL);
+        if (accepted == ERROR || setNonBlocking(accepted) == ERROR) {
+            fail("Failed to accept");
+        }
+        close(listener);
+        serveReplies(accepted);
+    }
+    close(listener);
+    return connectDbTransport(DB_TRANSPORT_TCP, ntohs(address.sin_port));
+}
+
+// Same for the unix socket of the transport, the child accepts it like the db does
+int connectUnix(int transport, int port) {
+    int listener = setupDbUnixServer(port, transport, 1);
+    if (fork() == 0) {
+        // Set up like the db sets up the connections it accepts, see acceptDbClients
+        fcntl(listener, F_SETFL, 0);
+        int accepted = accept(listener, NULL, NULL);
+        Connection* connection = accepted == ERROR ? NULL : getConnection(accepted);
+        if (connection == NULL) {
+            fail("Failed to accept");
+        }
+        connection->framed = transport == DB_TRANSPORT_UNIX;
+        // The child has nothing else to serve, so it waits for the channel on the blocking socket
+        if (transport == DB_TRANSPORT_SHM) {
+            connection->channel = malloc(sizeof(ShmChannel));
+            if (connection->channel == NULL || openShmChannel(connection->channel, accepted) == ERROR) {
+                fail("Failed to receive the channel");
+            }
+        }
+        if (setNonBlocking(accepted) == ERROR) {
+            fail("Failed to set up the connection");
+        }
+        close(listener);
+        serveReplies(accepted);
+    }
+    close(listener);
+    return connectDbTransport(transport, port);
+}
+
+void benchTransport(const char* name, int transport) {
+    // The unix sockets are named after the port, so the runs don't collide
+    int port = 40000 + getpid() % 10000 + transport;
+    int socket = transport == DB_TRANSPORT_TCP ? connectTcp() : connectUnix(transport, port);
+    if (socket == ERROR) {
+        fail("Failed to connect");
+    }
+    EventLoop loop;
+    setupEventLoop(&loop);
+    if (watchDbConnection(&loop, socket) == ERROR) {
+        fail("Failed to watch the connection");
+    }
+    Connection* connection = getConnection(socket);
+
+    char request[DB_FRAME_HEADER_SIZE + REQUEST_PAYLOAD_SIZE] = {0};
+    int requestLength = writeFrameHeader(request, DB_METHOD_READ, SUCCESS, 0, REQUEST_PAYLOAD_SIZE);
+    static long long latencies[ROUND_TRIPS];
+    for (int i = 0; i < WARMUP_ROUND_TRIPS + ROUND_TRIPS; i++) {
+        long long start = getMetricsTime();
+        if (sendToClient(socket, request, requestLength) == ERROR || flushConnection(connection) == ERROR) {
+            fail("Failed to send a request");
+        }
+        receiveFrame(&loop, connection);
+        if (i >= WARMUP_ROUND_TRIPS) {
+            latencies[i - WARMUP_ROUND_TRIPS] = getMetricsTime() - start;
+        }
+    }
+    closeConnection(socket);
+    closeEventLoop(&loop);
+    wait(NULL);
+
+    long long total = 0;
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        total += latencies[i];
+    }
+    qsort(latencies, ROUND_TRIPS, sizeof(long long), compareLongLong);
+    printf("%-5s round trip: mean %7.1f ns, p50 %7lld ns, p99 %7lld ns, p99.9 %7lld ns\n", name,
+           (double)total / ROUND_TRIPS, latencies[ROUND_TRIPS / 2], latencies[ROUND_TRIPS * 99 / 100],
+           latencies[ROUND_TRIPS * 999 / 1000]);
+    // The next child would print it again on its exit
+    fflush(stdout);
+}
+
+int main() {
+    benchTransport("tcp", DB_TRANSPORT_TCP);
+    benchTransport("unix", DB_TRANSPORT_UNIX);
+    benchTransport("shm", DB_TRANSPORT_SHM);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,919 @@
+// Load generator replaying the Crebitos simulation, see user-files/simulations/rinhabackend,
+// without Gatling: the same validations first, then the debits, credits and statements of the simulation,
+// ramping up and then holding their rates, with the same checks on every response
+// Each phase is written as json on the output, with the p50, p99 and p99.9 of each kind of request,
+// and the program fails if any request failed, so it can gate a change on any linux box
+//
+// open - the requests arrive at the rates of the simulation whether the api keeps up or not,
+//        and their latency counts from when they should have been sent, not from when a connection was free,
+//        so a stall shows on every request it held back instead of only on the one it caught (coordinated omission)
+// closed - each connection sends its next request as soon as the last one is answered,
+//        the connections ramp up like the rates, it finds how many requests the api takes
+//
+// Build with `make build`, run against the load balancer with `make run`, or the api with `make run PORT=3000`
+// The validations expect a fresh db
+
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "../src/helpers.h"
+#include "../src/metrics.h"
+
+#define HOST_FLAG "--host"
+#define MODE_FLAG "--mode"
+#define CONNECTIONS_FLAG "--connections"
+#define RAMP_FLAG "--ramp-s"
+#define STEADY_FLAG "--steady-s"
+#define RATE_SCALE_FLAG "--rate-scale"
+#define SKIP_VALIDATION_FLAG "--skip-validation"
+
+#define MODE_OPEN 0
+#define MODE_CLOSED 1
+
+#define KIND_DEBIT 0
+#define KIND_CREDIT 1
+#define KIND_EXTRATO 2
+#define KIND_VALIDATION 3
+#define KINDS 4
+// Only the debits, credits and statements are part of the load
+#define LOAD_KINDS 3
+
+#define PHASE_VALIDATION 0
+#define PHASE_RAMP 1
+#define PHASE_STEADY 2
+#define PHASES 3
+
+#define CLIENTS 5
+// Concurrent requests of the first validation, like the simulation
+#define CONCURRENT_VALIDATIONS 25
+// Concurrent statements checked after a credit
+#define CONCURRENT_STATEMENTS 4
+// Fits a statement with all the transactions
+#define LOAD_RESPONSE_SIZE 8 * 1024
+#define LOAD_REQUEST_SIZE 512
+#define DESCRICAO_SIZE 10
+// Arrivals waiting for a free connection on the open mode
+#define MAX_QUEUED_ARRIVALS (1 << 20)
+// The requests still unanswered this long after the load are failed
+#define DRAIN_TIMEOUT_NS 10000000000LL
+// How often the closed mode adds connections during the ramp
+#define CLOSED_RAMP_TICK_NS 10000000LL
+// Failures printed, the others are only counted
+#define MAX_PRINTED_FAILURES 20
+
+const char* kindNames[KINDS] = {"debitos", "creditos", "extratos", "validacoes"};
+const char* phaseNames[PHASES] = {"validacoes", "ramp", "steady"};
+// Requests per second of the load at the end of the ramp, the ramp starts at 1
+const double kindRates[LOAD_KINDS] = {220, 110, 10};
+const int clientLimits[CLIENTS + 1] = {0, 1000 * 100, 800 * 100, 10000 * 100, 100000 * 100, 5000 * 100};
+
+typedef struct PHASE_STATS {
+    // Latencies of the answered requests, failed or not
+    Histogram latencies[KINDS];
+    unsigned long maxNs[KINDS];
+    unsigned long failures[KINDS];
+    long long startNs, endNs;
+} PhaseStats;
+
+typedef struct LOAD_RESPONSE {
+    int status;
+    // NUL terminated
+    const char* body;
+    int bodyLength;
+} LoadResponse;
+
+typedef struct LOAD_CONNECTION {
+    int socket;
+    bool busy;
+    int kind;
+    int phase;
+    int clientId;
+    // When the request should have been sent, or was sent on the closed mode
+    long long startNs;
+    char request[LOAD_REQUEST_SIZE];
+    int requestLength, sent;
+    // One more byte for the NUL
+    char response[LOAD_RESPONSE_SIZE + 1];
+    int responseLength;
+} LoadConnection;
+
+typedef struct LOAD_ARRIVAL {
+    int kind;
+    long long startNs;
+} LoadArrival;
+
+PhaseStats phaseStats[PHASES];
+unsigned long printedFailures = 0;
+
+struct in_addr apiHost;
+int apiPort;
+int mode = MODE_OPEN;
+int nConnections = 256;
+int rampS = 120, steadyS = 120;
+double rateScale = 1;
+bool skipValidation = false;
+
+LoadConnection* connections;
+int epollFd, timerFd;
+int busyConnections = 0;
+long long loadStartNs, rampEndNs, loadEndNs;
+
+LoadArrival* arrivals;
+int arrivalsHead = 0, arrivalsCount = 0;
+
+unsigned long long randomState;
+
+void fail(const char* message) {
+    perror(message);
+    exit(EXIT_FAILURE);
+}
+
+// xorshift, the requests only need to be spread, not unpredictable
+unsigned long long nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+// Returns a number from min to max, both included
+int randomBetween(int min, int max) {
+    return min + (int)(nextRandom() % (unsigned long long)(max - min + 1));
+}
+
+void recordRequest(int phase, int kind, long long latencyNs) {
+    unsigned long value = latencyNs < 0 ? 0 : (unsigned long)latencyNs;
+    Histogram* histogram = &phaseStats[phase].latencies[kind];
+    histogram->buckets[getBucket(value)]++;
+    histogram->sumNs += value;
+    histogram->count++;
+    if (value > phaseStats[phase].maxNs[kind]) {
+        phaseStats[phase].maxNs[kind] = value;
+    }
+}
+
+void recordFailure(int phase, int kind, const char* format, ...) {
+    phaseStats[phase].failures[kind]++;
+    if (printedFailures++ >= MAX_PRINTED_FAILURES) {
+        return;
+    }
+    va_list arguments;
+    va_start(arguments, format);
+    fprintf(stderr, "[ %s - %s: ", phaseNames[phase], kindNames[kind]);
+    vfprintf(stderr, format, arguments);
+    fprintf(stderr, " ]\n");
+    va_end(arguments);
+}
+
+// Http
+
+// Returns the length of the response on the buffer, 0 if it's not complete yet, or ERROR if it's not http
+// The buffer must be NUL terminated at length
+int parseResponse(char* buffer, int length, LoadResponse* response) {
+    char* headerEnd = strstr(buffer, "\r\n\r\n");
+    if (headerEnd == NULL) {
+        return length > LOAD_RESPONSE_SIZE / 2 ? ERROR : 0;
+    }
+    if (length < 12 || strncmp(buffer, "HTTP/1.1 ", 9) != 0) {
+        return ERROR;
+    }
+    response->status = atoi(&buffer[9]);
+    int contentLength = 0;
+    for (char* line = strstr(buffer, "\r\n") + 2; line < headerEnd; line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "content-length:", 15) == 0) {
+            contentLength = atoi(&line[15]);
+        }
+    }
+    int responseLength = (int)(headerEnd - buffer) + 4 + contentLength;
+    if (contentLength < 0 || responseLength > LOAD_RESPONSE_SIZE) {
+        return ERROR;
+    }
+    if (responseLength > length) {
+        return 0;
+    }
+    response->body = headerEnd + 4;
+    response->bodyLength = contentLength;
+    buffer[responseLength] = '\0';
+    return responseLength;
+}
+
+int buildPost(char* request, int clientId, const char* body, int bodyLength) {
+    return snprintf(request, LOAD_REQUEST_SIZE,
+                    "POST /clientes/%d/transacoes HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\n"
+                    "Content-Length: %d\r\n\r\n%s",
+                    clientId, bodyLength, body);
+}
+
+int buildTransaction(char* request, int clientId, int valor, char tipo, const char* descricao) {
+    char body[128];
+    int bodyLength = snprintf(body, sizeof(body), "{\"valor\": %d, \"tipo\": \"%c\", \"descricao\": \"%s\"}", valor, tipo, descricao);
+    return buildPost(request, clientId, body, bodyLength);
+}
+
+int buildExtrato(char* request, int clientId) {
+    return snprintf(request, LOAD_REQUEST_SIZE, "GET /clientes/%d/extrato HTTP/1.1\r\nHost: localhost\r\n\r\n", clientId);
+}
+
+// Json, only what the checks need, the fields are found by name
+
+// Finds the number after "key": between start and end
+// Returns false if it's not there
+bool findJsonInt(const char* start, const char* end, const char* key, long long* value) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* found = strstr(start, pattern);
+    if (found == NULL || found >= end) {
+        return false;
+    }
+    char* numberEnd;
+    *value = strtoll(found + strlen(pattern), &numberEnd, 10);
+    return numberEnd != found + strlen(pattern) && (*numberEnd == ',' || *numberEnd == '}' || *numberEnd == ' ');
+}
+
+// Finds the string after "key": between start and end
+// Returns false if it's not there
+bool findJsonString(const char* start, const char* end, const char* key, char* value, int size) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* found = strstr(start, pattern);
+    if (found == NULL || found >= end) {
+        return false;
+    }
+    const char* open = strchr(found + strlen(pattern), '"');
+    const char* close = open == NULL ? NULL : strchr(open + 1, '"');
+    if (close == NULL || close >= end || close - open - 1 >= size) {
+        return false;
+    }
+    memcpy(value, open + 1, close - open - 1);
+    value[close - open - 1] = '\0';
+    return true;
+}
+
+// Checks the balance isn't below the limit, saldo and limite on a transaction, total and limite on a statement
+bool isBalanceConsistent(const LoadResponse* response, const char* balanceKey, long long* balance, long long* limit) {
+    const char* end = response->body + response->bodyLength;
+    return findJsonInt(response->body, end, balanceKey, balance) && findJsonInt(response->body, end, "limite", limit) &&
+           *balance >= -*limit;
+}
+
+// Checks the transaction at the index of the statement, the latest first
+bool isStatementTransaction(const LoadResponse* response, int index, const char* descricao, char tipo, long long valor) {
+    const char* end = response->body + response->bodyLength;
+    const char* transaction = strstr(response->body, "\"ultimas_transacoes\"");
+    for (int i = 0; transaction != NULL && i <= index; i++) {
+        transaction = strchr(transaction + 1, '{');
+    }
+    const char* transactionEnd = transaction == NULL ? NULL : strchr(transaction, '}');
+    if (transactionEnd == NULL || transactionEnd > end) {
+        return false;
+    }
+    char foundDescricao[DESCRICAO_SIZE + 1], foundTipo[2];
+    long long foundValor;
+    return findJsonString(transaction, transactionEnd, "descricao", foundDescricao, sizeof(foundDescricao)) &&
+           findJsonString(transaction, transactionEnd, "tipo", foundTipo, sizeof(foundTipo)) &&
+           findJsonInt(transaction, transactionEnd, "valor", &foundValor) && strcmp(foundDescricao, descricao) == 0 &&
+           foundTipo[0] == tipo && foundValor == valor;
+}
+
+// Checks the response to a request of the load, like the simulation does
+void checkLoadResponse(int phase, int kind, int clientId, const LoadResponse* response) {
+    long long balance, limit;
+    if (kind == KIND_EXTRATO) {
+        if (response->status != 200 || !isBalanceConsistent(response, "total", &balance, &limit)) {
+            recordFailure(phase, kind, "client %d, status %d, %.200s", clientId, response->status, response->body);
+        }
+        return;
+    }
+    // A debit over the limit is refused
+    if (kind == KIND_DEBIT && response->status == 422) {
+        return;
+    }
+    if (response->status != 200 || !isBalanceConsistent(response, "saldo", &balance, &limit)) {
+        recordFailure(phase, kind, "client %d, status %d, %.200s", clientId, response->status, response->body);
+    }
+}
+
+// Connections
+
+int connectToApi() {
+    int apiSocket = socket(AF_INET, SOCK_STREAM, 0);
+    raiseIfError(apiSocket);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(apiPort), .sin_addr = apiHost};
+    if (connect(apiSocket, (SA*)&address, sizeof(address)) == ERROR) {
+        close(apiSocket);
+        return ERROR;
+    }
+    int yes = 1;
+    setsockopt(apiSocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return apiSocket;
+}
+
+int sendAll(int socket, const char* data, int length) {
+    int sent = 0;
+    while (sent < length) {
+        ssize_t result = send(socket, &data[sent], length - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        raiseIfError(result);
+        sent += (int)result;
+    }
+    return SUCCESS;
+}
+
+// Reads a whole response from the blocking socket into the buffer, of LOAD_RESPONSE_SIZE + 1 bytes
+// Returns ERROR if the connection failed or the response is invalid
+int receiveResponse(int socket, char* buffer, LoadResponse* response) {
+    int length = 0;
+    while (true) {
+        ssize_t bytesRead = recv(socket, &buffer[length], LOAD_RESPONSE_SIZE - length, 0);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead < 1) {
+            return ERROR;
+        }
+        length += (int)bytesRead;
+        buffer[length] = '\0';
+        int responseLength = parseResponse(buffer, length, response);
+        if (responseLength != 0) {
+            return responseLength;
+        }
+    }
+}
+
+// Validations, on blocking connections, before the load
+
+int validationSockets[CONCURRENT_VALIDATIONS];
+char validationBuffers[CONCURRENT_VALIDATIONS][LOAD_RESPONSE_SIZE + 1];
+LoadResponse validationResponses[CONCURRENT_VALIDATIONS];
+
+// Sends the request on count connections at once, and waits for every response on validationResponses
+// The connections that fail get a 0 status
+void exchange(int count, const char* request, int requestLength) {
+    long long start = getMetricsTime();
+    for (int i = 0; i < count; i++) {
+        validationResponses[i].status = 0;
+        if (validationSockets[i] != ERROR && sendAll(validationSockets[i], request, requestLength) == ERROR) {
+            validationSockets[i] = ERROR;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (validationSockets[i] == ERROR ||
+            receiveResponse(validationSockets[i], validationBuffers[i], &validationResponses[i]) == ERROR) {
+            validationResponses[i].status = 0;
+            validationResponses[i].body = "";
+            validationResponses[i].bodyLength = 0;
+            // Connected again for the next validation
+            if (validationSockets[i] != ERROR) {
+                close(validationSockets[i]);
+            }
+            validationSockets[i] = connectToApi();
+        }
+        recordRequest(PHASE_VALIDATION, KIND_VALIDATION, getMetricsTime() - start);
+    }
+}
+
+void expectStatus(const char* name, int status, int expected, int alternative) {
+    if (status != expected && status != alternative) {
+        recordFailure(PHASE_VALIDATION, KIND_VALIDATION, "%s, status %d", name, status);
+    }
+}
+
+void expect(const char* name, bool condition, const LoadResponse* response) {
+    if (!condition) {
+        recordFailure(PHASE_VALIDATION, KIND_VALIDATION, "%s, status %d, %.200s", name, response->status, response->body);
+    }
+}
+
+// Concurrent debits and then credits of 1 on the first client, the balance must follow them
+void validateConcurrency(char tipo, int expectedBalance) {
+    char request[LOAD_REQUEST_SIZE];
+    int requestLength = buildTransaction(request, 1, 1, tipo, "validacao");
+    exchange(CONCURRENT_VALIDATIONS, request, requestLength);
+    for (int i = 0; i < CONCURRENT_VALIDATIONS; i++) {
+        expect("concurrent transaction", validationResponses[i].status == 200, &validationResponses[i]);
+    }
+    requestLength = buildExtrato(request, 1);
+    exchange(1, request, requestLength);
+    long long balance;
+    const LoadResponse* response = &validationResponses[0];
+    expect("concurrent balance",
+           findJsonInt(response->body, response->body + response->bodyLength, "total", &balance) && balance == expectedBalance,
+           response);
+}
+
+// The checks of the simulation on a client, from its initial balance
+void validateClient(int clientId) {
+    char request[LOAD_REQUEST_SIZE];
+    const LoadResponse* response = &validationResponses[0];
+    long long balance, limit;
+
+    exchange(1, request, buildExtrato(request, clientId));
+    expect("initial statement",
+           response->status == 200 && isBalanceConsistent(response, "total", &balance, &limit) && balance == 0 &&
+               limit == clientLimits[clientId],
+           response);
+
+    exchange(1, request, buildTransaction(request, clientId, 1, 'c', "toma"));
+    expect("credit", response->status == 200 && isBalanceConsistent(response, "saldo", &balance, &limit), response);
+    exchange(1, request, buildTransaction(request, clientId, 1, 'd', "devolve"));
+    expect("debit", response->status == 200 && isBalanceConsistent(response, "saldo", &balance, &limit), response);
+    exchange(1, request, buildExtrato(request, clientId));
+    expect("statement transactions",
+           isStatementTransaction(response, 0, "devolve", 'd', 1) && isStatementTransaction(response, 1, "toma", 'c', 1),
+           response);
+
+    // The statements right after a credit must already have it
+    exchange(1, request, buildTransaction(request, clientId, 1, 'c', "danada"));
+    bool credited = response->status == 200 && isBalanceConsistent(response, "saldo", &balance, &limit);
+    expect("credit", credited, response);
+    exchange(CONCURRENT_STATEMENTS, request, buildExtrato(request, clientId));
+    for (int i = 0; credited && i < CONCURRENT_STATEMENTS; i++) {
+        long long statementBalance, statementLimit;
+        response = &validationResponses[i];
+        expect("statement consistency",
+               isStatementTransaction(response, 0, "danada", 'c', 1) &&
+                   isBalanceConsistent(response, "total", &statementBalance, &statementLimit) &&
+                   statementBalance == balance && statementLimit == limit,
+               response);
+    }
+
+    const char* invalidBodies[] = {
+        "{\"valor\": 1.2, \"tipo\": \"d\", \"descricao\": \"devolve\"}",
+        "{\"valor\": 1, \"tipo\": \"x\", \"descricao\": \"devolve\"}",
+        "{\"valor\": 1, \"tipo\": \"c\", \"descricao\": \"123456789 e mais um pouco\"}",
+        "{\"valor\": 1, \"tipo\": \"c\", \"descricao\": \"\"}",
+        "{\"valor\": 1, \"tipo\": \"c\", \"descricao\": null}",
+    };
+    for (int i = 0; i < 5; i++) {
+        exchange(1, request, buildPost(request, clientId, invalidBodies[i], (int)strlen(invalidBodies[i])));
+        // A decimal valor may also be a bad request
+        expectStatus(invalidBodies[i], validationResponses[0].status, 422, i == 0 ? 400 : 422);
+    }
+}
+
+void runValidations() {
+    for (int i = 0; i < CONCURRENT_VALIDATIONS; i++) {
+        validationSockets[i] = connectToApi();
+        if (validationSockets[i] == ERROR) {
+            fail("Failed to connect to the api");
+        }
+    }
+    validateConcurrency('d', -CONCURRENT_VALIDATIONS);
+    validateConcurrency('c', 0);
+    for (int clientId = 1; clientId <= CLIENTS; clientId++) {
+        validateClient(clientId);
+    }
+    char request[LOAD_REQUEST_SIZE];
+    exchange(1, request, buildExtrato(request, CLIENTS + 1));
+    expectStatus("unknown client", validationResponses[0].status, 404, 404);
+    for (int i = 0; i < CONCURRENT_VALIDATIONS; i++) {
+        if (validationSockets[i] != ERROR) {
+            close(validationSockets[i]);
+        }
+    }
+}
+
+// Load, on non blocking connections watched by epoll
+
+void watchConnection(int index, bool writing) {
+    struct epoll_event event = {.events = EPOLLIN | (writing ? EPOLLOUT : 0), .data.u32 = (uint32_t)index};
+    if (epoll_ctl(epollFd, EPOLL_CTL_MOD, connections[index].socket, &event) == ERROR) {
+        fail("Failed to watch a connection");
+    }
+}
+
+void openLoadConnection(int index) {
+    LoadConnection* connection = &connections[index];
+    connection->socket = connectToApi();
+    if (connection->socket == ERROR) {
+        fail("Failed to connect to the api");
+    }
+    fcntl(connection->socket, F_SETFL, fcntl(connection->socket, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = (uint32_t)index};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connection->socket, &event) == ERROR) {
+        fail("Failed to watch a connection");
+    }
+    connection->busy = false;
+    connection->responseLength = 0;
+}
+
+// Fails the request of the connection, if any, and connects it again
+void resetLoadConnection(int index, const char* reason) {
+    LoadConnection* connection = &connections[index];
+    if (connection->busy) {
+        recordFailure(connection->phase, connection->kind, "client %d, %s", connection->clientId, reason);
+        busyConnections--;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->socket, NULL);
+    close(connection->socket);
+    openLoadConnection(index);
+}
+
+// Sends what's left of the request, waiting to write if the socket is full
+void flushRequest(int index) {
+    LoadConnection* connection = &connections[index];
+    while (connection->sent < connection->requestLength) {
+        ssize_t sent = send(connection->socket, &connection->request[connection->sent],
+                            connection->requestLength - connection->sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && errno == EAGAIN) {
+            watchConnection(index, true);
+            return;
+        }
+        if (sent < 0) {
+            resetLoadConnection(index, "failed to send");
+            return;
+        }
+        connection->sent += (int)sent;
+    }
+}
+
+// Starts a request of the kind on the free connection, to a random client
+void startRequest(int index, int kind, long long startNs) {
+    LoadConnection* connection = &connections[index];
+    connection->kind = kind;
+    connection->startNs = startNs;
+    connection->phase = startNs < rampEndNs ? PHASE_RAMP : PHASE_STEADY;
+    connection->clientId = randomBetween(1, CLIENTS);
+    if (kind == KIND_EXTRATO) {
+        connection->requestLength = buildExtrato(connection->request, connection->clientId);
+    } else {
+        char descricao[DESCRICAO_SIZE + 1];
+        const char alphanumeric[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+        for (int i = 0; i < DESCRICAO_SIZE; i++) {
+            descricao[i] = alphanumeric[randomBetween(0, sizeof(alphanumeric) - 2)];
+        }
+        descricao[DESCRICAO_SIZE] = '\0';
+        connection->requestLength = buildTransaction(connection->request, connection->clientId, randomBetween(1, 10000),
+                                                     kind == KIND_DEBIT ? 'd' : 'c', descricao);
+    }
+    connection->sent = 0;
+    connection->busy = true;
+    busyConnections++;
+    flushRequest(index);
+}
+
+// Returns a free connection, or ERROR if they're all busy
+int findFreeConnection() {
+    static int next = 0;
+    for (int i = 0; i < nConnections; i++) {
+        int index = (next + i) % nConnections;
+        if (!connections[index].busy) {
+            next = index + 1;
+            return index;
+        }
+    }
+    return ERROR;
+}
+
+// Reads the response of the connection, and records it once it's whole
+// Returns true if the request was answered
+bool receiveLoadResponse(int index) {
+    LoadConnection* connection = &connections[index];
+    while (true) {
+        ssize_t bytesRead = recv(connection->socket, &connection->response[connection->responseLength],
+                                 LOAD_RESPONSE_SIZE - connection->responseLength, 0);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead < 0 && errno == EAGAIN) {
+            return false;
+        }
+        if (bytesRead < 1 || !connection->busy) {
+            resetLoadConnection(index, "connection closed");
+            return false;
+        }
+        connection->responseLength += (int)bytesRead;
+        connection->response[connection->responseLength] = '\0';
+        LoadResponse response;
+        int responseLength = parseResponse(connection->response, connection->responseLength, &response);
+        if (responseLength == ERROR) {
+            resetLoadConnection(index, "invalid response");
+            return false;
+        }
+        if (responseLength > 0) {
+            recordRequest(connection->phase, connection->kind, getMetricsTime() - connection->startNs);
+            checkLoadResponse(connection->phase, connection->kind, connection->clientId, &response);
+            connection->busy = false;
+            connection->responseLength = 0;
+            busyConnections--;
+            return true;
+        }
+    }
+}
+
+// Requests per second of the kind at the time
+double getRate(int kind, long long timeNs) {
+    double rate = kindRates[kind];
+    if (timeNs < rampEndNs) {
+        rate = 1 + (rate - 1) * (double)(timeNs - loadStartNs) / (double)(rampEndNs - loadStartNs);
+    }
+    return rate * rateScale;
+}
+
+void armTimer(long long timeNs) {
+    struct itimerspec timer = {.it_value = {.tv_sec = timeNs / 1000000000, .tv_nsec = timeNs % 1000000000}};
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, NULL) == ERROR) {
+        fail("Failed to arm the timer");
+    }
+}
+
+// Waits for the connections or the timer, and reads the answered responses
+// Calls back onAnswered with each connection that got its response
+void waitLoadEvents(void (*onAnswered)(int index)) {
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(epollFd, events, 256, -1);
+    if (nEvents == ERROR && errno != EINTR) {
+        fail("Failed to wait");
+    }
+    for (int i = 0; i < nEvents; i++) {
+        if (events[i].data.u32 == UINT32_MAX) {
+            unsigned long long expirations;
+            if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                fail("Failed to read the timer");
+            }
+            continue;
+        }
+        int index = (int)events[i].data.u32;
+        if (events[i].events & EPOLLOUT) {
+            watchConnection(index, false);
+            flushRequest(index);
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && receiveLoadResponse(index)) {
+            onAnswered(index);
+        }
+    }
+}
+
+void dispatchArrivals(int index) {
+    (void)index;
+    while (arrivalsCount > 0) {
+        int free = findFreeConnection();
+        if (free == ERROR) {
+            return;
+        }
+        LoadArrival* arrival = &arrivals[arrivalsHead];
+        arrivalsHead = (arrivalsHead + 1) % MAX_QUEUED_ARRIVALS;
+        arrivalsCount--;
+        startRequest(free, arrival->kind, arrival->startNs);
+    }
+}
+
+// Each kind arrives at its own rate, the arrivals wait for a free connection and their latency counts the wait
+void runOpenLoad() {
+    arrivals = malloc(MAX_QUEUED_ARRIVALS * sizeof(LoadArrival));
+    if (arrivals == NULL) {
+        fail("Failed to allocate the arrivals");
+    }
+    long long nextArrival[LOAD_KINDS];
+    for (int kind = 0; kind < LOAD_KINDS; kind++) {
+        nextArrival[kind] = loadStartNs;
+    }
+    while (true) {
+        long long now = getMetricsTime();
+        long long nextWakeup = loadEndNs + DRAIN_TIMEOUT_NS;
+        for (int kind = 0; kind < LOAD_KINDS; kind++) {
+            while (nextArrival[kind] <= now && nextArrival[kind] < loadEndNs) {
+                int phase = nextArrival[kind] < rampEndNs ? PHASE_RAMP : PHASE_STEADY;
+                if (arrivalsCount == MAX_QUEUED_ARRIVALS) {
+                    recordFailure(phase, kind, "too many requests waiting for a connection");
+                } else {
+                    arrivals[(arrivalsHead + arrivalsCount) % MAX_QUEUED_ARRIVALS] = (LoadArrival){kind, nextArrival[kind]};
+                    arrivalsCount++;
+                }
+                nextArrival[kind] += (long long)(1e9 / getRate(kind, nextArrival[kind]));
+            }
+            if (nextArrival[kind] < loadEndNs && nextArrival[kind] < nextWakeup) {
+                nextWakeup = nextArrival[kind];
+            }
+        }
+        dispatchArrivals(ERROR);
+        bool arrived = nextWakeup >= loadEndNs;
+        if (arrived && arrivalsCount == 0 && busyConnections == 0) {
+            return;
+        }
+        if (now >= loadEndNs + DRAIN_TIMEOUT_NS) {
+            break;
+        }
+        armTimer(nextWakeup);
+        waitLoadEvents(dispatchArrivals);
+    }
+    // Never answered
+    for (int i = 0; i < nConnections; i++) {
+        if (connections[i].busy) {
+            resetLoadConnection(i, "no response");
+        }
+    }
+    for (; arrivalsCount > 0; arrivalsCount--) {
+        LoadArrival* arrival = &arrivals[arrivalsHead];
+        arrivalsHead = (arrivalsHead + 1) % MAX_QUEUED_ARRIVALS;
+        recordFailure(arrival->startNs < rampEndNs ? PHASE_RAMP : PHASE_STEADY, arrival->kind, "no free connection");
+    }
+}
+
+// Returns a kind with the proportions of the rates
+int randomKind() {
+    int total = (int)(kindRates[KIND_DEBIT] + kindRates[KIND_CREDIT] + kindRates[KIND_EXTRATO]);
+    int pick = randomBetween(0, total - 1);
+    if (pick < kindRates[KIND_DEBIT]) {
+        return KIND_DEBIT;
+    }
+    return pick < kindRates[KIND_DEBIT] + kindRates[KIND_CREDIT] ? KIND_CREDIT : KIND_EXTRATO;
+}
+
+// Connections taking part in the closed load at the time, from 1 to all of them during the ramp
+int getActiveConnections(long long timeNs) {
+    if (timeNs >= rampEndNs) {
+        return nConnections;
+    }
+    int active = (int)((double)nConnections * (double)(timeNs - loadStartNs) / (double)(rampEndNs - loadStartNs));
+    return active < 1 ? 1 : active;
+}
+
+void continueClosedLoad(int index) {
+    long long now = getMetricsTime();
+    if (now < loadEndNs && index < getActiveConnections(now) && !connections[index].busy) {
+        startRequest(index, randomKind(), now);
+    }
+}
+
+// Each active connection sends a request as soon as its last one is answered
+void runClosedLoad() {
+    while (true) {
+        long long now = getMetricsTime();
+        if (now < loadEndNs) {
+            int active = getActiveConnections(now);
+            for (int i = 0; i < active; i++) {
+                if (!connections[i].busy) {
+                    startRequest(i, randomKind(), now);
+                }
+            }
+        } else if (busyConnections == 0) {
+            return;
+        }
+        if (now >= loadEndNs + DRAIN_TIMEOUT_NS) {
+            break;
+        }
+        long long nextWakeup = now < rampEndNs ? now + CLOSED_RAMP_TICK_NS : now < loadEndNs ? loadEndNs : loadEndNs + DRAIN_TIMEOUT_NS;
+        armTimer(nextWakeup);
+        waitLoadEvents(continueClosedLoad);
+    }
+    for (int i = 0; i < nConnections; i++) {
+        if (connections[i].busy) {
+            resetLoadConnection(i, "no response");
+        }
+    }
+}
+
+void runLoad() {
+    connections = calloc(nConnections, sizeof(LoadConnection));
+    epollFd = epoll_create1(0);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (connections == NULL || epollFd == ERROR || timerFd == ERROR) {
+        fail("Failed to set up the load");
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = UINT32_MAX};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) == ERROR) {
+        fail("Failed to watch the timer");
+    }
+    for (int i = 0; i < nConnections; i++) {
+        openLoadConnection(i);
+    }
+
+    loadStartNs = getMetricsTime();
+    rampEndNs = loadStartNs + (long long)rampS * 1000000000;
+    loadEndNs = rampEndNs + (long long)steadyS * 1000000000;
+    phaseStats[PHASE_RAMP].startNs = loadStartNs;
+    phaseStats[PHASE_RAMP].endNs = rampEndNs;
+    phaseStats[PHASE_STEADY].startNs = rampEndNs;
+    phaseStats[PHASE_STEADY].endNs = loadEndNs;
+    if (mode == MODE_OPEN) {
+        runOpenLoad();
+    } else {
+        runClosedLoad();
+    }
+}
+
+// Output
+
+double toMs(unsigned long ns) {
+    return (double)ns / 1e6;
+}
+
+// The quantiles are the ends of their buckets, so they're kept under the slowest request
+double getQuantileMs(PhaseStats* stats, int kind, double quantile) {
+    Histogram* histogram = &stats->latencies[kind];
+    if (histogram->count == 0) {
+        return 0;
+    }
+    unsigned long value = getQuantile(histogram, quantile);
+    return toMs(value < stats->maxNs[kind] ? value : stats->maxNs[kind]);
+}
+
+// Returns the number of failures of every phase
+unsigned long printReport() {
+    unsigned long totalFailures = 0;
+    printf("{\"mode\": \"%s\", \"connections\": %d, \"rateScale\": %g, \"phases\": [", mode == MODE_OPEN ? "open" : "closed",
+           nConnections, rateScale);
+    bool firstPhase = true;
+    for (int phase = 0; phase < PHASES; phase++) {
+        PhaseStats* stats = &phaseStats[phase];
+        double seconds = (double)(stats->endNs - stats->startNs) / 1e9;
+        if (stats->endNs <= stats->startNs) {
+            continue;
+        }
+        unsigned long requests = 0, failures = 0;
+        for (int kind = 0; kind < KINDS; kind++) {
+            requests += stats->latencies[kind].count;
+            failures += stats->failures[kind];
+        }
+        totalFailures += failures;
+        printf("%s\n  {\"name\": \"%s\", \"seconds\": %.3f, \"requests\": %lu, \"failures\": %lu, \"throughput\": %.1f, \"kinds\": {",
+               firstPhase ? "" : ",", phaseNames[phase], seconds, requests, failures, (double)requests / seconds);
+        firstPhase = false;
+        bool firstKind = true;
+        for (int kind = 0; kind < KINDS; kind++) {
+            Histogram* histogram = &stats->latencies[kind];
+            if (histogram->count == 0 && stats->failures[kind] == 0) {
+                continue;
+            }
+            printf("%s\n    \"%s\": {\"requests\": %lu, \"failures\": %lu, \"p50Ms\": %.3f, \"p99Ms\": %.3f, \"p999Ms\": %.3f, \"maxMs\": %.3f}",
+                   firstKind ? "" : ",", kindNames[kind], histogram->count, stats->failures[kind],
+                   getQuantileMs(stats, kind, 0.5), getQuantileMs(stats, kind, 0.99), getQuantileMs(stats, kind, 0.999),
+                   toMs(stats->maxNs[kind]));
+            firstKind = false;
+        }
+        printf("}}");
+    }
+    printf("\n]}\n");
+    return totalFailures;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <port> [" HOST_FLAG " <ipv4>] [" MODE_FLAG " open|closed] [" CONNECTIONS_FLAG " <number of connections>] [" RAMP_FLAG " <seconds>] [" STEADY_FLAG " <seconds>] [" RATE_SCALE_FLAG " <multiplier>] [" SKIP_VALIDATION_FLAG "]\n", argv[0]);
+        return ERROR;
+    }
+
+    apiPort = atoi(argv[1]);
+    const char* host = "127.0.0.1";
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], SKIP_VALIDATION_FLAG) == 0) {
+            skipValidation = true;
+            continue;
+        }
+        // The other flags take a value
+        if (i + 1 == argc) {
+            break;
+        }
+        if (strcmp(argv[i], HOST_FLAG) == 0) {
+            host = argv[i + 1];
+        } else if (strcmp(argv[i], MODE_FLAG) == 0) {
+            mode = strcmp(argv[i + 1], "open") == 0 ? MODE_OPEN : strcmp(argv[i + 1], "closed") == 0 ? MODE_CLOSED : ERROR;
+        } else if (strcmp(argv[i], CONNECTIONS_FLAG) == 0) {
+            nConnections = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], RAMP_FLAG) == 0) {
+            rampS = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], STEADY_FLAG) == 0) {
+            steadyS = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], RATE_SCALE_FLAG) == 0) {
+            rateScale = atof(argv[i + 1]);
+        }
+        i++;
+    }
+    if (apiPort < 1 || apiPort > 65535 || inet_pton(AF_INET, host, &apiHost) != 1) {
+        printf("The api must be an ipv4 host and a port\n");
+        return ERROR;
+    }
+    if (mode == ERROR) {
+        printf("The mode must be open or closed\n");
+        return ERROR;
+    }
+    if (nConnections < 1) {
+        printf("There must be at least one connection\n");
+        return ERROR;
+    }
+    if (rampS < 0 || steadyS < 0 || rampS + steadyS == 0) {
+        printf("The load must last at least a second\n");
+        return ERROR;
+    }
+    if (rateScale <= 0) {
+        printf("The rate scale must be positive\n");
+        return ERROR;
+    }
+    randomState = (unsigned long long)getMetricsTime() | 1;
+
+    if (!skipValidation) {
+        phaseStats[PHASE_VALIDATION].startNs = getMetricsTime();
+        runValidations();
+        phaseStats[PHASE_VALIDATION].endNs = getMetricsTime();
+    }
+    runLoad();
+    return printReport() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
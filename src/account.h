@@ -0,0 +1,55 @@
+#ifndef ACCOUNT_H
+#define ACCOUNT_H
+
+// Header file for the account rules
+// Applies a transaction to a user, the same way on every storage backend and on log replay
+
+#include "helpers.h"
+
+// move right on a circular array
+#define moveRightInTransactions(index) (index = (index + 1) % MAX_TRANSACTIONS)
+
+// Initial database setup, the limits of the users 1 to 5
+const int userInitialLimits[] = {100000, 80000, 1000000, 10000000, 500000};
+const int numberInitialUsers = sizeof(userInitialLimits) / sizeof(int);
+
+// Returns INVALID_TIPO_ERROR if the tipo is not valid
+// Returns LIMIT_EXCEEDED_ERROR if the user has no limit
+// Returns SUCCESS if the transaction was successful
+int addTransaction(User* user, Transaction* transaction);
+// Tries to add or subtract the transaction value from the user's total
+// Returns ERROR if the user doesn't have enough limit
+int addSaldo(User* user, Transaction* transaction);
+
+int addTransaction(User* user, Transaction* transaction) {
+    int resultSaldo = addSaldo(user, transaction);
+    if (resultSaldo != SUCCESS) {
+        return resultSaldo;
+    }
+    if (user->nTransactions == 10) {
+        user->transactions[user->oldestTransaction] = *transaction;
+        moveRightInTransactions(user->oldestTransaction);
+        return SUCCESS;
+    }
+
+    user->transactions[user->nTransactions] = *transaction;
+    user->nTransactions++;
+    return SUCCESS;
+}
+
+int addSaldo(User* user, Transaction* transaction) {
+    if (transaction->tipo == 'd') {
+        int newTotal = user->total - transaction->valor;
+        if (-1 * newTotal > user->limit) {
+            return LIMIT_EXCEEDED_ERROR;
+        }
+        user->total = newTotal;
+        return SUCCESS;
+    } else if (transaction->tipo == 'c') {
+        user->total += transaction->valor;
+        return SUCCESS;
+    }
+    return INVALID_TIPO_ERROR;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef ADMIN_SERVER_H
+#define ADMIN_SERVER_H
+
+// Header file for the db admin server
+// A small http server on its own port and its own thread, away from the workers,
+// it only answers GET /metrics, see metrics.h
+// It's blocking and serves one connection at a time, a request and then the connection is closed,
+// scrapes are rare and the workers never wait for it
+
+#include <pthread.h>
+
+#include "dbHandler.h"
+#include "httpParser.h"
+#include "metrics.h"
+
+#define ADMIN_BACKLOG 16
+// 4KB
+#define ADMIN_REQUEST_SIZE 4 * 1024
+// A scraper has this long to send its request
+#define ADMIN_TIMEOUT_MS 1000
+
+int adminServerSocket;
+// The metrics are rendered here, only the admin thread uses it
+char* adminResponseBuffer = NULL;
+
+// Starts the admin server on the port, on its own thread
+// Crash the program if the socket creation or binding fails
+// Returns ERROR if the thread can't be started
+int startAdminServer(int port);
+
+// Sends the whole response on the blocking socket
+// Returns ERROR if the connection failed
+int sendAdminResponse(int socket, const char* response, int size) {
+    int sent = 0;
+    while (sent < size) {
+        ssize_t result = send(socket, &response[sent], size - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        raiseIfError(result);
+        sent += (int)result;
+    }
+    return SUCCESS;
+}
+
+// Reads a request from the connection and answers it
+void serveAdminClient(int clientSocket) {
+    struct timeval timeout = {.tv_sec = ADMIN_TIMEOUT_MS / 1000, .tv_usec = ADMIN_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[ADMIN_REQUEST_SIZE];
+    int length = 0;
+    HttpRequest parsed;
+    int requestLength = 0;
+    while (requestLength == 0) {
+        ssize_t bytesRead = recv(clientSocket, &request[length], sizeof(request) - length, 0);
+        if (bytesRead < 1) {
+            return;
+        }
+        length += (int)bytesRead;
+        requestLength = parseHttpRequest(request, length, sizeof(request), &parsed);
+    }
+    if (requestLength == ERROR) {
+        sendAdminResponse(clientSocket, badRequestResponse, sizeof(badRequestResponse) - 1);
+        return;
+    }
+    if (parsed.method != HTTP_METHOD_GET || parsed.path != HTTP_PATH_METRICS) {
+        sendAdminResponse(clientSocket, notFoundResponse, sizeof(notFoundResponse) - 1);
+        return;
+    }
+    int responseSize;
+    char* response = serializeMetrics(METRICS_DB, adminResponseBuffer, METRICS_RESPONSE_SIZE, &responseSize);
+    if (response == NULL) {
+        sendAdminResponse(clientSocket, internalServerErrorResponse, sizeof(internalServerErrorResponse) - 1);
+        return;
+    }
+    sendAdminResponse(clientSocket, response, responseSize);
+}
+
+// Accepts and serves the connections, never returns
+void* runAdminServer(void* arg) {
+    (void)arg;
+    while (true) {
+        int clientSocket = accept(adminServerSocket, NULL, NULL);
+        if (clientSocket == ERROR) {
+            continue;
+        }
+        serveAdminClient(clientSocket);
+        close(clientSocket);
+    }
+    return NULL;
+}
+
+int startAdminServer(int port) {
+    adminResponseBuffer = malloc(METRICS_RESPONSE_SIZE);
+    errIfNull(adminResponseBuffer);
+    adminServerSocket = setupServer(port, ADMIN_BACKLOG);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runAdminServer, NULL) != 0) {
+        close(adminServerSocket);
+        return ERROR;
+    }
+    pthread_detach(thread);
+    return SUCCESS;
+}
+
+#endif
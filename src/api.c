@@ -1,88 +1,228 @@
+#include <pthread.h>
+
 #include "httpHandler.h"
+#include "eventLoop.h"
+
+// Each worker has its own listener on the shared port, its own event loop and its own db connections
+// The kernel spreads the accepted connections across the workers
+typedef struct WORKER {
+    pthread_t thread;
+    int serverSocket;
+    EventLoop loop;
+    DbPool pool;
+    int statsPrinted;
+} Worker;
+
+#define WORKERS_FLAG "--workers"
+#define MAX_WORKERS 256
+#define DB_CONNECTIONS_FLAG "--db-connections"
+#define DB_TRANSPORT_FLAG "--db-transport"
+#define IO_FLAG "--io"
+#define RESET_FLAG "--reset"
+#define RECOVER_FLAG "--recover"
+
+Worker* workers = NULL;
+int nWorkers = 1;
+int nDbConnections = DB_POOL_DEFAULT_SIZE;
+int dbTransport = DB_TRANSPORT_TCP;
+// The port of the db, or the name of the shared users in the embedded mode
+int dbPort;
 
-int serverSocket, dbSocket;
+// Incremented on SIGUSR1, each worker prints its db pool and statement cache stats on the next wakeup
+volatile sig_atomic_t statsRequested = 0;
 
 // For profiling even if the server closes from a ctrl+c signal
 void sigIntHandler(int signum) {
     printf("{ Caught signal %d }\n", signum);
-    close(dbSocket);
-    close(serverSocket);
+    for (int i = 0; i < nWorkers; i++) {
+        for (int j = 0; j < workers[i].pool.size; j++) {
+            close(workers[i].pool.connections[j].socket);
+        }
+        close(workers[i].serverSocket);
+    }
+    closeEmbeddedDb();
     exit(EXIT_SUCCESS);
 }
 
+void sigUsr1Handler(int signum) {
+    (void)signum;
+    statsRequested++;
+}
+
+// Runs the event loop of a worker, never returns
+void* runWorker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    EventLoop* loop = &worker->loop;
+
+    // The connection states are per thread, so each worker connects its own pool
+    // The embedded mode has no db, and its pool stays empty
+    if (dbTransport != DB_TRANSPORT_EMBEDDED) {
+        log("{ connecting worker %d to db }\n", (int)(worker - workers));
+        if (setupDbPool(&worker->pool, loop, dbPort, dbTransport, nDbConnections) == ERROR) {
+            printf("Failed to connect to the db on port %d\n", dbPort);
+            exit(EXIT_FAILURE);
+        }
+        log("connected to db on port %d\n", dbPort);
+    }
+
+    while (true) {
+        // Wait for an activity on one of the sockets, or for a db connection to be due for reconnecting
+        int timeout = maintainDbPool(&worker->pool, loop);
+        int nReady = waitEvents(loop, timeout);
+        if (nReady == ERROR) {
+            perror("Failed to wait for events");
+            exit(EXIT_FAILURE);
+        }
+
+        if (worker->statsPrinted != statsRequested) {
+            worker->statsPrinted = statsRequested;
+            printf("{ Worker %d }\n", (int)(worker - workers));
+            printDbPoolStats(&worker->pool, stdout);
+            printExtratoCacheStats(stdout);
+        }
+
+        // Only the sockets with activity are visited
+        for (int i = 0; i < nReady; i++) {
+            int socket = loop->events[i].data.fd;
+            // Accept new connections
+            if (socket == worker->serverSocket) {
+                acceptClients(loop, worker->serverSocket);
+                continue;
+            }
+
+            // Handle db responses
+            DbConnection* db = findDbConnection(&worker->pool, socket);
+            if (db != NULL) {
+                Connection* dbConnection = getConnection(socket);
+                if (dbConnection == NULL || flushConnection(dbConnection) == ERROR) {
+                    closeDbConnection(db);
+                    continue;
+                }
+                if (loop->events[i].events & EPOLLIN) {
+                    receiveDbResponses(db);
+                }
+                continue;
+            }
+
+            // Handle client requests
+            Connection* client = getConnection(socket);
+            if (client == NULL) {
+                closeConnection(socket);
+                continue;
+            }
+            serveClient(client, &worker->pool);
+        }
+
+        // Everything the ready sockets asked of the db goes out together
+        flushDbPool(&worker->pool);
+    }
+
+    return NULL;
+}
+
+// Prints the arguments the program takes
+void printUsage(const char* program) {
+    printf("Usage: %s <port> <database port> [" WORKERS_FLAG " <number of workers>] [" DB_CONNECTIONS_FLAG " <db connections per worker>] [" DB_TRANSPORT_FLAG " tcp|unix|shm|embedded] [" IO_FLAG " epoll|uring] [" RESET_FLAG " | " RECOVER_FLAG "]\n", program);
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 3) {
-        printf("Usage: %s <port> <database port>\n", argv[0]);
+        printUsage(argv[0]);
         return ERROR;
     }
 
     const int SERVER_PORT = atoi(argv[1]);
-    const int DB_PORT = atoi(argv[2]);
-
-    log("{ connecting to db }\n");
-    dbSocket = connectToDb(DB_PORT);
-    if (dbSocket == ERROR) {
-        log("{ Error connecting to db }\n");
+    dbPort = atoi(argv[2]);
+    // Only the embedded mode keeps the users, and it starts them over unless it's asked to recover
+    bool reset = true;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], RESET_FLAG) == 0) {
+            reset = true;
+            continue;
+        }
+        if (strcmp(argv[i], RECOVER_FLAG) == 0) {
+            reset = false;
+            continue;
+        }
+        // The other flags take a value
+        if (i + 1 == argc) {
+            printf("The flag %s is unknown or has no value\n", argv[i]);
+            printUsage(argv[0]);
+            return ERROR;
+        }
+        if (strcmp(argv[i], WORKERS_FLAG) == 0) {
+            nWorkers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], DB_CONNECTIONS_FLAG) == 0) {
+            nDbConnections = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], DB_TRANSPORT_FLAG) == 0) {
+            dbTransport = getDbTransport(argv[i + 1]);
+        } else if (strcmp(argv[i], IO_FLAG) == 0) {
+            ioBackend = getIoBackend(argv[i + 1]);
+        } else {
+            printf("Unknown flag %s\n", argv[i]);
+            printUsage(argv[0]);
+            return ERROR;
+        }
+        i++;
+    }
+    if (nWorkers < 1 || nWorkers > MAX_WORKERS) {
+        printf("The number of workers must be between 1 and %d\n", MAX_WORKERS);
+        return ERROR;
+    }
+    if (nDbConnections < 1 || nDbConnections > DB_POOL_MAX_SIZE) {
+        printf("The number of db connections must be between 1 and %d\n", DB_POOL_MAX_SIZE);
+        return ERROR;
+    }
+    if (ioBackend == ERROR) {
+        printf("The io backend must be epoll or uring\n");
+        return ERROR;
+    }
+    if (dbTransport == ERROR) {
+        printf("The db transport must be tcp, unix, shm or embedded\n");
         return ERROR;
     }
-    log("connected to db on port %d\n", DB_PORT);
+    if (dbTransport == DB_TRANSPORT_EMBEDDED) {
+        // The processes started after the first one share its users, reset only applies to the first
+        if (openEmbeddedDb(dbPort, reset) == ERROR) {
+            perror("Failed to open the embedded db");
+            return ERROR;
+        }
+        pthread_t logWriter;
+        if (pthread_create(&logWriter, NULL, runEmbeddedLogWriter, NULL) != 0) {
+            perror("Failed to start the log writer");
+            return ERROR;
+        }
+    }
+
+    workers = calloc(nWorkers, sizeof(Worker));
+    errIfNull(workers);
+
+    for (int i = 0; i < nWorkers; i++) {
+        setupEventLoop(&workers[i].loop);
+        workers[i].serverSocket = setupServer(SERVER_PORT, SERVER_BACKLOG);
+        check(setNonBlocking(workers[i].serverSocket), "Failed to set server socket as non blocking");
+        check(watchServerSocket(&workers[i].loop, workers[i].serverSocket), "Failed to watch server socket");
+    }
 
-    serverSocket = setupServer(SERVER_PORT, SERVER_BACKLOG);
     signal(SIGINT, sigIntHandler);
     signal(SIGTERM, sigIntHandler);
-    log("{ Server is running(%d) }\n", serverSocket);
+    signal(SIGUSR1, sigUsr1Handler);
+    // A client closing the connection shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+    int fileLimit = raiseFileLimit();
+    log("{ Server is running with %d workers }\n", nWorkers);
     log("{ Listening on port %d }\n", SERVER_PORT);
-    log("{ FD_SETSIZE: %d }\n", FD_SETSIZE);
-
-    // Set of socket descriptors
-    fd_set currentSockets, readySockets;
+    log("{ Open file limit: %d }\n", fileLimit);
+    (void)fileLimit;
 
-    // Initialize the set of active sockets
-    FD_ZERO(&currentSockets);
-    FD_SET(serverSocket, &currentSockets);
-
-    while (true) {
-        readySockets = currentSockets;
-
-        // Wait for an activity on one of the sockets
-        if (select(FD_SETSIZE, &readySockets, NULL, NULL, NULL) < 0) {
-            printf("Select failed");
+    // The main thread runs the first worker
+    for (int i = 1; i < nWorkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0) {
+            perror("Failed to start worker");
             return ERROR;
         }
-
-        // Check all sockets for activity
-        for (int socket = 0; socket < FD_SETSIZE; socket++) {
-            if (FD_ISSET(socket, &readySockets)) {
-                // Accept new connection
-                if (socket == serverSocket) {
-                    struct sockaddr_in clientAddress;
-                    socklen_t clientAddressSize = sizeof(clientAddress);
-                    int clientSocket = accept(serverSocket, (SA*)&clientAddress, &clientAddressSize);
-                    FD_SET(clientSocket, &currentSockets);
-                } else {
-                    // Handle client request
-                    int clientSocket = socket;
-                    char request[SOCKET_READ_SIZE];
-                    int bytesRead = recv(clientSocket, request, sizeof(request), SEND_DEFAULT);
-
-                    if (bytesRead >= 1 && bytesRead < SOCKET_READ_SIZE) {
-                        request[bytesRead] = '\0';
-                        int sentResult = handleRequest(request, bytesRead, clientSocket, dbSocket);
-                        if (sentResult == ERROR) {
-                            log("{ Error sending response }\n");
-                        } else {
-                            log("{ Request handled }\n");
-                        }
-                    }
-
-                    close(clientSocket);
-                    FD_CLR(clientSocket, &currentSockets);
-                }
-            }
-        }
     }
+    runWorker(&workers[0]);
 
-    close(dbSocket);
-    close(serverSocket);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,381 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+// Header file for the connection state
+// Keeps the partial reads and the pending writes of every open socket
+// so a request split across many recv calls, or many requests on a single recv,
+// can be parsed incrementally, and a response bigger than the socket buffer isn't lost
+// A connection is a tcp socket, a unix seqpacket socket carrying a frame on each message,
+// or a shared memory channel, the reads and writes look the same for all of them
+// On the io_uring loop the tcp sockets aren't read by the connection, the loop queues what it received
+// on the connection, and the reads take it from the queue, see eventLoop.h
+// The loop stops receiving once CONNECTION_INPUT_LIMIT bytes are queued, and receives again once they're read,
+// so a client that sends faster than it's served is held back by the kernel, like on epoll
+
+#include "helpers.h"
+#include "shmChannel.h"
+
+// 8KB, biggest request accepted on a connection
+#define CONNECTION_READ_SIZE 8 * 1024
+// 16KB, initial size of the pending writes buffer
+#define CONNECTION_WRITE_SIZE 16 * 1024
+// 8KB, queued input that pauses the receives of the loop
+// What the kernel had already received when the pause took effect is still queued, so it can go over by
+// at most the receive buffers of the ring, see ioUring.h
+#define CONNECTION_INPUT_LIMIT 8 * 1024
+
+typedef struct CONNECTION {
+    int socket;
+    // Sockets are reused after being closed, the id tells connections on the same socket apart
+    unsigned long id;
+    // Bytes received but not consumed yet
+    int readLength;
+    // Bytes waiting for the socket to be writable
+    int writeOffset, writeLength, writeCapacity;
+    char* writeBuffer;
+    // Close the connection as soon as the pending writes are sent
+    bool closeAfterWrite;
+    // A request is waiting for the database, the next ones wait for it to be answered
+    bool waitingDb;
+    // When the last data was received, and the route of the request being answered, for the metrics
+    long long receivedAt;
+    int requestRoute;
+    // Each frame goes on its own message, the socket keeps the message boundaries
+    // The data sent are db frames, which start with their length, see dbProtocol.h
+    bool framed;
+    // The data go through the shared memory, the socket is only watched to see the other side hang up
+    ShmChannel* channel;
+    // A shm connection whose channel hasn't arrived on the socket yet, see attachConnectionChannel
+    bool awaitingChannel;
+    // The input is queued by the event loop, instead of being read from the socket
+    bool inputQueued;
+    // The loop got the end of the input, inputError is its errno, or 0 if the peer closed the connection
+    bool inputEnded;
+    int inputError;
+    // The loop stopped receiving, the queue is full
+    bool inputPaused;
+    // Input queued by the loop and not moved to the read buffer yet
+    int inputOffset, inputLength, inputCapacity;
+    char* inputBuffer;
+    char readBuffer[CONNECTION_READ_SIZE];
+} Connection;
+
+// Gets the connection state of the socket, creating it on the first call
+// Returns NULL if it fails to allocate the state
+Connection* getConnection(int socket);
+
+// Gets the connection state of the socket
+// Returns NULL if the socket has no state
+Connection* findConnection(int socket);
+
+// Closes the socket and frees its connection state
+void closeConnection(int socket);
+
+// Receives once into the free space of the read buffer
+// Returns the number of bytes received
+// Returns 0 if the peer closed the connection
+// Returns ERROR if it fails, errno is EAGAIN if there's nothing left to read
+int receiveIntoConnection(Connection* connection);
+
+// Removes the first size bytes of the read buffer
+void consumeConnectionInput(Connection* connection, int size);
+
+// Queues input received by the event loop, for the next reads of the connection
+// Returns ERROR if the queue can't grow
+int queueConnectionInput(Connection* connection, const char* data, int size);
+
+// Ends the input of the connection once the queue is read, with the errno of the failure, or 0 if the peer closed it
+void endConnectionInput(Connection* connection, int error);
+
+// Sends data to the socket, buffering what the socket can't take right now
+// The buffered data is sent by flushConnection when the socket becomes writable
+// Returns size if the data was sent or buffered
+// Returns ERROR if the connection failed
+int sendToClient(int socket, const char* data, int size);
+
+// Sends the buffered data
+// Returns SUCCESS if there's nothing left to send, or the socket is full
+// Returns ERROR if the connection failed
+int flushConnection(Connection* connection);
+
+// Returns true if there's data waiting to be sent
+bool hasPendingWrites(Connection* connection);
+
+// Indexed by socket, grows as sockets with bigger numbers are opened
+// Each worker thread only sees its own sockets, so each one has its own table
+__thread Connection** connections = NULL;
+__thread int connectionsCapacity = 0;
+__thread unsigned long nextConnectionId = 0;
+// Called right before a socket is closed, set by the event loops that hold on to the sockets they watch
+__thread void (*socketClosing)(int socket) = NULL;
+// Called once the queue of a paused connection was read, set by the event loops that queue the input
+__thread void (*inputDrained)(Connection* connection) = NULL;
+
+Connection* getConnection(int socket) {
+    if (socket < 0) {
+        return NULL;
+    }
+    if (socket >= connectionsCapacity) {
+        int newCapacity = connectionsCapacity == 0 ? 1024 : connectionsCapacity;
+        while (newCapacity <= socket) {
+            newCapacity *= 2;
+        }
+        Connection** grown = realloc(connections, newCapacity * sizeof(Connection*));
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(&grown[connectionsCapacity], 0, (newCapacity - connectionsCapacity) * sizeof(Connection*));
+        connections = grown;
+        connectionsCapacity = newCapacity;
+    }
+    if (connections[socket] == NULL) {
+        Connection* connection = malloc(sizeof(Connection));
+        if (connection == NULL) {
+            return NULL;
+        }
+        connection->socket = socket;
+        connection->id = nextConnectionId++;
+        connection->readLength = 0;
+        connection->writeOffset = 0;
+        connection->writeLength = 0;
+        connection->writeCapacity = 0;
+        connection->writeBuffer = NULL;
+        connection->closeAfterWrite = false;
+        connection->waitingDb = false;
+        connection->receivedAt = 0;
+        connection->requestRoute = 0;
+        connection->framed = false;
+        connection->channel = NULL;
+        connection->awaitingChannel = false;
+        connection->inputQueued = false;
+        connection->inputEnded = false;
+        connection->inputError = 0;
+        connection->inputPaused = false;
+        connection->inputOffset = 0;
+        connection->inputLength = 0;
+        connection->inputCapacity = 0;
+        connection->inputBuffer = NULL;
+        connections[socket] = connection;
+    }
+    return connections[socket];
+}
+
+Connection* findConnection(int socket) {
+    if (socket < 0 || socket >= connectionsCapacity) {
+        return NULL;
+    }
+    return connections[socket];
+}
+
+void closeConnection(int socket) {
+    if (socket >= 0 && socket < connectionsCapacity && connections[socket] != NULL) {
+        if (connections[socket]->channel != NULL) {
+            closeShmChannel(connections[socket]->channel);
+            free(connections[socket]->channel);
+        }
+        free(connections[socket]->writeBuffer);
+        free(connections[socket]->inputBuffer);
+        free(connections[socket]);
+        connections[socket] = NULL;
+    }
+    if (socketClosing != NULL) {
+        socketClosing(socket);
+    }
+    // Closing the socket also removes it from the event loop
+    close(socket);
+}
+
+int receiveIntoConnection(Connection* connection) {
+    int freeSpace = CONNECTION_READ_SIZE - connection->readLength;
+    if (freeSpace <= 0) {
+        errno = ENOBUFS;
+        return ERROR;
+    }
+    if (connection->inputQueued) {
+        int queued = connection->inputLength - connection->inputOffset;
+        if (queued > 0) {
+            int chunk = queued < freeSpace ? queued : freeSpace;
+            memcpy(&connection->readBuffer[connection->readLength], &connection->inputBuffer[connection->inputOffset], chunk);
+            connection->readLength += chunk;
+            connection->inputOffset += chunk;
+            if (connection->inputOffset == connection->inputLength) {
+                connection->inputOffset = 0;
+                connection->inputLength = 0;
+                // A burst that came in before a pause doesn't keep its memory
+                if (connection->inputCapacity > CONNECTION_INPUT_LIMIT) {
+                    free(connection->inputBuffer);
+                    connection->inputBuffer = NULL;
+                    connection->inputCapacity = 0;
+                }
+                if (connection->inputPaused) {
+                    connection->inputPaused = false;
+                    if (inputDrained != NULL) {
+                        inputDrained(connection);
+                    }
+                }
+            }
+            return chunk;
+        }
+        if (connection->inputEnded && connection->inputError == 0) {
+            return 0;
+        }
+        errno = connection->inputEnded ? connection->inputError : EAGAIN;
+        return ERROR;
+    }
+    if (connection->channel != NULL) {
+        int received = readFromChannel(connection->channel, &connection->readBuffer[connection->readLength], freeSpace);
+        if (received > 0) {
+            connection->readLength += received;
+            return received;
+        }
+        // Nothing on the ring, the socket only has something to read once the other side hangs up
+        char byte;
+        if (recv(connection->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return ERROR;
+    }
+    while (true) {
+        ssize_t received = recv(connection->socket, &connection->readBuffer[connection->readLength], freeSpace, 0);
+        if (received == ERROR && errno == EINTR) {
+            continue;
+        }
+        if (received > 0) {
+            connection->readLength += received;
+        }
+        return (int)received;
+    }
+}
+
+void consumeConnectionInput(Connection* connection, int size) {
+    if (size >= connection->readLength) {
+        connection->readLength = 0;
+        return;
+    }
+    memmove(connection->readBuffer, &connection->readBuffer[size], connection->readLength - size);
+    connection->readLength -= size;
+}
+
+int queueConnectionInput(Connection* connection, const char* data, int size) {
+    if (connection->inputOffset > 0) {
+        int queued = connection->inputLength - connection->inputOffset;
+        memmove(connection->inputBuffer, &connection->inputBuffer[connection->inputOffset], queued);
+        connection->inputOffset = 0;
+        connection->inputLength = queued;
+    }
+    if (connection->inputLength + size > connection->inputCapacity) {
+        int newCapacity = connection->inputCapacity == 0 ? CONNECTION_READ_SIZE : connection->inputCapacity;
+        while (newCapacity < connection->inputLength + size) {
+            newCapacity *= 2;
+        }
+        char* grown = realloc(connection->inputBuffer, newCapacity);
+        errIfNull(grown);
+        connection->inputBuffer = grown;
+        connection->inputCapacity = newCapacity;
+    }
+    memcpy(&connection->inputBuffer[connection->inputLength], data, size);
+    connection->inputLength += size;
+    return SUCCESS;
+}
+
+void endConnectionInput(Connection* connection, int error) {
+    connection->inputEnded = true;
+    connection->inputError = error;
+}
+
+bool hasPendingWrites(Connection* connection) {
+    return connection->writeLength > connection->writeOffset;
+}
+
+// Appends the data to the pending writes buffer
+int bufferWrite(Connection* connection, const char* data, int size) {
+    // Drop what was already sent before growing the buffer
+    if (connection->writeOffset > 0) {
+        int pending = connection->writeLength - connection->writeOffset;
+        memmove(connection->writeBuffer, &connection->writeBuffer[connection->writeOffset], pending);
+        connection->writeOffset = 0;
+        connection->writeLength = pending;
+    }
+    if (connection->writeLength + size > connection->writeCapacity) {
+        int newCapacity = connection->writeCapacity == 0 ? CONNECTION_WRITE_SIZE : connection->writeCapacity;
+        while (newCapacity < connection->writeLength + size) {
+            newCapacity *= 2;
+        }
+        char* grown = realloc(connection->writeBuffer, newCapacity);
+        errIfNull(grown);
+        connection->writeBuffer = grown;
+        connection->writeCapacity = newCapacity;
+    }
+    memcpy(&connection->writeBuffer[connection->writeLength], data, size);
+    connection->writeLength += size;
+    return size;
+}
+
+// Sends as much of the data as the connection takes at once, a single frame on framed connections
+// Returns ERROR with errno EAGAIN if the connection can't take anything right now
+ssize_t sendSome(Connection* connection, const char* data, int size) {
+    if (connection->channel != NULL) {
+        int written = writeToChannel(connection->channel, data, size);
+        if (written == 0) {
+            errno = EAGAIN;
+            return ERROR;
+        }
+        return written;
+    }
+    if (connection->framed) {
+        int frameLength = fromBin((char*)data);
+        size = frameLength < size ? frameLength : size;
+    }
+    return send(connection->socket, data, size, MSG_NOSIGNAL);
+}
+
+int sendToClient(int socket, const char* data, int size) {
+    Connection* connection = getConnection(socket);
+    errIfNull(connection);
+
+    int sent = 0;
+    // Only send directly if nothing is waiting, otherwise the responses would be out of order
+    if (!hasPendingWrites(connection)) {
+        while (sent < size) {
+            ssize_t result = sendSome(connection, &data[sent], size - sent);
+            if (result == ERROR) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return ERROR;
+            }
+            sent += result;
+        }
+    }
+    if (sent < size) {
+        raiseIfError(bufferWrite(connection, &data[sent], size - sent));
+    }
+    return size;
+}
+
+int flushConnection(Connection* connection) {
+    while (hasPendingWrites(connection)) {
+        ssize_t result = sendSome(connection,
+                                  &connection->writeBuffer[connection->writeOffset],
+                                  connection->writeLength - connection->writeOffset);
+        if (result == ERROR) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SUCCESS;
+            }
+            return ERROR;
+        }
+        connection->writeOffset += result;
+    }
+    connection->writeOffset = 0;
+    connection->writeLength = 0;
+    return SUCCESS;
+}
+
+#endif
@@ -1,98 +1,288 @@
+#include <pthread.h>
+
+#include "adminServer.h"
 #include "dbHandler.h"
+#include "dbTransport.h"
+#include "eventLoop.h"
+
+#define STORAGE_FLAG "--storage"
+#define DURABILITY_FLAG "--durability"
+#define COMMIT_WINDOW_FLAG "--commit-window-ms"
+#define MAP_OPTIONS_FLAG "--map-options"
+#define CHECKPOINT_INTERVAL_FLAG "--checkpoint-interval-s"
+#define IO_FLAG "--io"
+#define RESET_FLAG "--reset"
+#define RECOVER_FLAG "--recover"
+// The metrics are served on this port, no admin server without it
+#define ADMIN_PORT_FLAG "--admin-port"
+
+// Each worker has its own listener on the shared port and its own event loop, the storage is shared
+// The kernel spreads the accepted connections across the workers
+typedef struct WORKER {
+    pthread_t thread;
+    int serverSocket;
+    EventLoop loop;
+} Worker;
+
+#define WORKERS_FLAG "--workers"
+#define MAX_WORKERS 256
+
+Worker* workers = NULL;
+int nWorkers = 1;
+pthread_t checkpointThread;
+// The unix sockets have no port to share, every worker watches the same ones
+int unixServerSocket, shmServerSocket;
 
-int serverSocket;
+// Incremented on SIGUSR1, the commit stats are printed on the next wakeup of the first worker
+volatile sig_atomic_t statsRequested = 0;
+int statsPrinted = 0;
 
 // For profiling even if the server closes from a ctrl+c signal
 void sigIntHandler(int signum) {
     printf("{ Caught signal %d }\n", signum);
-    closeDBFiles();
-    close(serverSocket);
+    closeStorage();
+    for (int i = 0; i < nWorkers; i++) {
+        close(workers[i].serverSocket);
+    }
+    close(unixServerSocket);
+    close(shmServerSocket);
     exit(EXIT_SUCCESS);
 }
 
+void sigUsr1Handler(int signum) {
+    (void)signum;
+    statsRequested++;
+}
+
+// Runs the event loop of a worker, never returns
+void* runWorker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    EventLoop* loop = &worker->loop;
+
+    while (true) {
+        // Wait for an activity on one of the sockets, or for the changes to be due for a commit
+        int nReady = waitEvents(loop, getCommitTimeout());
+        if (nReady == ERROR) {
+            perror("Failed to wait for events");
+            exit(EXIT_FAILURE);
+        }
+
+        if (worker == &workers[0] && statsPrinted != statsRequested) {
+            statsPrinted = statsRequested;
+            printCommitStats(stdout);
+        }
+
+        // Only the sockets with activity are visited
+        for (int i = 0; i < nReady; i++) {
+            int socket = loop->events[i].data.fd;
+            // Accept new connections
+            if (socket == worker->serverSocket) {
+                acceptClients(loop, worker->serverSocket);
+                continue;
+            }
+            if (socket == unixServerSocket) {
+                acceptDbClients(loop, unixServerSocket, DB_TRANSPORT_UNIX);
+                continue;
+            }
+            if (socket == shmServerSocket) {
+                acceptDbClients(loop, shmServerSocket, DB_TRANSPORT_SHM);
+                continue;
+            }
+
+            // Handle client requests
+            int clientSocket = socket;
+            Connection* connection = getConnection(clientSocket);
+            if (connection == NULL) {
+                closeConnection(clientSocket);
+                continue;
+            }
+            // A shm connection sends nothing else on its socket before its channel
+            if (connection->awaitingChannel) {
+                if (attachConnectionChannel(loop, connection) == ERROR) {
+                    log("{ Failed to receive the shm channel }\n");
+                    closeConnection(clientSocket);
+                }
+                continue;
+            }
+
+            // The loop is edge-triggered, so the socket is read until it would block
+            bool shouldClose = false;
+            while (loop->events[i].events & EPOLLIN) {
+                int bytesRead = receiveIntoConnection(connection);
+                if (bytesRead == ERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                if (bytesRead < 1) {
+                    shouldClose = true;
+                    break;
+                }
+                int handleResult = handleConnectionRequests(connection);
+                if (handleResult == ERROR || handleResult == END_CONNECTION) {
+                    log("{ Error sending response or client asked to close }\n");
+                    shouldClose = true;
+                    break;
+                }
+            }
+
+            // Send what didn't fit on the socket before
+            if (flushConnection(connection) == ERROR) {
+                shouldClose = true;
+            }
+
+            if (shouldClose) {
+                log("{ Client closed connection }\n");
+                closeConnection(clientSocket);
+            }
+        }
+
+        // Everything changed on this iteration is committed together, then the replies are released
+        maintainCommits();
+    }
+
+    return NULL;
+}
+
+// Prints the arguments the program takes
+void printUsage(const char* program) {
+    printf("Usage: %s <port> [" STORAGE_FLAG " files|memory|mapped] [" DURABILITY_FLAG " none|batch|every-write] [" COMMIT_WINDOW_FLAG " <ms>] [" MAP_OPTIONS_FLAG " populate,hugepages] [" WORKERS_FLAG " <number of workers>] [" CHECKPOINT_INTERVAL_FLAG " <seconds>] [" IO_FLAG " epoll|uring] [" ADMIN_PORT_FLAG " <port>] [" RESET_FLAG " | " RECOVER_FLAG "]\n", program);
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        printf("Usage: %s <port>\n", argv[0]);
+        printUsage(argv[0]);
         return ERROR;
     }
 
     const int SERVER_PORT = atoi(argv[1]);
+    int mode = STORAGE_FILES;
+    // The database starts empty unless it's asked to recover
+    bool reset = true;
+    int adminPort = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], RESET_FLAG) == 0) {
+            reset = true;
+            continue;
+        }
+        if (strcmp(argv[i], RECOVER_FLAG) == 0) {
+            reset = false;
+            continue;
+        }
+        // The other flags take a value
+        if (i + 1 == argc) {
+            printf("The flag %s is unknown or has no value\n", argv[i]);
+            printUsage(argv[0]);
+            return ERROR;
+        }
+        if (strcmp(argv[i], STORAGE_FLAG) == 0) {
+            mode = getStorageMode(argv[i + 1]);
+        } else if (strcmp(argv[i], DURABILITY_FLAG) == 0) {
+            durabilityPolicy = getDurabilityPolicy(argv[i + 1]);
+        } else if (strcmp(argv[i], COMMIT_WINDOW_FLAG) == 0) {
+            commitWindowMs = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], MAP_OPTIONS_FLAG) == 0) {
+            mapOptions = getMapOptions(argv[i + 1]);
+        } else if (strcmp(argv[i], WORKERS_FLAG) == 0) {
+            nWorkers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], CHECKPOINT_INTERVAL_FLAG) == 0) {
+            checkpointIntervalS = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], IO_FLAG) == 0) {
+            ioBackend = getIoBackend(argv[i + 1]);
+        } else if (strcmp(argv[i], ADMIN_PORT_FLAG) == 0) {
+            adminPort = atoi(argv[i + 1]);
+        } else {
+            printf("Unknown flag %s\n", argv[i]);
+            printUsage(argv[0]);
+            return ERROR;
+        }
+        i++;
+    }
+    if (ioBackend == ERROR) {
+        printf("The io backend must be epoll or uring\n");
+        return ERROR;
+    }
+    if (mode == ERROR) {
+        printf("The storage must be files, memory or mapped\n");
+        return ERROR;
+    }
+    if (mapOptions == ERROR) {
+        printf("The map options must be populate and/or hugepages\n");
+        return ERROR;
+    }
+    if (durabilityPolicy == ERROR) {
+        printf("The durability must be none, batch or every-write\n");
+        return ERROR;
+    }
+    if (commitWindowMs < 0) {
+        printf("The commit window can't be negative\n");
+        return ERROR;
+    }
+    if (nWorkers < 1 || nWorkers > MAX_WORKERS) {
+        printf("The number of workers must be between 1 and %d\n", MAX_WORKERS);
+        return ERROR;
+    }
+    if (checkpointIntervalS < 0) {
+        printf("The checkpoint interval can't be negative\n");
+        return ERROR;
+    }
+    if (adminPort < 0 || adminPort > 65535 || adminPort == SERVER_PORT) {
+        printf("The admin port must be a port other than the db port\n");
+        return ERROR;
+    }
 
     log("{ Starting database on PORT %d }\n", SERVER_PORT);
 
-#ifdef RESET_DB
-    log("{ Creating data folder }\n");
-    int createFolderResult = system("mkdir -p data");
-    raiseIfError(createFolderResult);
-    log("{ Resetting database }\n");
-    int resetDbResult = initDb();
-    raiseIfError(resetDbResult);
-    log("{ Database reset successfully }\n");
-#endif
+    if (setupStorage(mode, reset) == ERROR) {
+        perror("Failed to open the storage");
+        return ERROR;
+    }
 
     log("{ Starting up server }\n");
-    serverSocket = setupServer(SERVER_PORT, SERVER_BACKLOG);
+    workers = calloc(nWorkers, sizeof(Worker));
+    errIfNull(workers);
+    unixServerSocket = setupDbUnixServer(SERVER_PORT, DB_TRANSPORT_UNIX, SERVER_BACKLOG);
+    shmServerSocket = setupDbUnixServer(SERVER_PORT, DB_TRANSPORT_SHM, SERVER_BACKLOG);
+    for (int i = 0; i < nWorkers; i++) {
+        setupEventLoop(&workers[i].loop);
+        workers[i].serverSocket = setupServer(SERVER_PORT, SERVER_BACKLOG);
+        check(setNonBlocking(workers[i].serverSocket), "Failed to set server socket as non blocking");
+        check(watchServerSocket(&workers[i].loop, workers[i].serverSocket), "Failed to watch server socket");
+        check(watchServerSocket(&workers[i].loop, unixServerSocket), "Failed to watch unix socket");
+        check(watchServerSocket(&workers[i].loop, shmServerSocket), "Failed to watch shm socket");
+    }
     signal(SIGINT, sigIntHandler);
     signal(SIGTERM, sigIntHandler);
-    log("{ Server is running(%d) }\n", serverSocket);
+    signal(SIGUSR1, sigUsr1Handler);
+    // A client closing the connection shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+    int fileLimit = raiseFileLimit();
+    log("{ Server is running with %d workers }\n", nWorkers);
     log("{ Listening on port %d }\n", SERVER_PORT);
-    log("{ FD_SETSIZE: %d }\n", FD_SETSIZE);
+    log("{ Open file limit: %d }\n", fileLimit);
+    (void)fileLimit;
 
-    // Set of socket descriptors
-    fd_set currentSockets, readySockets;
-
-    // Initialize the set of active sockets
-    FD_ZERO(&currentSockets);
-    FD_SET(serverSocket, &currentSockets);
-
-    while (true) {
-        readySockets = currentSockets;
+    // Only the memory storage has checkpoints, the others are their own copy on the disk
+    if (storageMode == STORAGE_MEMORY && checkpointIntervalS > 0 &&
+        pthread_create(&checkpointThread, NULL, runCheckpoints, NULL) != 0) {
+        perror("Failed to start the checkpoints");
+        return ERROR;
+    }
 
-        // Wait for an activity on one of the sockets
-        if (select(FD_SETSIZE, &readySockets, NULL, NULL, NULL) < 0) {
-            printf("Select failed");
+    if (adminPort > 0) {
+        if (startAdminServer(adminPort) == ERROR) {
+            perror("Failed to start the admin server");
             return ERROR;
         }
+        log("{ Admin server on port %d }\n", adminPort);
+    }
 
-        // Check all sockets for activity
-        for (int socket = 0; socket < FD_SETSIZE; socket++) {
-            if (FD_ISSET(socket, &readySockets)) {
-                // Accept new connection
-                if (socket == serverSocket) {
-                    struct sockaddr_in clientAddress;
-                    socklen_t clientAddressSize = sizeof(clientAddress);
-                    int clientSocket = accept(serverSocket, (SA*)&clientAddress, &clientAddressSize);
-                    FD_SET(clientSocket, &currentSockets);
-                } else {
-                    // Handle client request
-                    int clientSocket = socket;
-                    char request[SOCKET_READ_SIZE];
-                    int bytesRead = recv(clientSocket, request, sizeof(request), SEND_DEFAULT);
-                    bool shouldClose = true;
-
-                    if (bytesRead >= 1 && bytesRead < SOCKET_READ_SIZE) {
-                        request[bytesRead] = '\0';
-                        int sentResult = handleRequest(request, bytesRead, clientSocket);
-                        if (sentResult == ERROR) {
-                            log("{ Error sending response }\n");
-                        } else if (sentResult != END_CONNECTION) {
-                            // Keep the connection open if the client didn't ask to close it
-                            shouldClose = false;
-                            log("{ Request handled }\n");
-                        }
-                    }
-
-                    if (shouldClose) {
-                        log("{ Client closed connection }\n");
-                        close(clientSocket);
-                        FD_CLR(clientSocket, &currentSockets);
-                    }
-                }
-            }
+    // The main thread runs the first worker
+    for (int i = 1; i < nWorkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0) {
+            perror("Failed to start worker");
+            return ERROR;
         }
     }
+    runWorker(&workers[0]);
 
-    closeDBFiles();
-    close(serverSocket);
     return EXIT_SUCCESS;
 }
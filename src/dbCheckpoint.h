@@ -0,0 +1,219 @@
+#ifndef DB_CHECKPOINT_H
+#define DB_CHECKPOINT_H
+
+// Header file for the checkpoints of the in-memory database
+// A checkpoint is a copy of every user, with the log sequence number of the last change applied to each one,
+// so the startup loads it and only replays the log written after it started, instead of the whole log
+// Checkpoints are taken while the workers keep changing the users, each user is copied consistently,
+// and a record replayed over a user that already has it is skipped
+// A checkpoint is written to a temporary file and renamed over the previous one once it's synced,
+// so a crash while it's written leaves the previous one in place
+//
+// File, all numbers little endian:
+// magic(4) - CHECKPOINT_MAGIC
+// version(4) - CHECKPOINT_VERSION
+// nUsers(4)
+// logOffset(8) - where the log was when the checkpoint started, the replay starts there
+// checksum(4) - crc32 of the users
+// headerChecksum(4) - crc32 of everything before it
+// nUsers entries of lsn(8) and the serialized user, see serializeUser
+
+#include "dbLog.h"
+
+#define CHECKPOINT_FILE_NAME "data/checkpoint.bin"
+#define CHECKPOINT_TEMP_FILE_NAME "data/checkpoint.tmp"
+#define CHECKPOINT_DIRECTORY "data"
+
+#define CHECKPOINT_MAGIC 0x504b4352
+// 2 since the users have the compact serialization, so the entries have different sizes
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_HEADER_SIZE 28
+#define CHECKPOINT_ENTRY_MAX_SIZE (8 + USER_SERIALIZED_MAX_SIZE)
+// Users copied and written at a time
+#define CHECKPOINT_BATCH_USERS 1024
+
+typedef struct CHECKPOINT_ENTRY {
+    // Log sequence number of the last change applied to the user
+    long long lsn;
+    User user;
+} CheckpointEntry;
+
+typedef struct CHECKPOINT_WRITER {
+    int file;
+    int nUsers;
+    long long logOffset;
+    uint32_t checksum;
+    char* buffer;
+} CheckpointWriter;
+
+// Called for every user of the checkpoint, in the order they were written
+// Returns ERROR if the user can't be loaded, which stops the load
+typedef int (*CheckpointLoadCallback)(const CheckpointEntry* entry);
+
+// Starts writing a checkpoint to the temporary file
+// logOffset is the end of the log when the checkpoint starts, before any user is copied
+// Returns ERROR if the file can't be created
+int beginCheckpoint(CheckpointWriter* writer, long long logOffset);
+
+// Appends the users to the checkpoint
+// Returns ERROR if the file can't be written
+int writeCheckpointEntries(CheckpointWriter* writer, const CheckpointEntry* entries, int nEntries);
+
+// Syncs the checkpoint and puts it in place of the previous one
+// Every record the users were copied with must be on the disk before it's called,
+// otherwise a crash would leave users ahead of the log
+// Returns ERROR if it can't be synced or renamed, the previous checkpoint is kept
+int finishCheckpoint(CheckpointWriter* writer);
+
+// Drops the checkpoint being written
+void abortCheckpoint(CheckpointWriter* writer);
+
+// Loads the users of the last checkpoint with the callback
+// Returns the log offset to replay from, 0 if there's no checkpoint
+// Returns ERROR if the checkpoint is corrupted, some users may have been loaded already
+long long loadCheckpoint(CheckpointLoadCallback load);
+
+// Removes the last checkpoint, so the next startup replays the whole log
+void removeCheckpoint();
+
+int beginCheckpoint(CheckpointWriter* writer, long long logOffset) {
+    writer->buffer = malloc((size_t)CHECKPOINT_BATCH_USERS * CHECKPOINT_ENTRY_MAX_SIZE);
+    errIfNull(writer->buffer);
+    writer->file = open(CHECKPOINT_TEMP_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->file == ERROR) {
+        free(writer->buffer);
+        return ERROR;
+    }
+    writer->nUsers = 0;
+    writer->logOffset = logOffset;
+    writer->checksum = 0;
+
+    // The header is written last, once the users are counted
+    if (lseek(writer->file, CHECKPOINT_HEADER_SIZE, SEEK_SET) == -1) {
+        abortCheckpoint(writer);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+int writeCheckpointEntries(CheckpointWriter* writer, const CheckpointEntry* entries, int nEntries) {
+    for (int start = 0; start < nEntries; start += CHECKPOINT_BATCH_USERS) {
+        int count = nEntries - start < CHECKPOINT_BATCH_USERS ? nEntries - start : CHECKPOINT_BATCH_USERS;
+        int size = 0;
+        for (int i = 0; i < count; i++) {
+            char* entry = &writer->buffer[size];
+            toBin64(entries[start + i].lsn, entry);
+            size += 8 + serializeUser(&entries[start + i].user, &entry[8]);
+        }
+        writer->checksum = crc32(writer->checksum, writer->buffer, size);
+        raiseIfError(writeAll(writer->file, writer->buffer, size));
+        writer->nUsers += count;
+    }
+    return SUCCESS;
+}
+
+int finishCheckpoint(CheckpointWriter* writer) {
+    char header[CHECKPOINT_HEADER_SIZE];
+    toBin(CHECKPOINT_MAGIC, &header[0]);
+    toBin(CHECKPOINT_VERSION, &header[4]);
+    toBin(writer->nUsers, &header[8]);
+    toBin64(writer->logOffset, &header[12]);
+    toBin((int)writer->checksum, &header[20]);
+    toBin((int)crc32(0, header, 24), &header[24]);
+
+    int result = ERROR;
+    if (pwrite(writer->file, header, CHECKPOINT_HEADER_SIZE, 0) == CHECKPOINT_HEADER_SIZE &&
+        fdatasync(writer->file) != -1 &&
+        rename(CHECKPOINT_TEMP_FILE_NAME, CHECKPOINT_FILE_NAME) != -1) {
+        // The rename is only durable once the directory is synced
+        int directory = open(CHECKPOINT_DIRECTORY, O_RDONLY);
+        if (directory != ERROR) {
+            result = fsync(directory) == -1 ? ERROR : SUCCESS;
+            close(directory);
+        }
+    }
+    close(writer->file);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return result;
+}
+
+void abortCheckpoint(CheckpointWriter* writer) {
+    close(writer->file);
+    unlink(CHECKPOINT_TEMP_FILE_NAME);
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+long long loadCheckpoint(CheckpointLoadCallback load) {
+    int file = open(CHECKPOINT_FILE_NAME, O_RDONLY);
+    if (file == ERROR) {
+        return errno == ENOENT ? 0 : ERROR;
+    }
+
+    char header[CHECKPOINT_HEADER_SIZE];
+    if (read(file, header, CHECKPOINT_HEADER_SIZE) != CHECKPOINT_HEADER_SIZE ||
+        (uint32_t)fromBin(&header[24]) != crc32(0, header, 24) ||
+        fromBin(&header[0]) != CHECKPOINT_MAGIC || fromBin(&header[4]) != CHECKPOINT_VERSION) {
+        close(file);
+        return ERROR;
+    }
+    int nUsers = fromBin(&header[8]);
+    long long logOffset = fromBin64(&header[12]);
+    uint32_t expectedChecksum = (uint32_t)fromBin(&header[20]);
+
+    int bufferSize = CHECKPOINT_BATCH_USERS * CHECKPOINT_ENTRY_MAX_SIZE;
+    char* buffer = malloc(bufferSize);
+    if (buffer == NULL) {
+        close(file);
+        return ERROR;
+    }
+    uint32_t checksum = 0;
+    int loaded = 0, filled = 0, position = 0;
+    bool ended = false, failed = false;
+    while (loaded < nUsers && !failed) {
+        // The entries have different sizes, so the buffer is refilled once the next one may not be whole on it
+        if (!ended && filled - position < CHECKPOINT_ENTRY_MAX_SIZE) {
+            memmove(buffer, &buffer[position], filled - position);
+            filled -= position;
+            position = 0;
+            int bytesRead = readAll(file, &buffer[filled], bufferSize - filled);
+            if (bytesRead == ERROR) {
+                failed = true;
+                break;
+            }
+            checksum = crc32(checksum, &buffer[filled], bytesRead);
+            ended = bytesRead < bufferSize - filled;
+            filled += bytesRead;
+        }
+
+        CheckpointEntry entry;
+        if (filled - position < 8) {
+            failed = true;
+            break;
+        }
+        entry.lsn = fromBin64(&buffer[position]);
+        int userSize = deserializeUser(&buffer[position + 8], filled - position - 8, &entry.user);
+        if (userSize == ERROR) {
+            failed = true;
+            break;
+        }
+        position += 8 + userSize;
+        failed = load(&entry) == ERROR;
+        loaded++;
+    }
+    free(buffer);
+    close(file);
+
+    if (failed || checksum != expectedChecksum) {
+        return ERROR;
+    }
+    return logOffset;
+}
+
+void removeCheckpoint() {
+    unlink(CHECKPOINT_FILE_NAME);
+    unlink(CHECKPOINT_TEMP_FILE_NAME);
+}
+
+#endif
@@ -1,125 +1,439 @@
 #ifndef DBCLIENT_H
 #define DBCLIENT_H
 
-// Header file for the database files
-// Saves and reads user data to and from binary files
+// Header file for the database client
+// Sends requests to the database server without waiting for the response
+// The http request is parked as a callback and resumed when the database responds,
+// so many requests can be waiting for the database at the same time
+// The requests are queued on a batch, and sent together by flushDbBatch, see DB_METHOD_BATCH on dbProtocol.h
 
+#include "connection.h"
+#include "dbProtocol.h"
+#include "dbTransport.h"
+#include "eventLoop.h"
 #include "helpers.h"
+#include "metrics.h"
 
-// Returns ERROR if the database fails to respond
-int readUser(int clientSocket, User* user, int id);
+// Called when the database responds to a request
+// pool is the pool of the connection that answered, so the callback can send more requests
+// client is the http connection that made the request
+// result is the database result code, or ERROR if the database connection failed
+// user is only set if the result is SUCCESS or NOT_MODIFIED
+// after an update the user only has the id, the limit and the total, see DB_METHOD_UPDATE on dbProtocol.h
+// on NOT_MODIFIED the user only has the id
+// version is the version of the user after a read or an update, DB_NO_VERSION otherwise
+typedef struct DB_CONNECTION DbConnection;
+typedef struct DB_POOL DbPool;
+typedef void (*DbCallback)(DbPool* pool, Connection* client, int result, User* user, long long version);
+
+// Requests waiting for a response on a single connection
+#define DB_MAX_PENDING_REQUESTS 1024 * 1024
+
+typedef struct DB_PENDING_REQUEST {
+    bool inUse;
+    uint32_t requestId;
+    char method;
+    // The user the request is about
+    int userId;
+    int clientSocket;
+    unsigned long connectionId;
+    DbCallback callback;
+    // When the request was queued, see getMetricsTime
+    long long queuedAt;
+} DbPendingRequest;
+
+// The responses are matched to the requests by the request id, so they can arrive in any order
+// The requests waiting for a response are kept on a table indexed by requestId % pendingCapacity
+// The socket is ERROR while the connection is down
+struct DB_CONNECTION {
+    int socket;
+    DbPool* pool;
+    uint32_t nextRequestId;
+    DbPendingRequest* pending;
+    int pendingCount, pendingCapacity;
+    // Batch frame of the requests not sent yet, the operations start after the header and the count
+    // batchReserve is the biggest reply they can have, see getResultReserve
+    char batch[DB_FRAME_MAX_SIZE];
+    int batchLength, batchCount, batchReserve;
+    uint32_t batchRequestId;
+    // Health counters
+    unsigned long requestsSent, framesSent, responsesReceived, requestsFailed;
+    int reconnects, failedConnects;
+    // When the connection is down, the time to try connecting again
+    long long reconnectAt;
+};
+
+// Sets up an empty connection, that belongs to the pool
+void initDbConnection(DbConnection* db, DbPool* pool);
+
+// Connects to the database on the given port with the transport, see dbTransport.h
+// The socket is non blocking, and must be watched by the event loop with watchDbConnection
+// Returns ERROR if it fails to connect
+int connectToDb(DbConnection* db, int port, int transport);
+
+// Reads the user, callback is called with the user once the database responds
+// Only the newest maxTransactions transactions are sent back, 0 for the balance only
+// If the caller has the user at a version, the callback gets NOT_MODIFIED if it's still the same,
+// DB_NO_VERSION to always get the user
+// Returns ERROR if the request couldn't be sent
+int readUser(DbConnection* db, int id, int maxTransactions, long long version, Connection* client, DbCallback callback);
 
 // You should only use if this if it's a new user, or you want to reset the user
 // Instead of doing subsequent readUser and writeUser, use the updateUser function to update the user
-// Returns ERROR if it fails to write the user to the database
-int writeUser(int clientSocket, User* user);
+// Returns ERROR if the request couldn't be sent
+int writeUser(DbConnection* db, User* user, Connection* client, DbCallback callback);
 
 // updates the user with the transaction
-// writes the updated user to the user variable
-// returns SUCCESS if transaction was successful
-// returns ERROR if it fails to lock the file
-// returns FILE_NOT_FOUND if the user is not found
-// returns LIMIT_EXCEEDED_ERROR if the user has no limit
-// returns INVALID_TIPO_ERROR if the tipo is not valid
-int updateUserWithTransaction(int clientSocket, int id, Transaction* transaction, User* user);
-
-// Returns INVALID_TIPO_ERROR if the tipo is not valid
-// Returns LIMIT_EXCEEDED_ERROR if the user has no limit
-// Returns SUCCESS if the transaction was successful
-int addTransaction(User* user, Transaction* transaction);
-
-int connectToDb();
-
-int connectToDb(int port) {
-    int dbSocket = socket(AF_INET, SOCK_STREAM, 0);
-    raiseIfError(dbSocket);
+// callback is called with the updated limit and total once the database responds
+// the result passed to the callback is
+// SUCCESS if transaction was successful
+// ERROR if it fails to lock the file
+// FILE_NOT_FOUND if the user is not found
+// LIMIT_EXCEEDED_ERROR if the user has no limit
+// INVALID_TIPO_ERROR if the tipo is not valid
+// Returns ERROR if the request couldn't be sent
+int updateUserWithTransaction(DbConnection* db, int id, Transaction* transaction, Connection* client, DbCallback callback);
 
-    struct sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(port);
-    serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+// Sends the queued requests, a single one on its own frame and many on a batch frame
+// Returns ERROR if the requests couldn't be sent, the connection must be closed to fail them
+int flushDbBatch(DbConnection* db);
 
-    if (connect(dbSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
-        return ERROR;
-    }
+// Reads every response available on the database socket, and calls the callbacks of the answered requests
+// Returns ERROR if the database connection failed, every waiting request is called back with ERROR
+int receiveDbResponses(DbConnection* db);
+
+// Closes the database connection and calls back every request waiting for a response with ERROR
+void closeDbConnection(DbConnection* db);
+
+// Empties the batch, the next request starts a new one
+void resetDbBatch(DbConnection* db) {
+    db->batchLength = DB_FRAME_HEADER_SIZE + DB_BATCH_HEADER_SIZE;
+    db->batchCount = 0;
+    db->batchReserve = DB_FRAME_HEADER_SIZE + DB_BATCH_HEADER_SIZE;
+}
 
+void initDbConnection(DbConnection* db, DbPool* pool) {
+    db->socket = ERROR;
+    db->pool = pool;
+    db->nextRequestId = 0;
+    db->pending = NULL;
+    db->pendingCount = 0;
+    db->pendingCapacity = 0;
+    resetDbBatch(db);
+    db->requestsSent = 0;
+    db->framesSent = 0;
+    db->responsesReceived = 0;
+    db->requestsFailed = 0;
+    db->reconnects = 0;
+    db->failedConnects = 0;
+    db->reconnectAt = 0;
+}
+
+int connectToDb(DbConnection* db, int port, int transport) {
+    int dbSocket = connectDbTransport(transport, port);
+    raiseIfError(dbSocket);
+    db->socket = dbSocket;
     return dbSocket;
 }
 
-int writeUser(int clientSocket, User* user) {
-    char response[DB_RESPONSE_SIZE];
-    char request[DB_REQUEST_SIZE];
-    request[0] = 'c';
-    request[1] = ' ';
-    toBin(user->id, &request[2]);
-    toBin(user->limit, &request[6]);
-    request[7] = '\0';
-    int requestSize = 8;
-    // 'c' id(binNum) limit(binNum)
-    int responseSize = clientRequest(clientSocket, request, requestSize, response, DB_RESPONSE_SIZE);
-    if (responseSize == -1) {
-        return ERROR;
+// Moves the waiting requests to a bigger table, where the new request id has a free slot
+// The ids are sequential, so the waiting requests never share a slot
+// on a table bigger than the distance from the oldest one to the new one
+int growPendingRequests(DbConnection* db, uint32_t requestId) {
+    uint32_t span = 0;
+    for (int i = 0; i < db->pendingCapacity; i++) {
+        if (db->pending[i].inUse && requestId - db->pending[i].requestId > span) {
+            span = requestId - db->pending[i].requestId;
+        }
+    }
+    int newCapacity = db->pendingCapacity == 0 ? 64 : db->pendingCapacity * 2;
+    while ((uint32_t)newCapacity <= span && newCapacity <= DB_MAX_PENDING_REQUESTS) {
+        newCapacity *= 2;
     }
-    if (response[0] != '0') {
+    if (newCapacity > DB_MAX_PENDING_REQUESTS) {
         return ERROR;
     }
+
+    DbPendingRequest* grown = calloc(newCapacity, sizeof(DbPendingRequest));
+    errIfNull(grown);
+    for (int i = 0; i < db->pendingCapacity; i++) {
+        if (db->pending[i].inUse) {
+            grown[db->pending[i].requestId % newCapacity] = db->pending[i];
+        }
+    }
+    free(db->pending);
+    db->pending = grown;
+    db->pendingCapacity = newCapacity;
     return SUCCESS;
 }
 
-int readUser(int clientSocket, User* user, int id) {
-    char response[DB_RESPONSE_SIZE];
-    char request[DB_REQUEST_SIZE];
-    request[0] = 'r';
-    request[1] = ' ';
-    if (id > 9) {
-        return ERROR;
+// Adds the request to the pending table, growing it if the slot of the new id is taken
+int addPendingRequest(DbConnection* db, uint32_t requestId, char method, int userId, Connection* client, DbCallback callback) {
+    if (db->pendingCapacity == 0 || db->pending[requestId % db->pendingCapacity].inUse) {
+        raiseIfError(growPendingRequests(db, requestId));
     }
-    request[2] = id + '0';
-    request[3] = '\0';
-    // 'r' id(binNum)
-    int responseSize = clientRequest(clientSocket, request, 4, response, DB_RESPONSE_SIZE);
-    if (responseSize == -1) {
-        return ERROR;
+    DbPendingRequest* request = &db->pending[requestId % db->pendingCapacity];
+    request->inUse = true;
+    request->requestId = requestId;
+    request->method = method;
+    request->userId = userId;
+    request->clientSocket = client->socket;
+    request->connectionId = client->id;
+    request->callback = callback;
+    request->queuedAt = getMetricsTime();
+    db->pendingCount++;
+    return SUCCESS;
+}
+
+// Removes the request from the pending table
+// Returns false if no request is waiting with the id
+bool takePendingRequest(DbConnection* db, uint32_t requestId, DbPendingRequest* request) {
+    if (db->pendingCapacity == 0) {
+        return false;
+    }
+    DbPendingRequest* slot = &db->pending[requestId % db->pendingCapacity];
+    if (!slot->inUse || slot->requestId != requestId) {
+        return false;
     }
-    if (response[0] != '0') {
+    *request = *slot;
+    slot->inUse = false;
+    db->pendingCount--;
+    return true;
+}
+
+int flushDbBatch(DbConnection* db) {
+    if (db->batchCount == 0) {
+        return SUCCESS;
+    }
+    int result;
+    if (db->batchCount == 1) {
+        // method(1) payloadLength(1) payload, moved over the count to make a plain frame
+        char* operation = &db->batch[DB_FRAME_HEADER_SIZE + DB_BATCH_HEADER_SIZE];
+        char method = operation[0];
+        int payloadSize = (unsigned char)operation[1];
+        memmove(&db->batch[DB_FRAME_HEADER_SIZE], &operation[DB_BATCH_OPERATION_HEADER_SIZE], payloadSize);
+        int frameLength = writeFrameHeader(db->batch, method, SUCCESS, db->batchRequestId, payloadSize);
+        result = sendToClient(db->socket, db->batch, frameLength);
+    } else {
+        toBin16(db->batchCount, &db->batch[DB_FRAME_HEADER_SIZE]);
+        writeFrameHeader(db->batch, DB_METHOD_BATCH, SUCCESS, db->batchRequestId, db->batchLength - DB_FRAME_HEADER_SIZE);
+        result = sendToClient(db->socket, db->batch, db->batchLength);
+    }
+    db->requestsSent += db->batchCount;
+    db->framesSent++;
+    resetDbBatch(db);
+    return result == ERROR ? ERROR : SUCCESS;
+}
+
+// Queues the request on the batch and adds the callback to the pending table
+// The batch is sent first if the request, or its reply, wouldn't fit on it
+// frame must have DB_FRAME_HEADER_SIZE bytes free before the payload
+int sendDbRequest(DbConnection* db, char* frame, char method, int payloadSize, Connection* client, DbCallback callback) {
+    if (db == NULL || db->socket == ERROR || payloadSize > DB_BATCH_OPERATION_MAX_SIZE) {
         return ERROR;
     }
+    int resultReserve = getResultReserve(method);
+    if (db->batchLength + DB_BATCH_OPERATION_HEADER_SIZE + payloadSize > DB_FRAME_MAX_SIZE ||
+        db->batchReserve + resultReserve > DB_FRAME_MAX_SIZE) {
+        if (flushDbBatch(db) == ERROR) {
+            // The loop sees the connection hang up, and fails the requests that were on the batch
+            shutdown(db->socket, SHUT_RDWR);
+            return ERROR;
+        }
+    }
 
-    deserializeUser(&response[2], user);
+    uint32_t requestId = db->nextRequestId++;
+    if (db->batchCount == 0) {
+        db->batchRequestId = requestId;
+    }
+    char* operation = &db->batch[db->batchLength];
+    operation[0] = method;
+    operation[1] = (char)payloadSize;
+    memcpy(&operation[DB_BATCH_OPERATION_HEADER_SIZE], &frame[DB_FRAME_HEADER_SIZE], payloadSize);
+    db->batchLength += DB_BATCH_OPERATION_HEADER_SIZE + payloadSize;
+    db->batchReserve += resultReserve;
+    db->batchCount++;
+    // Every payload starts with the id of its user
+    return addPendingRequest(db, requestId, method, fromBin(&frame[DB_FRAME_HEADER_SIZE]), client, callback);
+}
 
-    return SUCCESS;
+// Calls the callback, unless the http connection was closed while waiting
+void resumeRequest(DbConnection* db, DbPendingRequest* request, int result, User* user, long long version) {
+    Connection* client = findConnection(request->clientSocket);
+    if (client == NULL || client->id != request->connectionId) {
+        log("{ Client closed before the db response }\n");
+        return;
+    }
+    request->callback(db->pool, client, result, user, version);
 }
 
-int updateUserWithTransaction(int clientSocket, int id, Transaction* transaction, User* user) {
-    char response[DB_RESPONSE_SIZE];
-    char request[DB_REQUEST_SIZE];
-    request[0] = 'u';
-    request[1] = ' ';
+int writeUser(DbConnection* db, User* user, Connection* client, DbCallback callback) {
+    char frame[DB_REQUEST_SIZE];
+    char* payload = &frame[DB_FRAME_HEADER_SIZE];
+    // 'c' id(4) limit(4)
+    toBin(user->id, &payload[0]);
+    toBin(user->limit, &payload[4]);
+    return sendDbRequest(db, frame, DB_METHOD_CREATE, 8, client, callback);
+}
 
-    char charId = id + '0';
-    request[2] = charId;
-    request[3] = ' ';
-    request[4] = transaction->tipo;
-    request[5] = ' ';
-    toBin(transaction->valor, &request[6]);
-    request[10] = ' ';
-    strcpy(&request[11], transaction->descricao);
+int readUser(DbConnection* db, int id, int maxTransactions, long long version, Connection* client, DbCallback callback) {
+    char frame[DB_REQUEST_SIZE];
+    char* payload = &frame[DB_FRAME_HEADER_SIZE];
+    // 'r' id(4) maxTransactions(1) [version(8)]
+    toBin(id, &payload[0]);
+    payload[4] = (char)maxTransactions;
+    if (version == DB_NO_VERSION) {
+        return sendDbRequest(db, frame, DB_METHOD_READ, 5, client, callback);
+    }
+    toBin64(version, &payload[5]);
+    return sendDbRequest(db, frame, DB_METHOD_READ, 5 + DB_VERSION_SIZE, client, callback);
+}
 
-    int requestSize = 11 + DESCRIPTION_SIZE;
+int updateUserWithTransaction(DbConnection* db, int id, Transaction* transaction, Connection* client, DbCallback callback) {
+    char frame[DB_REQUEST_SIZE];
+    char* payload = &frame[DB_FRAME_HEADER_SIZE];
+    // 'u' id(4) valor(4) tipo(1) descricaoLength(1) descricao(descricaoLength)
+    int descricaoLength = transaction->descricaoLength;
+    toBin(id, &payload[0]);
+    toBin(transaction->valor, &payload[4]);
+    payload[8] = transaction->tipo;
+    payload[9] = (char)descricaoLength;
+    memcpy(&payload[10], transaction->descricao, descricaoLength);
+    return sendDbRequest(db, frame, DB_METHOD_UPDATE, 10 + descricaoLength, client, callback);
+}
 
-    // 'u' id(binNum) tipo('c' ou 'd') valor(binNum) descricao(char[DESCRIPTION_SIZE])
-    int responseSize = clientRequest(clientSocket, request, requestSize, response, DB_RESPONSE_SIZE);
-    if (responseSize == -1) {
+// Calls back the request with the result of its operation
+void handleDbResult(DbConnection* db, uint32_t requestId, int status, const char* payload, int payloadSize) {
+    DbPendingRequest request;
+    if (!takePendingRequest(db, requestId, &request)) {
+        log("{ Db response to an unknown request %u }\n", requestId);
+        return;
+    }
+    db->responsesReceived++;
+    int methodIndex = getMethodIndex(request.method);
+    if (methodIndex != ERROR) {
+        recordLatency(METRIC_API_DB_ROUND_TRIP + methodIndex, request.queuedAt);
+    }
+    bool hasVersion = request.method != DB_METHOD_CREATE && (status == SUCCESS || status == NOT_MODIFIED);
+    if (!hasVersion) {
+        resumeRequest(db, &request, status, NULL, DB_NO_VERSION);
+        return;
+    }
+    User user;
+    long long version;
+    int readResult;
+    if (request.method == DB_METHOD_UPDATE) {
+        // total(4) limit(4) version(8)
+        readResult = deserializeBalance(payload, payloadSize - DB_VERSION_SIZE, &user);
+        version = readResult == ERROR ? DB_NO_VERSION : fromBin64(&payload[DB_BALANCE_SIZE]);
+    } else {
+        // version(8) and the user, only the version if it's not modified
+        memset(&user, 0, offsetof(User, transactions));
+        readResult = payloadSize < DB_VERSION_SIZE ? ERROR : SUCCESS;
+        version = readResult == ERROR ? DB_NO_VERSION : fromBin64(payload);
+        if (readResult == SUCCESS && status == SUCCESS) {
+            readResult = deserializeUser(&payload[DB_VERSION_SIZE], payloadSize - DB_VERSION_SIZE, &user);
+        }
+    }
+    if (readResult == ERROR) {
+        resumeRequest(db, &request, ERROR, NULL, DB_NO_VERSION);
+        return;
+    }
+    user.id = request.userId;
+    resumeRequest(db, &request, status, &user, version);
+}
+
+// Calls back every operation of the batch with its result, the operations have sequential request ids
+// Returns ERROR if the batch failed or the results are invalid
+int handleDbBatchResults(DbConnection* db, DbFrameHeader* header, const char* payload, int payloadSize) {
+    if (header->status != SUCCESS || payloadSize < DB_BATCH_HEADER_SIZE) {
         return ERROR;
     }
-    if (response[0] != '0') {
-        int result = response[0] - '0';
-        return -result;
+    int count = fromBin16(payload) & 0xFFFF;
+    int position = DB_BATCH_HEADER_SIZE;
+    for (int i = 0; i < count; i++) {
+        if (position + DB_BATCH_RESULT_HEADER_SIZE > payloadSize) {
+            return ERROR;
+        }
+        int status = fromBin16(&payload[position]);
+        int resultSize = fromBin16(&payload[position + 2]) & 0xFFFF;
+        position += DB_BATCH_RESULT_HEADER_SIZE;
+        if (position + resultSize > payloadSize) {
+            return ERROR;
+        }
+        handleDbResult(db, header->requestId + i, status, &payload[position], resultSize);
+        position += resultSize;
     }
+    return SUCCESS;
+}
 
-    deserializeUser(&response[2], user);
+// Handles every complete response frame on the database read buffer
+// Returns ERROR if a frame is invalid
+int handleDbResponses(DbConnection* db, Connection* dbConnection) {
+    int consumed = 0;
+    while (consumed < dbConnection->readLength) {
+        DbFrameHeader header;
+        char* frame = &dbConnection->readBuffer[consumed];
+        int frameLength = readFrameHeader(frame, dbConnection->readLength - consumed, &header);
+        if (frameLength == 0) {
+            break;
+        }
+        if (frameLength == ERROR) {
+            consumeConnectionInput(dbConnection, consumed);
+            return ERROR;
+        }
+        consumed += frameLength;
 
+        const char* payload = &frame[DB_FRAME_HEADER_SIZE];
+        int payloadSize = frameLength - DB_FRAME_HEADER_SIZE;
+        if (header.method != DB_METHOD_BATCH) {
+            handleDbResult(db, header.requestId, header.status, payload, payloadSize);
+            continue;
+        }
+        if (handleDbBatchResults(db, &header, payload, payloadSize) == ERROR) {
+            consumeConnectionInput(dbConnection, consumed);
+            return ERROR;
+        }
+    }
+    consumeConnectionInput(dbConnection, consumed);
     return SUCCESS;
 }
 
+int receiveDbResponses(DbConnection* db) {
+    Connection* dbConnection = getConnection(db->socket);
+    if (dbConnection == NULL) {
+        closeDbConnection(db);
+        return ERROR;
+    }
+    while (true) {
+        int bytesRead = receiveIntoConnection(dbConnection);
+        if (bytesRead == ERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SUCCESS;
+        }
+        if (bytesRead < 1 || handleDbResponses(db, dbConnection) == ERROR) {
+            log("{ Db connection failed }\n");
+            closeDbConnection(db);
+            return ERROR;
+        }
+    }
+}
+
+void closeDbConnection(DbConnection* db) {
+    if (db->socket != ERROR) {
+        closeConnection(db->socket);
+        db->socket = ERROR;
+        // The pool schedules the reconnection
+        db->reconnectAt = 0;
+    }
+    resetDbBatch(db);
+    // New requests made by the callbacks fail right away, since the socket is closed
+    for (int i = 0; i < db->pendingCapacity && db->pendingCount > 0; i++) {
+        DbPendingRequest request;
+        if (db->pending[i].inUse && takePendingRequest(db, db->pending[i].requestId, &request)) {
+            db->requestsFailed++;
+            resumeRequest(db, &request, ERROR, NULL, DB_NO_VERSION);
+        }
+    }
+}
+
 #endif
@@ -0,0 +1,340 @@
+#ifndef DB_COMMIT_H
+#define DB_COMMIT_H
+
+// Header file for the commit pipeline of the storage
+// Changes are committed in groups, with a single write and sync,
+// and the replies that depend on them are held until they're committed
+// The storage sets the commit callback, that writes the changes to the disk
+// A reply depends on a change if it's about a user changed since the last commit,
+// so a client never sees a state that could be lost on a crash
+// Users are tracked by the slot the storage keeps them on
+//
+// Every change gets a sequence number, and the commits move the durable sequence forward,
+// so a worker also holds its replies about users changed by other workers
+// Each worker commits what its own replies wait for, at the end of its event loop iteration,
+// unless another worker's commit already got there
+//
+// Durability policies:
+// none - the changes are written once per iteration, without waiting for the disk
+// batch - the changes are written and synced once per iteration, or once per window if one is set
+// every-write - the changes are written and synced before each reply, nothing is held
+
+#include <pthread.h>
+
+#include "connection.h"
+#include "eventLoop.h"
+
+#define DURABILITY_NONE 0
+#define DURABILITY_BATCH 1
+#define DURABILITY_EVERY_WRITE 2
+
+// Initial number of held replies, and of bytes held
+#define HELD_REPLIES_SIZE 256
+#define HELD_FRAMES_SIZE 64 * 1024
+// Initial number of tracked slots
+#define COMMIT_SLOTS_SIZE 1024
+
+typedef struct HELD_REPLY {
+    int socket;
+    // The reply is dropped if the connection was replaced while it was held
+    unsigned long connectionId;
+    int offset, length;
+} HeldReply;
+
+typedef struct COMMIT_STATS {
+    unsigned long commits, records, heldReplies;
+    int maxBatch;
+    long long totalLatencyUs, maxLatencyUs;
+} CommitStats;
+
+// Writes the changes to the disk, and waits for them to get there if sync is set
+// slots are the slots of the users changed since the last commit
+// Returns the number of changes committed, or ERROR if they can't be considered durable
+typedef int (*CommitCallback)(bool sync, const int* slots, int nSlots);
+
+CommitCallback commitCallback = NULL;
+int durabilityPolicy = DURABILITY_BATCH;
+// How long the first held reply waits for others to join its commit, 0 commits at the end of every iteration
+int commitWindowMs = 0;
+// Guarded by syncLock, except the held replies count
+CommitStats commitStats = {0};
+
+// Guards the sequences and the slot lists
+pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+// A single commit runs at a time, so the durable sequence only moves forward
+pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Sequence of the last change, of the last change taken by a commit, and of the last durable change
+unsigned long changeSequence = 0, takenSequence = 0;
+// Written under syncLock, read without locks
+unsigned long durableSequence = 0;
+// Sequence of the last change of every slot
+unsigned long* slotSequences = NULL;
+int slotSequencesCapacity = 0;
+// Slots changed since the last commit, and the ones being committed
+int* uncommittedSlots = NULL;
+int nUncommittedSlots = 0, uncommittedSlotsCapacity = 0;
+int* committingSlots = NULL;
+int committingSlotsCapacity = 0;
+
+// Each worker holds the replies to its own connections
+// Sequence the held replies, and the changes made by the worker, wait for
+__thread unsigned long waitedSequence = 0;
+// When the worker started waiting, 0 if it's not waiting
+__thread long long waitingSince = 0;
+__thread HeldReply* heldReplies = NULL;
+__thread int nHeldReplies = 0, heldRepliesCapacity = 0;
+__thread char* heldFrames = NULL;
+__thread int heldFramesLength = 0, heldFramesCapacity = 0;
+
+// Returns the durability policy with the given name
+// Returns ERROR if there's no policy with the name
+int getDurabilityPolicy(const char* name);
+
+// Marks the slot as changed since the last commit, the worker waits for the change to be committed
+// Called with the lock of the user held, so no reply about the user is sent before the change is marked
+// Returns ERROR if it fails to track the slot
+int markUncommitted(int slot);
+
+// Commits the changes made by every worker now, crashes the program if they can't be committed
+// Must be called without any storage lock held
+void commitChanges();
+
+// Sends the reply about the user on the slot, or holds it until the user's changes are committed
+// slot is ERROR if the reply is not about a stored user
+// Returns ERROR if the reply can't be sent or held
+int sendCommittedReply(Connection* connection, int slot, const char* frame, int length);
+
+// Sends the reply, or holds it until the changes up to the sequence are committed
+// Used for replies about many users, with the newest sequence of them, see getSlotSequence
+// Returns ERROR if the reply can't be sent or held
+int sendReplyAfter(Connection* connection, unsigned long sequence, const char* frame, int length);
+
+// Commits the changes if they're due, and sends the replies that were waiting for them
+// Called at the end of every event loop iteration
+// Crashes the program if the log can't be written, the acknowledged state would be lost
+void maintainCommits();
+
+// Returns how many milliseconds the loop can wait before the next commit, or WAIT_FOREVER if nothing is waiting
+int getCommitTimeout();
+
+// Prints the batch sizes and the commit latency
+void printCommitStats(FILE* output);
+
+int getDurabilityPolicy(const char* name) {
+    if (strcmp(name, "none") == 0) {
+        return DURABILITY_NONE;
+    }
+    if (strcmp(name, "batch") == 0) {
+        return DURABILITY_BATCH;
+    }
+    if (strcmp(name, "every-write") == 0) {
+        return DURABILITY_EVERY_WRITE;
+    }
+    return ERROR;
+}
+
+void commitChanges() {
+    if (commitCallback == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&syncLock);
+
+    // Take the changed slots, the changes made from now on go to the next commit
+    pthread_mutex_lock(&commitLock);
+    unsigned long target = changeSequence;
+    takenSequence = target;
+    int* slots = uncommittedSlots;
+    int nSlots = nUncommittedSlots;
+    uncommittedSlots = committingSlots;
+    committingSlots = slots;
+    int capacity = uncommittedSlotsCapacity;
+    uncommittedSlotsCapacity = committingSlotsCapacity;
+    committingSlotsCapacity = capacity;
+    nUncommittedSlots = 0;
+    pthread_mutex_unlock(&commitLock);
+
+    long long start = getCurrentTimeUs();
+    int records = commitCallback(durabilityPolicy != DURABILITY_NONE, slots, nSlots);
+    if (records == ERROR) {
+        perror("Failed to commit the changes");
+        exit(EXIT_FAILURE);
+    }
+    long long latency = getCurrentTimeUs() - start;
+    __atomic_store_n(&durableSequence, target, __ATOMIC_RELEASE);
+
+    if (records > 0) {
+        commitStats.commits++;
+        commitStats.records += records;
+        commitStats.maxBatch = records > commitStats.maxBatch ? records : commitStats.maxBatch;
+        commitStats.totalLatencyUs += latency;
+        commitStats.maxLatencyUs = latency > commitStats.maxLatencyUs ? latency : commitStats.maxLatencyUs;
+    }
+    pthread_mutex_unlock(&syncLock);
+}
+
+// Grows the slot sequences and the slot list, so the slot fits on both
+int growCommitSlots(int slot) {
+    if (slot >= slotSequencesCapacity) {
+        int newCapacity = slotSequencesCapacity == 0 ? COMMIT_SLOTS_SIZE : slotSequencesCapacity;
+        while (slot >= newCapacity) {
+            newCapacity *= 2;
+        }
+        unsigned long* grown = realloc(slotSequences, newCapacity * sizeof(unsigned long));
+        errIfNull(grown);
+        memset(&grown[slotSequencesCapacity], 0, (newCapacity - slotSequencesCapacity) * sizeof(unsigned long));
+        slotSequences = grown;
+        slotSequencesCapacity = newCapacity;
+    }
+    if (nUncommittedSlots == uncommittedSlotsCapacity) {
+        int newCapacity = uncommittedSlotsCapacity == 0 ? COMMIT_SLOTS_SIZE : uncommittedSlotsCapacity * 2;
+        int* grown = realloc(uncommittedSlots, newCapacity * sizeof(int));
+        errIfNull(grown);
+        uncommittedSlots = grown;
+        uncommittedSlotsCapacity = newCapacity;
+    }
+    return SUCCESS;
+}
+
+bool isDurable(unsigned long sequence) {
+    return sequence <= __atomic_load_n(&durableSequence, __ATOMIC_ACQUIRE);
+}
+
+// The worker waits for the sequence to be durable before its next replies are sent
+void waitForSequence(unsigned long sequence) {
+    if (waitingSince == 0) {
+        waitingSince = getCurrentTimeMs();
+    }
+    if (sequence > waitedSequence) {
+        waitedSequence = sequence;
+    }
+}
+
+int markUncommitted(int slot) {
+    if (slot < 0) {
+        return ERROR;
+    }
+    pthread_mutex_lock(&commitLock);
+    int result = growCommitSlots(slot);
+    if (result != ERROR) {
+        // Slots changed after the last commit took its slots are already on the list
+        if (slotSequences[slot] <= takenSequence) {
+            uncommittedSlots[nUncommittedSlots++] = slot;
+        }
+        slotSequences[slot] = ++changeSequence;
+        waitForSequence(changeSequence);
+    }
+    pthread_mutex_unlock(&commitLock);
+    return result;
+}
+
+// Returns the sequence of the last change of the slot, 0 if it was never changed
+unsigned long getSlotSequence(int slot) {
+    unsigned long sequence = 0;
+    pthread_mutex_lock(&commitLock);
+    if (slot >= 0 && slot < slotSequencesCapacity) {
+        sequence = slotSequences[slot];
+    }
+    pthread_mutex_unlock(&commitLock);
+    return sequence;
+}
+
+// Keeps a copy of the reply, to be sent after the next commit
+int holdReply(Connection* connection, const char* frame, int length) {
+    if (nHeldReplies == heldRepliesCapacity) {
+        int newCapacity = heldRepliesCapacity == 0 ? HELD_REPLIES_SIZE : heldRepliesCapacity * 2;
+        HeldReply* grown = realloc(heldReplies, newCapacity * sizeof(HeldReply));
+        errIfNull(grown);
+        heldReplies = grown;
+        heldRepliesCapacity = newCapacity;
+    }
+    if (heldFramesLength + length > heldFramesCapacity) {
+        int newCapacity = heldFramesCapacity == 0 ? HELD_FRAMES_SIZE : heldFramesCapacity;
+        while (heldFramesLength + length > newCapacity) {
+            newCapacity *= 2;
+        }
+        char* grown = realloc(heldFrames, newCapacity);
+        errIfNull(grown);
+        heldFrames = grown;
+        heldFramesCapacity = newCapacity;
+    }
+
+    HeldReply* reply = &heldReplies[nHeldReplies++];
+    reply->socket = connection->socket;
+    reply->connectionId = connection->id;
+    reply->offset = heldFramesLength;
+    reply->length = length;
+    memcpy(&heldFrames[heldFramesLength], frame, length);
+    heldFramesLength += length;
+    __atomic_fetch_add(&commitStats.heldReplies, 1, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+int sendCommittedReply(Connection* connection, int slot, const char* frame, int length) {
+    return sendReplyAfter(connection, getSlotSequence(slot), frame, length);
+}
+
+int sendReplyAfter(Connection* connection, unsigned long sequence, const char* frame, int length) {
+    if (!isDurable(sequence)) {
+        if (durabilityPolicy != DURABILITY_EVERY_WRITE) {
+            waitForSequence(sequence);
+            return holdReply(connection, frame, length);
+        }
+        commitChanges();
+    }
+    return sendToClient(connection->socket, frame, length);
+}
+
+void maintainCommits() {
+    if (waitingSince == 0) {
+        return;
+    }
+    if (commitWindowMs > 0 && getCurrentTimeMs() - waitingSince < commitWindowMs) {
+        return;
+    }
+    if (!isDurable(waitedSequence)) {
+        commitChanges();
+    }
+    waitingSince = 0;
+
+    // The replies go in the order they were made
+    for (int i = 0; i < nHeldReplies; i++) {
+        HeldReply* reply = &heldReplies[i];
+        Connection* connection = findConnection(reply->socket);
+        if (connection == NULL || connection->id != reply->connectionId) {
+            log("{ Connection closed before the commit }\n");
+            continue;
+        }
+        if (sendToClient(reply->socket, &heldFrames[reply->offset], reply->length) == ERROR) {
+            closeConnection(reply->socket);
+        }
+    }
+    nHeldReplies = 0;
+    heldFramesLength = 0;
+}
+
+int getCommitTimeout() {
+    if (waitingSince == 0) {
+        return WAIT_FOREVER;
+    }
+    long long remaining = waitingSince + commitWindowMs - getCurrentTimeMs();
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+void printCommitStats(FILE* output) {
+    pthread_mutex_lock(&syncLock);
+    CommitStats stats = commitStats;
+    pthread_mutex_unlock(&syncLock);
+
+    const char* policies[] = {"none", "batch", "every-write"};
+    double averageBatch = stats.commits == 0 ? 0 : (double)stats.records / stats.commits;
+    double averageLatency = stats.commits == 0 ? 0 : (double)stats.totalLatencyUs / stats.commits;
+    fprintf(output,
+            "{ durability %s, window %dms: commits %lu, records %lu, batch avg %.1f max %d, "
+            "commit latency avg %.0fus max %lldus, held replies %lu }\n",
+            policies[durabilityPolicy], commitWindowMs, stats.commits, stats.records,
+            averageBatch, stats.maxBatch, averageLatency, stats.maxLatencyUs, stats.heldReplies);
+    fflush(output);
+}
+
+#endif
@@ -2,16 +2,16 @@
 #define DBFILES_H
 
 // Header file for the database files
-// Saves and reads user data to and from binary files
+// Saves and reads user data to and from binary files, one file per user
+// Each file has the serialized user, with its schema version, see serializeUser
+// The open files are kept on a growing array, found through the user index
+// A single process owns the files, so they're guarded by the storage locks instead of flock, see dbLocks.h
 
-#include <sys/file.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "helpers.h"
-
-// Comment this line to keep the database on server start
-#define RESET_DB 1
+#include "account.h"
+#include "userIndex.h"
 
 // Open file modes
 #define WRITE_BINARY "wb"
@@ -20,28 +20,30 @@
 // User File name template
 const char* userFileTemplate = "data/user%d.bin";
 
-// Initial database setup
-const int userInitialLimits[] = {100000, 80000, 1000000, 10000000, 500000};
-const int numberInitialUsers = sizeof(userInitialLimits) / sizeof(int);
-
-// move right on a circular array
-#define moveRightInTransactions(index) (index = (index + 1) % MAX_TRANSACTIONS)
-
 // user file name size
 #define FILE_NAME_SIZE 32
+#define USER_FILES_INITIAL_CAPACITY 1024
+
+// Returns the slot of the open file of the user
+// Returns ERROR if the file was not opened yet
+int findUserFile(int id);
 
-// Initializes the database with 5 users
-// Returns ERROR it fails to write a user to the file
-// Returns SUCCESS if the database was successfully initialized
-int initDb();
+// Returns true if the user has a file on the disk, opened or not
+// Only needs the storage locked for reading, the files are created with it locked for writing
+bool userFileExists(int id);
 
-// Returns ERROR if the file is not found
-int readUser(User* user, int id);
+// Opens the user file and keeps it on a new slot, the storage must be locked for writing
+// Returns the slot, FILE_NOT_FOUND if the file doesn't exist, or ERROR if it can't be opened
+int openUserFile(int id);
+
+// Reads the file without moving its position, so it can run during a change to the user
+// Returns FILE_NOT_FOUND if the file is not open
+int readUserFile(User* user, int id);
 
 // You should only use if this if it's a new user, or you want to reset the user
 // Instead of doing subsequent readUser and writeUser, use the updateUser function to update the user
 // Returns ERROR if it fails to write the user to the file
-int writeUser(User* user);
+int writeUserFile(User* user);
 
 // updates the user with the transaction
 // id is the user id
@@ -49,78 +51,95 @@ int writeUser(User* user);
 // user returns the updated user
 // writes the updated user to the user variable
 // returns SUCCESS if transaction was successful
-// returns ERROR if it fails to lock the file
+// returns ERROR if it fails to read or write the file
 // returns FILE_NOT_FOUND if the user is not found
 // returns LIMIT_EXCEEDED_ERROR if the user has no limit
 // returns INVALID_TIPO_ERROR if the tipo is not valid
-int updateUserWithTransaction(int id, Transaction* transaction, User* user);
-
-// Returns INVALID_TIPO_ERROR if the tipo is not valid
-// Returns LIMIT_EXCEEDED_ERROR if the user has no limit
-// Returns SUCCESS if the transaction was successful
-int addTransaction(User* user, Transaction* transaction);
-// Tries to add or subtract the transaction value from the user's total
-// Returns ERROR if the user doesn't have enough limit
-int addSaldo(User* user, Transaction* transaction);
+int updateUserFile(int id, Transaction* transaction, User* user);
 
 // Closes all the open files
 void closeDBFiles();
 
-#define MAX_USERS 10
-FILE* userFiles[MAX_USERS] = {NULL};
-int userFileNo[MAX_USERS] = {0};
-
-int initDb() {
-    User user;
-    user.total = 0;
-    user.nTransactions = 0;
-    user.oldestTransaction = 0;
-
-    for (int id = 0; id < numberInitialUsers; id++) {
-        user.id = id + 1;
-        user.limit = userInitialLimits[id];
-        int writeResult = writeUser(&user);
-        if (writeResult == ERROR) {
-            return ERROR;
-        }
-    }
+FILE** userFiles = NULL;
+int userFilesCount = 0, userFilesCapacity = 0;
+UserIndex userFilesIndex = {NULL, 0, 0};
 
-    return SUCCESS;
+void closeDBFiles() {
+    for (int i = 0; i < userFilesCount; i++) {
+        fclose(userFiles[i]);
+    }
+    free(userFiles);
+    userFiles = NULL;
+    userFilesCount = 0;
+    userFilesCapacity = 0;
+    if (userFilesIndex.entries != NULL) {
+        freeUserIndex(&userFilesIndex);
+    }
 }
 
-void closeDBFiles() {
-    for (int i = 0; i < 10; i++) {
-        if (userFiles[i] != NULL) {
-            fclose(userFiles[i]);
-        }
+int findUserFile(int id) {
+    if (userFilesIndex.entries == NULL) {
+        return ERROR;
     }
+    return findUserSlot(&userFilesIndex, id);
 }
 
-int getUserFile(int id, int* fileNo, FILE** file) {
-    if (id < 0 || id > MAX_USERS) {
+bool userFileExists(int id) {
+    char fname[FILE_NAME_SIZE];
+    sprintf(fname, userFileTemplate, id);
+    return access(fname, F_OK) == 0;
+}
+
+int openUserFile(int id) {
+    if (!userFileExists(id)) {
         return FILE_NOT_FOUND;
     }
-    if (userFiles[id] == NULL) {
-        char fname[FILE_NAME_SIZE];
-        sprintf(fname, userFileTemplate, id);
+    char fname[FILE_NAME_SIZE];
+    sprintf(fname, userFileTemplate, id);
 
-        if ((access(fname, F_OK) != 0)) {
-            return FILE_NOT_FOUND;
-        }
+    if (userFilesIndex.entries == NULL) {
+        raiseIfError(initUserIndex(&userFilesIndex));
+    }
+    if (userFilesCount == userFilesCapacity) {
+        int newCapacity = userFilesCapacity == 0 ? USER_FILES_INITIAL_CAPACITY : userFilesCapacity * 2;
+        FILE** grownFiles = realloc(userFiles, (size_t)newCapacity * sizeof(FILE*));
+        errIfNull(grownFiles);
+        userFiles = grownFiles;
+        userFilesCapacity = newCapacity;
+    }
 
-        userFiles[id] = fopen(fname, READ_WRITE_BINARY);
-        errIfNull(userFiles[id]);
-        userFileNo[id] = fileno(userFiles[id]);
+    FILE* file = fopen(fname, READ_WRITE_BINARY);
+    errIfNull(file);
+    int slot = userFilesCount;
+    if (addUserSlot(&userFilesIndex, id, slot) == ERROR) {
+        fclose(file);
+        return ERROR;
+    }
+    userFiles[slot] = file;
+    userFilesCount++;
+    return slot;
+}
+
+int getUserFile(int id, FILE** file) {
+    if (id < 0) {
+        return FILE_NOT_FOUND;
+    }
+    int slot = findUserFile(id);
+    if (slot == ERROR) {
+        // Only opened here when the storage is locked for writing, or the file doesn't exist
+        slot = openUserFile(id);
+        if (slot < 0) {
+            return slot;
+        }
     } else {
-        int seekResult = fseek(userFiles[id], 0, SEEK_SET);
+        int seekResult = fseek(userFiles[slot], 0, SEEK_SET);
         raiseIfError(seekResult);
     }
-    *file = userFiles[id];
-    *fileNo = userFileNo[id];
+    *file = userFiles[slot];
     return SUCCESS;
 }
 
-int writeUser(User* user) {
+int writeUserFile(User* user) {
     char fname[FILE_NAME_SIZE];
     sprintf(fname, userFileTemplate, user->id);
 
@@ -131,59 +150,45 @@ int writeUser(User* user) {
     }
 
     FILE* fpTotals;
-    int fpTotalsFileDescriptor;
-    int getFileResult = getUserFile(user->id, &fpTotalsFileDescriptor, &fpTotals);
+    int getFileResult = getUserFile(user->id, &fpTotals);
     if (getFileResult != SUCCESS) {
         return getFileResult;
     }
-    int lockResult = flock(fpTotalsFileDescriptor, LOCK_EX);
-    raiseIfError(lockResult);
-    int writeResult = fwrite(user, sizeof(User), 1, fpTotals);
+    char serializedUser[USER_SERIALIZED_MAX_SIZE];
+    int size = serializeUser(user, serializedUser);
+    int writeResult = fwrite(serializedUser, size, 1, fpTotals);
     raiseIfError(writeResult);
     int flushResult = fflush(fpTotals);
     raiseIfError(flushResult);
-    int release = flock(fpTotalsFileDescriptor, LOCK_UN);
-    raiseIfError(release);
     return SUCCESS;
 }
 
-int readUser(User* user, int id) {
-    FILE* fpTotals;
-    int fpTotalsFileDescriptor;
-    int getFileResult = getUserFile(id, &fpTotalsFileDescriptor, &fpTotals);
-    if (getFileResult != SUCCESS) {
-        return getFileResult;
+int readUserFile(User* user, int id) {
+    int slot = findUserFile(id);
+    if (slot == ERROR) {
+        return FILE_NOT_FOUND;
     }
-
-    int lockResult = flock(fpTotalsFileDescriptor, LOCK_SH);
-    raiseIfError(lockResult);
-    int readResult = fread(user, sizeof(User), 1, fpTotals);
-    raiseIfError(readResult);
-    int release = flock(fpTotalsFileDescriptor, LOCK_UN);
-
-    raiseIfError(release);
-    return SUCCESS;
-}
-
-int updateUserWithTransaction(int id, Transaction* transaction, User* user) {
-    char fname[FILE_NAME_SIZE];
-    sprintf(fname, userFileTemplate, id);
-
-    if ((access(fname, F_OK) != 0)) {
+    // The serialized user may be shorter than a previous one, whatever follows it is ignored
+    char serializedUser[USER_SERIALIZED_MAX_SIZE];
+    ssize_t readResult = pread(fileno(userFiles[slot]), serializedUser, sizeof(serializedUser), 0);
+    if (readResult == -1 || deserializeUser(serializedUser, readResult, user) == ERROR) {
         return ERROR;
     }
+    return SUCCESS;
+}
 
+int updateUserFile(int id, Transaction* transaction, User* user) {
     FILE* fpTotals;
-    int fpTotalsFileDescriptor;
-    int getFileResult = getUserFile(id, &fpTotalsFileDescriptor, &fpTotals);
+    int getFileResult = getUserFile(id, &fpTotals);
     if (getFileResult != SUCCESS) {
         return getFileResult;
     }
 
-    int lockResult = flock(fpTotalsFileDescriptor, LOCK_EX);
-    raiseIfError(lockResult);
-    int readResult = fread(user, sizeof(User), 1, fpTotals);
-    raiseIfError(readResult);
+    char serializedUser[USER_SERIALIZED_MAX_SIZE];
+    int readResult = fread(serializedUser, 1, sizeof(serializedUser), fpTotals);
+    if (ferror(fpTotals) || deserializeUser(serializedUser, readResult, user) == ERROR) {
+        return ERROR;
+    }
 
     int transactionResult = addTransaction(user, transaction);
 
@@ -191,45 +196,13 @@ int updateUserWithTransaction(int id, Transaction* transaction, User* user) {
         // Go back to the beginning of the file, because fread moved the cursor
         int seekResult = fseek(fpTotals, 0, SEEK_SET);
         raiseIfError(seekResult);
-        int writeResult = fwrite(user, sizeof(User), 1, fpTotals);
+        int size = serializeUser(user, serializedUser);
+        int writeResult = fwrite(serializedUser, size, 1, fpTotals);
         raiseIfError(writeResult);
     }
     int flushResult = fflush(fpTotals);
     raiseIfError(flushResult);
-    int release = flock(fpTotalsFileDescriptor, LOCK_UN);
-    raiseIfError(release);
     return transactionResult;
 }
 
-int addTransaction(User* user, Transaction* transaction) {
-    int resultSaldo = addSaldo(user, transaction);
-    if (resultSaldo != SUCCESS) {
-        return resultSaldo;
-    }
-    if (user->nTransactions == 10) {
-        user->transactions[user->oldestTransaction] = *transaction;
-        moveRightInTransactions(user->oldestTransaction);
-        return SUCCESS;
-    }
-
-    user->transactions[user->nTransactions] = *transaction;
-    user->nTransactions++;
-    return SUCCESS;
-}
-
-int addSaldo(User* user, Transaction* transaction) {
-    if (transaction->tipo == 'd') {
-        int newTotal = user->total - transaction->valor;
-        if (-1 * newTotal > user->limit) {
-            return LIMIT_EXCEEDED_ERROR;
-        }
-        user->total = newTotal;
-        return SUCCESS;
-    } else if (transaction->tipo == 'c') {
-        user->total += transaction->valor;
-        return SUCCESS;
-    }
-    return INVALID_TIPO_ERROR;
-}
-
 #endif
\ No newline at end of file
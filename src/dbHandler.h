@@ -3,9 +3,12 @@
 
 // Header file for the db socket handler
 // Handles the server db socket requests and responses
-// Calls the file database functions to read and write to the files
+// Calls the storage functions to read and write the users
 
-#include "dbFiles.h"
+#include "connection.h"
+#include "dbProtocol.h"
+#include "dbStorage.h"
+#include "metrics.h"
 
 // server port
 // #define SERVER_PORT 9999
@@ -15,8 +18,6 @@
 #define SOCKET_READ_SIZE 8 * 1024
 // 16KB
 #define RESPONSE_SIZE 16 * 1024
-// 8KB
-#define RESPONSE_BODY_SIZE 8 * 1024
 
 #ifdef LOGGING
 #define logRequest(request, requestSize)    \
@@ -41,11 +42,19 @@
 // Crash the program if the socket creation or binding fails
 int setupServer(short port, int backlog);
 
-// Handles the request and sends the response to the clientSocket
+// Handles every complete request frame buffered on the connection, in the order they arrived
+// A single recv may have many frames, or just part of one, when the api has many requests waiting
+// Returns END_CONNECTION if the client requests to close the connection
+// Returns SUCCESS if the requests were successful
+// Returns ERROR if a request was not successful
+int handleConnectionRequests(Connection* connection);
+
+// Handles the request frame and sends the response frame, with the same request id, to the connection
+// Responses about uncommitted changes are held until the changes are committed
 // Returns END_CONNECTION if the client requests to close the connection
 // Returns SUCCESS if the request was successful
 // Returns ERROR if the request was not successful
-int handleRequest(char* request, int requestSize, int clientSocket);
+int handleRequest(char* request, int requestSize, Connection* connection);
 
 int setupServer(short port, int backlog) {
     int serverSocket;
@@ -60,6 +69,8 @@ int setupServer(short port, int backlog) {
     // https://handsonnetworkprogramming.com/articles/bind-error-98-eaddrinuse-10048-wsaeaddrinuse-address-already-in-use/
     int yes = 1;
     check(setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)), "Failed to set socket options");
+    // Every worker binds its own socket to the same port, and the kernel balances the connections between them
+    check(setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)), "Failed to set socket options");
 
     check(bind(serverSocket, (SA*)&serverAddress, sizeof(serverAddress)), "Failed to bind socket");
     check(listen(serverSocket, backlog), "Failed to listen on socket");
@@ -67,106 +78,222 @@ int setupServer(short port, int backlog) {
     return serverSocket;
 }
 
-const char requestUnknown[] = "1 - Unknown request\n\n";
-#define REQUEST_UNKNOWN(clientSocket) STATIC_RESPONSE(clientSocket, requestUnknown)
-
-int handleRequest(char* request, int requestSize, int clientSocket) {
-#ifdef LOGGING
-    char reqTime[DATE_SIZE];
-    getCurrentTimeStr(reqTime);
-#endif
+int handleConnectionRequests(Connection* connection) {
+    while (connection->readLength > 0) {
+        DbFrameHeader header;
+        int frameLength = readFrameHeader(connection->readBuffer, connection->readLength, &header);
+        if (frameLength == 0) {
+            // Wait for the rest of the frame
+            return SUCCESS;
+        }
+        if (frameLength == ERROR) {
+            // The stream is out of sync, the next frames can't be found
+            log("[ Invalid frame ]\n");
+            return END_CONNECTION;
+        }
 
-    if (requestSize < 1) {
-        log("{ %s - Empty request }\n", reqTime);
-        return REQUEST_UNKNOWN(clientSocket);
+        int result = handleRequest(connection->readBuffer, frameLength, connection);
+        consumeConnectionInput(connection, frameLength);
+        if (result == ERROR || result == END_CONNECTION) {
+            return result;
+        }
+        log("{ Request handled }\n");
     }
+    return SUCCESS;
+}
 
-    log("{ %s - Received:", reqTime);
-    log(LOG_SEPARATOR);
-    logRequest(request, requestSize);
-    log(LOG_SEPARATOR);
-    log("(%d bytes read) }\n", requestSize);
-
-    // close connection request
-    if (request[0] == '0') {
-        send(clientSocket, "0 close", 8, SEND_DEFAULT);
-        return END_CONNECTION;
+// Sends a response frame with the status, and the payload if it's given
+// id is the user the response is about, or ERROR if it's not about a user
+// The response waits for the user's changes to be committed
+int respondFrame(Connection* connection, int id, char method, int status, uint32_t requestId, const char* payload, int payloadSize) {
+    char responseBuffer[DB_RESPONSE_SIZE];
+    if (payloadSize > 0) {
+        memcpy(&responseBuffer[DB_FRAME_HEADER_SIZE], payload, payloadSize);
     }
+    int frameLength = writeFrameHeader(responseBuffer, method, status, requestId, payloadSize);
+    int slot = id < 0 ? ERROR : getStorageSlot(id);
+    return sendCommittedReply(connection, slot, responseBuffer, frameLength);
+}
 
-    bool recognizedMethod = false;
-    char responseBuffer[DB_RESPONSE_SIZE];
-    int bufferLen = 0;
-    if (request[0] == 'c') {
-        recognizedMethod = true;
+// Runs a 'c', 'r' or 'u' operation, see runOperation
+int runStorageOperation(char method, char* payload, int payloadSize, char* reply, int* replySize, int* id) {
+    *replySize = 0;
+    *id = ERROR;
+
+    if (method == DB_METHOD_CREATE && payloadSize >= 8) {
         log("[ Create user request ]\n");
 
-        int id = request[2] - '0';
-        int limit = fromBin(&request[4]);
         User user;
         user.total = 0;
         user.nTransactions = 0;
         user.oldestTransaction = 0;
-        user.id = id;
-        user.limit = limit;
-        int writeUserResult = writeUser(&user);
-
-        responseBuffer[0] = (writeUserResult * -1) + '0';
-        bufferLen = 1;
+        user.id = fromBin(&payload[0]);
+        user.limit = fromBin(&payload[4]);
+        if (user.id < 0) {
+            return ERROR;
+        }
+        *id = user.id;
+        return writeUser(&user);
     }
 
-    if (request[0] == 'r') {
-        recognizedMethod = true;
-        int id = request[2] - '0';
+    if (method == DB_METHOD_READ && payloadSize >= 5) {
+        *id = fromBin(&payload[0]);
+        int maxTransactions = (unsigned char)payload[4];
 
         log("[ Read user request ]\n");
         User user;
-        int readResult = readUser(&user, id);
+        long long version;
+        int readResult = readUser(&user, *id, &version);
         log("{ Read result: %d }\n", readResult);
         log("{ User limit: %d }\n", user.limit);
         log("{ User total: %d }\n", user.total);
         log("{ User nTransactions: %d }\n", user.nTransactions);
         log("{ User oldestTransaction: %d }\n", user.oldestTransaction);
 
-        responseBuffer[0] = (readResult * -1) + '0';
-        responseBuffer[1] = ' ';
-        bufferLen = 2;
-        if (readResult == SUCCESS) {
-            int userBytes = serializeUser(&user, &responseBuffer[2]);
-            bufferLen += userBytes;
+        if (readResult != SUCCESS) {
+            return readResult;
         }
+        toBin64(version, &reply[0]);
+        *replySize = DB_VERSION_SIZE;
+        // The api already has the user as it is
+        if (payloadSize >= 5 + DB_VERSION_SIZE && fromBin64(&payload[5]) == version) {
+            return NOT_MODIFIED;
+        }
+        *replySize += serializeUserProjection(&user, maxTransactions, &reply[DB_VERSION_SIZE]);
+        return SUCCESS;
     }
 
-    if (request[0] == 'u') {
-        recognizedMethod = true;
+    if (method == DB_METHOD_UPDATE && payloadSize >= 10) {
         log("[ Update user request ]\n");
 
         User user;
-        int id = request[2] - '0';
+        int userId = fromBin(&payload[0]);
         Transaction transaction;
-        transaction.tipo = request[4];
-        transaction.valor = fromBin(&request[6]);
-        strncpy(transaction.descricao, &request[11], DESCRIPTION_SIZE - 1);
-        getCurrentTimeStr(transaction.realizada_em);
+        transaction.valor = fromBin(&payload[4]);
+        transaction.tipo = payload[8];
+        int descricaoLength = (unsigned char)payload[9];
+        if (descricaoLength > DESCRIPTION_SIZE || 10 + descricaoLength > payloadSize) {
+            return ERROR;
+        }
+        memcpy(transaction.descricao, &payload[10], descricaoLength);
+        transaction.descricaoLength = (unsigned char)descricaoLength;
+        transaction.realizadaEm = getEpochTimeUs();
+        *id = userId;
+
+        long long version;
+        int updateUserResult = updateUserWithTransaction(userId, &transaction, &user, &version);
+        // The api only answers with the balance, the transactions stay on the db
+        if (updateUserResult == SUCCESS) {
+            *replySize = serializeBalance(&user, reply);
+            toBin64(version, &reply[*replySize]);
+            *replySize += DB_VERSION_SIZE;
+        }
+        return updateUserResult;
+    }
 
-        int updateUserResult = updateUserWithTransaction(id, &transaction, &user);
-        responseBuffer[0] = (updateUserResult * -1) + '0';
-        responseBuffer[1] = ' ';
-        bufferLen = 2;
+    log("[ Method not allowed ]\n");
+    return ERROR;
+}
 
-        if (updateUserResult == SUCCESS) {
-            int userBytes = serializeUser(&user, &responseBuffer[2]);
-            bufferLen += userBytes;
+// Runs a 'c', 'r' or 'u' operation, and writes its reply payload
+// reply must fit DB_REPLY_MAX_SIZE
+// Sets id to the user the operation is about, or ERROR if it's not about a user
+// Returns the status of the operation
+int runOperation(char method, char* payload, int payloadSize, char* reply, int* replySize, int* id) {
+    long long start = getMetricsTime();
+    int status = runStorageOperation(method, payload, payloadSize, reply, replySize, id);
+    int methodIndex = getMethodIndex(method);
+    if (methodIndex != ERROR) {
+        recordLatency(METRIC_DB_OPERATION + methodIndex, start);
+    }
+    return status;
+}
+
+// Runs every operation of the batch, and sends their results on a single frame
+// The frame waits for the changes of every user on the batch to be committed
+int handleBatch(char* payload, int payloadSize, uint32_t requestId, Connection* connection) {
+    char responseBuffer[DB_FRAME_MAX_SIZE];
+    char* results = &responseBuffer[DB_FRAME_HEADER_SIZE];
+    int count = payloadSize < DB_BATCH_HEADER_SIZE ? ERROR : fromBin16(payload) & 0xFFFF;
+
+    // The operations are checked before any of them runs, so a batch runs whole or not at all
+    int position = DB_BATCH_HEADER_SIZE, reserved = DB_FRAME_HEADER_SIZE + DB_BATCH_HEADER_SIZE;
+    for (int i = 0; i < count && reserved != ERROR; i++) {
+        if (position + DB_BATCH_OPERATION_HEADER_SIZE > payloadSize) {
+            reserved = ERROR;
+            break;
         }
+        int operationSize = (unsigned char)payload[position + 1];
+        int resultReserve = getResultReserve(payload[position]);
+        position += DB_BATCH_OPERATION_HEADER_SIZE + operationSize;
+        reserved = resultReserve == ERROR || position > payloadSize ? ERROR : reserved + resultReserve;
+    }
+    if (count == ERROR || reserved == ERROR || reserved > DB_FRAME_MAX_SIZE) {
+        log("[ Invalid batch ]\n");
+        int frameLength = writeFrameHeader(responseBuffer, DB_METHOD_BATCH, ERROR, requestId, 0);
+        return sendToClient(connection->socket, responseBuffer, frameLength);
     }
 
-    // send response
-    if (recognizedMethod) {
-        send(clientSocket, responseBuffer, bufferLen, SEND_DEFAULT);
-        return SUCCESS;
+    toBin16(count, results);
+    int resultsSize = DB_BATCH_HEADER_SIZE;
+    unsigned long sequence = 0;
+    position = DB_BATCH_HEADER_SIZE;
+    for (int i = 0; i < count; i++) {
+        char method = payload[position];
+        int operationSize = (unsigned char)payload[position + 1];
+        char* result = &results[resultsSize];
+        int replySize, id;
+        int status = runOperation(method, &payload[position + DB_BATCH_OPERATION_HEADER_SIZE], operationSize,
+                                  &result[DB_BATCH_RESULT_HEADER_SIZE], &replySize, &id);
+        toBin16(status, &result[0]);
+        toBin16(replySize, &result[2]);
+        resultsSize += DB_BATCH_RESULT_HEADER_SIZE + replySize;
+        position += DB_BATCH_OPERATION_HEADER_SIZE + operationSize;
+
+        unsigned long userSequence = id < 0 ? 0 : getSlotSequence(getStorageSlot(id));
+        if (userSequence > sequence) {
+            sequence = userSequence;
+        }
     }
+    int frameLength = writeFrameHeader(responseBuffer, DB_METHOD_BATCH, SUCCESS, requestId, resultsSize);
+    return sendReplyAfter(connection, sequence, responseBuffer, frameLength);
+}
 
-    log("[ Method not allowed ]\n");
-    return REQUEST_UNKNOWN(clientSocket);
+int handleRequest(char* request, int requestSize, Connection* connection) {
+#ifdef LOGGING
+    char reqTime[DATE_SIZE];
+    getCurrentTimeStr(reqTime);
+#endif
+
+    DbFrameHeader header;
+    if (readFrameHeader(request, requestSize, &header) <= 0) {
+        log("{ %s - Invalid frame }\n", reqTime);
+        return ERROR;
+    }
+    char* payload = &request[DB_FRAME_HEADER_SIZE];
+    int payloadSize = requestSize - DB_FRAME_HEADER_SIZE;
+
+    log("{ %s - Received:", reqTime);
+    log(LOG_SEPARATOR);
+    logRequest(request, requestSize);
+    log(LOG_SEPARATOR);
+    log("(%d bytes read) }\n", requestSize);
+
+    // close connection request
+    if (header.method == DB_METHOD_CLOSE) {
+        respondFrame(connection, ERROR, DB_METHOD_CLOSE, SUCCESS, header.requestId, NULL, 0);
+        return END_CONNECTION;
+    }
+
+    if (header.method == DB_METHOD_BATCH) {
+        log("[ Batch request ]\n");
+        return handleBatch(payload, payloadSize, header.requestId, connection);
+    }
+
+    char reply[DB_REPLY_MAX_SIZE];
+    int replySize, id;
+    int status = runOperation(header.method, payload, payloadSize, reply, &replySize, &id);
+    return respondFrame(connection, id, header.method, status, header.requestId, reply, replySize);
 }
 
 #endif
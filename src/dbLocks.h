@@ -0,0 +1,143 @@
+#ifndef DB_LOCKS_H
+#define DB_LOCKS_H
+
+// Header file for the storage locks
+// The db workers share the storage, so every access to a user takes the storage lock,
+// guarding the index and the arrays the users are kept on,
+// only taken for writing when a user is added or the storage grows
+// A change also takes the lock of the stripe of the user, guarding the user itself
+// A user always maps to the same stripe, and users on different stripes are changed in parallel
+//
+// Reads don't take the stripe lock, each stripe is also a seqlock:
+// its sequence is odd while a change is in progress, and moves on every change,
+// so a reader copies the user and only retries if the sequence moved during the copy
+// The sequence is also the version of the users of the stripe, sent to the api so it can cache what it renders
+// of a user, see DB_METHOD_READ on dbProtocol.h
+//
+// Lock order: storage, stripe, log, commit
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "metrics.h"
+#include "userIndex.h"
+
+// Power of two
+#define USER_LOCK_STRIPES 1024
+#define CACHE_LINE_SIZE 64
+
+// Each stripe on its own cache line, so workers on different stripes don't fight over the line
+typedef struct USER_LOCK {
+    pthread_mutex_t mutex;
+    unsigned int sequence;
+} __attribute__((aligned(CACHE_LINE_SIZE))) UserLock;
+
+pthread_rwlock_t storageLock = PTHREAD_RWLOCK_INITIALIZER;
+UserLock userLocks[USER_LOCK_STRIPES];
+// Picked on every start, the sequences start over, so a version from before a restart never matches one after it
+unsigned int versionEpoch;
+
+// Initializes the stripe locks, before the workers start
+void initUserLocks();
+
+// Locks the storage for reading users, or changing the users that already exist
+void lockStorageRead();
+
+// Locks the storage for adding users, no other worker is on the storage until it's unlocked
+void lockStorageWrite();
+
+void unlockStorage();
+
+// Locks the stripe of the user to change it, the storage must be locked first
+// Readers of the stripe retry until it's unlocked
+void lockUserStripe(int id);
+
+// Returns the sequence the stripe is left with
+unsigned int unlockUserStripe(int id);
+
+// Starts an optimistic read of the user, the storage must be locked first
+// Returns the sequence to check the copy with, waiting for a change in progress to finish
+unsigned int beginUserRead(int id);
+
+// Returns true if the user changed during the read, and the copy must be retried
+bool userReadRaced(int id, unsigned int sequence);
+
+// Returns the version of a user read, or changed, with the sequence of its stripe
+// It moves on every change of the user, and on the changes of the other users of the stripe
+long long getUserVersion(unsigned int sequence);
+
+void initUserLocks() {
+    for (int i = 0; i < USER_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&userLocks[i].mutex, NULL);
+    }
+    versionEpoch = (unsigned int)(getEpochTimeUs() ^ ((long long)getpid() << 20));
+}
+
+// The waits are only measured when the lock is taken, so the free locks don't pay for the clock
+void lockStorageRead() {
+    if (pthread_rwlock_tryrdlock(&storageLock) != 0) {
+        long long start = getMetricsTime();
+        pthread_rwlock_rdlock(&storageLock);
+        recordLatency(METRIC_DB_STORAGE_LOCK_WAIT, start);
+    }
+}
+
+void lockStorageWrite() {
+    if (pthread_rwlock_trywrlock(&storageLock) != 0) {
+        long long start = getMetricsTime();
+        pthread_rwlock_wrlock(&storageLock);
+        recordLatency(METRIC_DB_STORAGE_LOCK_WAIT, start);
+    }
+}
+
+void unlockStorage() {
+    pthread_rwlock_unlock(&storageLock);
+}
+
+// The ids are hashed across the stripes, different accounts may still share one
+UserLock* getUserLock(int id) {
+    return &userLocks[hashUserId(id) & (USER_LOCK_STRIPES - 1)];
+}
+
+void lockUserStripe(int id) {
+    UserLock* lock = getUserLock(id);
+    if (pthread_mutex_trylock(&lock->mutex) != 0) {
+        long long start = getMetricsTime();
+        pthread_mutex_lock(&lock->mutex);
+        recordLatency(METRIC_DB_STRIPE_LOCK_WAIT, start);
+    }
+    // Odd, so the readers know a change is in progress, and nothing written after moves before it
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+unsigned int unlockUserStripe(int id) {
+    UserLock* lock = getUserLock(id);
+    unsigned int sequence = lock->sequence + 1;
+    __atomic_store_n(&lock->sequence, sequence, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock->mutex);
+    return sequence;
+}
+
+unsigned int beginUserRead(int id) {
+    UserLock* lock = getUserLock(id);
+    unsigned int sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE);
+    while (sequence & 1) {
+        // The writer may be waiting for the disk, let it run
+        sched_yield();
+        sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE);
+    }
+    return sequence;
+}
+
+bool userReadRaced(int id, unsigned int sequence) {
+    // The copy can't move after the check
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&getUserLock(id)->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+long long getUserVersion(unsigned int sequence) {
+    return (long long)((unsigned long long)versionEpoch << 32 | sequence);
+}
+
+#endif
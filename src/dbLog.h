@@ -0,0 +1,338 @@
+#ifndef DB_LOG_H
+#define DB_LOG_H
+
+// Header file for the database write-ahead log
+// Every change to the users is appended to a single log file before it's acknowledged,
+// and the users are rebuilt on startup by replaying the log from the start
+// Records are buffered, and written together by commitLog, so many changes cost a single write and sync
+// The workers append to the same buffer, under the log lock
+// A record is identified by its log sequence number, the position on the log right after it,
+// so the users can tell which records they already have when a checkpoint is loaded, see dbCheckpoint.h
+//
+// Record, all numbers little endian:
+// length(4) - size of the whole record
+// checksum(4) - crc32 of everything after the checksum
+// type(1) - LOG_RECORD_WRITE or LOG_RECORD_UPDATE
+// payload
+//
+// 'w' the whole serialized user, with its schema version
+// 'u' id(4) and the serialized transaction, see serializeTransaction
+//
+// A crash can leave the last record torn, replay stops on the first record that fails the checksum
+// and the log is truncated there
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "helpers.h"
+
+#define LOG_FILE_NAME "data/wal.log"
+
+#define LOG_RECORD_WRITE 'w'
+#define LOG_RECORD_UPDATE 'u'
+
+#define LOG_RECORD_HEADER_SIZE 9
+// Big enough for a whole serialized user
+#define LOG_RECORD_MAX_SIZE 1024
+// Size of the reads while replaying
+#define LOG_READ_SIZE 64 * 1024
+// Initial size of the buffer of records waiting to be written
+#define LOG_BUFFER_SIZE 64 * 1024
+
+// Called for every valid record on replay, with the record payload and its log sequence number
+// Returns ERROR if the record can't be applied, which stops the replay
+typedef int (*LogReplayCallback)(char type, const char* payload, int payloadSize, long long lsn);
+
+// Descriptor of the log file, ERROR while it's closed
+int logFile = ERROR;
+// Size of the log on the file, without the records waiting on the buffer
+long long logSize = 0;
+// Size of the log known to be on the disk, guarded by logLock
+// A commit syncs whenever the file is ahead of it, even with no records of its own,
+// the records it's waiting for may have been written by a commit whose sync is still running
+long long syncedSize = 0;
+// Records waiting to be written, guarded by logLock
+char* logBuffer = NULL;
+int logBufferLength = 0, logBufferCapacity = 0, logBufferRecords = 0;
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Opens the log file, creating it if needed
+// If reset is set the log is emptied, otherwise the records from the replayFrom position are replayed with the callback
+// Returns the number of records replayed
+// Returns ERROR if the log can't be opened, a record can't be applied, or the log ends before replayFrom
+long long openLog(bool reset, long long replayFrom, LogReplayCallback replay);
+
+// Appends a record to the log buffer, it's only on the file after commitLog
+// Returns the log sequence number of the record
+// Returns ERROR if the record is too big or the buffer can't grow
+long long appendLogRecord(char type, const char* payload, int payloadSize);
+
+// Builds the record with its header on the buffer, which must fit LOG_RECORD_MAX_SIZE
+// Returns the length of the record, or ERROR if it's too big
+int buildLogRecord(char* record, char type, const char* payload, int payloadSize);
+
+// Returns the log sequence number the next record will follow
+long long getLogEnd();
+
+// Writes the buffered records to the file, and waits for them to reach the disk if sync is set
+// Returns the number of records written
+// Returns ERROR if the write or the sync fails, the records can't be considered durable
+int commitLog(bool sync);
+
+// Closes the log file
+void closeLog();
+
+// Returns the crc32 of the data, continuing from a previous crc
+uint32_t crc32(uint32_t crc, const char* data, int size);
+
+// Slicing by 8, the crc of 8 bytes at a time from 8 tables, the checkpoint and the log replay are bound by it
+uint32_t crc32(uint32_t crc, const char* data, int size) {
+    static uint32_t table[8][256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+            table[0][i] = value;
+        }
+        for (int slice = 1; slice < 8; slice++) {
+            for (int i = 0; i < 256; i++) {
+                table[slice][i] = table[0][table[slice - 1][i] & 0xFF] ^ (table[slice - 1][i] >> 8);
+            }
+        }
+        tableReady = true;
+    }
+
+    crc = ~crc;
+    const unsigned char* bytes = (const unsigned char*)data;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint32_t low = crc ^ ((uint32_t)bytes[i] | (uint32_t)bytes[i + 1] << 8 |
+                              (uint32_t)bytes[i + 2] << 16 | (uint32_t)bytes[i + 3] << 24);
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^
+              table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+              table[3][bytes[i + 4]] ^ table[2][bytes[i + 5]] ^
+              table[1][bytes[i + 6]] ^ table[0][bytes[i + 7]];
+    }
+    for (; i < size; i++) {
+        crc = table[0][(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Reads until the buffer is full or the file ends, retrying partial reads
+// Returns the bytes read, or ERROR if the file can't be read
+int readAll(int file, char* data, int size) {
+    int filled = 0;
+    while (filled < size) {
+        ssize_t result = read(file, &data[filled], size - filled);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1) {
+            return ERROR;
+        }
+        if (result == 0) {
+            break;
+        }
+        filled += result;
+    }
+    return filled;
+}
+
+// Writes the whole buffer, retrying partial writes
+int writeAll(int file, const char* data, int size) {
+    int written = 0;
+    while (written < size) {
+        ssize_t result = write(file, &data[written], size - written);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result < 1) {
+            return ERROR;
+        }
+        written += result;
+    }
+    return SUCCESS;
+}
+
+// Replays the records on the log from the start position, and returns the size of the valid part of the log
+// Counts the records replayed on nRecords
+// Returns ERROR if the log can't be read or a record can't be applied
+long long replayLog(long long start, LogReplayCallback replay, long long* nRecords) {
+    char* buffer = malloc(LOG_READ_SIZE);
+    errIfNull(buffer);
+
+    long long validSize = start;
+    int length = 0;
+    bool endOfFile = false;
+    while (!endOfFile) {
+        ssize_t bytesRead = read(logFile, &buffer[length], LOG_READ_SIZE - length);
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead == -1) {
+            free(buffer);
+            return ERROR;
+        }
+        endOfFile = bytesRead == 0;
+        length += bytesRead;
+
+        // Apply every complete record on the buffer
+        int consumed = 0;
+        while (length - consumed >= LOG_RECORD_HEADER_SIZE) {
+            char* record = &buffer[consumed];
+            int recordLength = fromBin(&record[0]);
+            if (recordLength < LOG_RECORD_HEADER_SIZE || recordLength > LOG_RECORD_MAX_SIZE) {
+                // Torn or corrupted, nothing after it can be trusted
+                endOfFile = true;
+                break;
+            }
+            if (recordLength > length - consumed) {
+                break;
+            }
+            uint32_t checksum = (uint32_t)fromBin(&record[4]);
+            if (crc32(0, &record[8], recordLength - 8) != checksum) {
+                endOfFile = true;
+                break;
+            }
+            consumed += recordLength;
+            validSize += recordLength;
+            if (replay(record[8], &record[LOG_RECORD_HEADER_SIZE], recordLength - LOG_RECORD_HEADER_SIZE, validSize) == ERROR) {
+                free(buffer);
+                return ERROR;
+            }
+            (*nRecords)++;
+        }
+        memmove(buffer, &buffer[consumed], length - consumed);
+        length -= consumed;
+    }
+
+    free(buffer);
+    return validSize;
+}
+
+long long openLog(bool reset, long long replayFrom, LogReplayCallback replay) {
+    int flags = O_RDWR | O_CREAT;
+    if (reset) {
+        flags |= O_TRUNC;
+    }
+    logFile = open(LOG_FILE_NAME, flags, 0644);
+    raiseIfError(logFile);
+    // Builds the crc table now, before the workers can race to build it
+    crc32(0, NULL, 0);
+
+    logSize = 0;
+    long long nRecords = 0;
+    if (!reset) {
+        off_t fileSize = lseek(logFile, 0, SEEK_END);
+        if (fileSize < replayFrom || lseek(logFile, replayFrom, SEEK_SET) == -1) {
+            return ERROR;
+        }
+        logSize = replayLog(replayFrom, replay, &nRecords);
+        raiseIfError(logSize);
+        // Drop the torn tail, so new records go right after the last valid one
+        raiseIfError(ftruncate(logFile, logSize));
+    }
+    if (lseek(logFile, logSize, SEEK_SET) == -1) {
+        return ERROR;
+    }
+    syncedSize = logSize;
+    return nRecords;
+}
+
+long long getLogEnd() {
+    pthread_mutex_lock(&logLock);
+    long long end = logSize + logBufferLength;
+    pthread_mutex_unlock(&logLock);
+    return end;
+}
+
+// Makes room for the record on the buffer, called with the log lock held
+int reserveLogBuffer(int recordLength) {
+    if (logBufferLength + recordLength > logBufferCapacity) {
+        int newCapacity = logBufferCapacity == 0 ? LOG_BUFFER_SIZE : logBufferCapacity * 2;
+        char* grown = realloc(logBuffer, newCapacity);
+        errIfNull(grown);
+        logBuffer = grown;
+        logBufferCapacity = newCapacity;
+    }
+    return SUCCESS;
+}
+
+int buildLogRecord(char* record, char type, const char* payload, int payloadSize) {
+    int recordLength = LOG_RECORD_HEADER_SIZE + payloadSize;
+    if (recordLength > LOG_RECORD_MAX_SIZE) {
+        return ERROR;
+    }
+    toBin(recordLength, &record[0]);
+    record[8] = type;
+    memcpy(&record[LOG_RECORD_HEADER_SIZE], payload, payloadSize);
+    toBin((int)crc32(0, &record[8], recordLength - 8), &record[4]);
+    return recordLength;
+}
+
+long long appendLogRecord(char type, const char* payload, int payloadSize) {
+    // The record is built outside the lock, only the copy to the buffer is serialized
+    char record[LOG_RECORD_MAX_SIZE];
+    int recordLength = buildLogRecord(record, type, payload, payloadSize);
+    raiseIfError(recordLength);
+
+    pthread_mutex_lock(&logLock);
+    long long lsn = ERROR;
+    if (reserveLogBuffer(recordLength) != ERROR) {
+        memcpy(&logBuffer[logBufferLength], record, recordLength);
+        logBufferLength += recordLength;
+        logBufferRecords++;
+        lsn = logSize + logBufferLength;
+    }
+    pthread_mutex_unlock(&logLock);
+    return lsn;
+}
+
+int commitLog(bool sync) {
+    // The sync runs outside the lock, so the workers keep appending while it waits for the disk
+    pthread_mutex_lock(&logLock);
+    int records = logBufferRecords;
+    int writeResult = SUCCESS;
+    if (logBufferLength > 0) {
+        writeResult = writeAll(logFile, logBuffer, logBufferLength);
+        if (writeResult != ERROR) {
+            logSize += logBufferLength;
+            logBufferLength = 0;
+            logBufferRecords = 0;
+        }
+    }
+    long long writtenSize = logSize;
+    bool unsynced = writtenSize > syncedSize;
+    pthread_mutex_unlock(&logLock);
+    raiseIfError(writeResult);
+    if (sync && unsynced) {
+        raiseIfError(fdatasync(logFile));
+        pthread_mutex_lock(&logLock);
+        if (writtenSize > syncedSize) {
+            syncedSize = writtenSize;
+        }
+        pthread_mutex_unlock(&logLock);
+    }
+    return records;
+}
+
+void closeLog() {
+    if (logFile != ERROR) {
+        commitLog(false);
+        close(logFile);
+        logFile = ERROR;
+    }
+    free(logBuffer);
+    logBuffer = NULL;
+    logBufferLength = 0;
+    logBufferCapacity = 0;
+    logBufferRecords = 0;
+    syncedSize = 0;
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef DB_MAPPED_H
+#define DB_MAPPED_H
+
+// Header file for the memory mapped database
+// Keeps every user on a fixed size slot of a single preallocated file,
+// and maps the whole file, so reads and updates are plain memory accesses
+// The slots are found through the user index, rebuilt from the file on startup
+// New users take the next free slot, and the file doubles when it's full
+// The changed slots are flushed to the disk with msync when they're committed
+// A single file descriptor is used, no matter how many users there are
+// The slots have the User struct as it is on memory, tagged with USER_SCHEMA_VERSION,
+// so a file written with another layout is refused on startup
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "account.h"
+#include "dbCommit.h"
+#include "dbLocks.h"
+#include "userIndex.h"
+
+#define MAPPED_FILE_NAME "data/users.bin"
+#define MAPPED_INITIAL_SLOTS 1024
+
+// Map options
+#define MAP_OPTION_POPULATE 1
+#define MAP_OPTION_HUGEPAGES 2
+
+typedef struct MAPPED_SLOT {
+    // USER_SCHEMA_VERSION if the slot has a user
+    // Slots start zeroed, so a new file has no users
+    int schema;
+    User user;
+} MappedSlot;
+
+int mappedFile = ERROR;
+MappedSlot* mappedSlots = NULL;
+size_t mappedSize = 0;
+int mappedSlotsCount = 0, mappedSlotsCapacity = 0;
+int mappedOptions = 0;
+UserIndex mappedIndex;
+
+// Returns the map options on a comma separated list, like "populate,hugepages"
+// Returns ERROR if an option is unknown
+int getMapOptions(const char* list);
+
+// Opens and maps the users file, creating it with the initial slots
+// If reset is set the file is emptied and the database starts without users
+// populate reads the whole file into memory on startup, hugepages asks for transparent huge pages
+// Returns ERROR if the file can't be created or mapped, or has users with another schema
+int openMappedDb(bool reset, int options);
+
+// Returns the slot of the user on the file
+// Returns ERROR if the user doesn't exist
+int getMappedSlot(int id);
+
+// Returns FILE_NOT_FOUND if the user doesn't exist
+int readUserMapped(User* user, int id);
+
+// Creates or resets the user
+// Returns ERROR if the file can't grow
+int writeUserMapped(User* user);
+
+// Same results as updateUserFile
+int updateUserMapped(int id, Transaction* transaction, User* user);
+
+// Flushes and unmaps the file
+void closeMappedDb();
+
+int getMapOptions(const char* list) {
+    int options = 0;
+    const char* option = list;
+    while (*option != '\0') {
+        int length = strcspn(option, ",");
+        if (length == 8 && strncmp(option, "populate", length) == 0) {
+            options |= MAP_OPTION_POPULATE;
+        } else if (length == 9 && strncmp(option, "hugepages", length) == 0) {
+            options |= MAP_OPTION_HUGEPAGES;
+        } else if (length > 0) {
+            return ERROR;
+        }
+        option += length;
+        if (*option == ',') {
+            option++;
+        }
+    }
+    return options;
+}
+
+// Flushes the pages of the changed slots
+int commitMappedDb(bool sync, const int* slots, int nSlots) {
+    if (!sync) {
+        // The kernel writes the pages back on its own
+        return nSlots;
+    }
+    long pageSize = sysconf(_SC_PAGESIZE);
+    // A new user can move the map, so it's kept in place while it's flushed
+    lockStorageRead();
+    int result = nSlots;
+    for (int i = 0; i < nSlots; i++) {
+        // msync needs the start aligned to a page
+        uintptr_t start = (uintptr_t)&mappedSlots[slots[i]];
+        uintptr_t end = start + sizeof(MappedSlot);
+        start -= start % pageSize;
+        if (msync((void*)start, end - start, MS_SYNC) == -1) {
+            result = ERROR;
+            break;
+        }
+    }
+    unlockStorage();
+    return result;
+}
+
+// Sizes the file for the number of slots, and maps all of it
+// The slots move to a new address, so no pointer to a slot can be kept across this call
+int mapSlots(int capacity) {
+    // Reserve the blocks now, so a full disk fails here instead of on a write to the map
+    size_t size = (size_t)capacity * sizeof(MappedSlot);
+    if (posix_fallocate(mappedFile, 0, size) != 0) {
+        return ERROR;
+    }
+
+    int mapFlags = MAP_SHARED;
+    if (mappedOptions & MAP_OPTION_POPULATE) {
+        mapFlags |= MAP_POPULATE;
+    }
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, mapFlags, mappedFile, 0);
+    if (map == MAP_FAILED) {
+        return ERROR;
+    }
+    if ((mappedOptions & MAP_OPTION_HUGEPAGES) && madvise(map, size, MADV_HUGEPAGE) == -1) {
+        // Not every filesystem can back a file with huge pages
+        log("{ Huge pages not available for the users file }\n");
+    }
+
+    if (mappedSlots != NULL) {
+        munmap(mappedSlots, mappedSize);
+    }
+    mappedSlots = (MappedSlot*)map;
+    mappedSize = size;
+    mappedSlotsCapacity = capacity;
+    return SUCCESS;
+}
+
+int openMappedDb(bool reset, int options) {
+    int flags = O_RDWR | O_CREAT;
+    if (reset) {
+        flags |= O_TRUNC;
+    }
+    mappedFile = open(MAPPED_FILE_NAME, flags, 0644);
+    raiseIfError(mappedFile);
+    mappedOptions = options;
+
+    off_t fileSize = lseek(mappedFile, 0, SEEK_END);
+    if (fileSize == -1) {
+        return ERROR;
+    }
+    int capacity = MAPPED_INITIAL_SLOTS;
+    while ((off_t)capacity * (off_t)sizeof(MappedSlot) < fileSize) {
+        capacity *= 2;
+    }
+    raiseIfError(mapSlots(capacity));
+
+    // The slots are taken in order, so the used ones are all at the start
+    raiseIfError(initUserIndex(&mappedIndex));
+    mappedSlotsCount = 0;
+    while (mappedSlotsCount < mappedSlotsCapacity && mappedSlots[mappedSlotsCount].schema != 0) {
+        if (mappedSlots[mappedSlotsCount].schema != USER_SCHEMA_VERSION) {
+            fprintf(stderr, "{ The users file has the schema %d, start with --reset }\n", mappedSlots[mappedSlotsCount].schema);
+            return ERROR;
+        }
+        raiseIfError(addUserSlot(&mappedIndex, mappedSlots[mappedSlotsCount].user.id, mappedSlotsCount));
+        mappedSlotsCount++;
+    }
+
+    commitCallback = commitMappedDb;
+    return SUCCESS;
+}
+
+int getMappedSlot(int id) {
+    return findUserSlot(&mappedIndex, id);
+}
+
+int readUserMapped(User* user, int id) {
+    int slot = getMappedSlot(id);
+    if (slot == ERROR) {
+        return FILE_NOT_FOUND;
+    }
+    *user = mappedSlots[slot].user;
+    return SUCCESS;
+}
+
+int writeUserMapped(User* user) {
+    if (user->id < 0) {
+        return ERROR;
+    }
+    int slot = getMappedSlot(user->id);
+    if (slot == ERROR) {
+        if (mappedSlotsCount == mappedSlotsCapacity) {
+            raiseIfError(mapSlots(mappedSlotsCapacity * 2));
+        }
+        slot = mappedSlotsCount;
+        raiseIfError(addUserSlot(&mappedIndex, user->id, slot));
+        mappedSlotsCount++;
+    }
+    mappedSlots[slot].user = *user;
+    mappedSlots[slot].schema = USER_SCHEMA_VERSION;
+    return markUncommitted(slot);
+}
+
+int updateUserMapped(int id, Transaction* transaction, User* user) {
+    int slot = getMappedSlot(id);
+    if (slot == ERROR) {
+        return FILE_NOT_FOUND;
+    }
+    int transactionResult = addTransaction(&mappedSlots[slot].user, transaction);
+    *user = mappedSlots[slot].user;
+    if (transactionResult == SUCCESS) {
+        raiseIfError(markUncommitted(slot));
+    }
+    return transactionResult;
+}
+
+void closeMappedDb() {
+    if (mappedSlots != NULL) {
+        msync(mappedSlots, mappedSize, MS_SYNC);
+        munmap(mappedSlots, mappedSize);
+        mappedSlots = NULL;
+    }
+    freeUserIndex(&mappedIndex);
+    if (mappedFile != ERROR) {
+        close(mappedFile);
+        mappedFile = ERROR;
+    }
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef DB_MEMORY_H
+#define DB_MEMORY_H
+
+// Header file for the in-memory database
+// Keeps every user on a contiguous array, so reads never touch the kernel
+// The users are found on the array through the user index, and new users are added to the end
+// Every change is appended to the write-ahead log before it's applied, and the array is rebuilt on startup
+// from the last checkpoint and the log written after it, see dbCheckpoint.h
+
+#include "account.h"
+#include "dbCheckpoint.h"
+#include "dbCommit.h"
+#include "dbLocks.h"
+#include "dbLog.h"
+#include "userIndex.h"
+
+#define MEMORY_USERS_INITIAL_CAPACITY 1024
+
+typedef struct RECOVERY_STATS {
+    int checkpointUsers;
+    long long logRecords;
+    long long checkpointMs, logMs;
+} RecoveryStats;
+
+User* memoryUsers = NULL;
+// Log sequence number of the last change applied to each user
+long long* memoryLsns = NULL;
+int memoryUsersCount = 0, memoryUsersCapacity = 0;
+UserIndex memoryIndex;
+RecoveryStats memoryRecovery = {0};
+
+// Opens the log and rebuilds the users from the last checkpoint and the log
+// If reset is set the log and the checkpoint are emptied and the database starts without users
+// A corrupted checkpoint is ignored, and the users are rebuilt from the whole log
+// Returns ERROR if the log can't be opened or replayed
+int openMemoryDb(bool reset);
+
+// Writes a checkpoint of every user, while the workers keep running
+// Returns ERROR if the checkpoint can't be written, the previous one is kept
+int checkpointMemoryDb();
+
+// Returns the slot of the user on the array
+// Returns ERROR if the user doesn't exist
+int getMemorySlot(int id);
+
+// Returns FILE_NOT_FOUND if the user doesn't exist
+int readUserMemory(User* user, int id);
+
+// Creates or resets the user
+// Returns ERROR if it fails to write to the log, or the array can't grow
+int writeUserMemory(User* user);
+
+// Same results as updateUserFile
+// Returns ERROR if it fails to write to the log, the user is left unchanged
+int updateUserMemory(int id, Transaction* transaction, User* user);
+
+// Closes the log
+void closeMemoryDb();
+
+int getMemorySlot(int id) {
+    return findUserSlot(&memoryIndex, id);
+}
+
+// Stores the user on its slot, or on a new slot at the end of the array
+// lsn is the log sequence number of the change
+// Returns the slot, or ERROR if the array can't grow
+int putMemoryUser(User* user, long long lsn) {
+    int slot = getMemorySlot(user->id);
+    if (slot != ERROR) {
+        memoryUsers[slot] = *user;
+        memoryLsns[slot] = lsn;
+        return slot;
+    }
+    if (memoryUsersCount == memoryUsersCapacity) {
+        int newCapacity = memoryUsersCapacity == 0 ? MEMORY_USERS_INITIAL_CAPACITY : memoryUsersCapacity * 2;
+        User* grown = realloc(memoryUsers, (size_t)newCapacity * sizeof(User));
+        errIfNull(grown);
+        memoryUsers = grown;
+        long long* grownLsns = realloc(memoryLsns, (size_t)newCapacity * sizeof(long long));
+        errIfNull(grownLsns);
+        memoryLsns = grownLsns;
+        memoryUsersCapacity = newCapacity;
+    }
+    slot = memoryUsersCount;
+    raiseIfError(addUserSlot(&memoryIndex, user->id, slot));
+    memoryUsers[slot] = *user;
+    memoryLsns[slot] = lsn;
+    memoryUsersCount++;
+    return slot;
+}
+
+// Applies a log record to the users, unless the user loaded from the checkpoint already has it
+int replayMemoryRecord(char type, const char* payload, int payloadSize, long long lsn) {
+    if (type == LOG_RECORD_WRITE) {
+        User user;
+        if (deserializeUser(payload, payloadSize, &user) != payloadSize || user.id < 0) {
+            return ERROR;
+        }
+        int slot = getMemorySlot(user.id);
+        if (slot != ERROR && memoryLsns[slot] >= lsn) {
+            return SUCCESS;
+        }
+        return putMemoryUser(&user, lsn) == ERROR ? ERROR : SUCCESS;
+    }
+
+    if (type == LOG_RECORD_UPDATE && payloadSize > 4) {
+        int slot = getMemorySlot(fromBin((char*)&payload[0]));
+        if (slot == ERROR) {
+            return ERROR;
+        }
+        if (memoryLsns[slot] >= lsn) {
+            return SUCCESS;
+        }
+        Transaction transaction;
+        if (deserializeTransaction(&payload[4], payloadSize - 4, &transaction) != payloadSize - 4) {
+            return ERROR;
+        }
+
+        // Only the accepted transactions are logged, so they're accepted again
+        memoryLsns[slot] = lsn;
+        return addTransaction(&memoryUsers[slot], &transaction) == SUCCESS ? SUCCESS : ERROR;
+    }
+
+    log("{ Unknown log record %c }\n", type);
+    return ERROR;
+}
+
+// Writes the buffered log records, the log has every change so the slots aren't needed
+int commitMemoryDb(bool sync, const int* slots, int nSlots) {
+    (void)slots;
+    (void)nSlots;
+    return commitLog(sync);
+}
+
+// Adds a user loaded from the checkpoint
+int loadMemoryUser(const CheckpointEntry* entry) {
+    if (entry->user.id < 0) {
+        return ERROR;
+    }
+    User user = entry->user;
+    raiseIfError(putMemoryUser(&user, entry->lsn));
+    memoryRecovery.checkpointUsers++;
+    return SUCCESS;
+}
+
+// Drops every user, to rebuild them from the start
+void clearMemoryUsers() {
+    freeUserIndex(&memoryIndex);
+    free(memoryUsers);
+    free(memoryLsns);
+    memoryUsers = NULL;
+    memoryLsns = NULL;
+    memoryUsersCount = 0;
+    memoryUsersCapacity = 0;
+}
+
+int openMemoryDb(bool reset) {
+    memoryUsersCount = 0;
+    memset(&memoryRecovery, 0, sizeof(RecoveryStats));
+    raiseIfError(initUserIndex(&memoryIndex));
+    commitCallback = commitMemoryDb;
+
+    long long replayFrom = 0;
+    if (reset) {
+        removeCheckpoint();
+    } else {
+        long long start = getCurrentTimeMs();
+        replayFrom = loadCheckpoint(loadMemoryUser);
+        if (replayFrom == ERROR) {
+            log("{ The checkpoint is corrupted, replaying the whole log }\n");
+            clearMemoryUsers();
+            raiseIfError(initUserIndex(&memoryIndex));
+            memoryRecovery.checkpointUsers = 0;
+            replayFrom = 0;
+        }
+        memoryRecovery.checkpointMs = getCurrentTimeMs() - start;
+    }
+
+    long long start = getCurrentTimeMs();
+    memoryRecovery.logRecords = openLog(reset, replayFrom, replayMemoryRecord);
+    memoryRecovery.logMs = getCurrentTimeMs() - start;
+    raiseIfError(memoryRecovery.logRecords);
+    return SUCCESS;
+}
+
+int checkpointMemoryDb() {
+    CheckpointWriter writer;
+    raiseIfError(beginCheckpoint(&writer, getLogEnd()));
+    CheckpointEntry* entries = malloc(CHECKPOINT_BATCH_USERS * sizeof(CheckpointEntry));
+    if (entries == NULL) {
+        abortCheckpoint(&writer);
+        return ERROR;
+    }
+
+    // The storage is only locked for a batch at a time, so new users don't wait for the whole checkpoint
+    int slot = 0;
+    while (true) {
+        int count = 0;
+        lockStorageRead();
+        while (count < CHECKPOINT_BATCH_USERS && slot < memoryUsersCount) {
+            int id = memoryUsers[slot].id;
+            unsigned int sequence;
+            do {
+                sequence = beginUserRead(id);
+                entries[count].user = memoryUsers[slot];
+                entries[count].lsn = memoryLsns[slot];
+            } while (userReadRaced(id, sequence));
+            count++;
+            slot++;
+        }
+        unlockStorage();
+        if (count == 0) {
+            break;
+        }
+        if (writeCheckpointEntries(&writer, entries, count) == ERROR) {
+            free(entries);
+            abortCheckpoint(&writer);
+            return ERROR;
+        }
+    }
+    free(entries);
+
+    // The copies may have changes that are still on the log buffer
+    if (commitLog(true) == ERROR) {
+        abortCheckpoint(&writer);
+        return ERROR;
+    }
+    return finishCheckpoint(&writer);
+}
+
+int readUserMemory(User* user, int id) {
+    int slot = getMemorySlot(id);
+    if (slot == ERROR) {
+        return FILE_NOT_FOUND;
+    }
+    *user = memoryUsers[slot];
+    return SUCCESS;
+}
+
+int writeUserMemory(User* user) {
+    if (user->id < 0) {
+        return ERROR;
+    }
+    char payload[USER_SERIALIZED_MAX_SIZE];
+    int payloadSize = serializeUser(user, payload);
+    long long lsn = appendLogRecord(LOG_RECORD_WRITE, payload, payloadSize);
+    raiseIfError(lsn);
+
+    int slot = putMemoryUser(user, lsn);
+    raiseIfError(slot);
+    return markUncommitted(slot);
+}
+
+int updateUserMemory(int id, Transaction* transaction, User* user) {
+    int slot = getMemorySlot(id);
+    if (slot == ERROR) {
+        return FILE_NOT_FOUND;
+    }
+
+    // The transaction is applied to a copy, and only kept once it's on the log
+    *user = memoryUsers[slot];
+    int transactionResult = addTransaction(user, transaction);
+    if (transactionResult != SUCCESS) {
+        return transactionResult;
+    }
+
+    // 'u' id(4) and the serialized transaction
+    char payload[4 + TRANSACTION_SERIALIZED_MAX_SIZE];
+    toBin(id, &payload[0]);
+    int payloadSize = 4 + serializeTransaction(transaction, &payload[4]);
+    long long lsn = appendLogRecord(LOG_RECORD_UPDATE, payload, payloadSize);
+    raiseIfError(lsn);
+
+    memoryUsers[slot] = *user;
+    memoryLsns[slot] = lsn;
+    return markUncommitted(slot);
+}
+
+void closeMemoryDb() {
+    closeLog();
+    clearMemoryUsers();
+}
+
+#endif
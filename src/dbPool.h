@@ -0,0 +1,175 @@
+#ifndef DB_POOL_H
+#define DB_POOL_H
+
+// Header file for the database connection pool
+// Each worker keeps a few connections to the database, and sends each request to the
+// connection with the fewest requests waiting, so a slow response doesn't hold every client back
+// Connections that fail are reconnected with an exponential backoff
+
+#include "dbClient.h"
+#include "eventLoop.h"
+
+// Default number of connections of each worker
+#define DB_POOL_DEFAULT_SIZE 2
+#define DB_POOL_MAX_SIZE 64
+
+// Reconnection backoff, doubled on each failed attempt
+#define DB_RECONNECT_MIN_DELAY_MS 50
+#define DB_RECONNECT_MAX_DELAY_MS 5000
+
+struct DB_POOL {
+    DbConnection connections[DB_POOL_MAX_SIZE];
+    int size;
+    int port;
+    // See dbTransport.h
+    int transport;
+    // Where to start looking for the least loaded connection, so ties are spread
+    int nextConnection;
+};
+
+// Connects size connections to the database on the given port with the transport, and adds them to the loop
+// Connections that fail are reconnected later by maintainDbPool
+// Returns ERROR if none of the connections could be made
+int setupDbPool(DbPool* pool, EventLoop* loop, int port, int transport, int size);
+
+// Returns the connected connection with the fewest requests waiting for a response
+// Returns NULL if every connection is down
+DbConnection* pickDbConnection(DbPool* pool);
+
+// Returns the connection that uses the socket
+// Returns NULL if the socket is not from the pool
+DbConnection* findDbConnection(DbPool* pool, int socket);
+
+// Reconnects the connections that are down and due for a new attempt
+// Returns how many milliseconds the loop can wait before the next attempt, or WAIT_FOREVER if every connection is up
+int maintainDbPool(DbPool* pool, EventLoop* loop);
+
+// Sends the requests queued on every connection, once per event loop iteration
+// A connection that fails to send is closed, and its requests are called back with ERROR
+void flushDbPool(DbPool* pool);
+
+// Prints the health and the requests in flight of each connection
+void printDbPoolStats(DbPool* pool, FILE* output);
+
+// Returns the delay before the next reconnection attempt
+int getReconnectDelay(int failedConnects) {
+    int delay = DB_RECONNECT_MIN_DELAY_MS;
+    for (int i = 0; i < failedConnects && delay < DB_RECONNECT_MAX_DELAY_MS; i++) {
+        delay *= 2;
+    }
+    return delay < DB_RECONNECT_MAX_DELAY_MS ? delay : DB_RECONNECT_MAX_DELAY_MS;
+}
+
+// Tries to connect, and adds the connection to the loop if it succeeds
+int openDbConnection(DbConnection* db, EventLoop* loop, int port, int transport) {
+    if (connectToDb(db, port, transport) == ERROR) {
+        db->failedConnects++;
+        db->reconnectAt = getCurrentTimeMs() + getReconnectDelay(db->failedConnects);
+        return ERROR;
+    }
+    if (watchDbConnection(loop, db->socket) == ERROR) {
+        closeDbConnection(db);
+        db->failedConnects++;
+        db->reconnectAt = getCurrentTimeMs() + getReconnectDelay(db->failedConnects);
+        return ERROR;
+    }
+    db->failedConnects = 0;
+    return SUCCESS;
+}
+
+int setupDbPool(DbPool* pool, EventLoop* loop, int port, int transport, int size) {
+    pool->size = size;
+    pool->port = port;
+    pool->transport = transport;
+    pool->nextConnection = 0;
+
+    int connected = 0;
+    for (int i = 0; i < size; i++) {
+        initDbConnection(&pool->connections[i], pool);
+        if (openDbConnection(&pool->connections[i], loop, port, transport) == SUCCESS) {
+            connected++;
+        }
+    }
+    return connected > 0 ? SUCCESS : ERROR;
+}
+
+DbConnection* pickDbConnection(DbPool* pool) {
+    DbConnection* leastLoaded = NULL;
+    for (int i = 0; i < pool->size; i++) {
+        DbConnection* db = &pool->connections[(pool->nextConnection + i) % pool->size];
+        if (db->socket == ERROR) {
+            continue;
+        }
+        if (leastLoaded == NULL || db->pendingCount < leastLoaded->pendingCount) {
+            leastLoaded = db;
+        }
+    }
+    pool->nextConnection = (pool->nextConnection + 1) % pool->size;
+    return leastLoaded;
+}
+
+DbConnection* findDbConnection(DbPool* pool, int socket) {
+    for (int i = 0; i < pool->size; i++) {
+        if (pool->connections[i].socket == socket) {
+            return &pool->connections[i];
+        }
+    }
+    return NULL;
+}
+
+int maintainDbPool(DbPool* pool, EventLoop* loop) {
+    long long now = getCurrentTimeMs();
+    long long nextAttempt = -1;
+    for (int i = 0; i < pool->size; i++) {
+        DbConnection* db = &pool->connections[i];
+        if (db->socket != ERROR) {
+            continue;
+        }
+        // Just went down, schedule the first attempt
+        if (db->reconnectAt == 0) {
+            db->reconnectAt = now + getReconnectDelay(db->failedConnects);
+        }
+        if (db->reconnectAt <= now) {
+            log("{ Reconnecting to db, attempt %d }\n", db->failedConnects + 1);
+            if (openDbConnection(db, loop, pool->port, pool->transport) == SUCCESS) {
+                db->reconnects++;
+                continue;
+            }
+        }
+        if (nextAttempt == -1 || db->reconnectAt < nextAttempt) {
+            nextAttempt = db->reconnectAt;
+        }
+    }
+    if (nextAttempt == -1) {
+        return WAIT_FOREVER;
+    }
+    return nextAttempt > now ? (int)(nextAttempt - now) : 0;
+}
+
+void flushDbPool(DbPool* pool) {
+    // The callbacks of a closed connection may queue requests on the connections already flushed
+    bool queued = true;
+    while (queued) {
+        queued = false;
+        for (int i = 0; i < pool->size; i++) {
+            DbConnection* db = &pool->connections[i];
+            if (db->socket != ERROR && db->batchCount > 0 && flushDbBatch(db) == ERROR) {
+                closeDbConnection(db);
+                queued = true;
+            }
+        }
+    }
+}
+
+void printDbPoolStats(DbPool* pool, FILE* output) {
+    for (int i = 0; i < pool->size; i++) {
+        DbConnection* db = &pool->connections[i];
+        fprintf(output,
+                "{ db connection %d: %s, in flight %d, sent %lu in %lu frames, answered %lu, failed %lu, reconnects %d }\n",
+                i, db->socket == ERROR ? "down" : "up", db->pendingCount, db->requestsSent, db->framesSent,
+                db->responsesReceived, db->requestsFailed, db->reconnects);
+    }
+    fflush(output);
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef DB_PROTOCOL_H
+#define DB_PROTOCOL_H
+
+// Header file for the api <-> db protocol
+// Every message is a frame with a fixed header followed by binary fields
+// The length on the header lets the frames be found on a stream, no matter how tcp splits or joins them
+// The request id is copied to the response, so many requests can be sent on one connection
+// and the responses matched to them in any order
+//
+// Header, all numbers little endian:
+// length(4) - size of the whole frame, header included
+// version(1) - DB_PROTOCOL_VERSION
+// method(1) - 'c', 'r', 'u', 'b' or '0'
+// status(2) - result code on responses, 0 on requests
+// requestId(4) - chosen by the client, copied to the response
+//
+// Requests:
+// 'c' id(4) limit(4)
+// 'r' id(4) maxTransactions(1) [version(8)] - only the newest maxTransactions transactions are sent, 0 for the balance only
+//     with a version, the user is only sent if it changed since that version
+// 'u' id(4) valor(4) tipo(1) descricaoLength(1) descricao(descricaoLength)
+// 'b' count(2) and count operations of method(1) payloadLength(1) payload, the payload of a 'c', 'r' or 'u' request
+// '0' close the connection
+//
+// Responses:
+// 'c' and '0' only have the status
+// 'r' has version(8) and the serialized user if the status is SUCCESS, see serializeUserProjection
+//     only version(8) if the status is NOT_MODIFIED
+// 'u' has total(4) limit(4) version(8) if the status is SUCCESS, all the api answers a transaction with
+// 'b' count(2) and a result for each operation, in order, of status(2) payloadLength(2) payload
+//
+// A batch runs many operations in one round trip, the api sends all it has at the end of each event loop iteration
+// The operations take the request ids from the batch request id on, so each one is matched on its own
+// The reply must fit on a frame, so a batch only takes operations while their biggest replies fit, see getResultReserve
+// The batch status is ERROR, without results, if they don't
+//
+// The version of a user moves on each of its changes, and the versions of a db run never match the ones of another run
+// The api keeps what it rendered of a user with its version, and sends the version on its next read,
+// so a user that didn't change isn't sent or rendered again, see extratoCache.h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "helpers.h"
+
+// 5 since the user versions
+#define DB_PROTOCOL_VERSION 5
+
+#define DB_FRAME_HEADER_SIZE 12
+// Frames can't be bigger than the connection read buffer
+#define DB_FRAME_MAX_SIZE 8 * 1024
+
+#define DB_METHOD_CREATE 'c'
+#define DB_METHOD_READ 'r'
+#define DB_METHOD_UPDATE 'u'
+#define DB_METHOD_BATCH 'b'
+#define DB_METHOD_CLOSE '0'
+
+// count(2)
+#define DB_BATCH_HEADER_SIZE 2
+// method(1) payloadLength(1)
+#define DB_BATCH_OPERATION_HEADER_SIZE 2
+// status(2) payloadLength(2)
+#define DB_BATCH_RESULT_HEADER_SIZE 4
+// Biggest payload of an operation
+#define DB_BATCH_OPERATION_MAX_SIZE 255
+
+// Size of total(4) limit(4) on the 'u' response payload
+#define DB_BALANCE_SIZE 8
+// Size of the version on the 'r' and 'u' response payloads
+#define DB_VERSION_SIZE 8
+// Never the version of a user, their stripe sequences are even when read
+#define DB_NO_VERSION -1
+// Biggest payload of a 'c', 'r' or 'u' response
+#define DB_REPLY_MAX_SIZE (DB_VERSION_SIZE + USER_SERIALIZED_MAX_SIZE)
+
+typedef struct DB_FRAME_HEADER {
+    int length;
+    char version;
+    char method;
+    int status;
+    uint32_t requestId;
+} DbFrameHeader;
+
+// Writes the header on the start of the frame
+// payloadSize is the size of the fields after the header
+// Returns the size of the whole frame
+int writeFrameHeader(char* frame, char method, int status, uint32_t requestId, int payloadSize);
+
+// Reads the header of the first frame on the buffer
+// Returns 0 if the frame is not complete yet
+// Returns ERROR if the frame is invalid, or has an unknown version
+// Returns the size of the frame if it's complete
+int readFrameHeader(const char* buffer, int length, DbFrameHeader* header);
+
+// Writes the total and the limit of the user, the 'u' response payload
+// Returns DB_BALANCE_SIZE
+int serializeBalance(const User* user, char* payload);
+
+// Reads the 'u' response payload into the user, the other fields are left empty
+// Returns ERROR if the payload is too short
+int deserializeBalance(const char* payload, int size, User* user);
+
+// Returns the size of the biggest result of an operation with the method on a batch reply
+// Returns ERROR if the method can't be on a batch
+int getResultReserve(char method);
+
+// Returns the index of the method among the operations, 0 for 'c', 1 for 'r' and 2 for 'u'
+// Returns ERROR for the other methods
+int getMethodIndex(char method);
+
+// Writes a 16 bit number, little endian
+void toBin16(int value, char* bin);
+
+// Reads a 16 bit signed number, little endian
+int fromBin16(const char* bin);
+
+int serializeBalance(const User* user, char* payload) {
+    toBin(user->total, &payload[0]);
+    toBin(user->limit, &payload[4]);
+    return DB_BALANCE_SIZE;
+}
+
+int deserializeBalance(const char* payload, int size, User* user) {
+    if (size < DB_BALANCE_SIZE) {
+        return ERROR;
+    }
+    memset(user, 0, offsetof(User, transactions));
+    user->total = fromBin((char*)&payload[0]);
+    user->limit = fromBin((char*)&payload[4]);
+    return DB_BALANCE_SIZE;
+}
+
+int getResultReserve(char method) {
+    switch (method) {
+        case DB_METHOD_CREATE:
+            return DB_BATCH_RESULT_HEADER_SIZE;
+        case DB_METHOD_READ:
+            return DB_BATCH_RESULT_HEADER_SIZE + DB_REPLY_MAX_SIZE;
+        case DB_METHOD_UPDATE:
+            return DB_BATCH_RESULT_HEADER_SIZE + DB_BALANCE_SIZE + DB_VERSION_SIZE;
+        default:
+            return ERROR;
+    }
+}
+
+int getMethodIndex(char method) {
+    switch (method) {
+        case DB_METHOD_CREATE:
+            return 0;
+        case DB_METHOD_READ:
+            return 1;
+        case DB_METHOD_UPDATE:
+            return 2;
+        default:
+            return ERROR;
+    }
+}
+
+void toBin16(int value, char* bin) {
+    bin[0] = (char)(value & 0xFF);
+    bin[1] = (char)((value >> 8) & 0xFF);
+}
+
+int fromBin16(const char* bin) {
+    return (int16_t)((unsigned char)bin[0] | ((unsigned char)bin[1] << 8));
+}
+
+int writeFrameHeader(char* frame, char method, int status, uint32_t requestId, int payloadSize) {
+    int frameLength = DB_FRAME_HEADER_SIZE + payloadSize;
+    toBin(frameLength, &frame[0]);
+    frame[4] = DB_PROTOCOL_VERSION;
+    frame[5] = method;
+    toBin16(status, &frame[6]);
+    toBin((int)requestId, &frame[8]);
+    return frameLength;
+}
+
+int readFrameHeader(const char* buffer, int length, DbFrameHeader* header) {
+    if (length < DB_FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    header->length = fromBin((char*)&buffer[0]);
+    header->version = buffer[4];
+    header->method = buffer[5];
+    header->status = fromBin16(&buffer[6]);
+    header->requestId = (uint32_t)fromBin((char*)&buffer[8]);
+
+    if (header->version != DB_PROTOCOL_VERSION) {
+        return ERROR;
+    }
+    if (header->length < DB_FRAME_HEADER_SIZE || header->length > DB_FRAME_MAX_SIZE) {
+        return ERROR;
+    }
+    if (header->length > length) {
+        return 0;
+    }
+    return header->length;
+}
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef DB_STORAGE_H
+#define DB_STORAGE_H
+
+// Header file for the database storage
+// Sends the reads and writes to the storage backend chosen on startup
+// files - one binary file per user
+// memory - every user in memory, with a write-ahead log to rebuild them on startup
+// mapped - every user on a slot of a single memory mapped file
+// The memory and mapped storages are committed following the durability policy, see dbCommit.h
+// Every access takes the storage locks, so the db workers can share the storage, see dbLocks.h
+// The storage is reset on startup, or recovered from what's on the disk, chosen with --reset or --recover
+
+#include <sys/stat.h>
+
+#include "dbFiles.h"
+#include "dbLocks.h"
+#include "dbMapped.h"
+#include "dbMemory.h"
+
+#define STORAGE_FILES 0
+#define STORAGE_MEMORY 1
+#define STORAGE_MAPPED 2
+
+// Seconds between checkpoints of the memory storage
+#define DEFAULT_CHECKPOINT_INTERVAL_S 60
+
+int storageMode = STORAGE_FILES;
+// Options of the mapped storage, see getMapOptions
+int mapOptions = 0;
+// Seconds between checkpoints of the memory storage, 0 disables them
+int checkpointIntervalS = DEFAULT_CHECKPOINT_INTERVAL_S;
+
+// Returns the storage mode with the given name
+// Returns ERROR if there's no storage with the name
+int getStorageMode(const char* name);
+
+// Creates the data folder and opens the storage
+// If reset is set the storage is emptied, and the initial users are created,
+// otherwise the users are recovered from the disk
+// Called before the workers start, prints how long it took
+// Returns ERROR if the storage can't be opened
+int setupStorage(int mode, bool reset);
+
+// Takes a checkpoint every checkpointIntervalS seconds, if the storage changed since the last one
+// Runs on its own thread, next to the workers, never returns
+void* runCheckpoints(void* arg);
+
+// Initializes the database with 5 users
+// Returns ERROR it fails to write a user to the file
+// Returns SUCCESS if the database was successfully initialized
+int initDb();
+
+// Returns the slot the storage keeps the user on, used to track its uncommitted changes
+// Returns ERROR if the user doesn't exist, or the storage has no commits
+int getStorageSlot(int id);
+
+// Sets the version of the copy on version, see getUserVersion
+// Returns FILE_NOT_FOUND if the user doesn't exist
+int readUser(User* user, int id, long long* version);
+
+// You should only use if this if it's a new user, or you want to reset the user
+// Instead of doing subsequent readUser and writeUser, use the updateUser function to update the user
+// The version of the user moves, like on a change
+// Returns ERROR if it fails to write the user
+int writeUser(User* user);
+
+// updates the user with the transaction
+// id is the user id
+// transaction is the transaction to be added to the user
+// user returns the updated user
+// writes the updated user to the user variable
+// version returns the version of the user after the change, see getUserVersion
+// returns SUCCESS if transaction was successful
+// returns ERROR if it fails to write the file or the log
+// returns FILE_NOT_FOUND if the user is not found
+// returns LIMIT_EXCEEDED_ERROR if the user has no limit
+// returns INVALID_TIPO_ERROR if the tipo is not valid
+int updateUserWithTransaction(int id, Transaction* transaction, User* user, long long* version);
+
+// Closes the files of the storage
+void closeStorage();
+
+int getStorageMode(const char* name) {
+    if (strcmp(name, "files") == 0) {
+        return STORAGE_FILES;
+    }
+    if (strcmp(name, "memory") == 0) {
+        return STORAGE_MEMORY;
+    }
+    if (strcmp(name, "mapped") == 0) {
+        return STORAGE_MAPPED;
+    }
+    return ERROR;
+}
+
+int setupStorage(int mode, bool reset) {
+    storageMode = mode;
+    initUserLocks();
+
+    long long start = getCurrentTimeMs();
+    log("{ Creating data folder }\n");
+    if (mkdir("data", 0755) == ERROR && errno != EEXIST) {
+        return ERROR;
+    }
+
+    if (storageMode == STORAGE_MEMORY) {
+        log("{ Replaying the log }\n");
+        raiseIfError(openMemoryDb(reset));
+    }
+    if (storageMode == STORAGE_MAPPED) {
+        log("{ Mapping the users file }\n");
+        raiseIfError(openMappedDb(reset, mapOptions));
+    }
+    if (reset) {
+        log("{ Resetting database }\n");
+        raiseIfError(initDb());
+        log("{ Database reset successfully }\n");
+    }
+    // The initial users are on disk before the first request
+    commitChanges();
+
+    printf("{ Storage %s in %lld ms }\n", reset ? "reset" : "recovered", getCurrentTimeMs() - start);
+    if (storageMode == STORAGE_MEMORY && !reset) {
+        printf("{ %d users from the checkpoint in %lld ms, %lld log records in %lld ms }\n",
+               memoryRecovery.checkpointUsers, memoryRecovery.checkpointMs, memoryRecovery.logRecords, memoryRecovery.logMs);
+    }
+    fflush(stdout);
+    return SUCCESS;
+}
+
+void* runCheckpoints(void* arg) {
+    (void)arg;
+    long long checkpointedLogEnd = ERROR;
+    while (true) {
+        sleep(checkpointIntervalS);
+        long long logEnd = getLogEnd();
+        if (logEnd == checkpointedLogEnd) {
+            continue;
+        }
+        long long start = getCurrentTimeMs();
+        if (checkpointMemoryDb() == ERROR) {
+            perror("Failed to write the checkpoint");
+            continue;
+        }
+        checkpointedLogEnd = logEnd;
+        log("{ Checkpoint written in %lld ms }\n", getCurrentTimeMs() - start);
+        (void)start;
+    }
+    return NULL;
+}
+
+int initDb() {
+    User user;
+    memset(&user, 0, sizeof(User));
+    user.total = 0;
+    user.nTransactions = 0;
+    user.oldestTransaction = 0;
+
+    for (int id = 0; id < numberInitialUsers; id++) {
+        user.id = id + 1;
+        user.limit = userInitialLimits[id];
+        int writeResult = writeUser(&user);
+        if (writeResult == ERROR) {
+            return ERROR;
+        }
+    }
+
+    return SUCCESS;
+}
+
+int getStorageSlot(int id) {
+    // Files are written on every change, nothing is held for them
+    int slot = ERROR;
+    lockStorageRead();
+    if (storageMode == STORAGE_MEMORY) {
+        slot = getMemorySlot(id);
+    } else if (storageMode == STORAGE_MAPPED) {
+        slot = getMappedSlot(id);
+    }
+    unlockStorage();
+    return slot;
+}
+
+// Locks the storage to read or change the user
+void lockStorageForUser(int id) {
+    lockStorageRead();
+    // A user file is opened on its first use, which changes the open files
+    // A missing user is checked on the disk first, so looking it up keeps the storage shared
+    if (storageMode == STORAGE_FILES && findUserFile(id) == ERROR && userFileExists(id)) {
+        unlockStorage();
+        lockStorageWrite();
+        if (findUserFile(id) == ERROR) {
+            // A missing file is reported by the read or the update
+            openUserFile(id);
+        }
+        unlockStorage();
+        lockStorageRead();
+    }
+}
+
+// Takes the locks to change the user
+void lockUser(int id) {
+    lockStorageForUser(id);
+    lockUserStripe(id);
+}
+
+// Returns the sequence the stripe of the user is left with
+unsigned int unlockUser(int id) {
+    unsigned int sequence = unlockUserStripe(id);
+    unlockStorage();
+    return sequence;
+}
+
+int readUser(User* user, int id, long long* version) {
+    // Optimistic, a read never waits for the stripe lock, it's copied again if a change raced it
+    lockStorageForUser(id);
+    int result;
+    unsigned int sequence;
+    do {
+        sequence = beginUserRead(id);
+        if (storageMode == STORAGE_MEMORY) {
+            result = readUserMemory(user, id);
+        } else if (storageMode == STORAGE_MAPPED) {
+            result = readUserMapped(user, id);
+        } else {
+            result = readUserFile(user, id);
+        }
+    } while (userReadRaced(id, sequence));
+    unlockStorage();
+    *version = getUserVersion(sequence);
+    return result;
+}
+
+int writeUser(User* user) {
+    // The user may be new, so nobody else can be on the storage
+    lockStorageWrite();
+    // Moves the version, an api may have the user it replaces
+    lockUserStripe(user->id);
+    int result;
+    if (storageMode == STORAGE_MEMORY) {
+        result = writeUserMemory(user);
+    } else if (storageMode == STORAGE_MAPPED) {
+        result = writeUserMapped(user);
+    } else {
+        result = writeUserFile(user);
+    }
+    unlockUserStripe(user->id);
+    unlockStorage();
+    return result;
+}
+
+int updateUserWithTransaction(int id, Transaction* transaction, User* user, long long* version) {
+    lockUser(id);
+    int result;
+    if (storageMode == STORAGE_MEMORY) {
+        result = updateUserMemory(id, transaction, user);
+    } else if (storageMode == STORAGE_MAPPED) {
+        result = updateUserMapped(id, transaction, user);
+    } else {
+        result = updateUserFile(id, transaction, user);
+    }
+    *version = getUserVersion(unlockUser(id));
+    return result;
+}
+
+void closeStorage() {
+    if (storageMode == STORAGE_MEMORY) {
+        closeMemoryDb();
+        return;
+    }
+    if (storageMode == STORAGE_MAPPED) {
+        closeMappedDb();
+        return;
+    }
+    closeDBFiles();
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef DB_TRANSPORT_H
+#define DB_TRANSPORT_H
+
+// Header file for the transports between the api and the db
+// tcp - loopback tcp on the db port, the only one that works across machines
+// unix - unix seqpacket socket, each frame is a message, no tcp stack on the way
+// shm - shared memory channel, set up over a unix socket, see shmChannel.h
+// embedded - no db at all, the api processes share the users themselves, see embeddedDb.h
+// The db listens on every transport, and each api chooses one
+// The unix sockets are on the abstract namespace, named after the db port, so they need no files,
+// and are shared by every process on the same network namespace, like the containers on the host network
+
+#include <stddef.h>
+#include <sys/un.h>
+
+#include "connection.h"
+#include "eventLoop.h"
+
+#define DB_TRANSPORT_TCP 0
+#define DB_TRANSPORT_UNIX 1
+#define DB_TRANSPORT_SHM 2
+#define DB_TRANSPORT_EMBEDDED 3
+
+// The socket the shm channels are set up on, the unix socket has no suffix
+#define DB_SHM_SOCKET_SUFFIX "-shm"
+
+// Returns the transport of the name, tcp, unix, shm or embedded
+// Returns ERROR if the name is not a transport
+int getDbTransport(const char* name);
+
+// Listens on the unix socket of the transport, unix or shm, for the db on the port
+// Crash the program if it fails
+int setupDbUnixServer(int port, int transport, int backlog);
+
+// Accepts every pending connection on the unix socket of the transport and adds them to the loop
+// The shm connections are attached their channel if it already arrived, see attachConnectionChannel
+// Returns the number of accepted connections
+int acceptDbClients(EventLoop* loop, int serverSocket, int transport);
+
+// Receives the channel of a shm connection awaiting it, and watches its doorbell with the socket
+// The socket is non blocking, so the worker never waits for it, the connection keeps awaiting until it arrives
+// Returns ERROR if the channel is invalid or the client hung up before sending it
+int attachConnectionChannel(EventLoop* loop, Connection* connection);
+
+// Connects to the db on the port with the transport
+// The socket is non blocking, and its connection is set up for the transport
+// Returns the socket, or ERROR if it fails to connect
+int connectDbTransport(int transport, int port);
+
+// Watches the socket of the connection, and its doorbell if it's a shm channel
+// Returns ERROR if it fails
+int watchDbConnection(EventLoop* loop, int socket);
+
+int getDbTransport(const char* name) {
+    if (strcmp(name, "tcp") == 0) {
+        return DB_TRANSPORT_TCP;
+    }
+    if (strcmp(name, "unix") == 0) {
+        return DB_TRANSPORT_UNIX;
+    }
+    if (strcmp(name, "shm") == 0) {
+        return DB_TRANSPORT_SHM;
+    }
+    if (strcmp(name, "embedded") == 0) {
+        return DB_TRANSPORT_EMBEDDED;
+    }
+    return ERROR;
+}
+
+// Fills the abstract address of the unix socket of the transport
+socklen_t getDbUnixAddress(int port, int transport, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    // The leading '\0' puts the name on the abstract namespace
+    int nameLength = snprintf(&address->sun_path[1], sizeof(address->sun_path) - 1, "rinha-db-%d%s",
+                              port, transport == DB_TRANSPORT_SHM ? DB_SHM_SOCKET_SUFFIX : "");
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + nameLength);
+}
+
+int setupDbUnixServer(int port, int transport, int backlog) {
+    int serverSocket;
+    check((serverSocket = socket(AF_UNIX, SOCK_SEQPACKET, 0)), "Failed to create unix socket");
+    struct sockaddr_un address;
+    socklen_t addressLength = getDbUnixAddress(port, transport, &address);
+    check(bind(serverSocket, (SA*)&address, addressLength), "Failed to bind unix socket");
+    check(listen(serverSocket, backlog), "Failed to listen on unix socket");
+    check(setNonBlocking(serverSocket), "Failed to set unix socket as non blocking");
+    return serverSocket;
+}
+
+int watchDbConnection(EventLoop* loop, int socket) {
+    raiseIfError(watchSocket(loop, socket));
+    Connection* connection = findConnection(socket);
+    if (connection != NULL && connection->channel != NULL) {
+        return watchDoorbell(loop, connection->channel->inputDoorbell, socket);
+    }
+    return SUCCESS;
+}
+
+int attachConnectionChannel(EventLoop* loop, Connection* connection) {
+    ShmChannel received;
+    if (openShmChannel(&received, connection->socket) == ERROR) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? SUCCESS : ERROR;
+    }
+    ShmChannel* channel = malloc(sizeof(ShmChannel));
+    if (channel == NULL) {
+        closeShmChannel(&received);
+        return ERROR;
+    }
+    *channel = received;
+    connection->channel = channel;
+    connection->awaitingChannel = false;
+    return watchDoorbell(loop, channel->inputDoorbell, connection->socket);
+}
+
+int acceptDbClients(EventLoop* loop, int serverSocket, int transport) {
+    int accepted = 0;
+    while (true) {
+        int clientSocket = acceptFromLoop(loop, serverSocket);
+        if (clientSocket == ERROR) {
+            if (errno == EINTR || errno == ECONNABORTED || dropPendingConnection(loop, serverSocket)) {
+                continue;
+            }
+            break;
+        }
+        Connection* connection = getConnection(clientSocket);
+        if (connection == NULL) {
+            close(clientSocket);
+            continue;
+        }
+        connection->framed = transport == DB_TRANSPORT_UNIX;
+        connection->awaitingChannel = transport == DB_TRANSPORT_SHM;
+        if (setNonBlocking(clientSocket) == ERROR || watchDbConnection(loop, clientSocket) == ERROR ||
+            (connection->awaitingChannel && attachConnectionChannel(loop, connection) == ERROR)) {
+            closeConnection(clientSocket);
+            continue;
+        }
+        accepted++;
+    }
+    return accepted;
+}
+
+int connectDbTransport(int transport, int port) {
+    int dbSocket;
+    if (transport == DB_TRANSPORT_TCP) {
+        dbSocket = socket(AF_INET, SOCK_STREAM, 0);
+        raiseIfError(dbSocket);
+        struct sockaddr_in serverAddr;
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        serverAddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+        if (connect(dbSocket, (SA*)&serverAddr, sizeof(serverAddr)) == -1) {
+            close(dbSocket);
+            return ERROR;
+        }
+    } else {
+        dbSocket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        raiseIfError(dbSocket);
+        struct sockaddr_un address;
+        socklen_t addressLength = getDbUnixAddress(port, transport, &address);
+        if (connect(dbSocket, (SA*)&address, addressLength) == -1) {
+            close(dbSocket);
+            return ERROR;
+        }
+    }
+
+    Connection* connection = getConnection(dbSocket);
+    if (connection == NULL) {
+        close(dbSocket);
+        return ERROR;
+    }
+    connection->framed = transport == DB_TRANSPORT_UNIX;
+    if (transport == DB_TRANSPORT_SHM) {
+        ShmChannel* channel = malloc(sizeof(ShmChannel));
+        if (channel == NULL || createShmChannel(channel, dbSocket) == ERROR) {
+            free(channel);
+            closeConnection(dbSocket);
+            return ERROR;
+        }
+        connection->channel = channel;
+    }
+    if (setNonBlocking(dbSocket) == ERROR) {
+        closeConnection(dbSocket);
+        return ERROR;
+    }
+    return dbSocket;
+}
+
+#endif
@@ -0,0 +1,498 @@
+#ifndef EMBEDDED_DB_H
+#define EMBEDDED_DB_H
+
+// Header file for the embedded database
+// The api processes run the operations themselves, on the users of a shared memory segment
+// mapped by every one of them, so a request never leaves the process that received it
+//
+// The segment is named after the db port, and is set up by the first process that maps it:
+// every process holds a shared flock on the segment while it's mapped,
+// so the process that gets the exclusive flock knows no one else is on it, and (re)builds it
+// The users are only created while the segment is set up, so the index never changes afterwards,
+// and is read without locks
+//
+// The users are guarded like on the db, see dbLocks.h: a change takes the stripe lock of the user,
+// and the stripe sequence is a seqlock for the readers, and the version of the users of the stripe
+// The segment lives as long as any process has it mapped, so the versions need no epoch
+// The locks are robust process shared mutexes, so a process that dies holding one doesn't block the others
+//
+// Every change is appended to a shared log ring before it's acknowledged, under the log lock,
+// while holding the stripe, so the changes of a user are on the ring in the order they were applied
+// A single writer moves the ring to the log file, with the same records as the db log, see dbLog.h
+// Every process runs a writer thread, waiting on the writer lock, and the one that holds it is the writer
+// When the writer dies, the lock goes to the next process, which carries on from the ring
+// The processes must share the working directory, the log is only replayed when the segment is set up
+// If every process died and the segment was left behind, the next one to set it up first moves
+// what is still on its ring to the log file, unless it resets the db
+//
+// A change is acknowledged once it's on the ring, before the writer syncs it to the log file,
+// so the durability policies of the db, see dbCommit.h, don't apply here:
+// the changes of the last moment are lost if the machine goes down, like the db with --durability none
+
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "account.h"
+#include "dbLog.h"
+#include "userIndex.h"
+
+#define EMBEDDED_SEGMENT_PREFIX "/rinha-accounts-"
+#define EMBEDDED_SEGMENT_MAGIC 0x42444d45
+#define EMBEDDED_SEGMENT_VERSION 2
+#define EMBEDDED_MAX_USERS 16384
+// Power of two, at most half full
+#define EMBEDDED_INDEX_SIZE (2 * EMBEDDED_MAX_USERS)
+// Power of two
+#define EMBEDDED_STRIPES 1024
+// Power of two, holds the changes of many writer rounds
+#define EMBEDDED_LOG_RING_SIZE (1024 * 1024)
+// How long the writer sleeps when the ring is empty, and a change waits when it's full
+#define EMBEDDED_LOG_POLL_US 1000
+// Reads spin this long on a stripe before checking if its owner died in the middle of a change
+#define EMBEDDED_READ_SPINS 1000
+#define CACHE_LINE_SIZE 64
+
+typedef struct EMBEDDED_STRIPE {
+    pthread_mutex_t mutex;
+    unsigned int sequence;
+} __attribute__((aligned(CACHE_LINE_SIZE))) EmbeddedStripe;
+
+typedef struct EMBEDDED_SEGMENT {
+    int magic;
+    int version;
+    int nUsers;
+    // Held by the log writer for as long as it lives
+    pthread_mutex_t writerLock;
+    // Guards the head of the ring
+    pthread_mutex_t logLock;
+    // The positions only grow, the bytes on the ring are head - tail
+    unsigned long logHead __attribute__((aligned(CACHE_LINE_SIZE)));
+    // Everything before the tail is on the log file
+    unsigned long logTail __attribute__((aligned(CACHE_LINE_SIZE)));
+    // Size of the log file when the segment was set up, the file always ends at logBase + logTail
+    long long logBase;
+    UserIndexEntry index[EMBEDDED_INDEX_SIZE];
+    EmbeddedStripe stripes[EMBEDDED_STRIPES];
+    User users[EMBEDDED_MAX_USERS];
+    char log[EMBEDDED_LOG_RING_SIZE];
+} EmbeddedSegment;
+
+EmbeddedSegment* embeddedSegment = NULL;
+int embeddedSegmentFile = ERROR;
+char embeddedSegmentName[64];
+// Set while this process is the log writer
+volatile bool embeddedLogWriter = false;
+int embeddedLogFile = ERROR;
+// Keeps the writer thread and closeEmbeddedDb from writing the same bytes
+pthread_mutex_t embeddedWriteLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Maps the shared users of the db port, setting the segment up if no other process has it
+// The process that sets it up creates the data folder, and creates the initial users if reset is set,
+// or rebuilds the users from the log otherwise
+// Returns ERROR if the segment can't be mapped or set up
+int openEmbeddedDb(int port, bool reset);
+
+// Sets the version of the copy on version, the sequence of its stripe
+// Returns FILE_NOT_FOUND if the user doesn't exist
+int readUserEmbedded(User* user, int id, long long* version);
+
+// Sets the version the user has right now, without copying it
+// Returns FILE_NOT_FOUND if the user doesn't exist
+int getUserVersionEmbedded(int id, long long* version);
+
+// Same results as updateUserFile
+// version returns the version of the user after the change
+// Returns ERROR if it fails to append to the log, the user is left unchanged
+int updateUserEmbedded(int id, Transaction* transaction, User* user, long long* version);
+
+// Runs the log writer of the process, waiting for its turn if another process is the writer
+// Never returns, started on its own thread
+void* runEmbeddedLogWriter(void* arg);
+
+// Writes what's left on the ring if this process is the writer, called right before the process exits
+// The segment stays mapped, the other threads may be waiting on its locks
+// The last process to close removes the segment
+void closeEmbeddedDb();
+
+// Locks a mutex shared with the other processes
+// If its owner died holding it, what it guards is taken as the owner left it
+void lockShared(pthread_mutex_t* mutex) {
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        log("{ A process died holding a shared lock }\n");
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+int initSharedMutex(pthread_mutex_t* mutex) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    int result = pthread_mutex_init(mutex, &attributes) == 0 ? SUCCESS : ERROR;
+    pthread_mutexattr_destroy(&attributes);
+    return result;
+}
+
+int findEmbeddedSlot(int id) {
+    uint32_t mask = EMBEDDED_INDEX_SIZE - 1;
+    for (uint32_t i = hashUserId(id) & mask;; i = (i + 1) & mask) {
+        UserIndexEntry* entry = &embeddedSegment->index[i];
+        if (entry->id == id) {
+            return entry->slot;
+        }
+        if (entry->id == EMPTY_USER_ID) {
+            return ERROR;
+        }
+    }
+}
+
+// Only called while the segment is set up
+// Returns the slot of the user, or ERROR if the segment is full
+int addEmbeddedUser(int id) {
+    if (id < 0 || embeddedSegment->nUsers == EMBEDDED_MAX_USERS) {
+        return ERROR;
+    }
+    uint32_t mask = EMBEDDED_INDEX_SIZE - 1;
+    uint32_t i = hashUserId(id) & mask;
+    while (embeddedSegment->index[i].id != EMPTY_USER_ID) {
+        i = (i + 1) & mask;
+    }
+    int slot = embeddedSegment->nUsers++;
+    embeddedSegment->index[i].id = id;
+    embeddedSegment->index[i].slot = slot;
+    return slot;
+}
+
+EmbeddedStripe* getEmbeddedStripe(int id) {
+    return &embeddedSegment->stripes[hashUserId(id) & (EMBEDDED_STRIPES - 1)];
+}
+
+void lockEmbeddedStripe(EmbeddedStripe* stripe) {
+    lockShared(&stripe->mutex);
+    unsigned int sequence = stripe->sequence;
+    // The owner died in the middle of a change, the change is kept as it is
+    if (sequence & 1) {
+        sequence++;
+    }
+    __atomic_store_n(&stripe->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Returns the sequence the stripe is left with
+unsigned int unlockEmbeddedStripe(EmbeddedStripe* stripe) {
+    unsigned int sequence = stripe->sequence + 1;
+    __atomic_store_n(&stripe->sequence, sequence, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stripe->mutex);
+    return sequence;
+}
+
+unsigned int beginEmbeddedRead(EmbeddedStripe* stripe) {
+    unsigned int sequence = __atomic_load_n(&stripe->sequence, __ATOMIC_ACQUIRE);
+    for (int spins = 1; sequence & 1; spins++) {
+        if (spins % EMBEDDED_READ_SPINS == 0) {
+            // Taking the lock repairs the stripe if its owner is gone, and waits for it otherwise
+            lockEmbeddedStripe(stripe);
+            unlockEmbeddedStripe(stripe);
+        } else {
+            sched_yield();
+        }
+        sequence = __atomic_load_n(&stripe->sequence, __ATOMIC_ACQUIRE);
+    }
+    return sequence;
+}
+
+bool embeddedReadRaced(EmbeddedStripe* stripe, unsigned int sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&stripe->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+// Copies the record to the ring, waiting for the writer if it's full
+int appendEmbeddedLog(char type, const char* payload, int payloadSize) {
+    char record[LOG_RECORD_MAX_SIZE];
+    int recordLength = buildLogRecord(record, type, payload, payloadSize);
+    raiseIfError(recordLength);
+
+    EmbeddedSegment* segment = embeddedSegment;
+    while (true) {
+        lockShared(&segment->logLock);
+        unsigned long head = segment->logHead;
+        if (head - __atomic_load_n(&segment->logTail, __ATOMIC_ACQUIRE) + recordLength <= EMBEDDED_LOG_RING_SIZE) {
+            int offset = (int)(head & (EMBEDDED_LOG_RING_SIZE - 1));
+            int first = recordLength < EMBEDDED_LOG_RING_SIZE - offset ? recordLength : EMBEDDED_LOG_RING_SIZE - offset;
+            memcpy(&segment->log[offset], record, first);
+            memcpy(segment->log, &record[first], recordLength - first);
+            __atomic_store_n(&segment->logHead, head + recordLength, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&segment->logLock);
+            return SUCCESS;
+        }
+        pthread_mutex_unlock(&segment->logLock);
+        log("{ The log ring is full, waiting for the writer }\n");
+        usleep(EMBEDDED_LOG_POLL_US);
+    }
+}
+
+// Moves everything on the ring to the log file, only called by the writer
+// Returns the number of bytes written, or ERROR if the write fails, the bytes stay on the ring
+int writeEmbeddedLog() {
+    EmbeddedSegment* segment = embeddedSegment;
+    unsigned long tail = segment->logTail;
+    unsigned long head = __atomic_load_n(&segment->logHead, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return 0;
+    }
+    int size = (int)(head - tail);
+    int offset = (int)(tail & (EMBEDDED_LOG_RING_SIZE - 1));
+    int first = size < EMBEDDED_LOG_RING_SIZE - offset ? size : EMBEDDED_LOG_RING_SIZE - offset;
+    raiseIfError(writeAll(embeddedLogFile, &segment->log[offset], first));
+    raiseIfError(writeAll(embeddedLogFile, segment->log, size - first));
+    raiseIfError(fdatasync(embeddedLogFile));
+    __atomic_store_n(&segment->logTail, head, __ATOMIC_RELEASE);
+    return size;
+}
+
+// Opens the log file for the new writer
+// A writer that died in the middle of a write left part of the ring on the file, it's written again
+int openEmbeddedLogFile() {
+    embeddedLogFile = open(LOG_FILE_NAME, O_WRONLY | O_CREAT, 0644);
+    raiseIfError(embeddedLogFile);
+    off_t end = (off_t)(embeddedSegment->logBase + embeddedSegment->logTail);
+    raiseIfError(ftruncate(embeddedLogFile, end));
+    if (lseek(embeddedLogFile, end, SEEK_SET) == -1) {
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+void* runEmbeddedLogWriter(void* arg) {
+    (void)arg;
+    // The signal handlers close the db, they can't run on this thread while it holds the write lock
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    lockShared(&embeddedSegment->writerLock);
+    if (openEmbeddedLogFile() == ERROR) {
+        perror("Failed to open the log");
+        exit(EXIT_FAILURE);
+    }
+    embeddedLogWriter = true;
+    log("{ Process %d is the log writer }\n", getpid());
+
+    while (true) {
+        pthread_mutex_lock(&embeddedWriteLock);
+        int written = writeEmbeddedLog();
+        pthread_mutex_unlock(&embeddedWriteLock);
+        if (written == ERROR) {
+            // The changes are acknowledged, so they can't be dropped, the next writer tries them again
+            perror("Failed to write the log");
+            exit(EXIT_FAILURE);
+        }
+        if (written == 0) {
+            usleep(EMBEDDED_LOG_POLL_US);
+        }
+    }
+    return NULL;
+}
+
+// Applies a log record while the segment is set up, like the memory storage does, see replayMemoryRecord
+int replayEmbeddedRecord(char type, const char* payload, int payloadSize, long long lsn) {
+    (void)lsn;
+    if (type == LOG_RECORD_WRITE) {
+        User user;
+        if (deserializeUser(payload, payloadSize, &user) != payloadSize) {
+            return ERROR;
+        }
+        int slot = findEmbeddedSlot(user.id);
+        if (slot == ERROR) {
+            slot = addEmbeddedUser(user.id);
+            raiseIfError(slot);
+        }
+        embeddedSegment->users[slot] = user;
+        return SUCCESS;
+    }
+
+    if (type == LOG_RECORD_UPDATE && payloadSize > 4) {
+        int slot = findEmbeddedSlot(fromBin((char*)&payload[0]));
+        raiseIfError(slot);
+        Transaction transaction;
+        if (deserializeTransaction(&payload[4], payloadSize - 4, &transaction) != payloadSize - 4) {
+            return ERROR;
+        }
+        return addTransaction(&embeddedSegment->users[slot], &transaction) == SUCCESS ? SUCCESS : ERROR;
+    }
+
+    log("{ Unknown log record %c }\n", type);
+    return ERROR;
+}
+
+// Creates the initial users, their records go on the ring like any change
+int createEmbeddedUsers() {
+    for (int i = 0; i < numberInitialUsers; i++) {
+        User user;
+        memset(&user, 0, sizeof(User));
+        user.id = i + 1;
+        user.limit = userInitialLimits[i];
+        int slot = addEmbeddedUser(user.id);
+        raiseIfError(slot);
+        embeddedSegment->users[slot] = user;
+
+        char payload[USER_SERIALIZED_MAX_SIZE];
+        raiseIfError(appendEmbeddedLog(LOG_RECORD_WRITE, payload, serializeUser(&user, payload)));
+    }
+    return SUCCESS;
+}
+
+// Moves what the last processes left on the ring of an old segment to the log file,
+// they acknowledged those changes, but all of them died before a writer got to them
+// Does nothing if the segment was never set up
+// Returns ERROR if the log can't be written
+int drainEmbeddedSegment() {
+    EmbeddedSegment* segment = embeddedSegment;
+    if (segment->magic != EMBEDDED_SEGMENT_MAGIC || segment->version != EMBEDDED_SEGMENT_VERSION ||
+        segment->logHead == segment->logTail) {
+        return SUCCESS;
+    }
+    raiseIfError(openEmbeddedLogFile());
+    int written = writeEmbeddedLog();
+    close(embeddedLogFile);
+    embeddedLogFile = ERROR;
+    raiseIfError(written);
+    log("{ Recovered %d bytes of the log ring }\n", written);
+    return SUCCESS;
+}
+
+// Builds the segment, no other process has it mapped
+int setupEmbeddedSegment(bool reset) {
+    EmbeddedSegment* segment = embeddedSegment;
+    if (!reset) {
+        raiseIfError(drainEmbeddedSegment());
+    }
+    memset(segment, 0, sizeof(EmbeddedSegment));
+    for (int i = 0; i < EMBEDDED_INDEX_SIZE; i++) {
+        segment->index[i].id = EMPTY_USER_ID;
+    }
+    for (int i = 0; i < EMBEDDED_STRIPES; i++) {
+        raiseIfError(initSharedMutex(&segment->stripes[i].mutex));
+    }
+    raiseIfError(initSharedMutex(&segment->writerLock));
+    raiseIfError(initSharedMutex(&segment->logLock));
+
+    if (mkdir("data", 0755) == ERROR && errno != EEXIST) {
+        return ERROR;
+    }
+    long long nRecords = openLog(reset, 0, replayEmbeddedRecord);
+    raiseIfError(nRecords);
+    segment->logBase = logSize;
+    closeLog();
+    if (reset) {
+        raiseIfError(createEmbeddedUsers());
+    }
+
+    printf("{ Embedded db %s, %d users, %lld log records }\n", reset ? "reset" : "recovered", segment->nUsers, nRecords);
+    fflush(stdout);
+    // The other processes check it once they get the flock
+    segment->version = EMBEDDED_SEGMENT_VERSION;
+    __atomic_store_n(&segment->magic, EMBEDDED_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+int openEmbeddedDb(int port, bool reset) {
+    snprintf(embeddedSegmentName, sizeof(embeddedSegmentName), EMBEDDED_SEGMENT_PREFIX "%d", port);
+    embeddedSegmentFile = shm_open(embeddedSegmentName, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    raiseIfError(embeddedSegmentFile);
+    // Builds the crc table now, before the workers can race to build it
+    crc32(0, NULL, 0);
+
+    // Only the first process gets the exclusive flock, the others wait for it to set the segment up
+    bool first = flock(embeddedSegmentFile, LOCK_EX | LOCK_NB) == SUCCESS;
+    if (!first) {
+        raiseIfError(flock(embeddedSegmentFile, LOCK_SH));
+    } else {
+        raiseIfError(ftruncate(embeddedSegmentFile, sizeof(EmbeddedSegment)));
+    }
+    embeddedSegment = mmap(NULL, sizeof(EmbeddedSegment), PROT_READ | PROT_WRITE, MAP_SHARED, embeddedSegmentFile, 0);
+    if (embeddedSegment == MAP_FAILED) {
+        embeddedSegment = NULL;
+        return ERROR;
+    }
+
+    if (first) {
+        raiseIfError(setupEmbeddedSegment(reset));
+        // Lets the other processes in, the segment stays set up while any of them holds the flock
+        return flock(embeddedSegmentFile, LOCK_SH);
+    }
+    // The process that set it up died before it was done
+    if (__atomic_load_n(&embeddedSegment->magic, __ATOMIC_ACQUIRE) != EMBEDDED_SEGMENT_MAGIC ||
+        embeddedSegment->version != EMBEDDED_SEGMENT_VERSION) {
+        return ERROR;
+    }
+    printf("{ Embedded db shared, %d users }\n", embeddedSegment->nUsers);
+    fflush(stdout);
+    return SUCCESS;
+}
+
+int readUserEmbedded(User* user, int id, long long* version) {
+    int slot = findEmbeddedSlot(id);
+    if (slot == ERROR) {
+        return FILE_NOT_FOUND;
+    }
+    EmbeddedStripe* stripe = getEmbeddedStripe(id);
+    unsigned int sequence;
+    do {
+        sequence = beginEmbeddedRead(stripe);
+        *user = embeddedSegment->users[slot];
+    } while (embeddedReadRaced(stripe, sequence));
+    *version = sequence;
+    return SUCCESS;
+}
+
+int getUserVersionEmbedded(int id, long long* version) {
+    if (findEmbeddedSlot(id) == ERROR) {
+        return FILE_NOT_FOUND;
+    }
+    *version = beginEmbeddedRead(getEmbeddedStripe(id));
+    return SUCCESS;
+}
+
+int updateUserEmbedded(int id, Transaction* transaction, User* user, long long* version) {
+    int slot = findEmbeddedSlot(id);
+    if (slot == ERROR) {
+        return FILE_NOT_FOUND;
+    }
+
+    EmbeddedStripe* stripe = getEmbeddedStripe(id);
+    lockEmbeddedStripe(stripe);
+    // The transaction is applied to a copy, and only kept once it's on the log
+    *user = embeddedSegment->users[slot];
+    int result = addTransaction(user, transaction);
+    if (result == SUCCESS) {
+        // 'u' id(4) and the serialized transaction
+        char payload[4 + TRANSACTION_SERIALIZED_MAX_SIZE];
+        toBin(id, &payload[0]);
+        int payloadSize = 4 + serializeTransaction(transaction, &payload[4]);
+        result = appendEmbeddedLog(LOG_RECORD_UPDATE, payload, payloadSize);
+        if (result == SUCCESS) {
+            embeddedSegment->users[slot] = *user;
+        }
+    }
+    *version = unlockEmbeddedStripe(stripe);
+    return result;
+}
+
+void closeEmbeddedDb() {
+    if (embeddedSegment == NULL) {
+        return;
+    }
+    if (embeddedLogWriter) {
+        pthread_mutex_lock(&embeddedWriteLock);
+        writeEmbeddedLog();
+        pthread_mutex_unlock(&embeddedWriteLock);
+    }
+    if (flock(embeddedSegmentFile, LOCK_EX | LOCK_NB) == SUCCESS) {
+        shm_unlink(embeddedSegmentName);
+    }
+    close(embeddedSegmentFile);
+}
+
+#endif
@@ -0,0 +1,582 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+// Header file for the event loop
+// Wraps an edge-triggered epoll instance, shared by the api and the db servers
+// Only the sockets on the ready list are visited on each wakeup, so the cost
+// of a wakeup doesn't depend on how many connections are open
+//
+// The io_uring backend reports the same events, so the handlers don't know which backend they run on,
+// but the requests that watch the sockets do the work themselves, see ioUring.h:
+// a multishot accept on each server socket, queueing the accepted sockets for acceptClients,
+// a multishot recv on each tcp socket, queueing the received data on its connection for receiveIntoConnection,
+// cancelled while the queue of the connection is full, and armed again once it's read, see connection.h
+// and multishot polls for the writes, the unix sockets and the doorbells
+// A request per socket, and a single io_uring_enter per wakeup, instead of the accept and recv calls
+// The ring holds on to the sockets it watches, so the connections tell it when a socket is closed
+// The responses are still sent right away with send, the handlers send them from their own buffers
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "connection.h"
+#include "helpers.h"
+#include "ioUring.h"
+
+// max events returned by a single wait
+#define MAX_EVENTS 1024
+
+// Wait forever for events
+#define WAIT_FOREVER -1
+
+#define IO_BACKEND_EPOLL 0
+#define IO_BACKEND_URING 1
+
+// Kinds of the io_uring requests, on the user data of the requests with the socket and its generation
+#define URING_REQUEST_ACCEPT 1
+#define URING_REQUEST_POLL 2
+#define URING_REQUEST_RECV 3
+#define URING_REQUEST_WRITABLE 4
+#define URING_REQUEST_DOORBELL 5
+#define URING_REQUEST_CANCEL 6
+
+// How long a server socket waits to accept again after its accept failed, e.g. out of file descriptors
+#define URING_ACCEPT_RETRY_MS 100
+
+// The requests of a socket on the io_uring backend
+typedef struct WATCHED_SOCKET {
+    // Moves when the socket is closed, so the completions of its old requests are told apart
+    // from the requests of a new socket with the same number
+    unsigned short generation;
+    // The event of the socket on the current wait, if stamp is the number of the wait
+    int event;
+    unsigned int stamp;
+    // A recv is armed, until its last completion
+    bool receiving;
+    // The accept of the server socket failed, it's armed again at the retry time of the loop
+    bool acceptFailed;
+} WatchedSocket;
+
+typedef struct ACCEPTED_SOCKET {
+    int serverSocket;
+    int socket;
+} AcceptedSocket;
+
+typedef struct EVENT_LOOP {
+    int epollFd;
+    // Given up to accept a connection when the process is out of descriptors, see dropPendingConnection
+    int reserveFd;
+    // The io_uring backend, NULL on epoll
+    IoUring* uring;
+    // Only used by the io_uring backend, indexed by socket
+    WatchedSocket* watched;
+    int watchedCapacity;
+    unsigned int nWaits;
+    // Sockets accepted by the ring, waiting for acceptClients
+    AcceptedSocket accepted[MAX_EVENTS];
+    int nAccepted;
+    // When the failed accepts are armed again, 0 if none failed
+    long long acceptRetryAt;
+    struct epoll_event events[MAX_EVENTS];
+} EventLoop;
+
+// The backend of the loops set up from now on, a loop falls back to epoll if io_uring isn't available
+int ioBackend = IO_BACKEND_EPOLL;
+// The io_uring loop of the thread, told about the sockets closed by the thread
+__thread EventLoop* threadUringLoop = NULL;
+
+// Returns the backend with the name, epoll or uring
+// Returns ERROR if there's no backend with the name
+int getIoBackend(const char* name);
+
+// Creates the epoll instance, or the ring on the io_uring backend
+// Crash the program if it fails
+void setupEventLoop(EventLoop* loop);
+
+// Closes the epoll instance
+void closeEventLoop(EventLoop* loop);
+
+// Raises the open file limit to the hard limit, so the loop isn't capped at 1024 sockets
+// Returns the new soft limit, or ERROR if it can't be read
+int raiseFileLimit();
+
+// Sets the O_NONBLOCK flag on the socket
+// Returns ERROR if it fails
+int setNonBlocking(int socket);
+
+// Starts watching the socket for reads and writes, edge-triggered
+// The socket must be non blocking, and must be read until EAGAIN on every event
+// A write event is only sent when the socket goes from full to writable
+// A framed or shm connection must be set up before the socket is watched, the io_uring backend
+// only receives the data of the plain sockets itself
+// Returns ERROR if it fails
+int watchSocket(EventLoop* loop, int socket);
+
+// Starts watching the server socket for new connections, taken with acceptFromLoop
+// Returns ERROR if it fails
+int watchServerSocket(EventLoop* loop, int serverSocket);
+
+// Starts watching the doorbell of a shared memory channel, edge-triggered, see shmChannel.h
+// Its events are reported as events of the socket of the channel
+// Returns ERROR if it fails
+int watchDoorbell(EventLoop* loop, int doorbell, int socket);
+
+// Stops watching the socket
+// Closing the socket also removes it from the loop, this is only needed for sockets that stay open
+int unwatchSocket(EventLoop* loop, int socket);
+
+// Waits for events, for at most timeout milliseconds (WAIT_FOREVER to block)
+// Returns the number of ready events, stored on loop->events
+// Returns 0 if the wait was interrupted by a signal
+// Returns ERROR if the wait fails
+int waitEvents(EventLoop* loop, int timeout);
+
+// Returns the next pending connection on the server socket, a blocking socket like accept returns
+// Returns ERROR if it fails, errno is EAGAIN if there's no connection left
+int acceptFromLoop(EventLoop* loop, int serverSocket);
+
+// Accepts every pending connection on the server socket and adds them to the loop
+// Returns the number of accepted connections
+int acceptClients(EventLoop* loop, int serverSocket);
+
+// Called when accepting failed, if it failed for being out of descriptors, the next pending connection
+// is accepted on the reserve descriptor and closed right away
+// The edge-triggered server socket has no event for what's left on its backlog until another connection arrives,
+// so it's drained instead of being left there
+// Returns true if a connection was dropped, the backlog should be read on
+bool dropPendingConnection(EventLoop* loop, int serverSocket);
+
+int getIoBackend(const char* name) {
+    if (strcmp(name, "epoll") == 0) {
+        return IO_BACKEND_EPOLL;
+    }
+    if (strcmp(name, "uring") == 0) {
+        return IO_BACKEND_URING;
+    }
+    return ERROR;
+}
+
+void setupEventLoop(EventLoop* loop) {
+    memset(loop, 0, sizeof(EventLoop));
+    loop->epollFd = ERROR;
+    loop->reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (ioBackend == IO_BACKEND_URING) {
+        loop->uring = malloc(sizeof(IoUring));
+        if (loop->uring != NULL && setupIoUring(loop->uring) == SUCCESS) {
+            return;
+        }
+        printf("{ io_uring is not available (%s), falling back to epoll }\n", strerror(errno));
+        free(loop->uring);
+        loop->uring = NULL;
+    }
+    check((loop->epollFd = epoll_create1(EPOLL_CLOEXEC)), "Failed to create epoll instance");
+}
+
+void closeEventLoop(EventLoop* loop) {
+    if (loop->reserveFd != ERROR) {
+        close(loop->reserveFd);
+        loop->reserveFd = ERROR;
+    }
+    if (loop->uring != NULL) {
+        closeIoUring(loop->uring);
+        free(loop->uring);
+        loop->uring = NULL;
+        free(loop->watched);
+        loop->watched = NULL;
+        loop->watchedCapacity = 0;
+        return;
+    }
+    close(loop->epollFd);
+}
+
+int raiseFileLimit() {
+    struct rlimit limit;
+    raiseIfError(getrlimit(RLIMIT_NOFILE, &limit));
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        // Not being able to raise it is not fatal, we keep the old limit
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return (int)limit.rlim_cur;
+}
+
+int setNonBlocking(int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    raiseIfError(flags);
+    return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Gets the requests state of the socket, growing the table if needed
+// Returns NULL if the table can't grow
+WatchedSocket* getWatchedSocket(EventLoop* loop, int socket) {
+    if (socket < 0) {
+        return NULL;
+    }
+    if (socket >= loop->watchedCapacity) {
+        int newCapacity = loop->watchedCapacity == 0 ? 1024 : loop->watchedCapacity;
+        while (newCapacity <= socket) {
+            newCapacity *= 2;
+        }
+        WatchedSocket* grown = realloc(loop->watched, newCapacity * sizeof(WatchedSocket));
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(&grown[loop->watchedCapacity], 0, (newCapacity - loop->watchedCapacity) * sizeof(WatchedSocket));
+        loop->watched = grown;
+        loop->watchedCapacity = newCapacity;
+    }
+    return &loop->watched[socket];
+}
+
+uint64_t getUringUserData(int socket, int kind, unsigned short generation) {
+    return (uint64_t)(uint32_t)socket | (uint64_t)kind << 32 | (uint64_t)generation << 40;
+}
+
+// Queues a multishot request of the kind for the socket, submitted on the next wait
+// Returns ERROR if it can't be queued
+int armUringRequest(EventLoop* loop, int kind, int socket) {
+    WatchedSocket* watched = getWatchedSocket(loop, socket);
+    errIfNull(watched);
+    // The doorbell is watched for the socket of its channel
+    int fd = socket;
+    if (kind == URING_REQUEST_DOORBELL) {
+        Connection* connection = findConnection(socket);
+        if (connection == NULL || connection->channel == NULL) {
+            return ERROR;
+        }
+        fd = connection->channel->inputDoorbell;
+    }
+    struct io_uring_sqe* request = getIoUringRequest(loop->uring);
+    errIfNull(request);
+    request->fd = fd;
+    request->user_data = getUringUserData(socket, kind, watched->generation);
+    if (kind == URING_REQUEST_ACCEPT) {
+        request->opcode = IORING_OP_ACCEPT;
+        request->ioprio = IORING_ACCEPT_MULTISHOT;
+    } else if (kind == URING_REQUEST_RECV) {
+        watched->receiving = true;
+        // The kernel picks the buffer when the data arrive, so no memory is held by the idle sockets
+        request->opcode = IORING_OP_RECV;
+        request->ioprio = IORING_RECV_MULTISHOT;
+        request->flags = IOSQE_BUFFER_SELECT;
+        request->buf_group = IO_URING_BUFFER_GROUP;
+    } else {
+        request->opcode = IORING_OP_POLL_ADD;
+        request->len = IORING_POLL_ADD_MULTI;
+        request->poll32_events = kind == URING_REQUEST_WRITABLE ? EPOLLOUT
+                               : kind == URING_REQUEST_DOORBELL ? EPOLLIN
+                                                                : EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    }
+    return SUCCESS;
+}
+
+// Queues the cancel of the request of the kind for the socket, it ends with an -ECANCELED completion
+// Returns ERROR if it can't be queued
+int cancelUringRequest(EventLoop* loop, int kind, int socket) {
+    struct io_uring_sqe* request = getIoUringRequest(loop->uring);
+    errIfNull(request);
+    request->opcode = IORING_OP_ASYNC_CANCEL;
+    request->fd = -1;
+    request->addr = getUringUserData(socket, kind, loop->watched[socket].generation);
+    request->user_data = getUringUserData(socket, URING_REQUEST_CANCEL, 0);
+    return SUCCESS;
+}
+
+// Cancels the requests of the socket, the completions they still post are ignored
+void cancelUringRequests(EventLoop* loop, int socket) {
+    if (socket < 0 || socket >= loop->watchedCapacity) {
+        return;
+    }
+    WatchedSocket* watched = &loop->watched[socket];
+    int kinds[] = {URING_REQUEST_POLL, URING_REQUEST_RECV, URING_REQUEST_WRITABLE, URING_REQUEST_DOORBELL};
+    for (int i = 0; i < (int)(sizeof(kinds) / sizeof(int)); i++) {
+        if (cancelUringRequest(loop, kinds[i], socket) == ERROR) {
+            break;
+        }
+    }
+    watched->generation++;
+    watched->receiving = false;
+}
+
+// The ring keeps the socket open until its requests are cancelled
+void cancelClosingSocket(int socket) {
+    if (threadUringLoop != NULL) {
+        cancelUringRequests(threadUringLoop, socket);
+    }
+}
+
+// The queue of the connection was read, its recv is armed again
+// If the cancelled recv hasn't ended yet, its last completion arms it
+void resumeUringInput(Connection* connection) {
+    EventLoop* loop = threadUringLoop;
+    if (loop == NULL || connection->inputEnded || connection->socket >= loop->watchedCapacity ||
+        loop->watched[connection->socket].receiving) {
+        return;
+    }
+    armUringRequest(loop, URING_REQUEST_RECV, connection->socket);
+}
+
+int watchSocket(EventLoop* loop, int socket) {
+    if (loop->uring != NULL) {
+        Connection* connection = getConnection(socket);
+        errIfNull(connection);
+        // The framed and shm connections read their sockets themselves
+        if (connection->framed || connection->channel != NULL || connection->awaitingChannel) {
+            return armUringRequest(loop, URING_REQUEST_POLL, socket);
+        }
+        connection->inputQueued = true;
+        raiseIfError(armUringRequest(loop, URING_REQUEST_RECV, socket));
+        return armUringRequest(loop, URING_REQUEST_WRITABLE, socket);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.fd = socket;
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, socket, &event);
+}
+
+int watchServerSocket(EventLoop* loop, int serverSocket) {
+    if (loop->uring != NULL) {
+        return armUringRequest(loop, URING_REQUEST_ACCEPT, serverSocket);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = serverSocket;
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, serverSocket, &event);
+}
+
+int watchDoorbell(EventLoop* loop, int doorbell, int socket) {
+    if (loop->uring != NULL) {
+        return armUringRequest(loop, URING_REQUEST_DOORBELL, socket);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = socket;
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, doorbell, &event);
+}
+
+int unwatchSocket(EventLoop* loop, int socket) {
+    if (loop->uring != NULL) {
+        cancelUringRequests(loop, socket);
+        return SUCCESS;
+    }
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, socket, NULL);
+}
+
+// Adds the events to the event of the socket on this wait, so each socket is visited once
+void addUringEvent(EventLoop* loop, int socket, uint32_t events, int* nEvents) {
+    WatchedSocket* watched = getWatchedSocket(loop, socket);
+    if (watched == NULL) {
+        return;
+    }
+    if (watched->stamp == loop->nWaits) {
+        loop->events[watched->event].events |= events;
+        return;
+    }
+    watched->stamp = loop->nWaits;
+    watched->event = *nEvents;
+    loop->events[*nEvents].events = events;
+    loop->events[*nEvents].data.fd = socket;
+    (*nEvents)++;
+}
+
+// Turns the completion into the events of its socket, and rearms the requests the kernel ended
+void handleUringCompletion(EventLoop* loop, struct io_uring_cqe* completion, int* nEvents) {
+    int socket = (int)(uint32_t)completion->user_data;
+    int kind = (int)(completion->user_data >> 32 & 0xFF);
+    unsigned short generation = (unsigned short)(completion->user_data >> 40);
+    int result = completion->res;
+    bool more = completion->flags & IORING_CQE_F_MORE;
+    int bufferId = completion->flags & IORING_CQE_F_BUFFER ? (int)(completion->flags >> IORING_CQE_BUFFER_SHIFT) : ERROR;
+
+    if (kind == URING_REQUEST_ACCEPT) {
+        if (result >= 0) {
+            loop->accepted[loop->nAccepted].serverSocket = socket;
+            loop->accepted[loop->nAccepted].socket = result;
+            loop->nAccepted++;
+            addUringEvent(loop, socket, EPOLLIN, nEvents);
+        }
+        // The server sockets are never closed
+        if (!more) {
+            // Arming it right away would fail right away again, and spin the loop while the failure lasts
+            WatchedSocket* watched = getWatchedSocket(loop, socket);
+            if (result < 0 && result != -EINTR && result != -ECONNABORTED && watched != NULL) {
+                watched->acceptFailed = true;
+                if (loop->acceptRetryAt == 0) {
+                    loop->acceptRetryAt = getCurrentTimeMs() + URING_ACCEPT_RETRY_MS;
+                }
+                return;
+            }
+            armUringRequest(loop, URING_REQUEST_ACCEPT, socket);
+        }
+        return;
+    }
+
+    WatchedSocket* watched = getWatchedSocket(loop, socket);
+    bool stale = kind < URING_REQUEST_POLL || kind > URING_REQUEST_DOORBELL || watched == NULL ||
+                 watched->generation != generation;
+    if (kind == URING_REQUEST_RECV && !stale) {
+        Connection* connection = findConnection(socket);
+        bool paused = connection != NULL && connection->inputPaused;
+        if (!more) {
+            watched->receiving = false;
+        }
+        if (result > 0) {
+            if (connection != NULL && queueConnectionInput(connection, getIoUringBuffer(loop->uring, bufferId), result) == ERROR) {
+                endConnectionInput(connection, ENOMEM);
+            }
+            addUringEvent(loop, socket, EPOLLIN, nEvents);
+            // The queue is full, the client waits on the kernel until the connection reads it
+            if (connection != NULL && !paused && connection->inputLength >= CONNECTION_INPUT_LIMIT) {
+                connection->inputPaused = true;
+                paused = true;
+                if (more) {
+                    cancelUringRequest(loop, URING_REQUEST_RECV, socket);
+                }
+            }
+            if (!more && !paused) {
+                armUringRequest(loop, URING_REQUEST_RECV, socket);
+            }
+        } else if (result == -ENOBUFS || result == -ECANCELED) {
+            // Every buffer was taken, they're back on the ring once this wait is done,
+            // or the recv was cancelled by a pause, and the queue was read since
+            if (!paused) {
+                armUringRequest(loop, URING_REQUEST_RECV, socket);
+            }
+        } else {
+            if (connection != NULL) {
+                endConnectionInput(connection, -result);
+            }
+            addUringEvent(loop, socket, result == 0 ? EPOLLIN | EPOLLRDHUP : EPOLLIN | EPOLLERR, nEvents);
+        }
+    } else if (!stale && result != -ECANCELED) {
+        if (result < 0) {
+            // The reads of the handler find out what happened
+            addUringEvent(loop, socket, EPOLLIN | EPOLLERR, nEvents);
+            return;
+        }
+        addUringEvent(loop, socket, kind == URING_REQUEST_DOORBELL ? EPOLLIN : (uint32_t)result, nEvents);
+        if (!more) {
+            armUringRequest(loop, kind, socket);
+        }
+    }
+    // The data were copied to the connection
+    if (bufferId != ERROR) {
+        recycleIoUringBuffer(loop->uring, bufferId);
+    }
+}
+
+// Arms the failed accepts again once their pause is over
+// Returns the timeout of the wait, cut short so it ends when the pause is over
+int retryUringAccepts(EventLoop* loop, int timeout) {
+    if (loop->acceptRetryAt == 0) {
+        return timeout;
+    }
+    long long remaining = loop->acceptRetryAt - getCurrentTimeMs();
+    if (remaining > 0) {
+        return timeout == WAIT_FOREVER || timeout > remaining ? (int)remaining : timeout;
+    }
+    for (int socket = 0; socket < loop->watchedCapacity; socket++) {
+        if (loop->watched[socket].acceptFailed) {
+            loop->watched[socket].acceptFailed = false;
+            armUringRequest(loop, URING_REQUEST_ACCEPT, socket);
+        }
+    }
+    loop->acceptRetryAt = 0;
+    return timeout;
+}
+
+int waitUringEvents(EventLoop* loop, int timeout) {
+    threadUringLoop = loop;
+    socketClosing = cancelClosingSocket;
+    inputDrained = resumeUringInput;
+    timeout = retryUringAccepts(loop, timeout);
+    if (submitAndWait(loop->uring, timeout) == ERROR && errno != EINTR && errno != ETIME && errno != EBUSY) {
+        return ERROR;
+    }
+
+    loop->nWaits++;
+    int nEvents = 0;
+    // What doesn't fit on the events is left for the next wait
+    while (nEvents < MAX_EVENTS && loop->nAccepted < MAX_EVENTS) {
+        struct io_uring_cqe* completion = peekCompletion(loop->uring);
+        if (completion == NULL) {
+            break;
+        }
+        handleUringCompletion(loop, completion, &nEvents);
+        releaseCompletion(loop->uring);
+    }
+    publishBuffers(loop->uring);
+    return nEvents;
+}
+
+int waitEvents(EventLoop* loop, int timeout) {
+    if (loop->uring != NULL) {
+        return waitUringEvents(loop, timeout);
+    }
+    int nReady = epoll_wait(loop->epollFd, loop->events, MAX_EVENTS, timeout);
+    if (nReady == ERROR && errno == EINTR) {
+        return 0;
+    }
+    return nReady;
+}
+
+int acceptFromLoop(EventLoop* loop, int serverSocket) {
+    if (loop->uring == NULL) {
+        return accept(serverSocket, NULL, NULL);
+    }
+    for (int i = 0; i < loop->nAccepted; i++) {
+        if (loop->accepted[i].serverSocket == serverSocket) {
+            int socket = loop->accepted[i].socket;
+            loop->nAccepted--;
+            memmove(&loop->accepted[i], &loop->accepted[i + 1], (loop->nAccepted - i) * sizeof(AcceptedSocket));
+            return socket;
+        }
+    }
+    errno = EAGAIN;
+    return ERROR;
+}
+
+int acceptClients(EventLoop* loop, int serverSocket) {
+    int accepted = 0;
+    while (true) {
+        int clientSocket = acceptFromLoop(loop, serverSocket);
+        if (clientSocket == ERROR) {
+            if (errno == EINTR || errno == ECONNABORTED || dropPendingConnection(loop, serverSocket)) {
+                continue;
+            }
+            // EAGAIN means the accept queue is empty
+            break;
+        }
+        if (setNonBlocking(clientSocket) == ERROR || watchSocket(loop, clientSocket) == ERROR) {
+            closeConnection(clientSocket);
+            continue;
+        }
+        accepted++;
+    }
+    return accepted;
+}
+
+bool dropPendingConnection(EventLoop* loop, int serverSocket) {
+    // The ring accepts on its own, and backs off when it's out of descriptors, see retryUringAccepts
+    if (loop->uring != NULL || (errno != EMFILE && errno != ENFILE)) {
+        return false;
+    }
+    // Another thread may have taken the descriptor the last time it was given up
+    if (loop->reserveFd == ERROR) {
+        loop->reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (loop->reserveFd == ERROR) {
+            return false;
+        }
+    }
+    close(loop->reserveFd);
+    int dropped = accept(serverSocket, NULL, NULL);
+    if (dropped != ERROR) {
+        close(dropped);
+        log("{ Out of file descriptors, dropped a connection }\n");
+    }
+    loop->reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return dropped != ERROR;
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef EXTRATO_CACHE_H
+#define EXTRATO_CACHE_H
+
+// Header file for the statement cache
+// Each worker keeps the last statement it rendered for each user, with the version of the user it was rendered from
+// The statement only changes with the user, except for data_extrato, so for the same version
+// the rendered response is sent again with the current time written over the old one
+// The other api processes change the users too, so the db is still asked if the version is the current one,
+// but it only answers with the version, see DB_METHOD_READ on dbProtocol.h
+// In the embedded mode the version is read from the shared users, so a hit doesn't copy the user either
+//
+// The users are on a small table indexed by the hash of their id, a user takes the slot of the one that was there
+
+#include "dbProtocol.h"
+#include "userIndex.h"
+
+// Power of two, the table is allocated by each worker on its first statement
+#define EXTRATO_CACHE_SIZE 256
+// Fits a statement with all the transactions
+#define EXTRATO_CACHE_RESPONSE_SIZE 2048
+
+typedef struct EXTRATO_CACHE_ENTRY {
+    // EMPTY_USER_ID if the slot is free
+    int id;
+    long long version;
+    int length;
+    // Where data_extrato is on the response
+    int timestampOffset;
+    char response[EXTRATO_CACHE_RESPONSE_SIZE];
+} ExtratoCacheEntry;
+
+typedef struct EXTRATO_CACHE_STATS {
+    // Statements sent from the cache, and statements rendered
+    unsigned long hits, misses;
+    // Statements dropped because their user changed, or because another user took their slot
+    unsigned long invalidations, evictions;
+} ExtratoCacheStats;
+
+__thread ExtratoCacheEntry* extratoCache = NULL;
+__thread ExtratoCacheStats extratoCacheStats = {0};
+
+// Returns the version the user is cached at, or DB_NO_VERSION if it's not cached
+long long getCachedVersion(int id);
+
+// Returns the statement of the user at the version, with data_extrato set to now, and sets its size on responseSize
+// The response is only valid until the next change to the cache
+// Returns NULL if the user isn't cached at the version
+char* getCachedExtrato(int id, long long version, int* responseSize);
+
+// Keeps the statement rendered from the user at the version, counted as a miss
+// timestampOffset is where data_extrato is on the response
+// Statements too big for the cache are not kept
+void cacheExtrato(int id, long long version, const char* response, int responseSize, int timestampOffset);
+
+// Drops the statement of the user if it's cached at another version, called when the user changed
+void invalidateExtrato(int id, long long version);
+
+void printExtratoCacheStats(FILE* output);
+
+// Returns NULL if the table can't be allocated, nothing is cached then
+ExtratoCacheEntry* getExtratoSlot(int id) {
+    if (extratoCache == NULL) {
+        extratoCache = malloc(EXTRATO_CACHE_SIZE * sizeof(ExtratoCacheEntry));
+        if (extratoCache == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < EXTRATO_CACHE_SIZE; i++) {
+            extratoCache[i].id = EMPTY_USER_ID;
+        }
+    }
+    return &extratoCache[hashUserId(id) & (EXTRATO_CACHE_SIZE - 1)];
+}
+
+long long getCachedVersion(int id) {
+    ExtratoCacheEntry* entry = getExtratoSlot(id);
+    return entry != NULL && entry->id == id && id != EMPTY_USER_ID ? entry->version : DB_NO_VERSION;
+}
+
+char* getCachedExtrato(int id, long long version, int* responseSize) {
+    ExtratoCacheEntry* entry = getExtratoSlot(id);
+    if (entry == NULL || entry->id != id || id == EMPTY_USER_ID || entry->version != version) {
+        return NULL;
+    }
+    // formatTimestamp ends the timestamp with a '\0', which would be over the closing quote
+    char timestamp[DATE_SIZE];
+    formatTimestamp(getEpochTimeUs(), timestamp);
+    memcpy(&entry->response[entry->timestampOffset], timestamp, DATE_SIZE - 1);
+    extratoCacheStats.hits++;
+    *responseSize = entry->length;
+    return entry->response;
+}
+
+void cacheExtrato(int id, long long version, const char* response, int responseSize, int timestampOffset) {
+    extratoCacheStats.misses++;
+    ExtratoCacheEntry* entry = getExtratoSlot(id);
+    if (entry == NULL) {
+        return;
+    }
+    if (entry->id == id && entry->version != version) {
+        extratoCacheStats.invalidations++;
+    } else if (entry->id != id && entry->id != EMPTY_USER_ID) {
+        extratoCacheStats.evictions++;
+    }
+    if (responseSize > EXTRATO_CACHE_RESPONSE_SIZE) {
+        entry->id = EMPTY_USER_ID;
+        return;
+    }
+    entry->id = id;
+    entry->version = version;
+    entry->length = responseSize;
+    entry->timestampOffset = timestampOffset;
+    memcpy(entry->response, response, responseSize);
+}
+
+void invalidateExtrato(int id, long long version) {
+    ExtratoCacheEntry* entry = getExtratoSlot(id);
+    if (entry != NULL && entry->id == id && entry->version != version) {
+        entry->id = EMPTY_USER_ID;
+        extratoCacheStats.invalidations++;
+    }
+}
+
+void printExtratoCacheStats(FILE* output) {
+    ExtratoCacheStats* stats = &extratoCacheStats;
+    fprintf(output, "{ extrato cache: hits %lu, misses %lu, invalidations %lu, evictions %lu }\n", stats->hits,
+            stats->misses, stats->invalidations, stats->evictions);
+    fflush(output);
+}
+
+#endif
@@ -12,6 +12,7 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,7 +20,6 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
-#include <sys/select.h>
 #include <unistd.h>
 
 // Comment out to enable logging on the server and the db
@@ -38,6 +38,8 @@
 #define FILE_NOT_FOUND -2
 #define LIMIT_EXCEEDED_ERROR -3
 #define INVALID_TIPO_ERROR -4
+// The user didn't change since the version the reader has
+#define NOT_MODIFIED -5
 
 // Return error if pointer is NULL
 #define errIfNull(pointer) \
@@ -61,29 +63,32 @@
 #define DB_RESPONSE_SIZE 1024
 #define DB_REQUEST_SIZE 1024
 
-// Response templates
-const char* successResponseJsonTemplate = "HTTP/1.1 200 OK\nContent-Type: application/json\n\n%s";
+// Sends data to the client, buffering what the socket can't take right now
+// Defined on connection.h
+int sendToClient(int socket, const char* data, int size);
 
-// Send response to client
-#define RESPOND(clientSocket, response) send(clientSocket, response, strlen(response), SEND_DEFAULT);
+// Sends an http response to the client, and keeps its status for the metrics
+// Defined on httpHandler.h
+int sendHttpResponse(int socket, const char* response, int size);
 
 // static responses
 // response must be a string literal
-#define STATIC_RESPONSE(clientSocket, response) send(clientSocket, response, sizeof(response) - 1, SEND_DEFAULT);
+// Content-Length is required for the client to find the end of the response on a keep-alive connection
+#define STATIC_RESPONSE(clientSocket, response) sendHttpResponse(clientSocket, response, sizeof(response) - 1);
 
-const char badRequestResponse[] = "HTTP/1.1 400 Bad Request\nContent-Type: application/json\n\n{\"message\": \"Bad Request\"}";
+const char badRequestResponse[] = "HTTP/1.1 400 Bad Request\r\nContent-Type: application/json\r\nContent-Length: 26\r\n\r\n{\"message\": \"Bad Request\"}";
 #define BAD_REQUEST(clientSocket) STATIC_RESPONSE(clientSocket, badRequestResponse)
 
-const char methodNotAllowedResponse[] = "HTTP/1.1 405 Method Not Allowed\nContent-Type: application/json\n\n{\"message\": \"Method not allowed\"}";
+const char methodNotAllowedResponse[] = "HTTP/1.1 405 Method Not Allowed\r\nContent-Type: application/json\r\nContent-Length: 33\r\n\r\n{\"message\": \"Method not allowed\"}";
 #define METHOD_NOT_ALLOWED(clientSocket) STATIC_RESPONSE(clientSocket, methodNotAllowedResponse)
 
-const char notFoundResponse[] = "HTTP/1.1 404 Not Found\nContent-Type: application/json\n\n{\"message\": \"User Not Found\"}";
+const char notFoundResponse[] = "HTTP/1.1 404 Not Found\r\nContent-Type: application/json\r\nContent-Length: 29\r\n\r\n{\"message\": \"User Not Found\"}";
 #define NOT_FOUND(clientSocket) STATIC_RESPONSE(clientSocket, notFoundResponse)
 
-const char unprocessableEntityResponse[] = "HTTP/1.1 422 Unprocessable Entity\nContent-Type: application/json\n\n{\"message\": \"Unprocessable Entity\"}";
+const char unprocessableEntityResponse[] = "HTTP/1.1 422 Unprocessable Entity\r\nContent-Type: application/json\r\nContent-Length: 35\r\n\r\n{\"message\": \"Unprocessable Entity\"}";
 #define UNPROCESSABLE_ENTITY(clientSocket) STATIC_RESPONSE(clientSocket, unprocessableEntityResponse)
 
-const char internalServerErrorResponse[] = "HTTP/1.1 500 Internal Server Error\nContent-Type: application/json\n\n{\"message\": \"Internal Server Error\"}";
+const char internalServerErrorResponse[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: application/json\r\nContent-Length: 36\r\n\r\n{\"message\": \"Internal Server Error\"}";
 #define INTERNAL_SERVER_ERROR(clientSocket) STATIC_RESPONSE(clientSocket, internalServerErrorResponse)
 
 // HTTP methods
@@ -97,21 +102,41 @@ typedef struct sockaddr_in SA_IN;
 
 // User struct constants
 #define MAX_TRANSACTIONS 10
-#define DATE_SIZE 32
-#define DESCRIPTION_SIZE 32
-
+// Longest descricao, it's kept with its length instead of a '\0'
+#define DESCRIPTION_SIZE 10
+// An ISO-8601 timestamp, like 2024-01-17T02:34:41.217753Z, and the '\0'
+#define DATE_SIZE 28
+
+// Version of the serialized users, kept on the log, the checkpoints, the user files and the db replies
+// Data with another version is refused instead of misread
+#define USER_SCHEMA_VERSION 2
+
+// Serialized transaction:
+// realizadaEm(8) valor(4) tipo(1) descricaoLength(1) descricao(descricaoLength)
+#define TRANSACTION_SERIALIZED_HEADER_SIZE 14
+#define TRANSACTION_SERIALIZED_MAX_SIZE (TRANSACTION_SERIALIZED_HEADER_SIZE + DESCRIPTION_SIZE)
+// Serialized user, all numbers little endian:
+// version(1) - USER_SCHEMA_VERSION
+// id(4) limit(4) total(4) nTransactions(1), and the transactions from the oldest to the newest
+#define USER_SERIALIZED_HEADER_SIZE 14
+#define USER_SERIALIZED_MAX_SIZE (USER_SERIALIZED_HEADER_SIZE + MAX_TRANSACTIONS * TRANSACTION_SERIALIZED_MAX_SIZE)
+
+// 24 bytes, the timestamp is only formatted when the json is rendered
 typedef struct TRANSACTION {
+    // Microseconds since the epoch
+    long long realizadaEm;
     int valor;
     char tipo;
+    unsigned char descricaoLength;
     char descricao[DESCRIPTION_SIZE];
-    char realizada_em[DATE_SIZE];
 } Transaction;
 
+// 256 bytes, 4 cache lines
 typedef struct USER {
     int id;
     int limit, total;
-    int nTransactions;
-    int oldestTransaction;
+    unsigned char nTransactions;
+    unsigned char oldestTransaction;
     Transaction transactions[MAX_TRANSACTIONS];
 } User;
 
@@ -122,24 +147,55 @@ int check(int expression, const char* message);
 // Compare two strings up to maxLength
 int partialEqual(const char* str1, const char* str2, int maxLength);
 
-// Gets system time and stores it in timeStr
+// Gets system time and stores it in timeStr, as an ISO-8601 timestamp
+// timeStr must fit DATE_SIZE
 void getCurrentTimeStr(char* timeStr);
 
+// Gets the wall clock time in microseconds since the epoch, to stamp the transactions
+long long getEpochTimeUs();
+
+// Writes the time as an ISO-8601 UTC timestamp with microseconds, and a '\0'
+// timestamp must fit DATE_SIZE
+// Returns the size of the timestamp, without the '\0'
+int formatTimestamp(long long epochUs, char* timestamp);
+
+// Gets a monotonic time in milliseconds, to measure intervals
+long long getCurrentTimeMs();
+
+// Gets a monotonic time in microseconds, to measure short intervals
+long long getCurrentTimeUs();
+
 // Convert number to binary, writes it to a char[4] array
 void toBin(int number, char* binaryRepresentation);
 
 // Convert binary representation on char[4] to it's number
 int fromBin(char* binaryRepresentation);
 
-// Send request to server and store the response in the response string
-int clientRequest(int clientSocket, const char* request, int requestSize, char* response, int responseSize);
+// Writes a 64 bit number to a char[8] array, little endian
+void toBin64(long long value, char* bin);
 
-// Serialize user to a string
+// Reads a 64 bit number from a char[8] array, little endian
+long long fromBin64(const char* bin);
+
+// Serializes the transaction, serializedTransaction must fit TRANSACTION_SERIALIZED_MAX_SIZE
+// Returns the size of the serialized transaction in bytes
+int serializeTransaction(const Transaction* transaction, char* serializedTransaction);
+
+// Deserializes a transaction from the first size bytes
+// Returns the size it took, or ERROR if it's truncated or invalid
+int deserializeTransaction(const char* serializedTransaction, int size, Transaction* transaction);
+
+// Serialize user to a string, serializedUser must fit USER_SERIALIZED_MAX_SIZE
 // returns the size of the serialized user in bytes
-int serializeUser(User* user, char* serializedUser);
+int serializeUser(const User* user, char* serializedUser);
 
-// Deserialize user from a string
-void deserializeUser(char* serializedUser, User* user);
+// Same as serializeUser, keeping only the newest maxTransactions transactions
+// With 0 only the header goes, the id, limit and total
+int serializeUserProjection(const User* user, int maxTransactions, char* serializedUser);
+
+// Deserialize user from the first size bytes of the string
+// Returns the size it took, or ERROR if it's truncated, invalid or has another schema version
+int deserializeUser(const char* serializedUser, int size, User* user);
 
 int check(int expression, const char* message) {
     if (expression == ERROR) {
@@ -162,10 +218,78 @@ int partialEqual(const char* str1, const char* str2, int maxLength) {
 }
 
 void getCurrentTimeStr(char* timeStr) {
-    time_t mytime = time(NULL);
-    char* time_str = ctime(&mytime);
-    time_str[strlen(time_str) - 1] = '\0';
-    strcpy(timeStr, time_str);
+    formatTimestamp(getEpochTimeUs(), timeStr);
+}
+
+long long getEpochTimeUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Writes the number with a fixed number of digits
+void writeDigits(char* digits, int number, int nDigits) {
+    for (int i = nDigits - 1; i >= 0; i--) {
+        digits[i] = (char)('0' + number % 10);
+        number /= 10;
+    }
+}
+
+int formatTimestamp(long long epochUs, char* timestamp) {
+    long long seconds = epochUs / 1000000;
+    int micros = (int)(epochUs % 1000000);
+    if (micros < 0) {
+        seconds--;
+        micros += 1000000;
+    }
+    long long days = seconds / 86400;
+    int secondOfDay = (int)(seconds % 86400);
+    if (secondOfDay < 0) {
+        days--;
+        secondOfDay += 86400;
+    }
+
+    // Civil date from the days since 1970-01-01, without gmtime and its locks
+    // Years start on March 1st here, so the leap day is the last day of the year
+    days += 719468;
+    long long era = (days >= 0 ? days : days - 146096) / 146097;
+    int dayOfEra = (int)(days - era * 146097);
+    int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int shiftedMonth = (5 * dayOfYear + 2) / 153;
+    int day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+    int month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+    int year = (int)(yearOfEra + era * 400) + (month <= 2);
+
+    // YYYY-MM-DDTHH:MM:SS.ffffffZ
+    writeDigits(&timestamp[0], year, 4);
+    timestamp[4] = '-';
+    writeDigits(&timestamp[5], month, 2);
+    timestamp[7] = '-';
+    writeDigits(&timestamp[8], day, 2);
+    timestamp[10] = 'T';
+    writeDigits(&timestamp[11], secondOfDay / 3600, 2);
+    timestamp[13] = ':';
+    writeDigits(&timestamp[14], secondOfDay / 60 % 60, 2);
+    timestamp[16] = ':';
+    writeDigits(&timestamp[17], secondOfDay % 60, 2);
+    timestamp[19] = '.';
+    writeDigits(&timestamp[20], micros, 6);
+    timestamp[26] = 'Z';
+    timestamp[27] = '\0';
+    return DATE_SIZE - 1;
+}
+
+long long getCurrentTimeMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long getCurrentTimeUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
 void toBin(int value, char* bin) {
@@ -182,26 +306,88 @@ int fromBin(char* bin) {
     return value;
 }
 
-int clientRequest(int clientSocket, const char* request, int requestSize, char* response, int responseSize) {
-    send(clientSocket, request, requestSize, 0);
-    int bytesRead = recv(clientSocket, response, responseSize, 0);
-    if (bytesRead > 0) {
-        response[bytesRead] = '\0';
+void toBin64(long long value, char* bin) {
+    toBin((int)(value & 0xFFFFFFFF), &bin[0]);
+    toBin((int)(value >> 32), &bin[4]);
+}
+
+long long fromBin64(const char* bin) {
+    return (long long)(uint32_t)fromBin((char*)&bin[0]) | (long long)fromBin((char*)&bin[4]) << 32;
+}
+
+// The fields are written one by one instead of a memcpy of the struct,
+// so only the used transactions and the used part of the descricao are sent and stored,
+// and the layout doesn't depend on the compiler's padding
+int serializeTransaction(const Transaction* transaction, char* serializedTransaction) {
+    int descricaoLength = transaction->descricaoLength;
+    toBin64(transaction->realizadaEm, &serializedTransaction[0]);
+    toBin(transaction->valor, &serializedTransaction[8]);
+    serializedTransaction[12] = transaction->tipo;
+    serializedTransaction[13] = (char)descricaoLength;
+    memcpy(&serializedTransaction[14], transaction->descricao, descricaoLength);
+    return TRANSACTION_SERIALIZED_HEADER_SIZE + descricaoLength;
+}
+
+int deserializeTransaction(const char* serializedTransaction, int size, Transaction* transaction) {
+    if (size < TRANSACTION_SERIALIZED_HEADER_SIZE) {
+        return ERROR;
+    }
+    int descricaoLength = (unsigned char)serializedTransaction[13];
+    if (descricaoLength > DESCRIPTION_SIZE || TRANSACTION_SERIALIZED_HEADER_SIZE + descricaoLength > size) {
+        return ERROR;
     }
-    return bytesRead;
+    transaction->realizadaEm = fromBin64(&serializedTransaction[0]);
+    transaction->valor = fromBin((char*)&serializedTransaction[8]);
+    transaction->tipo = serializedTransaction[12];
+    transaction->descricaoLength = (unsigned char)descricaoLength;
+    memcpy(transaction->descricao, &serializedTransaction[14], descricaoLength);
+    return TRANSACTION_SERIALIZED_HEADER_SIZE + descricaoLength;
 }
 
-// never do this in production
-// it's faster to memcpy and send it over the network
-// but when dealing with different machines and operating systems
-// it's better to serialize the data manually
-int serializeUser(User* user, char* serializedUser) {
-    memcpy(serializedUser, user, sizeof(User));
-    return sizeof(User);
+int serializeUser(const User* user, char* serializedUser) {
+    return serializeUserProjection(user, MAX_TRANSACTIONS, serializedUser);
 }
 
-void deserializeUser(char* serializedUser, User* user) {
-    memcpy(user, serializedUser, sizeof(User));
+int serializeUserProjection(const User* user, int maxTransactions, char* serializedUser) {
+    int nTransactions = user->nTransactions < maxTransactions ? user->nTransactions : maxTransactions;
+    if (nTransactions < 0) {
+        nTransactions = 0;
+    }
+    serializedUser[0] = USER_SCHEMA_VERSION;
+    toBin(user->id, &serializedUser[1]);
+    toBin(user->limit, &serializedUser[5]);
+    toBin(user->total, &serializedUser[9]);
+    serializedUser[13] = (char)nTransactions;
+    int size = USER_SERIALIZED_HEADER_SIZE;
+    // The circular array is unrolled, so the oldest transaction kept is always the first one
+    int i = (user->oldestTransaction + user->nTransactions - nTransactions) % MAX_TRANSACTIONS;
+    for (int j = 0; j < nTransactions; j++) {
+        size += serializeTransaction(&user->transactions[i], &serializedUser[size]);
+        i = (i + 1) % MAX_TRANSACTIONS;
+    }
+    return size;
+}
+
+int deserializeUser(const char* serializedUser, int size, User* user) {
+    if (size < USER_SERIALIZED_HEADER_SIZE || serializedUser[0] != USER_SCHEMA_VERSION) {
+        return ERROR;
+    }
+    int nTransactions = (unsigned char)serializedUser[13];
+    if (nTransactions > MAX_TRANSACTIONS) {
+        return ERROR;
+    }
+    user->id = fromBin((char*)&serializedUser[1]);
+    user->limit = fromBin((char*)&serializedUser[5]);
+    user->total = fromBin((char*)&serializedUser[9]);
+    user->nTransactions = (unsigned char)nTransactions;
+    user->oldestTransaction = 0;
+    int position = USER_SERIALIZED_HEADER_SIZE;
+    for (int i = 0; i < nTransactions; i++) {
+        int transactionSize = deserializeTransaction(&serializedUser[position], size - position, &user->transactions[i]);
+        raiseIfError(transactionSize);
+        position += transactionSize;
+    }
+    return position;
 }
 
 #endif
@@ -4,9 +4,18 @@
 // Header file for the http handler
 // Handles the http requests and responses
 // Handles deserialization and serialization of the requests and responses
-// Calls the database client functions to call the server db socket
-
-#include "dbClient.h"
+// Calls the database client functions to call the server db socket,
+// or runs the operations on the shared users in the embedded mode, see embeddedDb.h
+// The statements are cached by the version of their user, see extratoCache.h
+// Every request is measured, by route and status, and the metrics are served on GET /metrics, see metrics.h
+
+#include "connection.h"
+#include "dbPool.h"
+#include "embeddedDb.h"
+#include "extratoCache.h"
+#include "httpParser.h"
+#include "metrics.h"
+#include "responseWriter.h"
 
 // server port
 // #define SERVER_PORT 9999
@@ -16,10 +25,8 @@
 #define SOCKET_READ_SIZE 8 * 1024
 // 16KB
 #define RESPONSE_SIZE 16 * 1024
-// 8KB
-#define RESPONSE_BODY_SIZE 8 * 1024
 // 256B
-#define RESPONSE_BODY_TRANSACTIONS_SIZE 256
+#define POST_RESPONSE_SIZE 256
 
 #define LOG_SEPARATOR "\n----------------------------------------------\n"
 
@@ -27,36 +34,67 @@
 #define SEND_DEFAULT 0
 #define PROTOCOL_DEFAULT 0
 
+// socket results
+#define END_CONNECTION 1
+// The request is waiting for the database, the response is sent by a callback
+#define WAITING_DB 2
+
 // Startup server socket on the given port, with the max number of connections waiting to be accepted set to backlog
 // Crash the program if the socket creation or binding fails
 int setupServer(short port, int backlog);
 
-// Handles the request and sends the response to the clientSocket
-int handleRequest(char* request, int requestSize, int clientSocket, int dbSocket);
-
-// Handles any GET request, assuming all GET requests are for the bank statement endpoint
-int handleGetRequest(int clientSocket, int dbSocket, char* request, int requestSize);
-// Assuming the request is "GET /clientes/1/..." id is on the 14th position
-// Returns ERROR if the request is invalid
-// Returns the id if the request is valid
-int getIdFromGETRequest(const char* request, int requestLength);
-// Serializes GET bank statement response into json and writes it to response
-void serializeGetResponse(User* user, char* response);
-
-// Handles any POST request, assuming all POST requests are for creating transactions
-int handlePostRequest(int clientSocket, int dbSocket, char* request, int requestSize);
-// Assuming the request is "POST /clientes/1/..." id is on the 15th position
-// Returns ERROR if the request is invalid
-// Returns the id if the request is valid
-int getIdFromPOSTRequest(const char* request, int requestLength);
-// Get transaction from body
-// returns ERROR if the body it fails to parse the body
-// returns SUCCESS if it parses the body successfully
-// Sets the transaction variable with the parsed values
-// Sets the transaction.realizada_em with the current time
-int getTransactionFromBody(char* request, Transaction* transaction);
-// Serializes POST transaction response into json and writes it to response
-void serializePostResponse(User* user, char* response);
+// Reads everything available on the client socket, handles the complete requests and sends the responses
+// Closes the connection if the client closed it, or once the last response is sent
+// Called when the socket has activity, and when a request waiting for the database is answered
+void serveClient(Connection* client, DbPool* pool);
+
+// Handles every complete request buffered on the connection, in the order they arrived
+// Partial requests are kept on the connection until the rest of them is received
+// Stops at a request waiting for the database, the next ones are handled once it's answered
+// Returns END_CONNECTION if the connection should be closed once the responses are sent
+// Returns SUCCESS if the connection should be kept alive
+int handleConnectionRequests(Connection* client, DbPool* pool);
+
+// Routes the parsed request and sends the response to the client
+// Returns WAITING_DB if the response will be sent once the database answers
+int handleRequest(HttpRequest* request, Connection* client, DbPool* pool);
+
+// Records the time of the request just answered, with the status of its response
+void recordHttpRequest(Connection* client);
+
+// Handles GET /metrics, the metrics of every worker of the process
+// Returns ERROR if the response can't be sent
+int handleMetricsRequest(int clientSocket);
+
+// Handles GET /clientes/<id>/extrato
+// Answers right away in the embedded mode, from the cache if the user didn't change
+// Otherwise asks the database for the user, unless it's still at the version of the cached statement
+int handleGetRequest(Connection* client, DbPool* pool, HttpRequest* request);
+// Sends the bank statement once the database answers the read
+void respondGetRequest(DbPool* pool, Connection* client, int result, User* user, long long version);
+// Sends the bank statement, or the error of the read
+// A user read at the version is rendered and cached, a NOT_MODIFIED one is sent from the cache
+// Returns ERROR if the response can't be sent
+int sendGetResponse(int clientSocket, int result, User* user, long long version);
+// Serializes GET bank statement response into json and writes it to the buffer
+// Returns the start of the response on the buffer, and sets its size on responseSize,
+// and where data_extrato is on the response on timestampOffset
+// Returns NULL if the response doesn't fit on the buffer
+char* serializeGetResponse(User* user, char* buffer, int bufferSize, int* responseSize, int* timestampOffset);
+
+// Handles POST /clientes/<id>/transacoes
+// Answers right away in the embedded mode
+int handlePostRequest(Connection* client, DbPool* pool, HttpRequest* request);
+// Sends the transaction result once the database answers the update
+void respondPostRequest(DbPool* pool, Connection* client, int result, User* user, long long version);
+// Sends the balance, or the error of the update
+// The cached statement of the user is dropped once the user is at another version
+// Returns ERROR if the response can't be sent
+int sendPostResponse(int clientSocket, int transactionResult, User* user, long long version);
+// Serializes POST transaction response into json and writes it to the buffer
+// Returns the start of the response on the buffer, and sets its size on responseSize
+// Returns NULL if the response doesn't fit on the buffer
+char* serializePostResponse(User* user, char* buffer, int bufferSize, int* responseSize);
 
 int setupServer(short port, int backlog) {
     int serverSocket;
@@ -71,6 +109,8 @@ int setupServer(short port, int backlog) {
     // https://handsonnetworkprogramming.com/articles/bind-error-98-eaddrinuse-10048-wsaeaddrinuse-address-already-in-use/
     int yes = 1;
     check(setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)), "Failed to set socket options");
+    // Every worker binds its own socket to the same port, and the kernel balances the connections between them
+    check(setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)), "Failed to set socket options");
 
     check(bind(serverSocket, (SA*)&serverAddress, sizeof(serverAddress)), "Failed to bind socket");
     check(listen(serverSocket, backlog), "Failed to listen on socket");
@@ -78,7 +118,105 @@ int setupServer(short port, int backlog) {
     return serverSocket;
 }
 
-int handleRequest(char* request, int requestSize, int clientSocket, int dbSocket) {
+void serveClient(Connection* client, DbPool* pool) {
+    // The loop is edge-triggered, so the socket is read until it would block
+    bool shouldClose = false;
+    while (!client->closeAfterWrite) {
+        // The buffer is full of pipelined requests, the rest is read when the database answers
+        if (client->waitingDb && client->readLength == CONNECTION_READ_SIZE) {
+            break;
+        }
+        // The client isn't reading its responses, the rest is read once the socket is writable again,
+        // so what it sends meanwhile waits on the kernel instead of piling up here
+        if (hasPendingWrites(client)) {
+            if (flushConnection(client) == ERROR) {
+                shouldClose = true;
+                break;
+            }
+            if (hasPendingWrites(client)) {
+                break;
+            }
+        }
+        int bytesRead = receiveIntoConnection(client);
+        if (bytesRead == ERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (bytesRead < 1) {
+            shouldClose = true;
+            break;
+        }
+        client->receivedAt = getMetricsTime();
+        if (handleConnectionRequests(client, pool) == END_CONNECTION) {
+            client->closeAfterWrite = true;
+        }
+    }
+
+    // Send what didn't fit on the socket before
+    if (flushConnection(client) == ERROR) {
+        shouldClose = true;
+    }
+    if (client->closeAfterWrite && !client->waitingDb && !hasPendingWrites(client)) {
+        shouldClose = true;
+    }
+
+    if (shouldClose) {
+        log("{ Client closed connection }\n");
+        closeConnection(client->socket);
+    }
+}
+
+// Marks the request as answered, and carries on with the requests that arrived meanwhile
+void resumeClient(Connection* client, DbPool* pool) {
+    recordHttpRequest(client);
+    client->waitingDb = false;
+    if (!client->closeAfterWrite && handleConnectionRequests(client, pool) == END_CONNECTION) {
+        client->closeAfterWrite = true;
+    }
+    serveClient(client, pool);
+}
+
+int handleConnectionRequests(Connection* connection, DbPool* pool) {
+    while (connection->readLength > 0 && !connection->waitingDb) {
+        HttpRequest request;
+        long long parseStart = getMetricsTime();
+        int requestLength = parseHttpRequest(connection->readBuffer, connection->readLength, CONNECTION_READ_SIZE, &request);
+        if (requestLength == 0) {
+            // Wait for the rest of the request
+            return SUCCESS;
+        }
+        recordLatency(METRIC_API_PARSE, parseStart);
+        connection->requestRoute = METRICS_ROUTE_OTHER;
+        if (requestLength == ERROR) {
+            log("[ Bad Request - Malformed or too big ]\n");
+            BAD_REQUEST(connection->socket);
+            recordHttpRequest(connection);
+            return END_CONNECTION;
+        }
+
+        // The request points into the read buffer, so it's handled before being consumed
+        int sentResult = handleRequest(&request, connection, pool);
+        consumeConnectionInput(connection, requestLength);
+
+        if (sentResult == ERROR) {
+            log("{ Error sending response }\n");
+            return END_CONNECTION;
+        }
+        if (sentResult == WAITING_DB) {
+            log("{ Request waiting for the db }\n");
+            connection->waitingDb = true;
+            return request.keepAlive ? SUCCESS : END_CONNECTION;
+        }
+        recordHttpRequest(connection);
+        log("{ Request handled }\n");
+        if (!request.keepAlive) {
+            return END_CONNECTION;
+        }
+    }
+    return SUCCESS;
+}
+
+int handleRequest(HttpRequest* request, Connection* client, DbPool* pool) {
+    int clientSocket = client->socket;
 #ifdef LOGGING
     char reqTime[DATE_SIZE];
     getCurrentTimeStr(reqTime);
@@ -86,227 +224,248 @@ int handleRequest(char* request, int requestSize, int clientSocket, int dbSocket
 
     log("{ %s - Received:", reqTime);
     log(LOG_SEPARATOR);
-    log("[%s]", request);
+    log("[%.*s]", request->length, client->readBuffer);
     log(LOG_SEPARATOR);
-    log("(%d bytes read) }\n", requestSize);
+    log("(%d bytes read) }\n", request->length);
 
-    // "GET" alone has 3 bytes, so we need at least 4 bytes to consume a request
-    if (requestSize < 4) {
-        log("[ Unprocessable Entity ]\n");
-        return UNPROCESSABLE_ENTITY(clientSocket);
+    if (request->method == HTTP_METHOD_OTHER) {
+        log("[ Method not allowed ]\n");
+        return METHOD_NOT_ALLOWED(clientSocket);
     }
-
-    bool isGet = partialEqual(request, GET_METHOD, GET_METHOD_LENGTH);
-    if (isGet) {
-        return handleGetRequest(clientSocket, dbSocket, request, requestSize);
+    if (request->method == HTTP_METHOD_GET && request->path == HTTP_PATH_EXTRATO) {
+        client->requestRoute = METRICS_ROUTE_EXTRATO;
+        return handleGetRequest(client, pool, request);
+    }
+    if (request->method == HTTP_METHOD_POST && request->path == HTTP_PATH_TRANSACOES) {
+        client->requestRoute = METRICS_ROUTE_TRANSACOES;
+        return handlePostRequest(client, pool, request);
+    }
+    if (request->method == HTTP_METHOD_GET && request->path == HTTP_PATH_METRICS) {
+        return handleMetricsRequest(clientSocket);
     }
 
-    bool isPost = partialEqual(request, POST_METHOD, POST_METHOD_LENGTH);
-    if (isPost) {
-        return handlePostRequest(clientSocket, dbSocket, request, requestSize);
+    log("[ NOT_FOUND - path ]\n");
+    return NOT_FOUND(clientSocket);
+}
+
+// Status of the last response sent by the worker, it's sent right before the request is recorded
+__thread int lastResponseStatus = 0;
+
+int sendHttpResponse(int socket, const char* response, int size) {
+    // "HTTP/1.1 200 ..."
+    if (size > 12) {
+        lastResponseStatus = (response[9] - '0') * 100 + (response[10] - '0') * 10 + (response[11] - '0');
     }
+    return sendToClient(socket, response, size);
+}
 
-    log("[ Method not allowed ]\n");
-    return METHOD_NOT_ALLOWED(clientSocket);
+void recordHttpRequest(Connection* client) {
+    recordLatency(getRequestSeries(client->requestRoute, lastResponseStatus), client->receivedAt);
 }
 
-int handleGetRequest(int clientSocket, int dbSocket, char* request, int requestSize) {
-    // get id from request path
-    int id = getIdFromGETRequest(request, requestSize);
-    if (id == ERROR) {
-        log("[ NOT_FOUND - over 9 ]\n");
-        return NOT_FOUND(clientSocket);
+int handleMetricsRequest(int clientSocket) {
+    char* buffer = malloc(METRICS_RESPONSE_SIZE);
+    if (buffer == NULL) {
+        return INTERNAL_SERVER_ERROR(clientSocket);
     }
+    int responseSize;
+    char* response = serializeMetrics(METRICS_API, buffer, METRICS_RESPONSE_SIZE, &responseSize);
+    int result;
+    if (response == NULL) {
+        result = INTERNAL_SERVER_ERROR(clientSocket);
+    } else {
+        result = sendHttpResponse(clientSocket, response, responseSize);
+    }
+    free(buffer);
+    return result;
+}
 
-    // get user from db by id
-    User user;
-    int readResult = readUser(dbSocket, &user, id);
+int handleGetRequest(Connection* client, DbPool* pool, HttpRequest* request) {
+    int clientSocket = client->socket;
+    if (embeddedSegment != NULL) {
+        long long version;
+        int responseSize;
+        char* cached = getUserVersionEmbedded(request->id, &version) == SUCCESS
+                           ? getCachedExtrato(request->id, version, &responseSize)
+                           : NULL;
+        if (cached != NULL) {
+            return sendHttpResponse(clientSocket, cached, responseSize);
+        }
+        User user;
+        int readResult = readUserEmbedded(&user, request->id, &version);
+        return sendGetResponse(clientSocket, readResult, &user, version);
+    }
+    // get user from db by id, the response is sent when the db answers
+    long long cachedVersion = getCachedVersion(request->id);
+    int readResult = readUser(pickDbConnection(pool), request->id, MAX_TRANSACTIONS, cachedVersion, client, respondGetRequest);
     if (readResult == ERROR) {
-        log("[ NOT_FOUND - file ]\n");
-        return NOT_FOUND(clientSocket);
+        log("[ Internal Server Error - Db request ]\n");
+        return INTERNAL_SERVER_ERROR(clientSocket);
     }
+    return WAITING_DB;
+}
 
-    // serialize user to response
-    char response[RESPONSE_SIZE];
-    serializeGetResponse(&user, response);
-
-    log("[ %s ]\n", response);
-    return RESPOND(clientSocket, response);
+void respondGetRequest(DbPool* pool, Connection* client, int result, User* user, long long version) {
+    // The statement left the cache while the db checked its version, so the user is read again whole
+    if (result == NOT_MODIFIED && getCachedVersion(user->id) != version) {
+        if (readUser(pickDbConnection(pool), user->id, MAX_TRANSACTIONS, DB_NO_VERSION, client, respondGetRequest) != ERROR) {
+            return;
+        }
+        result = ERROR;
+    }
+    sendGetResponse(client->socket, result, user, version);
+    resumeClient(client, pool);
 }
 
-int getIdFromGETRequest(const char* request, int requestLength) {
-    if (requestLength < 15) {
-        return ERROR;
+int sendGetResponse(int clientSocket, int result, User* user, long long version) {
+    int responseSize;
+    if (result == NOT_MODIFIED) {
+        char* cached = getCachedExtrato(user->id, version, &responseSize);
+        if (cached == NULL) {
+            return INTERNAL_SERVER_ERROR(clientSocket);
+        }
+        return sendHttpResponse(clientSocket, cached, responseSize);
+    }
+    if (result == FILE_NOT_FOUND) {
+        log("[ NOT_FOUND - file ]\n");
+        return NOT_FOUND(clientSocket);
     }
-    if (request[13] != '/' || request[15] != '/') {
-        return ERROR;
+    if (result != SUCCESS) {
+        log("[ Internal Server Error - Db read ]\n");
+        return INTERNAL_SERVER_ERROR(clientSocket);
     }
-    if (request[14] < '0' || request[14] > '9') {
-        return ERROR;
+    // serialize user to response
+    char buffer[RESPONSE_SIZE];
+    int timestampOffset;
+    long long serializeStart = getMetricsTime();
+    char* response = serializeGetResponse(user, buffer, sizeof(buffer), &responseSize, &timestampOffset);
+    recordLatency(METRIC_API_SERIALIZE_EXTRATO, serializeStart);
+    if (response == NULL) {
+        return INTERNAL_SERVER_ERROR(clientSocket);
     }
-    return request[14] - '0';
+    cacheExtrato(user->id, version, response, responseSize, timestampOffset);
+    log("[ %.*s ]\n", responseSize, response);
+    return sendHttpResponse(clientSocket, response, responseSize);
 }
 
-void serializeOrderedTransactions(User* user, char* body) {
+// Writes the transactions from the newest to the oldest, separated by commas
+void serializeOrderedTransactions(User* user, ResponseWriter* writer) {
     if (user->nTransactions == 0) {
         return;
     }
-    char transactionData[RESPONSE_BODY_TRANSACTIONS_SIZE];
 
     int i = user->oldestTransaction;
     i = (i - 1 + user->nTransactions) % user->nTransactions;
     for (int j = 0; j < user->nTransactions; j++) {
-        Transaction transaction = user->transactions[i];
-        const char* transactionTemplate = "{\"valor\":%d,\"tipo\":\"%c\",\"descricao\":\"%s\",\"realizada_em\":\"%s\"},";
-        sprintf(transactionData,
-                transactionTemplate,
-                transaction.valor, transaction.tipo, transaction.descricao, transaction.realizada_em);
-
-        strcat(body, transactionData);
+        Transaction* transaction = &user->transactions[i];
+        if (j > 0) {
+            appendChar(writer, ',');
+        }
+        appendLiteral(writer, "{\"valor\":");
+        appendInt(writer, transaction->valor);
+        appendLiteral(writer, ",\"tipo\":\"");
+        appendChar(writer, transaction->tipo);
+        appendLiteral(writer, "\",\"descricao\":\"");
+        appendBytes(writer, transaction->descricao, transaction->descricaoLength);
+        appendLiteral(writer, "\",\"realizada_em\":\"");
+        appendTimestamp(writer, transaction->realizadaEm);
+        appendLiteral(writer, "\"}");
         i = (i - 1 + user->nTransactions) % user->nTransactions;
     }
-    int length = strlen(body);
-    body[length - 1] = '\0';
 }
 
-void serializeGetResponse(User* user, char* response) {
-    char body[RESPONSE_BODY_SIZE] = "";
-    char dateTime[DATE_SIZE];
+char* serializeGetResponse(User* user, char* buffer, int bufferSize, int* responseSize, int* timestampOffset) {
+    ResponseWriter writer;
+    startResponse(&writer, buffer, bufferSize);
 
     // First part of the response
-    getCurrentTimeStr(dateTime);
-    const char* userDataTemplate = "{\"saldo\":{\"total\":%d,\"data_extrato\":\"%s\",\"limite\":%d},\"ultimas_transacoes\":[";
-    sprintf(body,
-            userDataTemplate,
-            user->total, dateTime, user->limit);
+    appendLiteral(&writer, "{\"saldo\":{\"total\":");
+    appendInt(&writer, user->total);
+    appendLiteral(&writer, ",\"data_extrato\":\"");
+    int timestampPosition = writer.length;
+    appendTimestamp(&writer, getEpochTimeUs());
+    appendLiteral(&writer, "\",\"limite\":");
+    appendInt(&writer, user->limit);
+    appendLiteral(&writer, "},\"ultimas_transacoes\":[");
 
-    serializeOrderedTransactions(user, body);
+    serializeOrderedTransactions(user, &writer);
 
     // Close the array and the outermost object
-    strcat(body, "]}");
+    appendLiteral(&writer, "]}");
 
-    // Write the http response using a success template, with a body
-    sprintf(response, successResponseJsonTemplate, body);
+    // Write the http headers before the body
+    char* response = finishResponse(&writer, okJsonHeader, sizeof(okJsonHeader) - 1, responseSize);
+    *timestampOffset = response == NULL ? ERROR : (int)(&buffer[timestampPosition] - response);
+    return response;
 }
 
-int handlePostRequest(int clientSocket, int dbSocket, char* request, int requestSize) {
-    // get id from request path
-    int id = getIdFromPOSTRequest(request, requestSize);
-    if (id == ERROR) {
-        log("[ Not Found - over 9 ]\n");
-        return NOT_FOUND(clientSocket);
-    }
-
+int handlePostRequest(Connection* client, DbPool* pool, HttpRequest* request) {
+    int clientSocket = client->socket;
     Transaction transaction;
-    int parseResult = getTransactionFromBody(request, &transaction);
+    int parseResult = parseTransaction(request->body, request->bodyLength, &transaction);
     if (parseResult == ERROR) {
         log("[ Unprocessable Entity - Failed to get body ]\n");
         return UNPROCESSABLE_ENTITY(clientSocket);
     }
 
-    // update user on db by id
-    User user;
-    int transactionResult = updateUserWithTransaction(dbSocket, id, &transaction, &user);
+    if (embeddedSegment != NULL) {
+        User user;
+        long long version;
+        transaction.realizadaEm = getEpochTimeUs();
+        int transactionResult = updateUserEmbedded(request->id, &transaction, &user, &version);
+        return sendPostResponse(clientSocket, transactionResult, &user, version);
+    }
+
+    // update user on db by id, the response is sent when the db answers
+    int requestResult = updateUserWithTransaction(pickDbConnection(pool), request->id, &transaction, client, respondPostRequest);
+    if (requestResult == ERROR) {
+        log("[ Internal Server Error - Db request ]\n");
+        return INTERNAL_SERVER_ERROR(clientSocket);
+    }
+    return WAITING_DB;
+}
+
+void respondPostRequest(DbPool* pool, Connection* client, int transactionResult, User* user, long long version) {
+    sendPostResponse(client->socket, transactionResult, user, version);
+    resumeClient(client, pool);
+}
 
+int sendPostResponse(int clientSocket, int transactionResult, User* user, long long version) {
     if (transactionResult == ERROR) {
         log("[ Internal Server Error - Locking file ]\n");
         return INTERNAL_SERVER_ERROR(clientSocket);
-    } else if (transactionResult == FILE_NOT_FOUND) {
+    }
+    if (transactionResult == FILE_NOT_FOUND) {
         log("[ Not Found - User file ]\n");
         return NOT_FOUND(clientSocket);
-    } else if (transactionResult == LIMIT_EXCEEDED_ERROR || transactionResult == INVALID_TIPO_ERROR) {
+    }
+    if (transactionResult == LIMIT_EXCEEDED_ERROR || transactionResult == INVALID_TIPO_ERROR) {
         log("[ Unprocessable entity - LIMIT OR TIPO ]\n");
         return UNPROCESSABLE_ENTITY(clientSocket);
     }
-
+    invalidateExtrato(user->id, version);
     // serialize user to response
-    char response[RESPONSE_SIZE];
-    serializePostResponse(&user, response);
-
-    log("[ %s ]\n", response);
-    // send response
-    return RESPOND(clientSocket, response);
-}
-
-int getIdFromPOSTRequest(const char* request, int requestLength) {
-    if (requestLength < 16) {
-        return ERROR;
-    }
-    if (request[14] != '/' || request[16] != '/') {
-        return ERROR;
-    }
-    if (request[15] < '0' || request[15] > '9') {
-        return ERROR;
-    }
-    return request[15] - '0';
-}
-
-int getValorFromBody(char* str) {
-    const int maxDigits = 20;
-    for (int i = 0; i < maxDigits; i++) {
-        if (str[i] == ',') {
-            break;
-        }
-        if ((str[i] < '0' || str[i] > '9') && str[i] != ' ') {
-            return ERROR;
-        }
-    }
-    return atoi(str);
-}
-
-int getTransactionFromBody(char* request, Transaction* transaction) {
-    // Find body in request
-    char* body = strstr(request, "{");
-    errIfNull(body);
-
-    // Find valor key in body
-    char* valor = strstr(body, "valor");
-    errIfNull(valor);
-    valor = strstr(valor, ":");
-    errIfNull(valor);
-    valor = &valor[1];
-    transaction->valor = getValorFromBody(valor);
-    raiseIfError(transaction->valor);
-
-    // Find tipo key in body
-    char* tipo = strstr(body, "tipo");
-    errIfNull(tipo);
-    tipo = strstr(tipo, ":");
-    errIfNull(tipo);
-    tipo = strstr(tipo, "\"");
-    errIfNull(tipo);
-    transaction->tipo = tipo[1];
-
-    // Find descricao key in body
-    char* descricaoStart = strstr(body, "descricao");
-    errIfNull(descricaoStart);
-    descricaoStart = strstr(descricaoStart, ":");
-    errIfNull(descricaoStart);
-    // Find the quote before the value
-    descricaoStart = strstr(descricaoStart, "\"");
-    errIfNull(descricaoStart);
-    descricaoStart++;
-    // Find the quote after the value
-    char* descricaoEnd = strstr(descricaoStart, "\"");
-    errIfNull(descricaoEnd);
-    // Copy the value to the transaction
-    char descricao[DESCRIPTION_SIZE];
-    int length = descricaoEnd - descricaoStart;
-    if (length > 10 || length < 1) {
-        return ERROR;
+    char buffer[POST_RESPONSE_SIZE];
+    int responseSize;
+    long long serializeStart = getMetricsTime();
+    char* response = serializePostResponse(user, buffer, sizeof(buffer), &responseSize);
+    recordLatency(METRIC_API_SERIALIZE_TRANSACOES, serializeStart);
+    if (response == NULL) {
+        return INTERNAL_SERVER_ERROR(clientSocket);
     }
-    strncpy(descricao, descricaoStart, length);
-    descricao[length] = '\0';
-    strcpy(transaction->descricao, descricao);
-
-    // Set the transaction realizada_em to the current time
-    getCurrentTimeStr(transaction->realizada_em);
-
-    return SUCCESS;
+    log("[ %.*s ]\n", responseSize, response);
+    // send response
+    return sendHttpResponse(clientSocket, response, responseSize);
 }
 
-void serializePostResponse(User* user, char* response) {
-    const char* postResponseTemplate = "HTTP/1.1 200 OK\nContent-Type: application/json\n\n{\"limite\":%d, \"saldo\":%d}";
-    sprintf(response, postResponseTemplate, user->limit, user->total);
+char* serializePostResponse(User* user, char* buffer, int bufferSize, int* responseSize) {
+    ResponseWriter writer;
+    startResponse(&writer, buffer, bufferSize);
+    appendLiteral(&writer, "{\"limite\":");
+    appendInt(&writer, user->limit);
+    appendLiteral(&writer, ", \"saldo\":");
+    appendInt(&writer, user->total);
+    appendChar(&writer, '}');
+    return finishResponse(&writer, okJsonHeader, sizeof(okJsonHeader) - 1, responseSize);
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,399 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+// Header file for the http request parser
+// Parses a request in a single forward pass over the buffer: the request line, the headers and the json body
+// Every read is bounds checked against the end of the buffer, the request doesn't need to be '\0' terminated
+// Delimiters are found 16 or 32 bytes at a time with SSE2 or AVX2, when the compiler targets them
+
+#include <limits.h>
+#include <strings.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "helpers.h"
+
+// Request methods
+#define HTTP_METHOD_OTHER 0
+#define HTTP_METHOD_GET 1
+#define HTTP_METHOD_POST 2
+
+// Request paths, /clientes/<id>/extrato, /clientes/<id>/transacoes and /metrics
+#define HTTP_PATH_OTHER 0
+#define HTTP_PATH_EXTRATO 1
+#define HTTP_PATH_TRANSACOES 2
+#define HTTP_PATH_METRICS 3
+
+// Ids are 32 bit, ids with more digits, or above INT_MAX, are not routed
+#define HTTP_MAX_ID_DIGITS 10
+
+typedef struct HTTP_REQUEST {
+    int method;
+    int path;
+    // ERROR if the path has no valid id
+    int id;
+    // False if the client asked to close the connection, or is on HTTP/1.0
+    bool keepAlive;
+    const char* body;
+    int bodyLength;
+    // Size of the whole request, headers and body
+    int length;
+} HttpRequest;
+
+// Parses the first request on the buffer
+// maxLength is the biggest request accepted
+// Returns 0 if the request is not complete yet
+// Returns ERROR if the request is malformed, its body length is ambiguous, or it's bigger than maxLength
+// Returns the size of the request if it's complete, and fills request
+// An unknown method or path is not an error, it's reported on request->method and request->path
+int parseHttpRequest(const char* buffer, int length, int maxLength, HttpRequest* request);
+
+// Parses the valor, tipo and descricao fields of the transaction json body
+// Other fields are skipped
+// Returns ERROR if a field is missing or invalid
+// Returns SUCCESS and fills the transaction otherwise, realizadaEm is left for the database to set
+int parseTransaction(const char* body, int length, Transaction* transaction);
+
+// Returns the first occurrence of character between start and end
+// Returns NULL if it's not found
+const char* findByte(const char* start, const char* end, char character);
+
+const char* findByte(const char* start, const char* end, char character) {
+    const char* current = start;
+#ifdef __AVX2__
+    const __m256i pattern32 = _mm256_set1_epi8(character);
+    while (end - current >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)current);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern32));
+        if (mask != 0) {
+            return current + __builtin_ctz(mask);
+        }
+        current += 32;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i pattern16 = _mm_set1_epi8(character);
+    while (end - current >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)current);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern16));
+        if (mask != 0) {
+            return current + __builtin_ctz(mask);
+        }
+        current += 16;
+    }
+#endif
+    // What's left is smaller than a vector
+    for (; current < end; current++) {
+        if (*current == character) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
+// Returns true if the bytes between start and end are exactly the literal
+#define equalsLiteral(start, end, literal) \
+    ((end) - (start) == sizeof(literal) - 1 && memcmp(start, literal, sizeof(literal) - 1) == 0)
+
+// Returns true if the line starts with the header name, case insensitive
+#define isHeader(line, end, name) \
+    ((end) - (line) > (long)sizeof(name) - 1 && strncasecmp(line, name, sizeof(name) - 1) == 0)
+
+// Skips the spaces and tabs after a header name
+const char* skipHeaderSpaces(const char* current, const char* end) {
+    while (current < end && (*current == ' ' || *current == '\t')) {
+        current++;
+    }
+    return current;
+}
+
+// Parses /clientes/<id>/<resource>, setting the id and the path of the request
+void parsePath(const char* path, const char* end, HttpRequest* request) {
+    static const char prefix[] = "/clientes/";
+    const int prefixLength = sizeof(prefix) - 1;
+    request->id = ERROR;
+    request->path = HTTP_PATH_OTHER;
+    if (equalsLiteral(path, end, "/metrics")) {
+        request->path = HTTP_PATH_METRICS;
+        return;
+    }
+    if (end - path <= prefixLength || memcmp(path, prefix, prefixLength) != 0) {
+        return;
+    }
+
+    const char* current = &path[prefixLength];
+    const char* digits = current;
+    long id = 0;
+    while (current < end && *current >= '0' && *current <= '9' && current - digits < HTTP_MAX_ID_DIGITS) {
+        id = id * 10 + (*current - '0');
+        current++;
+    }
+    if (current == digits || current == end || *current != '/' || id > INT_MAX) {
+        return;
+    }
+    current++;
+
+    if (equalsLiteral(current, end, "extrato")) {
+        request->path = HTTP_PATH_EXTRATO;
+    } else if (equalsLiteral(current, end, "transacoes")) {
+        request->path = HTTP_PATH_TRANSACOES;
+    } else {
+        return;
+    }
+    request->id = (int)id;
+}
+
+// Parses "<method> <path> <version>", line doesn't include the line break
+// Returns ERROR if the line is malformed
+int parseRequestLine(const char* line, const char* end, HttpRequest* request) {
+    const char* methodEnd = findByte(line, end, ' ');
+    errIfNull(methodEnd);
+    if (equalsLiteral(line, methodEnd, "GET")) {
+        request->method = HTTP_METHOD_GET;
+    } else if (equalsLiteral(line, methodEnd, "POST")) {
+        request->method = HTTP_METHOD_POST;
+    } else {
+        request->method = HTTP_METHOD_OTHER;
+    }
+
+    const char* path = methodEnd + 1;
+    const char* pathEnd = findByte(path, end, ' ');
+    errIfNull(pathEnd);
+    parsePath(path, pathEnd, request);
+
+    // HTTP/1.0 closes the connection by default
+    const char* version = pathEnd + 1;
+    if (end > version && end[-1] == '\r') {
+        end--;
+    }
+    request->keepAlive = !equalsLiteral(version, end, "HTTP/1.0");
+    return SUCCESS;
+}
+
+int parseHttpRequest(const char* buffer, int length, int maxLength, HttpRequest* request) {
+    const char* end = &buffer[length];
+    // Whatever isn't complete within maxLength will never be
+    const int incomplete = length >= maxLength ? ERROR : 0;
+
+    // Request line
+    const char* lineEnd = findByte(buffer, end, '\n');
+    if (lineEnd == NULL) {
+        return incomplete;
+    }
+    raiseIfError(parseRequestLine(buffer, lineEnd, request));
+
+    // Headers, until an empty line
+    long contentLength = 0;
+    bool hasContentLength = false;
+    const char* line = lineEnd + 1;
+    while (true) {
+        lineEnd = findByte(line, end, '\n');
+        if (lineEnd == NULL) {
+            return incomplete;
+        }
+        if (lineEnd == line || (lineEnd == line + 1 && line[0] == '\r')) {
+            line = lineEnd + 1;
+            break;
+        }
+
+        // Only the headers that change how the request is read are looked at
+        // A body that could be framed more than one way is rejected, so no proxy in front can split it differently
+        if (isHeader(line, lineEnd, "Content-Length:")) {
+            const char* value = skipHeaderSpaces(&line[sizeof("Content-Length:") - 1], lineEnd);
+            if (hasContentLength || value == lineEnd || *value < '0' || *value > '9') {
+                return ERROR;
+            }
+            hasContentLength = true;
+            for (; value < lineEnd && *value >= '0' && *value <= '9'; value++) {
+                contentLength = contentLength * 10 + (*value - '0');
+                if (contentLength > maxLength) {
+                    return ERROR;
+                }
+            }
+            // Only spaces can follow the digits
+            value = skipHeaderSpaces(value, lineEnd);
+            if (value < lineEnd && !(value == lineEnd - 1 && *value == '\r')) {
+                return ERROR;
+            }
+        } else if (isHeader(line, lineEnd, "Transfer-Encoding:")) {
+            // The body is only read by its Content-Length, a chunked one would be taken for the next requests
+            return ERROR;
+        } else if (isHeader(line, lineEnd, "Connection:")) {
+            const char* value = skipHeaderSpaces(&line[sizeof("Connection:") - 1], lineEnd);
+            if (lineEnd - value >= 5 && strncasecmp(value, "close", 5) == 0) {
+                request->keepAlive = false;
+            } else if (lineEnd - value >= 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+                request->keepAlive = true;
+            }
+        }
+        line = lineEnd + 1;
+    }
+
+    long requestLength = (line - buffer) + contentLength;
+    if (requestLength > maxLength) {
+        return ERROR;
+    }
+    if (requestLength > length) {
+        return 0;
+    }
+    request->body = line;
+    request->bodyLength = (int)contentLength;
+    request->length = (int)requestLength;
+    return request->length;
+}
+
+// Skips the json whitespace
+const char* skipJsonSpaces(const char* current, const char* end) {
+    while (current < end && (*current == ' ' || *current == '\t' || *current == '\n' || *current == '\r')) {
+        current++;
+    }
+    return current;
+}
+
+// Finds the quote that closes the string starting at start, right after the opening quote
+// Returns NULL if the string isn't closed
+const char* findStringEnd(const char* start, const char* end) {
+    const char* current = start;
+    while (true) {
+        const char* quote = findByte(current, end, '"');
+        if (quote == NULL) {
+            return NULL;
+        }
+        // The quote is escaped if it comes after an odd number of backslashes
+        int backslashes = 0;
+        while (quote - backslashes > start && quote[-backslashes - 1] == '\\') {
+            backslashes++;
+        }
+        if (backslashes % 2 == 0) {
+            return quote;
+        }
+        current = quote + 1;
+    }
+}
+
+// Parses a json string value, current is on the opening quote
+// Sets value and valueEnd to the contents, without the quotes
+// Returns the position after the closing quote, or NULL if it's not a string
+const char* parseJsonString(const char* current, const char* end, const char** value, const char** valueEnd) {
+    if (current == end || *current != '"') {
+        return NULL;
+    }
+    *value = current + 1;
+    *valueEnd = findStringEnd(*value, end);
+    if (*valueEnd == NULL) {
+        return NULL;
+    }
+    return *valueEnd + 1;
+}
+
+// Parses a non negative json integer, fractions and exponents are rejected
+// Returns the position after the number, or NULL if it's not a valid integer
+const char* parseJsonInt(const char* current, const char* end, int* number) {
+    const char* digits = current;
+    long value = 0;
+    for (; current < end && *current >= '0' && *current <= '9'; current++) {
+        value = value * 10 + (*current - '0');
+        if (value > INT_MAX) {
+            return NULL;
+        }
+    }
+    if (current == digits || (current < end && (*current == '.' || *current == 'e' || *current == 'E'))) {
+        return NULL;
+    }
+    *number = (int)value;
+    return current;
+}
+
+// Skips a value of a field that isn't used, nested objects and arrays are not accepted
+// Returns the position after the value, or NULL if it's not valid
+const char* skipJsonValue(const char* current, const char* end) {
+    if (current < end && *current == '"') {
+        const char* value;
+        const char* valueEnd;
+        return parseJsonString(current, end, &value, &valueEnd);
+    }
+    const char* start = current;
+    while (current < end && *current != ',' && *current != '}' && *current != '{' && *current != '[') {
+        current++;
+    }
+    if (current == start || (current < end && (*current == '{' || *current == '['))) {
+        return NULL;
+    }
+    return current;
+}
+
+// Field flags, to check every field was found
+#define VALOR_FIELD 1
+#define TIPO_FIELD 2
+#define DESCRICAO_FIELD 4
+#define TRANSACTION_FIELDS (VALOR_FIELD | TIPO_FIELD | DESCRICAO_FIELD)
+
+// Longest descricao accepted, the transaction has no room for more
+#define MAX_DESCRICAO_LENGTH DESCRIPTION_SIZE
+
+int parseTransaction(const char* body, int length, Transaction* transaction) {
+    const char* end = &body[length];
+    const char* current = skipJsonSpaces(body, end);
+    if (current == end || *current != '{') {
+        return ERROR;
+    }
+    current = skipJsonSpaces(current + 1, end);
+
+    int found = 0;
+    while (current < end && *current != '}') {
+        const char* key;
+        const char* keyEnd;
+        current = parseJsonString(current, end, &key, &keyEnd);
+        errIfNull(current);
+        current = skipJsonSpaces(current, end);
+        if (current == end || *current != ':') {
+            return ERROR;
+        }
+        current = skipJsonSpaces(current + 1, end);
+
+        if (equalsLiteral(key, keyEnd, "valor")) {
+            current = parseJsonInt(current, end, &transaction->valor);
+            found |= VALOR_FIELD;
+        } else if (equalsLiteral(key, keyEnd, "tipo")) {
+            const char* tipo;
+            const char* tipoEnd;
+            current = parseJsonString(current, end, &tipo, &tipoEnd);
+            if (current != NULL && tipoEnd - tipo != 1) {
+                return ERROR;
+            }
+            transaction->tipo = current != NULL ? tipo[0] : '\0';
+            found |= TIPO_FIELD;
+        } else if (equalsLiteral(key, keyEnd, "descricao")) {
+            const char* descricao;
+            const char* descricaoEnd;
+            current = parseJsonString(current, end, &descricao, &descricaoEnd);
+            if (current != NULL) {
+                int descricaoLength = descricaoEnd - descricao;
+                if (descricaoLength < 1 || descricaoLength > MAX_DESCRICAO_LENGTH) {
+                    return ERROR;
+                }
+                memcpy(transaction->descricao, descricao, descricaoLength);
+                transaction->descricaoLength = (unsigned char)descricaoLength;
+            }
+            found |= DESCRICAO_FIELD;
+        } else {
+            current = skipJsonValue(current, end);
+        }
+        errIfNull(current);
+
+        current = skipJsonSpaces(current, end);
+        if (current < end && *current == ',') {
+            current = skipJsonSpaces(current + 1, end);
+        } else if (current == end || *current != '}') {
+            return ERROR;
+        }
+    }
+    if (current == end || found != TRANSACTION_FIELDS) {
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+// Header file for the io_uring rings
+// The bare ring, with the system calls and the shared memory of the kernel interface,
+// there's no liburing on the image, the event loop builds the sockets on top of it, see eventLoop.h
+//
+// Requests go on the submission queue without a system call, and are submitted together
+// by the same io_uring_enter that waits for the completions
+// The received data go to a ring of provided buffers, the kernel picks a free buffer for each completion,
+// and the buffer goes back to the ring once its data are copied out
+//
+// Needs Linux 6.0, for the multishot recv and the provided buffer rings
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "helpers.h"
+
+#define IO_URING_ENTRIES 1024
+// The multishot requests post many completions each, so the completion queue is bigger
+#define IO_URING_COMPLETION_ENTRIES (8 * IO_URING_ENTRIES)
+// Power of two
+#define IO_URING_BUFFERS 512
+// Big enough for a whole request, 4KB
+#define IO_URING_BUFFER_SIZE 4 * 1024
+#define IO_URING_BUFFER_GROUP 0
+
+typedef struct IO_URING {
+    int fd;
+    // Submission queue, shared with the kernel
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask, sqEntries;
+    // Tail with the requests not given to the kernel yet
+    unsigned sqLocalTail;
+    struct io_uring_sqe* sqes;
+    // Completion queue, shared with the kernel
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize, cqRingSize;
+    // Provided buffers
+    struct io_uring_buf_ring* bufferRing;
+    char* buffers;
+    unsigned short bufferTail;
+} IoUring;
+
+// Creates the ring and registers its provided buffers
+// Returns ERROR if the kernel doesn't have io_uring, or the features it needs
+int setupIoUring(IoUring* ring);
+
+// Closes the ring and frees its buffers
+void closeIoUring(IoUring* ring);
+
+// Returns a zeroed request at the end of the submission queue, submitting the queue if it's full
+// Returns NULL if the full queue can't be submitted
+struct io_uring_sqe* getIoUringRequest(IoUring* ring);
+
+// Submits the queued requests, and waits for a completion if there's none yet,
+// for at most timeout milliseconds (-1 to block)
+// Returns ERROR with errno EINTR or ETIME if the wait was interrupted or timed out
+int submitAndWait(IoUring* ring, int timeout);
+
+// Returns the next completion, or NULL if there's none, it's released with releaseCompletion
+struct io_uring_cqe* peekCompletion(IoUring* ring);
+
+void releaseCompletion(IoUring* ring);
+
+// Returns the data of the provided buffer
+char* getIoUringBuffer(IoUring* ring, int bufferId);
+
+// Gives the buffer back to the kernel, only seen by the kernel after publishBuffers
+void recycleIoUringBuffer(IoUring* ring, int bufferId);
+
+void publishBuffers(IoUring* ring);
+
+int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+int ioUringRegister(int fd, unsigned opcode, void* arg, unsigned nArgs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nArgs);
+}
+
+// Maps the queues shared with the kernel
+int mapIoUring(IoUring* ring, struct io_uring_params* params) {
+    ring->sqRingSize = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        return ERROR;
+    }
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+        return ERROR;
+    }
+    ring->sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        return ERROR;
+    }
+
+    char* sq = ring->sqRing;
+    ring->sqHead = (unsigned*)(sq + params->sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params->sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + params->sq_off.ring_mask);
+    ring->sqEntries = params->sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    // Each slot of the queue always points to the request with the same index
+    unsigned* array = (unsigned*)(sq + params->sq_off.array);
+    for (unsigned i = 0; i < params->sq_entries; i++) {
+        array[i] = i;
+    }
+
+    char* cq = ring->cqRing;
+    ring->cqHead = (unsigned*)(cq + params->cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params->cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+    return SUCCESS;
+}
+
+// Registers the provided buffers, every buffer starts on the ring
+int registerIoUringBuffers(IoUring* ring) {
+    size_t ringSize = IO_URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->bufferRing = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufferRing == MAP_FAILED) {
+        ring->bufferRing = NULL;
+        return ERROR;
+    }
+    ring->buffers = malloc((size_t)IO_URING_BUFFERS * IO_URING_BUFFER_SIZE);
+    errIfNull(ring->buffers);
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long)ring->bufferRing;
+    registration.ring_entries = IO_URING_BUFFERS;
+    registration.bgid = IO_URING_BUFFER_GROUP;
+    raiseIfError(ioUringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1));
+
+    ring->bufferTail = 0;
+    for (int i = 0; i < IO_URING_BUFFERS; i++) {
+        recycleIoUringBuffer(ring, i);
+    }
+    publishBuffers(ring);
+    return SUCCESS;
+}
+
+int setupIoUring(IoUring* ring) {
+    memset(ring, 0, sizeof(IoUring));
+    ring->fd = ERROR;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = IO_URING_COMPLETION_ENTRIES;
+    ring->fd = ioUringSetup(IO_URING_ENTRIES, &params);
+    raiseIfError(ring->fd);
+    // The waits have a timeout, and a full completion queue must not lose completions
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+        mapIoUring(ring, &params) == ERROR || registerIoUringBuffers(ring) == ERROR) {
+        closeIoUring(ring);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+void closeIoUring(IoUring* ring) {
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqEntries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->bufferRing != NULL) {
+        munmap(ring->bufferRing, IO_URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    free(ring->buffers);
+    if (ring->fd != ERROR) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(IoUring));
+    ring->fd = ERROR;
+}
+
+// Gives the queued requests to the kernel
+// Returns the number of requests not taken yet
+unsigned publishRequests(IoUring* ring) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    return ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe* getIoUringRequest(IoUring* ring) {
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries) {
+        unsigned pending = publishRequests(ring);
+        if (ioUringEnter(ring->fd, pending, 0, 0, NULL, 0) == ERROR) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* request = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    memset(request, 0, sizeof(struct io_uring_sqe));
+    ring->sqLocalTail++;
+    return request;
+}
+
+int submitAndWait(IoUring* ring, int timeout) {
+    unsigned pending = publishRequests(ring);
+    bool ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) != *ring->cqHead;
+    if (ready) {
+        // Nothing to wait for, and nothing to do if there's nothing to submit either
+        return pending == 0 ? SUCCESS : ioUringEnter(ring->fd, pending, 0, 0, NULL, 0);
+    }
+
+    struct __kernel_timespec timespec = {.tv_sec = timeout / 1000, .tv_nsec = (long long)(timeout % 1000) * 1000000};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        arg.ts = (unsigned long)&timespec;
+    }
+    return ioUringEnter(ring->fd, pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+struct io_uring_cqe* peekCompletion(IoUring* ring) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void releaseCompletion(IoUring* ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+char* getIoUringBuffer(IoUring* ring, int bufferId) {
+    return &ring->buffers[(size_t)bufferId * IO_URING_BUFFER_SIZE];
+}
+
+void recycleIoUringBuffer(IoUring* ring, int bufferId) {
+    struct io_uring_buf* buffer = &ring->bufferRing->bufs[ring->bufferTail & (IO_URING_BUFFERS - 1)];
+    buffer->addr = (unsigned long)getIoUringBuffer(ring, bufferId);
+    buffer->len = IO_URING_BUFFER_SIZE;
+    buffer->bid = (unsigned short)bufferId;
+    ring->bufferTail++;
+}
+
+void publishBuffers(IoUring* ring) {
+    __atomic_store_n(&ring->bufferRing->tail, ring->bufferTail, __ATOMIC_RELEASE);
+}
+
+#endif
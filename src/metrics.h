@@ -0,0 +1,340 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Header file for the metrics
+// Latency histograms, kept by each thread on its own memory and summed when they're scraped,
+// so recording a value is a few plain increments, without locks, atomic instructions or shared cache lines
+// The histograms are log-linear, like HdrHistogram: 16 buckets for each power of two of nanoseconds,
+// so a value is known within 1/16 of it, from 1ns to about 36 minutes, on 5KB per histogram
+// Their count and sum are the counters of what they measure
+//
+// Both processes expose them in the Prometheus text format, the api on GET /metrics of its port,
+// the db on its admin port, see adminServer.h
+// Each histogram has power of four buckets in seconds, and its p50, p99 and p99.9 on a gauge next to it
+// Only the series that have values are exposed
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "responseWriter.h"
+
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+// Values from 2^41ns on, about 36 minutes, go to the last bucket
+#define METRICS_MAX_EXPONENT 40
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * (METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2))
+// The exposed buckets go from 2^10ns, about 1us, to 2^34ns, about 17s, each one 4 times the previous one
+#define METRICS_FIRST_EXPOSED_EXPONENT 10
+#define METRICS_LAST_EXPOSED_EXPONENT 34
+// Big enough for every series with values
+#define METRICS_RESPONSE_SIZE (256 * 1024)
+
+// Every series of both processes, each process only records and exposes its own
+// Api - from the request read to the response sent, by route and status
+#define METRIC_API_REQUEST 0
+#define METRIC_API_REQUEST_SERIES (3 * 6)
+#define METRIC_API_PARSE (METRIC_API_REQUEST + METRIC_API_REQUEST_SERIES)
+#define METRIC_API_SERIALIZE_EXTRATO (METRIC_API_PARSE + 1)
+#define METRIC_API_SERIALIZE_TRANSACOES (METRIC_API_SERIALIZE_EXTRATO + 1)
+// From the request queued on the db batch to its answer, by op, c, r and u
+#define METRIC_API_DB_ROUND_TRIP (METRIC_API_SERIALIZE_TRANSACOES + 1)
+// Db - the operations by op, c, r and u, and the waits for a lock held by another worker
+#define METRIC_DB_OPERATION (METRIC_API_DB_ROUND_TRIP + 3)
+#define METRIC_DB_STORAGE_LOCK_WAIT (METRIC_DB_OPERATION + 3)
+#define METRIC_DB_STRIPE_LOCK_WAIT (METRIC_DB_STORAGE_LOCK_WAIT + 1)
+#define METRIC_SERIES_COUNT (METRIC_DB_STRIPE_LOCK_WAIT + 1)
+
+#define METRICS_API 0
+#define METRICS_DB 1
+
+// The routes and statuses of METRIC_API_REQUEST, see getRequestSeries
+#define METRICS_ROUTE_OTHER 0
+#define METRICS_ROUTE_EXTRATO 1
+#define METRICS_ROUTE_TRANSACOES 2
+
+const char okMetricsHeader[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+
+typedef struct HISTOGRAM {
+    unsigned long count;
+    unsigned long sumNs;
+    unsigned long buckets[METRICS_BUCKETS];
+} Histogram;
+
+typedef struct METRIC_SERIES {
+    int process;
+    // Family name, without the unit, and the labels of the series
+    const char* name;
+    const char* labels;
+    const char* help;
+} MetricSeries;
+
+// Histograms of a thread, linked so the scrape finds every thread
+typedef struct THREAD_METRICS {
+    Histogram series[METRIC_SERIES_COUNT];
+    struct THREAD_METRICS* next;
+} ThreadMetrics;
+
+const char apiRequestHelp[] = "Time from reading the request to sending its response";
+const char apiParseHelp[] = "Time to parse a request";
+const char apiSerializeHelp[] = "Time to render a response body";
+const char apiDbHelp[] = "Time from queueing a db request to its answer";
+const char dbOperationHelp[] = "Time to run an operation on the storage";
+const char dbLockWaitHelp[] = "Time waiting for a lock held by another worker";
+
+#define API_REQUEST_SERIES(route, status) {METRICS_API, "rinha_api_request", "route=\"" route "\",status=\"" status "\"", apiRequestHelp}
+#define API_ROUTE_SERIES(route)                                                                                           \
+    API_REQUEST_SERIES(route, "200"), API_REQUEST_SERIES(route, "400"), API_REQUEST_SERIES(route, "404"),                 \
+        API_REQUEST_SERIES(route, "405"), API_REQUEST_SERIES(route, "422"), API_REQUEST_SERIES(route, "500")
+
+const MetricSeries metricSeries[METRIC_SERIES_COUNT] = {
+    API_ROUTE_SERIES("other"),
+    API_ROUTE_SERIES("extrato"),
+    API_ROUTE_SERIES("transacoes"),
+    {METRICS_API, "rinha_api_parse", "", apiParseHelp},
+    {METRICS_API, "rinha_api_serialize", "route=\"extrato\"", apiSerializeHelp},
+    {METRICS_API, "rinha_api_serialize", "route=\"transacoes\"", apiSerializeHelp},
+    {METRICS_API, "rinha_api_db_round_trip", "op=\"c\"", apiDbHelp},
+    {METRICS_API, "rinha_api_db_round_trip", "op=\"r\"", apiDbHelp},
+    {METRICS_API, "rinha_api_db_round_trip", "op=\"u\"", apiDbHelp},
+    {METRICS_DB, "rinha_db_operation", "op=\"c\"", dbOperationHelp},
+    {METRICS_DB, "rinha_db_operation", "op=\"r\"", dbOperationHelp},
+    {METRICS_DB, "rinha_db_operation", "op=\"u\"", dbOperationHelp},
+    {METRICS_DB, "rinha_db_lock_wait", "lock=\"storage\"", dbLockWaitHelp},
+    {METRICS_DB, "rinha_db_lock_wait", "lock=\"stripe\"", dbLockWaitHelp},
+};
+
+__thread ThreadMetrics* threadMetrics = NULL;
+ThreadMetrics* allThreadMetrics = NULL;
+pthread_mutex_t allThreadMetricsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns a monotonic time in nanoseconds, to start a measure with
+long long getMetricsTime();
+
+// Records the time since start on the series
+void recordLatency(int series, long long start);
+
+// Records the value, in nanoseconds, on the series
+void recordValue(int series, long long valueNs);
+
+// Returns the METRIC_API_REQUEST series of the route and the http status
+int getRequestSeries(int route, int status);
+
+// Writes every series of the process with values, in the Prometheus text format, on the writer
+void writeMetrics(ResponseWriter* writer, int process);
+
+// Writes the http response with the metrics of the process on the buffer, and sets its size on responseSize
+// Returns a pointer to the response, or NULL if it doesn't fit the buffer
+char* serializeMetrics(int process, char* buffer, int bufferSize, int* responseSize);
+
+// Returns the bucket of the value, see METRICS_SUB_BUCKETS
+int getBucket(unsigned long value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzl(value);
+    if (exponent > METRICS_MAX_EXPONENT) {
+        return METRICS_BUCKETS - 1;
+    }
+    int shift = exponent - METRICS_SUB_BUCKET_BITS;
+    return METRICS_SUB_BUCKETS * (shift + 1) + (int)(value >> shift) - METRICS_SUB_BUCKETS;
+}
+
+// Returns the first value after the bucket
+unsigned long getBucketEnd(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return (unsigned long)bucket + 1;
+    }
+    int shift = bucket / METRICS_SUB_BUCKETS - 1;
+    unsigned long start = (unsigned long)(METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS) << shift;
+    return start + (1ul << shift);
+}
+
+long long getMetricsTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns the histograms of the thread, allocated on its first value
+// Returns NULL if they can't be allocated, the values are dropped then
+ThreadMetrics* getThreadMetrics() {
+    if (threadMetrics == NULL) {
+        ThreadMetrics* metrics = calloc(1, sizeof(ThreadMetrics));
+        if (metrics == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&allThreadMetricsLock);
+        metrics->next = allThreadMetrics;
+        allThreadMetrics = metrics;
+        pthread_mutex_unlock(&allThreadMetricsLock);
+        threadMetrics = metrics;
+    }
+    return threadMetrics;
+}
+
+// Only the thread writes its counters, so a relaxed load and store don't lose increments,
+// and the scrape never sees a torn value
+void addToCounter(unsigned long* counter, unsigned long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void recordValue(int series, long long valueNs) {
+    ThreadMetrics* metrics = getThreadMetrics();
+    if (metrics == NULL) {
+        return;
+    }
+    unsigned long value = valueNs < 0 ? 0 : (unsigned long)valueNs;
+    Histogram* histogram = &metrics->series[series];
+    addToCounter(&histogram->buckets[getBucket(value)], 1);
+    addToCounter(&histogram->sumNs, value);
+    addToCounter(&histogram->count, 1);
+}
+
+void recordLatency(int series, long long start) {
+    recordValue(series, getMetricsTime() - start);
+}
+
+int getRequestSeries(int route, int status) {
+    int statusIndex;
+    switch (status) {
+        case 200:
+            statusIndex = 0;
+            break;
+        case 400:
+            statusIndex = 1;
+            break;
+        case 404:
+            statusIndex = 2;
+            break;
+        case 405:
+            statusIndex = 3;
+            break;
+        case 422:
+            statusIndex = 4;
+            break;
+        default:
+            statusIndex = 5;
+            break;
+    }
+    return METRIC_API_REQUEST + route * 6 + statusIndex;
+}
+
+// Sums the series of every thread on the histogram
+void sumThreadMetrics(int series, Histogram* sum) {
+    memset(sum, 0, sizeof(Histogram));
+    pthread_mutex_lock(&allThreadMetricsLock);
+    for (ThreadMetrics* metrics = allThreadMetrics; metrics != NULL; metrics = metrics->next) {
+        Histogram* histogram = &metrics->series[series];
+        // The count goes first, so the buckets have at least as many values
+        sum->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        sum->sumNs += __atomic_load_n(&histogram->sumNs, __ATOMIC_RELAXED);
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            sum->buckets[i] += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&allThreadMetricsLock);
+}
+
+// Returns the end of the bucket of the value at the quantile, in nanoseconds
+unsigned long getQuantile(Histogram* histogram, double quantile) {
+    unsigned long rank = (unsigned long)(quantile * (double)histogram->count);
+    unsigned long seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            return getBucketEnd(i);
+        }
+    }
+    return getBucketEnd(METRICS_BUCKETS - 1);
+}
+
+// Appends a formatted line, metrics are only written when they're scraped, so snprintf is fine here
+void appendMetricsLine(ResponseWriter* writer, const char* format, ...) {
+    char line[512];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    if (length < 0 || length >= (int)sizeof(line)) {
+        writer->overflow = true;
+        return;
+    }
+    appendBytes(writer, line, length);
+}
+
+void writeHistogram(ResponseWriter* writer, const MetricSeries* series, Histogram* histogram) {
+    const char* separator = series->labels[0] == '\0' ? "" : ",";
+    unsigned long cumulative = 0;
+    int bucket = 0;
+    for (int exponent = METRICS_FIRST_EXPOSED_EXPONENT; exponent <= METRICS_LAST_EXPOSED_EXPONENT; exponent += 2) {
+        // The powers of two are bucket boundaries, so the exposed buckets are exact
+        int end = getBucket(1ul << exponent);
+        for (; bucket < end; bucket++) {
+            cumulative += histogram->buckets[bucket];
+        }
+        appendMetricsLine(writer, "%s_seconds_bucket{%s%sle=\"%.9g\"} %lu\n", series->name, series->labels,
+                          separator, (double)(1ul << exponent) / 1e9, cumulative);
+    }
+    appendMetricsLine(writer, "%s_seconds_bucket{%s%sle=\"+Inf\"} %lu\n", series->name, series->labels, separator,
+                      histogram->count);
+    // No braces at all for a series without labels
+    const char* open = series->labels[0] == '\0' ? "" : "{";
+    const char* close = series->labels[0] == '\0' ? "" : "}";
+    appendMetricsLine(writer, "%s_seconds_sum%s%s%s %.9g\n", series->name, open, series->labels, close,
+                      (double)histogram->sumNs / 1e9);
+    appendMetricsLine(writer, "%s_seconds_count%s%s%s %lu\n", series->name, open, series->labels, close,
+                      histogram->count);
+}
+
+void writeQuantiles(ResponseWriter* writer, const MetricSeries* series, Histogram* histogram) {
+    const char* separator = series->labels[0] == '\0' ? "" : ",";
+    const double quantiles[] = {0.5, 0.99, 0.999};
+    for (int i = 0; i < 3; i++) {
+        appendMetricsLine(writer, "%s_quantile_seconds{%s%squantile=\"%g\"} %.9g\n", series->name, series->labels,
+                          separator, quantiles[i], (double)getQuantile(histogram, quantiles[i]) / 1e9);
+    }
+}
+
+void writeMetrics(ResponseWriter* writer, int process) {
+    // The series of a family are next to each other, the family header goes before the first one with values
+    static Histogram histograms[METRIC_SERIES_COUNT];
+    static pthread_mutex_t scrapeLock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&scrapeLock);
+    for (int i = 0; i < METRIC_SERIES_COUNT; i++) {
+        if (metricSeries[i].process == process) {
+            sumThreadMetrics(i, &histograms[i]);
+        }
+    }
+    // The histograms, then their quantiles
+    for (int quantiles = 0; quantiles < 2; quantiles++) {
+        const char* family = NULL;
+        for (int i = 0; i < METRIC_SERIES_COUNT; i++) {
+            const MetricSeries* series = &metricSeries[i];
+            if (series->process != process || histograms[i].count == 0) {
+                continue;
+            }
+            if (family == NULL || strcmp(family, series->name) != 0) {
+                family = series->name;
+                const char* suffix = quantiles ? "_quantile_seconds" : "_seconds";
+                appendMetricsLine(writer, "# HELP %s%s %s\n", family, suffix, series->help);
+                appendMetricsLine(writer, "# TYPE %s%s %s\n", family, suffix, quantiles ? "gauge" : "histogram");
+            }
+            if (quantiles) {
+                writeQuantiles(writer, series, &histograms[i]);
+            } else {
+                writeHistogram(writer, series, &histograms[i]);
+            }
+        }
+    }
+    pthread_mutex_unlock(&scrapeLock);
+}
+
+char* serializeMetrics(int process, char* buffer, int bufferSize, int* responseSize) {
+    ResponseWriter writer;
+    startResponse(&writer, buffer, bufferSize);
+    writeMetrics(&writer, process);
+    return finishResponse(&writer, okMetricsHeader, sizeof(okMetricsHeader) - 1, responseSize);
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef RESPONSE_WRITER_H
+#define RESPONSE_WRITER_H
+
+// Header file for the response writer
+// Builds http responses in a single pass over a caller owned buffer, without sprintf, strcat or strlen
+// The body is written first, after some space reserved for the headers,
+// then the headers are written backwards right before it, once the Content-Length is known
+
+#include "helpers.h"
+
+// Space reserved before the body for the status line and the headers
+#define RESPONSE_HEADER_RESERVE 128
+
+typedef struct RESPONSE_WRITER {
+    char* buffer;
+    int capacity;
+    // Where the body starts, and where the next byte goes
+    int bodyStart;
+    int length;
+    // Set if something didn't fit, the response must not be sent
+    bool overflow;
+} ResponseWriter;
+
+// Precomputed header fragments, written before the Content-Length value and after it
+const char okJsonHeader[] = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: ";
+const char headerEnd[] = "\r\n\r\n";
+
+// Starts a response on the buffer, the body is written after the reserved header space
+void startResponse(ResponseWriter* writer, char* buffer, int capacity);
+
+// Appends size bytes to the body
+void appendBytes(ResponseWriter* writer, const char* data, int size);
+
+// Appends a string literal to the body, its size is known at compile time
+#define appendLiteral(writer, literal) appendBytes(writer, literal, sizeof(literal) - 1)
+
+// Appends a single character to the body
+void appendChar(ResponseWriter* writer, char character);
+
+// Appends a '\0' terminated string, copying at most maxSize bytes
+void appendString(ResponseWriter* writer, const char* string, int maxSize);
+
+// Appends the decimal representation of the number
+void appendInt(ResponseWriter* writer, int number);
+
+// Appends the time as an ISO-8601 timestamp, see formatTimestamp
+void appendTimestamp(ResponseWriter* writer, long long epochUs);
+
+// Writes the headers before the body, with the Content-Length of the body
+// header is the precomputed header up to the Content-Length value
+// Returns the start of the response, and sets its size on responseSize
+// Returns NULL if the response didn't fit on the buffer
+char* finishResponse(ResponseWriter* writer, const char* header, int headerSize, int* responseSize);
+
+// Writes the decimal digits of number, ending right before end
+// Returns the position of the first digit
+char* writeIntBackwards(char* end, unsigned int number);
+
+void startResponse(ResponseWriter* writer, char* buffer, int capacity) {
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    writer->bodyStart = RESPONSE_HEADER_RESERVE;
+    writer->length = RESPONSE_HEADER_RESERVE;
+    writer->overflow = capacity < RESPONSE_HEADER_RESERVE;
+}
+
+void appendBytes(ResponseWriter* writer, const char* data, int size) {
+    if (writer->length + size > writer->capacity) {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(&writer->buffer[writer->length], data, size);
+    writer->length += size;
+}
+
+void appendChar(ResponseWriter* writer, char character) {
+    if (writer->length >= writer->capacity) {
+        writer->overflow = true;
+        return;
+    }
+    writer->buffer[writer->length++] = character;
+}
+
+void appendString(ResponseWriter* writer, const char* string, int maxSize) {
+    int size = strnlen(string, maxSize);
+    appendBytes(writer, string, size);
+}
+
+char* writeIntBackwards(char* end, unsigned int number) {
+    do {
+        *--end = (char)('0' + number % 10);
+        number /= 10;
+    } while (number != 0);
+    return end;
+}
+
+void appendInt(ResponseWriter* writer, int number) {
+    // 10 digits and the sign
+    char digits[11];
+    char* end = &digits[sizeof(digits)];
+    // Negating as unsigned keeps INT_MIN correct
+    unsigned int magnitude = number < 0 ? 0u - (unsigned int)number : (unsigned int)number;
+    char* start = writeIntBackwards(end, magnitude);
+    if (number < 0) {
+        *--start = '-';
+    }
+    appendBytes(writer, start, end - start);
+}
+
+void appendTimestamp(ResponseWriter* writer, long long epochUs) {
+    // Formatted straight on the buffer when it fits, the '\0' is overwritten by the next append
+    if (writer->length + DATE_SIZE > writer->capacity) {
+        writer->overflow = true;
+        return;
+    }
+    writer->length += formatTimestamp(epochUs, &writer->buffer[writer->length]);
+}
+
+char* finishResponse(ResponseWriter* writer, const char* header, int headerSize, int* responseSize) {
+    if (writer->overflow) {
+        return NULL;
+    }
+    int bodySize = writer->length - writer->bodyStart;
+    char* start = &writer->buffer[writer->bodyStart];
+
+    start -= sizeof(headerEnd) - 1;
+    memcpy(start, headerEnd, sizeof(headerEnd) - 1);
+    start = writeIntBackwards(start, (unsigned int)bodySize);
+    start -= headerSize;
+    if (start < writer->buffer) {
+        return NULL;
+    }
+    memcpy(start, header, headerSize);
+
+    *responseSize = &writer->buffer[writer->length] - start;
+    return start;
+}
+
+#endif
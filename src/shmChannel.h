@@ -0,0 +1,256 @@
+#ifndef SHM_CHANNEL_H
+#define SHM_CHANNEL_H
+
+// Header file for the shared memory channels
+// A channel is a pair of single producer, single consumer byte rings on a memory shared by two processes,
+// one ring for each direction, so the frames go from one process to the other without the network stack
+// The rings are streams, like a tcp socket, the frames are found on them by their length
+//
+// Each side has an eventfd doorbell, rung by the other side only when it's needed:
+// when the consumer found its ring empty and went to sleep, or when the producer found its ring full
+// While both sides are busy the frames go through the memory without any system call
+// The doorbell is watched by the event loop, its events are reported on the socket of the channel
+//
+// The channel is set up over a unix socket, the side that connects creates the memory and the doorbells,
+// and sends them to the other side, see createShmChannel
+// The socket stays open, so each side sees the other one hang up
+
+#include <linux/memfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "helpers.h"
+
+// Power of two, big enough for many batch frames
+#define SHM_RING_SIZE (256 * 1024)
+#define CACHE_LINE_SIZE 64
+
+// The memory, the doorbell of the side that connects, and the doorbell of the side that accepts
+#define SHM_CHANNEL_FDS 3
+#define SHM_CHANNEL_MAGIC 0x4d485352
+
+// The positions only grow, the bytes on the ring are head - tail
+typedef struct SHM_RING {
+    // Written by the producer
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+    // Written by the consumer
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    // Set by each side before it sleeps, and cleared by the other side when it rings the doorbell
+    int consumerWaiting __attribute__((aligned(CACHE_LINE_SIZE)));
+    int producerWaiting __attribute__((aligned(CACHE_LINE_SIZE)));
+    char data[SHM_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+} ShmRing;
+
+typedef struct SHM_CHANNEL {
+    ShmRing* input;
+    ShmRing* output;
+    // Rung by the other side, watched by the event loop
+    int inputDoorbell;
+    // Rings the other side
+    int outputDoorbell;
+    void* memory;
+} ShmChannel;
+
+// Creates the memory and the doorbells of a new channel, and sends them over the connected unix socket
+// Returns ERROR if the channel can't be created or sent
+int createShmChannel(ShmChannel* channel, int socket);
+
+// Receives a channel created by the other side of the unix socket
+// Returns ERROR if the channel can't be received or mapped, errno is EAGAIN if it hasn't arrived on a non blocking socket
+int openShmChannel(ShmChannel* channel, int socket);
+
+// Writes as much of the data as fits on the output ring, and wakes the other side if it's sleeping
+// If not everything fit, the other side rings the doorbell once there's room
+// Returns the number of bytes written
+int writeToChannel(ShmChannel* channel, const char* data, int size);
+
+// Reads at most size bytes from the input ring, and wakes the other side if it's waiting for room
+// Returns the number of bytes read, 0 if the ring is empty and the doorbell will ring on the next write
+int readFromChannel(ShmChannel* channel, char* buffer, int size);
+
+// Unmaps the memory and closes the doorbells, the socket is closed by its owner
+void closeShmChannel(ShmChannel* channel);
+
+// Maps the memory of the two rings, the first ring goes from the side that connects to the side that accepts
+int mapShmRings(ShmChannel* channel, int memory, bool connecting) {
+    channel->memory = mmap(NULL, 2 * sizeof(ShmRing), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+    if (channel->memory == MAP_FAILED) {
+        return ERROR;
+    }
+    ShmRing* rings = channel->memory;
+    channel->output = connecting ? &rings[0] : &rings[1];
+    channel->input = connecting ? &rings[1] : &rings[0];
+    return SUCCESS;
+}
+
+int createShmChannel(ShmChannel* channel, int socket) {
+    int fds[SHM_CHANNEL_FDS];
+    // The glibc wrapper is only declared with _GNU_SOURCE
+    fds[0] = (int)syscall(SYS_memfd_create, "rinha-channel", MFD_CLOEXEC);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int result = ERROR;
+    if (fds[0] != ERROR && fds[1] != ERROR && fds[2] != ERROR &&
+        ftruncate(fds[0], 2 * sizeof(ShmRing)) != -1 && mapShmRings(channel, fds[0], true) == SUCCESS) {
+        // The memory is zeroed by the kernel, so both rings start empty
+        // Both sides start asleep, the first write rings the doorbell
+        ShmRing* rings = channel->memory;
+        rings[0].consumerWaiting = 1;
+        rings[1].consumerWaiting = 1;
+        char message[4];
+        toBin(SHM_CHANNEL_MAGIC, message);
+        struct iovec vector = {.iov_base = message, .iov_len = sizeof(message)};
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct msghdr header = {.msg_iov = &vector, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        struct cmsghdr* rights = CMSG_FIRSTHDR(&header);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(rights), fds, sizeof(fds));
+        if (sendmsg(socket, &header, MSG_NOSIGNAL) == sizeof(message)) {
+            result = SUCCESS;
+        } else {
+            munmap(channel->memory, 2 * sizeof(ShmRing));
+        }
+    }
+
+    // The memory stays mapped without its descriptor
+    if (fds[0] != ERROR) {
+        close(fds[0]);
+    }
+    if (result == ERROR) {
+        for (int i = 1; i < SHM_CHANNEL_FDS; i++) {
+            if (fds[i] != ERROR) {
+                close(fds[i]);
+            }
+        }
+        return ERROR;
+    }
+    channel->outputDoorbell = fds[2];
+    channel->inputDoorbell = fds[1];
+    return SUCCESS;
+}
+
+int openShmChannel(ShmChannel* channel, int socket) {
+    char message[4];
+    struct iovec vector = {.iov_base = message, .iov_len = sizeof(message)};
+    int fds[SHM_CHANNEL_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr header = {.msg_iov = &vector, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t received = recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+    if (received != sizeof(message)) {
+        // A hang up or a short message isn't mistaken for a channel still on its way
+        if (received != ERROR) {
+            errno = EPROTO;
+        }
+        return ERROR;
+    }
+    struct cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    if (rights == NULL || rights->cmsg_level != SOL_SOCKET || rights->cmsg_type != SCM_RIGHTS ||
+        rights->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        errno = EPROTO;
+        return ERROR;
+    }
+    memcpy(fds, CMSG_DATA(rights), sizeof(fds));
+
+    int result = fromBin(message) == SHM_CHANNEL_MAGIC ? mapShmRings(channel, fds[0], false) : ERROR;
+    close(fds[0]);
+    if (result == ERROR) {
+        close(fds[1]);
+        close(fds[2]);
+        return ERROR;
+    }
+    channel->outputDoorbell = fds[1];
+    channel->inputDoorbell = fds[2];
+    return SUCCESS;
+}
+
+void ringDoorbell(int doorbell) {
+    uint64_t one = 1;
+    // A full counter already wakes the other side, so a failed write can be ignored
+    if (write(doorbell, &one, sizeof(one)) == -1) {
+        log("{ Failed to ring the doorbell }\n");
+    }
+}
+
+// Rings the doorbell if the flag was set by the other side before it went to sleep
+void wakeIfWaiting(int* waiting, int doorbell) {
+    // The flag can't be read before the positions the other side checks are written
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL)) {
+        ringDoorbell(doorbell);
+    }
+}
+
+// Copies between the data and the ring, the position wraps around the end of the ring
+void copyToRing(ShmRing* ring, unsigned long position, const char* data, int size) {
+    int offset = (int)(position & (SHM_RING_SIZE - 1));
+    int first = size < SHM_RING_SIZE - offset ? size : SHM_RING_SIZE - offset;
+    memcpy(&ring->data[offset], data, first);
+    memcpy(ring->data, &data[first], size - first);
+}
+
+void copyFromRing(ShmRing* ring, unsigned long position, char* data, int size) {
+    int offset = (int)(position & (SHM_RING_SIZE - 1));
+    int first = size < SHM_RING_SIZE - offset ? size : SHM_RING_SIZE - offset;
+    memcpy(data, &ring->data[offset], first);
+    memcpy(&data[first], ring->data, size - first);
+}
+
+int writeToChannel(ShmChannel* channel, const char* data, int size) {
+    ShmRing* ring = channel->output;
+    unsigned long head = ring->head;
+    int written = 0;
+    while (true) {
+        int room = SHM_RING_SIZE - (int)(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+        int chunk = size - written < room ? size - written : room;
+        copyToRing(ring, head, &data[written], chunk);
+        head += chunk;
+        written += chunk;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        if (written == size) {
+            break;
+        }
+        // Full, the other side rings once it reads, unless it read right before the flag was set
+        __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == SHM_RING_SIZE) {
+            break;
+        }
+    }
+    if (written > 0) {
+        wakeIfWaiting(&ring->consumerWaiting, channel->outputDoorbell);
+    }
+    return written;
+}
+
+int readFromChannel(ShmChannel* channel, char* buffer, int size) {
+    ShmRing* ring = channel->input;
+    unsigned long tail = ring->tail;
+    int available = (int)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail);
+    if (available == 0) {
+        // Empty, the other side rings on its next write, unless it wrote right before the flag was set
+        __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        available = (int)(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail);
+        if (available == 0) {
+            return 0;
+        }
+        __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+    }
+    int chunk = size < available ? size : available;
+    copyFromRing(ring, tail, buffer, chunk);
+    __atomic_store_n(&ring->tail, tail + chunk, __ATOMIC_RELEASE);
+    wakeIfWaiting(&ring->producerWaiting, channel->outputDoorbell);
+    return chunk;
+}
+
+void closeShmChannel(ShmChannel* channel) {
+    munmap(channel->memory, 2 * sizeof(ShmRing));
+    close(channel->inputDoorbell);
+    close(channel->outputDoorbell);
+}
+
+#endif
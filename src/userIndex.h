@@ -0,0 +1,140 @@
+#ifndef USER_INDEX_H
+#define USER_INDEX_H
+
+// Header file for the user index
+// Maps user ids to the slots where the users are stored
+// Open addressing hash table with linear probing, kept at most half full,
+// so a lookup touches one or two cache lines no matter how many users there are
+
+#include <stdint.h>
+
+#include "helpers.h"
+
+// Ids are non negative, so a negative id marks an empty entry
+#define EMPTY_USER_ID -1
+#define USER_INDEX_INITIAL_CAPACITY 1024
+
+typedef struct USER_INDEX_ENTRY {
+    int id;
+    int slot;
+} UserIndexEntry;
+
+typedef struct USER_INDEX {
+    UserIndexEntry* entries;
+    // Always a power of two
+    int capacity;
+    int count;
+} UserIndex;
+
+// Starts an empty index
+// Returns ERROR if it fails to allocate the table
+int initUserIndex(UserIndex* index);
+
+// Returns the slot of the user
+// Returns ERROR if the user is not on the index
+int findUserSlot(UserIndex* index, int id);
+
+// Adds the user to the index, or moves it to a new slot if it's already there
+// Returns ERROR if the id is negative or the table can't grow
+int addUserSlot(UserIndex* index, int id, int slot);
+
+// Frees the table
+void freeUserIndex(UserIndex* index);
+
+// Spreads the ids across the table, the callers take the low bits
+// Every input bit changes the low bits, a plain multiply would only mix upwards,
+// so ids with the same low bits, like strided ones, would all collide
+// The murmur3 finalizer
+uint32_t hashUserId(int id) {
+    uint32_t hash = (uint32_t)id;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+int initUserIndex(UserIndex* index) {
+    index->entries = malloc(USER_INDEX_INITIAL_CAPACITY * sizeof(UserIndexEntry));
+    errIfNull(index->entries);
+    for (int i = 0; i < USER_INDEX_INITIAL_CAPACITY; i++) {
+        index->entries[i].id = EMPTY_USER_ID;
+    }
+    index->capacity = USER_INDEX_INITIAL_CAPACITY;
+    index->count = 0;
+    return SUCCESS;
+}
+
+int findUserSlot(UserIndex* index, int id) {
+    uint32_t mask = (uint32_t)index->capacity - 1;
+    for (uint32_t i = hashUserId(id) & mask;; i = (i + 1) & mask) {
+        UserIndexEntry* entry = &index->entries[i];
+        if (entry->id == id) {
+            return entry->slot;
+        }
+        if (entry->id == EMPTY_USER_ID) {
+            return ERROR;
+        }
+    }
+}
+
+// Puts the entry on the first free position of its probe sequence, or over the entry with the same id
+// Returns true if a new entry was added
+bool placeUserEntry(UserIndexEntry* entries, int capacity, int id, int slot) {
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (uint32_t i = hashUserId(id) & mask;; i = (i + 1) & mask) {
+        UserIndexEntry* entry = &entries[i];
+        if (entry->id == id || entry->id == EMPTY_USER_ID) {
+            bool added = entry->id == EMPTY_USER_ID;
+            entry->id = id;
+            entry->slot = slot;
+            return added;
+        }
+    }
+}
+
+// Doubles the table, moving every entry to its new position
+int growUserIndex(UserIndex* index) {
+    if (index->capacity > INT32_MAX / 2) {
+        return ERROR;
+    }
+    int newCapacity = index->capacity * 2;
+    UserIndexEntry* grown = malloc((size_t)newCapacity * sizeof(UserIndexEntry));
+    errIfNull(grown);
+    for (int i = 0; i < newCapacity; i++) {
+        grown[i].id = EMPTY_USER_ID;
+    }
+    for (int i = 0; i < index->capacity; i++) {
+        if (index->entries[i].id != EMPTY_USER_ID) {
+            placeUserEntry(grown, newCapacity, index->entries[i].id, index->entries[i].slot);
+        }
+    }
+    free(index->entries);
+    index->entries = grown;
+    index->capacity = newCapacity;
+    return SUCCESS;
+}
+
+int addUserSlot(UserIndex* index, int id, int slot) {
+    if (id < 0) {
+        return ERROR;
+    }
+    // At most half full, so the probe sequences stay short
+    if ((index->count + 1) * 2 > index->capacity) {
+        raiseIfError(growUserIndex(index));
+    }
+    if (placeUserEntry(index->entries, index->capacity, id, slot)) {
+        index->count++;
+    }
+    return SUCCESS;
+}
+
+void freeUserIndex(UserIndex* index) {
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+#endif
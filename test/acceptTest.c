@@ -0,0 +1,131 @@
+// Runs the event loop out of file descriptors with a connection waiting to be accepted,
+// and checks the loop neither spins on the failed accepts nor leaves the connection behind:
+// epoll drops it right away, io_uring accepts it once there are descriptors again
+// Build and run with `make run`
+
+#include "../src/httpHandler.h"
+#include "test.h"
+
+// Small, so filling the table is quick
+#define FILE_LIMIT 64
+#define TEST_MS 500
+#define WAIT_MS 50
+
+// Descriptors taken to fill the table
+int fillers[FILE_LIMIT];
+int nFillers = 0;
+
+// Returns a non blocking loopback server socket, its port is set on port
+int listenOnLoopback(int* port) {
+    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    SA_IN address = {.sin_family = AF_INET, .sin_port = 0, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addressLength = sizeof(address);
+    if (serverSocket == ERROR || bind(serverSocket, (SA*)&address, sizeof(address)) == ERROR ||
+        listen(serverSocket, 16) == ERROR || getsockname(serverSocket, (SA*)&address, &addressLength) == ERROR ||
+        setNonBlocking(serverSocket) == ERROR) {
+        perror("Failed to listen");
+        exit(EXIT_FAILURE);
+    }
+    *port = ntohs(address.sin_port);
+    return serverSocket;
+}
+
+// Connects a client, then takes every descriptor left
+int connectAndFillTable(int port) {
+    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+    SA_IN address = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (clientSocket == ERROR || connect(clientSocket, (SA*)&address, sizeof(address)) == ERROR) {
+        perror("Failed to connect");
+        exit(EXIT_FAILURE);
+    }
+    while (nFillers < FILE_LIMIT) {
+        int filler = dup(STDIN_FILENO);
+        if (filler == ERROR) {
+            break;
+        }
+        fillers[nFillers++] = filler;
+    }
+    return clientSocket;
+}
+
+void freeTable() {
+    for (int i = 0; i < nFillers; i++) {
+        close(fillers[i]);
+    }
+    nFillers = 0;
+}
+
+void testAcceptOutOfFiles(const char* name, int backend) {
+    ioBackend = backend;
+    EventLoop loop;
+    setupEventLoop(&loop);
+    if (backend == IO_BACKEND_URING && loop.uring == NULL) {
+        printf("skip   %s, io_uring is not available\n", name);
+        closeEventLoop(&loop);
+        return;
+    }
+    int port;
+    int serverSocket = listenOnLoopback(&port);
+    if (watchServerSocket(&loop, serverSocket) == ERROR) {
+        perror("Failed to watch the server socket");
+        exit(EXIT_FAILURE);
+    }
+    int clientSocket = connectAndFillTable(port);
+
+    int nWaits = 0;
+    int accepted = 0;
+    long long end = getCurrentTimeMs() + TEST_MS;
+    while (getCurrentTimeMs() < end) {
+        int nReady = waitEvents(&loop, WAIT_MS);
+        nWaits++;
+        for (int i = 0; i < nReady; i++) {
+            if (loop.events[i].data.fd == serverSocket) {
+                accepted += acceptClients(&loop, serverSocket);
+            }
+        }
+    }
+    char description[256];
+    snprintf(description, sizeof(description), "%s: %d waits in %d ms out of descriptors", name, nWaits, TEST_MS);
+    expect(nWaits <= 2 * TEST_MS / WAIT_MS, description);
+
+    // Once there are descriptors again, the connection isn't waiting for another one to arrive
+    freeTable();
+    bool dropped = false;
+    end = getCurrentTimeMs() + TEST_MS;
+    while (accepted == 0 && !dropped && getCurrentTimeMs() < end) {
+        char byte;
+        ssize_t received = recv(clientSocket, &byte, 1, MSG_DONTWAIT);
+        dropped = received == 0 || (received == ERROR && errno != EAGAIN);
+        int nReady = waitEvents(&loop, WAIT_MS);
+        for (int i = 0; i < nReady; i++) {
+            if (loop.events[i].data.fd == serverSocket) {
+                accepted += acceptClients(&loop, serverSocket);
+            }
+        }
+    }
+    snprintf(description, sizeof(description), "%s: the waiting connection was %s", name,
+             dropped ? "dropped" : accepted == 1 ? "accepted" : "left on the backlog");
+    expect(accepted == 1 || dropped, description);
+
+    close(clientSocket);
+    for (int socket = 0; socket < connectionsCapacity; socket++) {
+        if (connections[socket] != NULL) {
+            closeConnection(socket);
+        }
+    }
+    closeEventLoop(&loop);
+    close(serverSocket);
+}
+
+int main() {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = FILE_LIMIT;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == ERROR) {
+        perror("Failed to lower the file limit");
+        return EXIT_FAILURE;
+    }
+    testAcceptOutOfFiles("epoll", IO_BACKEND_EPOLL);
+    testAcceptOutOfFiles("io_uring", IO_BACKEND_URING);
+    return finishTests();
+}
@@ -0,0 +1,47 @@
+// Parses requests whose body could be framed more than one way, and checks they're all rejected,
+// so the api answers them with a 400 instead of guessing where the next request starts
+// Build and run with `make run`
+
+#include "../src/httpParser.h"
+#include "test.h"
+
+#define MAX_REQUEST_LENGTH 4096
+
+#define POST_LINE "POST /clientes/1/transacoes HTTP/1.1\r\nHost: localhost\r\n"
+#define BODY "{\"valor\": 1000, \"tipo\": \"c\", \"descricao\": \"abc\"}"
+
+void expectParse(const char* raw, int expected, const char* description) {
+    HttpRequest request;
+    int result = parseHttpRequest(raw, (int)strlen(raw), MAX_REQUEST_LENGTH, &request);
+    expect(result == expected, description);
+}
+
+int main() {
+    const char valid[] = POST_LINE "Content-Length: 48\r\n\r\n" BODY;
+    expectParse(valid, sizeof(valid) - 1, "a single Content-Length is accepted");
+    const char spaced[] = POST_LINE "Content-Length:  48 \t\r\n\r\n" BODY;
+    expectParse(spaced, sizeof(spaced) - 1, "spaces around the Content-Length digits are accepted");
+    const char bare[] = POST_LINE "Content-Length: 48\n\n" BODY;
+    expectParse(bare, sizeof(bare) - 1, "a Content-Length line ending on a bare \\n is accepted");
+
+    expectParse(POST_LINE "Content-Length: 48\r\nContent-Length: 48\r\n\r\n" BODY, ERROR,
+                "a duplicate Content-Length is rejected, even with the same value");
+    expectParse(POST_LINE "Content-Length: 48\r\ncontent-length: 0\r\n\r\n" BODY, ERROR,
+                "a duplicate Content-Length with another value and case is rejected");
+    expectParse(POST_LINE "Content-Length: 12abc\r\n\r\n" BODY, ERROR,
+                "bytes after the Content-Length digits are rejected");
+    expectParse(POST_LINE "Content-Length: 48 1\r\n\r\n" BODY, ERROR,
+                "a second number after the Content-Length is rejected");
+    expectParse(POST_LINE "Content-Length: 48,48\r\n\r\n" BODY, ERROR,
+                "a Content-Length list is rejected");
+    expectParse(POST_LINE "Transfer-Encoding: chunked\r\n\r\n30\r\n" BODY "\r\n0\r\n\r\n", ERROR,
+                "a chunked Transfer-Encoding is rejected");
+    expectParse(POST_LINE "Content-Length: 48\r\nTransfer-Encoding: chunked\r\n\r\n" BODY, ERROR,
+                "a Transfer-Encoding with a Content-Length is rejected");
+    expectParse(POST_LINE "transfer-encoding: identity\r\n\r\n", ERROR,
+                "any Transfer-Encoding is rejected, whatever its value and case");
+    // Rejected as soon as the header is read, not once the body arrived
+    expectParse(POST_LINE "Content-Length: 48\r\nContent-Length: 48\r\n", ERROR,
+                "a duplicate Content-Length is rejected before the headers end");
+    return finishTests();
+}
@@ -0,0 +1,137 @@
+// Pipelines requests on a connection that never reads its responses, on both event loop backends,
+// and checks the api stops reading it, so the kernel holds the client back, instead of buffering what it sends
+// Build and run with `make run`
+
+#include "../src/httpHandler.h"
+#include "test.h"
+
+// Far more than the socket buffers take, the client must be held back long before
+#define PIPELINE_BYTES (64 * 1024 * 1024)
+#define CHUNK_SIZE (64 * 1024)
+// The client is held back once it can't send anything for this many waits in a row
+#define STALLED_WAITS 200
+#define MAX_WAITS 200000
+// A read buffer of requests and their responses, and what the kernel received before the loop paused,
+// nothing that grows with what the client sends
+#define MAX_CONNECTION_MEMORY (4 * 1024 * 1024)
+
+const char request[] = "GET /clientes/1/missing HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+// Returns a non blocking loopback server socket, its port is set on port
+int listenOnLoopback(int* port) {
+    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    SA_IN address = {.sin_family = AF_INET, .sin_port = 0, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addressLength = sizeof(address);
+    if (serverSocket == ERROR || bind(serverSocket, (SA*)&address, sizeof(address)) == ERROR ||
+        listen(serverSocket, 16) == ERROR || getsockname(serverSocket, (SA*)&address, &addressLength) == ERROR ||
+        setNonBlocking(serverSocket) == ERROR) {
+        perror("Failed to listen");
+        exit(EXIT_FAILURE);
+    }
+    *port = ntohs(address.sin_port);
+    return serverSocket;
+}
+
+int connectToLoopback(int port) {
+    int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+    SA_IN address = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (clientSocket == ERROR || connect(clientSocket, (SA*)&address, sizeof(address)) == ERROR ||
+        setNonBlocking(clientSocket) == ERROR) {
+        perror("Failed to connect");
+        exit(EXIT_FAILURE);
+    }
+    return clientSocket;
+}
+
+void testPipeline(const char* name, int backend) {
+    ioBackend = backend;
+    EventLoop loop;
+    setupEventLoop(&loop);
+    if (backend == IO_BACKEND_URING && loop.uring == NULL) {
+        printf("skip   %s, io_uring is not available\n", name);
+        closeEventLoop(&loop);
+        return;
+    }
+    int port;
+    int serverSocket = listenOnLoopback(&port);
+    if (watchServerSocket(&loop, serverSocket) == ERROR) {
+        perror("Failed to watch the server socket");
+        exit(EXIT_FAILURE);
+    }
+    int clientSocket = connectToLoopback(port);
+    // The requests have no db to go to, they're all answered right away
+    DbPool pool;
+    memset(&pool, 0, sizeof(DbPool));
+
+    static char chunk[CHUNK_SIZE];
+    int requestLength = sizeof(request) - 1;
+    int chunkLength = CHUNK_SIZE / requestLength * requestLength;
+    for (int i = 0; i < chunkLength; i += requestLength) {
+        memcpy(&chunk[i], request, requestLength);
+    }
+
+    long long sent = 0;
+    int chunkOffset = 0;
+    int stalledWaits = 0;
+    int maxMemory = 0;
+    bool closed = false;
+    for (int wait = 0; wait < MAX_WAITS && sent < PIPELINE_BYTES && stalledWaits < STALLED_WAITS && !closed; wait++) {
+        long long sentBefore = sent;
+        while (sent < PIPELINE_BYTES) {
+            ssize_t result = send(clientSocket, &chunk[chunkOffset], chunkLength - chunkOffset, MSG_NOSIGNAL);
+            if (result < 1) {
+                break;
+            }
+            sent += result;
+            chunkOffset = (chunkOffset + (int)result) % chunkLength;
+        }
+        stalledWaits = sent == sentBefore ? stalledWaits + 1 : 0;
+
+        int nReady = waitEvents(&loop, 1);
+        for (int i = 0; i < nReady; i++) {
+            int socket = loop.events[i].data.fd;
+            if (socket == serverSocket) {
+                acceptClients(&loop, serverSocket);
+                continue;
+            }
+            Connection* connection = getConnection(socket);
+            if (connection == NULL) {
+                closeConnection(socket);
+                closed = true;
+                continue;
+            }
+            serveClient(connection, &pool);
+            connection = findConnection(socket);
+            if (connection == NULL) {
+                closed = true;
+                continue;
+            }
+            int memory = connection->inputCapacity + connection->writeCapacity;
+            maxMemory = memory > maxMemory ? memory : maxMemory;
+        }
+    }
+
+    char description[256];
+    snprintf(description, sizeof(description), "%s: the api kept the connection open", name);
+    expect(!closed, description);
+    snprintf(description, sizeof(description), "%s: the client was held back after %lld MB", name, sent / (1024 * 1024));
+    expect(sent < PIPELINE_BYTES, description);
+    snprintf(description, sizeof(description), "%s: the connection buffers peaked at %d KB", name, maxMemory / 1024);
+    expect(maxMemory <= MAX_CONNECTION_MEMORY, description);
+
+    close(clientSocket);
+    // The next test may get the same socket numbers
+    for (int socket = 0; socket < connectionsCapacity; socket++) {
+        if (connections[socket] != NULL) {
+            closeConnection(socket);
+        }
+    }
+    closeEventLoop(&loop);
+    close(serverSocket);
+}
+
+int main() {
+    testPipeline("epoll", IO_BACKEND_EPOLL);
+    testPipeline("io_uring", IO_BACKEND_URING);
+    return finishTests();
+}
@@ -0,0 +1,31 @@
+#ifndef TEST_H
+#define TEST_H
+
+// Header file for what the tests share
+// Each expectation prints a line, the failed ones are counted and the test exits with EXIT_FAILURE if any failed
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int testFailures = 0;
+
+// Prints the expectation, and counts it if it failed
+void expect(bool passed, const char* description);
+
+// Returns the exit status of the test
+int finishTests();
+
+void expect(bool passed, const char* description) {
+    printf("%s %s\n", passed ? "ok    " : "FAILED", description);
+    if (!passed) {
+        testFailures++;
+    }
+}
+
+int finishTests() {
+    printf("%d failed\n", testFailures);
+    return testFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif